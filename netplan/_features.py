@@ -0,0 +1,13 @@
+# Generated file
+NETPLAN_FEATURE_FLAGS = [
+    "dbus-config",
+    "generate-just-in-time",
+    "generated-supplicant",
+    "auth-phase2",
+    "dhcp-use-domains",
+    "ipv6-mtu",
+    "modems",
+    "sriov",
+    "openvswitch",
+    "activation-mode",
+]
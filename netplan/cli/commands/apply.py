@@ -23,8 +23,10 @@ import logging
 import os
 import sys
 import glob
+import fnmatch
 import subprocess
 import shutil
+import uuid
 import netifaces
 
 import netplan.cli.utils as utils
@@ -34,6 +36,11 @@ from netplan.cli.ovs import apply_ovs_cleanup
 
 
 OVS_CLEANUP_SERVICE = 'netplan-ovs-cleanup.service'
+# Generated files, by which part of the system they affect
+NETWORKD_PATHS = ('/run/systemd/network/', '/run/systemd/system/', '/run/netplan/wpa-')
+NM_PROFILE_PATHS = ('/run/NetworkManager/system-connections/',
+                    '/run/NetworkManager/conf.d/10-globally-managed-devices.conf')
+NM_CONF_PATHS = ('/run/NetworkManager/conf.d/',)
 
 
 class NetplanApply(utils.NetplanCommand):
@@ -44,12 +51,15 @@ class NetplanApply(utils.NetplanCommand):
                          leaf=True)
         self.sriov_only = False
         self.only_ovs_cleanup = False
+        self.only_changed = False
 
     def run(self):  # pragma: nocover (covered in autopkgtest)
         self.parser.add_argument('--sriov-only', action='store_true',
                                  help='Only apply SR-IOV related configuration and exit')
         self.parser.add_argument('--only-ovs-cleanup', action='store_true',
                                  help='Only clean up old OpenVSwitch interfaces and exit')
+        self.parser.add_argument('--only-changed', action='store_true',
+                                 help='Only restart backends and reconfigure interfaces affected by changed files')
 
         self.func = self.command_apply
 
@@ -110,15 +120,22 @@ class NetplanApply(utils.NetplanCommand):
         old_nm_glob = glob.glob('/run/NetworkManager/system-connections/netplan-*')
         nm_ifaces = utils.nm_interfaces(old_nm_glob, netifaces.interfaces())
         old_files_nm = bool(old_nm_glob)
+        old_manifest = utils.generate_manifest()
 
         generator_call = []
         generate_out = None
+        generate_env = None
+        run_id = None
+        if self.only_changed and run_generate:
+            # make sure the manifest we look at afterwards is our own
+            run_id = uuid.uuid4().hex
+            generate_env = dict(os.environ, NETPLAN_GENERATE_RUN_ID=run_id)
         if 'NETPLAN_PROFILE' in os.environ:
             generator_call.extend(['valgrind', '--leak-check=full'])
             generate_out = subprocess.STDOUT
 
         generator_call.append(utils.get_generator_path())
-        if run_generate and subprocess.call(generator_call, stderr=generate_out) != 0:
+        if run_generate and subprocess.call(generator_call, stderr=generate_out, env=generate_env) != 0:
             if exit_on_error:
                 sys.exit(os.EX_CONFIG)
             else:
@@ -150,6 +167,15 @@ class NetplanApply(utils.NetplanCommand):
         if not restart_nm and old_files_nm:
             restart_nm = True
 
+        # If asked to, and the generator told us which files it actually changed,
+        # only restart the backends and reconfigure the interfaces affected by those.
+        networkd_ifaces = None
+        reload_nm = False
+        manifest = utils.generate_manifest(run_id=run_id) if run_id else None
+        if manifest is not None:
+            restart_networkd, restart_nm, reload_nm, networkd_ifaces = \
+                NetplanApply.process_generate_manifest(old_manifest, manifest, devices)
+
         # stop backends
         if restart_networkd:
             logging.debug('netplan generated networkd configuration changed, reloading networkd')
@@ -238,7 +264,9 @@ class NetplanApply(utils.NetplanCommand):
                            if not f.endswith('/' + OVS_CLEANUP_SERVICE)]
             # Run 'systemctl start' command synchronously, to avoid race conditions
             # with 'oneshot' systemd service units, e.g. netplan-ovs-*.service.
-            utils.networkctl_reconfigure(utils.networkd_interfaces())
+            if networkd_ifaces is None:
+                networkd_ifaces = utils.networkd_interfaces()
+            utils.networkctl_reconfigure(networkd_ifaces)
             # 1st: execute OVS cleanup, to avoid races while applying OVS config
             utils.systemctl('start', [OVS_CLEANUP_SERVICE], sync=True)
             # 2nd: start all other services
@@ -249,6 +277,10 @@ class NetplanApply(utils.NetplanCommand):
             for iface in utils.nm_interfaces(restart_nm_glob, devices):
                 utils.ip_addr_flush(iface)
             utils.systemctl_network_manager('start', sync=sync)
+        elif reload_nm and utils.nm_running():
+            # only the NM configuration changed (e.g. the list of devices it
+            # should leave alone), which does not need a restart
+            utils.systemctl_network_manager('reload', sync=sync)
 
     @staticmethod
     def is_composite_member(composites, phy):
@@ -267,6 +299,43 @@ class NetplanApply(utils.NetplanCommand):
 
         return False
 
+    @staticmethod
+    def process_generate_manifest(old_manifest, manifest, devices):
+        """
+        Find out what is affected by the files the generator added, changed or
+        removed, according to its manifests of the previous and the last run.
+        Returns a tuple (restart_networkd, restart_nm, reload_nm, networkd_ifaces),
+        networkd_ifaces being None if all networkd interfaces need to be
+        reconfigured.
+        """
+        old_files = {f['path']: f for f in (old_manifest or {}).get('files', [])}
+        restart_networkd = restart_nm = reload_nm = False
+        reconfigure_all = False
+        networkd_ifaces = set()
+
+        for f in manifest.get('files', []):
+            path = f['path']
+            if f['status'] == 'unchanged':
+                continue
+            if path.startswith(NM_PROFILE_PATHS):
+                restart_nm = True
+            elif path.startswith(NM_CONF_PATHS):
+                reload_nm = True
+            elif path.startswith(NETWORKD_PATHS):
+                restart_networkd = True
+                # removed files are only known to the previous manifest
+                if f['status'] == 'removed':
+                    f = old_files.get(path, f)
+                iface = f.get('interface')
+                if iface is None:
+                    reconfigure_all = True
+                else:
+                    # only existing interfaces can be reconfigured; networkd
+                    # will pick up new ones by itself
+                    networkd_ifaces.update(fnmatch.filter(devices, iface))
+
+        return restart_networkd, restart_nm, reload_nm, None if reconfigure_all else networkd_ifaces
+
     @staticmethod
     def process_link_changes(interfaces, config_manager):  # pragma: nocover (covered in autopkgtest)
         """
@@ -39,6 +39,10 @@ class NetplanGenerate(utils.NetplanCommand):
                                  help='Search for and generate configuration files in this root directory instead of /')
         self.parser.add_argument('--mapping',
                                  help='Display the netplan device ID/backend/interface name mapping and exit.')
+        self.parser.add_argument('--changes', action='store_true',
+                                 help='Print which backend configuration files got added, changed or removed.')
+        self.parser.add_argument('--timings', action='store_true',
+                                 help='Print where the time went, as JSON on stderr.')
 
         self.func = self.command_generate
 
@@ -80,6 +84,10 @@ class NetplanGenerate(utils.NetplanCommand):
             argv += ['--root-dir', self.root_dir]
         if self.mapping:
             argv += ['--mapping', self.mapping]
+        if self.changes:
+            argv += ['--changes']
+        if self.timings:
+            argv += ['--timings']
         logging.debug('command generate: running %s', argv)
         # FIXME: os.execv(argv[0], argv) would be better but fails coverage
         sys.exit(subprocess.call(argv))
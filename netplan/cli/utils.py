@@ -22,6 +22,7 @@ import os
 import logging
 import fnmatch
 import argparse
+import json
 import subprocess
 import netifaces
 import re
@@ -37,20 +38,25 @@ class _GError(ctypes.Structure):
 
 
 lib = ctypes.CDLL(ctypes.util.find_library('netplan'))
-lib.netplan_parse_yaml.argtypes = [ctypes.c_char_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_parser_new.restype = ctypes.c_void_p
+lib.netplan_parser_parse_file.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_parser_finish.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_parser_finish.restype = ctypes.c_void_p
+lib.netplan_parser_free.argtypes = [ctypes.c_void_p]
 lib.netplan_get_filename_by_id.restype = ctypes.c_char_p
 
 
 def netplan_parse(path):
-    # Clear old NetplanNetDefinitions from libnetplan memory
-    lib.netplan_clear_netdefs()
+    # Use a parser of our own, leaving the global libnetplan state alone
+    parser = lib.netplan_parser_new()
     err = ctypes.POINTER(_GError)()
-    ret = bool(lib.netplan_parse_yaml(path.encode(), ctypes.byref(err)))
-    if not ret:
-        raise Exception(err.contents.message.decode('utf-8'))
-    lib.netplan_finish_parse(ctypes.byref(err))
-    if err:
-        raise Exception(err.contents.message.decode('utf-8'))
+    try:
+        if lib.netplan_parser_parse_file(parser, path.encode(), ctypes.byref(err)):
+            lib.netplan_parser_finish(parser, ctypes.byref(err))
+        if err:
+            raise Exception(err.contents.message.decode('utf-8'))
+    finally:
+        lib.netplan_parser_free(parser)
     return True
 
 
@@ -63,6 +69,20 @@ def get_generator_path():
     return os.environ.get('NETPLAN_GENERATE_PATH', '/lib/netplan/generate')
 
 
+def generate_manifest(rootdir='/', run_id=None):
+    '''Return the manifest of files written by the last generator run, or None if there is none.
+    If run_id is given, also return None if the last run was not the one started with
+    NETPLAN_GENERATE_RUN_ID=run_id in its environment.'''
+    try:
+        with open(os.path.join(rootdir, 'run', 'netplan', 'generate.json')) as f:
+            manifest = json.load(f)
+    except (OSError, ValueError):
+        return None
+    if run_id is not None and manifest.get('run-id') != run_id:
+        return None
+    return manifest
+
+
 def is_nm_snap_enabled():
     return subprocess.call(['systemctl', '--quiet', 'is-enabled', NM_SNAP_SERVICE_NAME], stderr=subprocess.DEVNULL) == 0
 
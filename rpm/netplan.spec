@@ -30,6 +30,7 @@ BuildRequires:  pkgconfig(systemd)
 BuildRequires:  pkgconfig(glib-2.0)
 BuildRequires:  pkgconfig(yaml-0.1)
 BuildRequires:  pkgconfig(uuid)
+BuildRequires:  systemtap-sdt-devel
 BuildRequires:  %{_bindir}/pandoc
 BuildRequires:  python%{python3_pkgversion}-devel
 # For tests
@@ -107,6 +108,7 @@ make check
 %{_mandir}/man5/%{name}.5*
 %{_mandir}/man8/%{name}*.8*
 %dir %{_sysconfdir}/%{name}
+%dir %attr(0700,root,root) %{_localstatedir}/cache/%{name}
 %{_prefix}/lib/%{name}/
 %{_datadir}/bash-completion/completions/%{name}
 
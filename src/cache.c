@@ -0,0 +1,1078 @@
+/*
+ * Copyright (C) 2021 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* for dl_iterate_phdr() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "cache.h"
+#include "parse.h"
+
+/* Change this whenever the layout below changes, or the parser starts to
+ * produce different definitions from the same YAML. Besides, the cache is
+ * tied to the build of libnetplan which wrote it, see build_id(). */
+#define CACHE_MAGIC "netplan state cache 5"
+
+/* Besides the final state, the state before each of the last this many input
+ * files is kept. Changing one of those then only needs the files from there
+ * on to be parsed again. Late files are the drop-ins which usually get
+ * changed, e.g. by "netplan set". */
+#define CACHE_CHECKPOINTS 8
+
+/****************************************************
+ * State cache
+ *
+ * Snapshots of the parser state (definitions, global backend and OpenVSwitch
+ * settings) while parsing a YAML hierarchy, so that the next run over the
+ * same files can skip parsing them. The input files are recorded by path,
+ * size, mtime and SHA-256, in order. Each snapshot ("checkpoint") is the
+ * state after a number of them, and only valid as long as none of those
+ * changed. Files are merged strictly in order, so parsing the rest of the
+ * files on top of a checkpoint gives the same state as parsing all of them.
+ ****************************************************/
+
+typedef struct {
+    gchar* path;
+    guint64 size;
+    gint64 mtime;
+    gchar* checksum;
+} CacheInput;
+
+typedef struct {
+    /* number of input files the state got parsed from */
+    guint position;
+    /* serialized state, see io_state() */
+    GByteArray* state;
+} CacheCheckpoint;
+
+struct netplan_state_cache {
+    gchar* path;
+    /* CacheInput of each input file, in parsing order */
+    GArray* inputs;
+    /* CacheCheckpoint, ordered by position */
+    GArray* checkpoints;
+};
+
+/* The cache gets written and read by the same functions below, which walk
+ * the state in either direction, so that both always agree on the layout.
+ * Integers are stored in host byte order, the cache is never shared between
+ * machines. */
+typedef struct {
+    /* set when writing */
+    GByteArray* out;
+    /* read position and end, when reading */
+    const guint8* pos;
+    const guint8* end;
+    /* reading went past the end */
+    gboolean failed;
+} CacheIO;
+
+static void
+io_bytes(CacheIO* io, void* data, gsize len)
+{
+    if (io->out)
+        g_byte_array_append(io->out, data, len);
+    else if (!io->failed && (gsize) (io->end - io->pos) >= len) {
+        memcpy(data, io->pos, len);
+        io->pos += len;
+    } else
+        io->failed = TRUE;
+}
+
+static void
+io_uint(CacheIO* io, guint* value)
+{
+    guint32 v = *value;
+    io_bytes(io, &v, sizeof(v));
+    *value = v;
+}
+
+static void
+io_uint64(CacheIO* io, guint64* value)
+{
+    io_bytes(io, value, sizeof(*value));
+}
+
+/* Strings are stored with their length plus one, 0 standing for NULL */
+static void
+io_str(CacheIO* io, char** s)
+{
+    guint32 len = (io->out && *s) ? strlen(*s) + 1 : 0;
+
+    io_bytes(io, &len, sizeof(len));
+    if (io->out) {
+        if (len > 1)
+            io_bytes(io, *s, len - 1);
+        return;
+    }
+    g_free(*s);
+    *s = NULL;
+    if (len == 0 || io->failed)
+        return;
+    if ((gsize) (io->end - io->pos) < len - 1) {
+        io->failed = TRUE;
+        return;
+    }
+    *s = g_strndup((const gchar*) io->pos, len - 1);
+    io->pos += len - 1;
+}
+
+/* Number of elements of @container, plus one; 0 stands for no container at
+ * all, which is not the same as an empty one. Returns what got read. */
+static guint
+io_count(CacheIO* io, gconstpointer container, guint len)
+{
+    guint count = container ? len + 1 : 0;
+    io_uint(io, &count);
+    return io->failed ? 0 : count;
+}
+
+static void
+io_str_array(CacheIO* io, GArray** array)
+{
+    guint count = io_count(io, *array, *array ? (*array)->len : 0);
+
+    if (io->out) {
+        for (guint i = 0; *array && i < (*array)->len; ++i)
+            io_str(io, &g_array_index(*array, char*, i));
+        return;
+    }
+    if (count == 0)
+        return;
+    *array = g_array_new(FALSE, FALSE, sizeof(char*));
+    for (guint i = 1; i < count && !io->failed; ++i) {
+        char* s = NULL;
+        io_str(io, &s);
+        g_array_append_val(*array, s);
+    }
+}
+
+/* GArray of pointers to structs of @size, walked with @io_elem */
+static void
+io_ptr_array(CacheIO* io, GArray** array, gsize size, void (*io_elem)(CacheIO*, gpointer))
+{
+    guint count = io_count(io, *array, *array ? (*array)->len : 0);
+
+    if (io->out) {
+        for (guint i = 0; *array && i < (*array)->len; ++i)
+            io_elem(io, g_array_index(*array, gpointer, i));
+        return;
+    }
+    if (count == 0)
+        return;
+    *array = g_array_new(FALSE, TRUE, sizeof(gpointer));
+    for (guint i = 1; i < count && !io->failed; ++i) {
+        gpointer elem = g_malloc0(size);
+        io_elem(io, elem);
+        g_array_append_val(*array, elem);
+    }
+}
+
+/* string → string map, as filled by handle_generic_map() */
+static void
+io_map(CacheIO* io, GHashTable** map)
+{
+    guint count = io_count(io, *map, *map ? g_hash_table_size(*map) : 0);
+
+    if (io->out) {
+        GHashTableIter iter;
+        gpointer key, value;
+        if (!*map)
+            return;
+        g_hash_table_iter_init(&iter, *map);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            io_str(io, (char**) &key);
+            io_str(io, (char**) &value);
+        }
+        return;
+    }
+    if (count == 0)
+        return;
+    *map = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    for (guint i = 1; i < count && !io->failed; ++i) {
+        char* key = NULL;
+        char* value = NULL;
+        io_str(io, &key);
+        io_str(io, &value);
+        if (key)
+            g_hash_table_insert(*map, key, value);
+        else
+            g_free(value);
+    }
+}
+
+static void
+collect_datalist_entry(GQuark key_id, gpointer data, gpointer user_data)
+{
+    GPtrArray* entries = user_data;
+    g_ptr_array_add(entries, (gpointer) g_quark_to_string(key_id));
+    g_ptr_array_add(entries, data);
+}
+
+static void
+io_datalist(CacheIO* io, GData** list)
+{
+    guint count;
+
+    if (io->out) {
+        GPtrArray* entries = g_ptr_array_new();
+        g_datalist_foreach(list, collect_datalist_entry, entries);
+        io_count(io, *list, entries->len / 2);
+        for (guint i = 0; i < entries->len; ++i)
+            io_str(io, (char**) &g_ptr_array_index(entries, i));
+        g_ptr_array_free(entries, TRUE);
+        return;
+    }
+    count = io_count(io, NULL, 0);
+    for (guint i = 1; i < count && !io->failed; ++i) {
+        char* key = NULL;
+        char* value = NULL;
+        io_str(io, &key);
+        io_str(io, &value);
+        if (key && value)
+            g_datalist_set_data_full(list, key, value, g_free);
+        else
+            g_free(value);
+        g_free(key);
+    }
+}
+
+static void
+io_auth(CacheIO* io, NetplanAuthenticationSettings* auth)
+{
+    io_uint(io, (guint*) &auth->key_management);
+    io_uint(io, (guint*) &auth->eap_method);
+    io_str(io, &auth->identity);
+    io_str(io, &auth->anonymous_identity);
+    io_str(io, &auth->password);
+    io_str(io, &auth->ca_certificate);
+    io_str(io, &auth->client_certificate);
+    io_str(io, &auth->client_key);
+    io_str(io, &auth->client_key_password);
+    io_str(io, &auth->phase2_auth);
+}
+
+static void
+io_backend_settings(CacheIO* io, NetplanBackendSettings* settings)
+{
+    /* networkd.unit shares its storage with nm.name */
+    io_str(io, &settings->nm.name);
+    io_str(io, &settings->nm.uuid);
+    io_str(io, &settings->nm.stable_id);
+    io_str(io, &settings->nm.device);
+    io_datalist(io, &settings->nm.passthrough);
+}
+
+static void
+io_ovs_settings(CacheIO* io, NetplanOVSSettings* ovs)
+{
+    io_map(io, &ovs->external_ids);
+    io_map(io, &ovs->other_config);
+    io_str(io, &ovs->lacp);
+    io_str(io, &ovs->fail_mode);
+    io_uint(io, (guint*) &ovs->mcast_snooping);
+    io_str_array(io, &ovs->protocols);
+    io_uint(io, (guint*) &ovs->rstp);
+    io_str(io, &ovs->controller.connection_mode);
+    io_str_array(io, &ovs->controller.addresses);
+    io_auth(io, &ovs->ssl);
+}
+
+static void
+io_dhcp_overrides(CacheIO* io, NetplanDHCPOverrides* overrides)
+{
+    io_uint(io, (guint*) &overrides->use_dns);
+    io_uint(io, (guint*) &overrides->use_ntp);
+    io_uint(io, (guint*) &overrides->send_hostname);
+    io_uint(io, (guint*) &overrides->use_hostname);
+    io_uint(io, (guint*) &overrides->use_mtu);
+    io_uint(io, (guint*) &overrides->use_routes);
+    io_str(io, &overrides->use_domains);
+    io_str(io, &overrides->hostname);
+    io_uint(io, &overrides->metric);
+}
+
+static void
+io_address_options(CacheIO* io, gpointer elem)
+{
+    NetplanAddressOptions* opts = elem;
+    io_str(io, &opts->address);
+    io_str(io, &opts->lifetime);
+    io_str(io, &opts->label);
+}
+
+static void
+io_ip_prefix(CacheIO* io, NetplanIPPrefix* ip)
+{
+    io_uint(io, &ip->family);
+    io_uint(io, &ip->prefix);
+    io_bytes(io, ip->addr, sizeof(ip->addr));
+}
+
+static void
+io_address(CacheIO* io, NetplanAddress* address)
+{
+    io_ip_prefix(io, &address->ip);
+    io_str(io, &address->text);
+}
+
+/* GArray of NetplanAddress */
+static void
+io_address_array(CacheIO* io, GArray** array)
+{
+    guint count = io_count(io, *array, *array ? (*array)->len : 0);
+
+    if (io->out) {
+        for (guint i = 0; *array && i < (*array)->len; ++i)
+            io_address(io, &g_array_index(*array, NetplanAddress, i));
+        return;
+    }
+    if (count == 0)
+        return;
+    *array = g_array_new(FALSE, FALSE, sizeof(NetplanAddress));
+    for (guint i = 1; i < count && !io->failed; ++i) {
+        NetplanAddress address = { .text = NULL };
+        io_address(io, &address);
+        g_array_append_val(*array, address);
+    }
+}
+
+static void
+io_route(CacheIO* io, gpointer elem)
+{
+    NetplanIPRoute* route = elem;
+    io_uint(io, &route->family);
+    io_str(io, &route->type);
+    io_str(io, &route->scope);
+    io_uint(io, &route->table);
+    io_str(io, &route->from);
+    io_str(io, &route->to);
+    io_str(io, &route->via);
+    io_ip_prefix(io, &route->from_ip);
+    io_ip_prefix(io, &route->to_ip);
+    io_ip_prefix(io, &route->via_ip);
+    io_uint(io, (guint*) &route->onlink);
+    io_uint(io, &route->metric);
+    io_uint(io, &route->mtubytes);
+    io_uint(io, &route->congestion_window);
+    io_uint(io, &route->advertised_receive_window);
+}
+
+static void
+io_ip_rule(CacheIO* io, gpointer elem)
+{
+    NetplanIPRule* rule = elem;
+    io_uint(io, &rule->family);
+    io_str(io, &rule->from);
+    io_str(io, &rule->to);
+    io_ip_prefix(io, &rule->from_ip);
+    io_ip_prefix(io, &rule->to_ip);
+    io_uint(io, &rule->table);
+    io_uint(io, &rule->priority);
+    io_uint(io, &rule->fwmark);
+    io_uint(io, &rule->tos);
+}
+
+static void
+io_wireguard_peer(CacheIO* io, gpointer elem)
+{
+    NetplanWireguardPeer* peer = elem;
+    io_str(io, &peer->endpoint);
+    io_str(io, &peer->public_key);
+    io_str(io, &peer->preshared_key);
+    io_address_array(io, &peer->allowed_ips);
+    io_uint(io, &peer->keepalive);
+}
+
+static void
+io_access_point(CacheIO* io, NetplanWifiAccessPoint* ap)
+{
+    io_uint(io, (guint*) &ap->mode);
+    io_str(io, &ap->ssid);
+    io_uint(io, (guint*) &ap->band);
+    io_str(io, &ap->bssid);
+    io_uint(io, (guint*) &ap->hidden);
+    io_uint(io, &ap->channel);
+    io_auth(io, &ap->auth);
+    io_uint(io, (guint*) &ap->has_auth);
+    io_backend_settings(io, &ap->backend_settings);
+}
+
+static void
+io_access_points(CacheIO* io, GHashTable** access_points)
+{
+    guint count = io_count(io, *access_points, *access_points ? g_hash_table_size(*access_points) : 0);
+
+    if (io->out) {
+        GHashTableIter iter;
+        gpointer value;
+        if (!*access_points)
+            return;
+        g_hash_table_iter_init(&iter, *access_points);
+        while (g_hash_table_iter_next(&iter, NULL, &value))
+            io_access_point(io, value);
+        return;
+    }
+    if (count == 0)
+        return;
+    /* the SSID keys belong to the access points, like in handle_wifi_access_points() */
+    *access_points = g_hash_table_new(g_str_hash, g_str_equal);
+    for (guint i = 1; i < count && !io->failed; ++i) {
+        NetplanWifiAccessPoint* ap = g_new0(NetplanWifiAccessPoint, 1);
+        io_access_point(io, ap);
+        g_hash_table_insert(*access_points, ap->ssid ?: "", ap);
+    }
+}
+
+/* Everything of @nd but its type, backend and ID (which are needed upfront
+ * to create it) and its links to other definitions */
+static void
+io_netdef(CacheIO* io, NetplanNetDefinition* nd)
+{
+    io_bytes(io, nd->uuid, sizeof(nd->uuid));
+    io_uint(io, (guint*) &nd->optional);
+    io_uint(io, (guint*) &nd->optional_addresses);
+    io_uint(io, (guint*) &nd->critical);
+
+    io_uint(io, (guint*) &nd->dhcp4);
+    io_uint(io, (guint*) &nd->dhcp6);
+    io_str(io, &nd->dhcp_identifier);
+    io_dhcp_overrides(io, &nd->dhcp4_overrides);
+    io_dhcp_overrides(io, &nd->dhcp6_overrides);
+    io_uint(io, (guint*) &nd->accept_ra);
+    io_address_array(io, &nd->ip4_addresses);
+    io_address_array(io, &nd->ip6_addresses);
+    io_ptr_array(io, &nd->address_options, sizeof(NetplanAddressOptions), io_address_options);
+    io_uint(io, (guint*) &nd->ip6_privacy);
+    io_uint(io, &nd->ip6_addr_gen_mode);
+    io_str(io, &nd->ip6_addr_gen_token);
+    io_address(io, &nd->gateway4);
+    io_address(io, &nd->gateway6);
+    io_address_array(io, &nd->ip4_nameservers);
+    io_address_array(io, &nd->ip6_nameservers);
+    io_str_array(io, &nd->search_domains);
+    io_ptr_array(io, &nd->routes, sizeof(NetplanIPRoute), io_route);
+    io_ptr_array(io, &nd->ip_rules, sizeof(NetplanIPRule), io_ip_rule);
+    io_ptr_array(io, &nd->wireguard_peers, sizeof(NetplanWireguardPeer), io_wireguard_peer);
+    io_uint(io, (guint*) &nd->linklocal.ipv4);
+    io_uint(io, (guint*) &nd->linklocal.ipv6);
+
+    io_str(io, &nd->bridge);
+    io_str(io, &nd->bond);
+    io_str(io, &nd->peer);
+
+    io_uint(io, &nd->vlan_id);
+    io_uint(io, (guint*) &nd->has_vlans);
+    io_str(io, &nd->set_mac);
+    io_uint(io, &nd->mtubytes);
+    io_uint(io, &nd->ipv6_mtubytes);
+
+    io_str(io, &nd->set_name);
+    io_str(io, &nd->match.driver);
+    io_str(io, &nd->match.mac);
+    io_str(io, &nd->match.original_name);
+    io_uint(io, (guint*) &nd->has_match);
+    io_uint(io, (guint*) &nd->wake_on_lan);
+    io_uint(io, (guint*) &nd->wowlan);
+    io_uint(io, (guint*) &nd->emit_lldp);
+
+    io_access_points(io, &nd->access_points);
+
+    io_str(io, &nd->bond_params.mode);
+    io_str(io, &nd->bond_params.lacp_rate);
+    io_str(io, &nd->bond_params.monitor_interval);
+    io_uint(io, &nd->bond_params.min_links);
+    io_str(io, &nd->bond_params.transmit_hash_policy);
+    io_str(io, &nd->bond_params.selection_logic);
+    io_uint(io, (guint*) &nd->bond_params.all_slaves_active);
+    io_str(io, &nd->bond_params.arp_interval);
+    io_str_array(io, &nd->bond_params.arp_ip_targets);
+    io_str(io, &nd->bond_params.arp_validate);
+    io_str(io, &nd->bond_params.arp_all_targets);
+    io_str(io, &nd->bond_params.up_delay);
+    io_str(io, &nd->bond_params.down_delay);
+    io_str(io, &nd->bond_params.fail_over_mac_policy);
+    io_uint(io, &nd->bond_params.gratuitous_arp);
+    io_uint(io, &nd->bond_params.packets_per_slave);
+    io_str(io, &nd->bond_params.primary_reselect_policy);
+    io_uint(io, &nd->bond_params.resend_igmp);
+    io_str(io, &nd->bond_params.learn_interval);
+    io_str(io, &nd->bond_params.primary_slave);
+
+    io_str(io, &nd->modem_params.apn);
+    io_uint(io, (guint*) &nd->modem_params.auto_config);
+    io_str(io, &nd->modem_params.device_id);
+    io_str(io, &nd->modem_params.network_id);
+    io_str(io, &nd->modem_params.number);
+    io_str(io, &nd->modem_params.password);
+    io_str(io, &nd->modem_params.pin);
+    io_str(io, &nd->modem_params.sim_id);
+    io_str(io, &nd->modem_params.sim_operator_id);
+    io_str(io, &nd->modem_params.username);
+
+    io_str(io, &nd->bridge_params.ageing_time);
+    io_uint(io, &nd->bridge_params.priority);
+    io_uint(io, &nd->bridge_params.port_priority);
+    io_str(io, &nd->bridge_params.forward_delay);
+    io_str(io, &nd->bridge_params.hello_time);
+    io_str(io, &nd->bridge_params.max_age);
+    io_uint(io, &nd->bridge_params.path_cost);
+    io_uint(io, (guint*) &nd->bridge_params.stp);
+    io_uint(io, (guint*) &nd->custom_bridging);
+
+    io_uint(io, (guint*) &nd->tunnel.mode);
+    io_str(io, &nd->tunnel.local_ip);
+    io_str(io, &nd->tunnel.remote_ip);
+    io_str(io, &nd->tunnel.input_key);
+    io_str(io, &nd->tunnel.output_key);
+    io_str(io, &nd->tunnel.private_key);
+    io_uint(io, &nd->tunnel.fwmark);
+    io_uint(io, &nd->tunnel.port);
+
+    io_auth(io, &nd->auth);
+    io_uint(io, (guint*) &nd->has_auth);
+
+    io_uint(io, (guint*) &nd->sriov_vlan_filter);
+    io_uint(io, &nd->sriov_explicit_vf_count);
+
+    io_ovs_settings(io, &nd->ovs_settings);
+    io_backend_settings(io, &nd->backend_settings);
+
+    io_str(io, &nd->filename);
+    io_uint(io, &nd->tunnel_ttl);
+    io_str(io, &nd->activation_mode);
+}
+
+typedef struct {
+    const void* addr;
+    gchar* id;
+} BuildIdLookup;
+
+#define NOTE_ALIGN(n, align) (((n) + (align) - 1) & ~((align) - 1))
+
+static int
+find_build_id(struct dl_phdr_info* info, size_t size, void* data)
+{
+    BuildIdLookup* lookup = data;
+    gboolean ours = FALSE;
+
+    for (guint i = 0; i < info->dlpi_phnum && !ours; ++i) {
+        const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+        ours = ph->p_type == PT_LOAD && (uintptr_t) lookup->addr >= start &&
+               (uintptr_t) lookup->addr < start + ph->p_memsz;
+    }
+    if (!ours)
+        return 0;
+
+    for (guint i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+        const guchar* pos = (const guchar*) (info->dlpi_addr + ph->p_vaddr);
+        const guchar* end = pos + ph->p_memsz;
+        size_t align = ph->p_align == 8 ? 8 : 4;
+
+        if (ph->p_type != PT_NOTE)
+            continue;
+        while (pos + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr)* note = (const ElfW(Nhdr)*) pos;
+            const guchar* name = pos + sizeof(ElfW(Nhdr));
+            const guchar* desc = name + NOTE_ALIGN(note->n_namesz, align);
+
+            if (desc + note->n_descsz > end)
+                break; // LCOV_EXCL_LINE
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == sizeof(ELF_NOTE_GNU) &&
+                memcmp(name, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)) == 0) {
+                GString* hex = g_string_sized_new(2 * note->n_descsz);
+                for (guint j = 0; j < note->n_descsz; ++j)
+                    g_string_append_printf(hex, "%02x", desc[j]);
+                lookup->id = g_string_free(hex, FALSE);
+                return 1;
+            }
+            pos = desc + NOTE_ALIGN(note->n_descsz, align);
+        }
+    }
+    return 1;
+}
+
+/* The GNU build ID of libnetplan in hex, or "" if it got linked without one.
+ * A cache written by any other build of it, e.g. before a package upgrade,
+ * is not used, even if the bump of CACHE_MAGIC got forgotten. */
+static const char*
+build_id()
+{
+    static gsize inited = 0;
+    static gchar* id = NULL;
+
+    if (g_once_init_enter(&inited)) {
+        BuildIdLookup lookup = { (const void*) find_build_id, NULL };
+        dl_iterate_phdr(find_build_id, &lookup);
+        id = lookup.id ? lookup.id : g_strdup("");
+        g_once_init_leave(&inited, 1);
+    }
+    return id;
+}
+
+/* Header: the format of the cache and the build of libnetplan which wrote
+ * it. @magic and @build get replaced when reading. */
+static void
+io_format(CacheIO* io, char** magic, char** build, guint* netdef_size)
+{
+    io_str(io, magic);
+    io_str(io, build);
+    io_uint(io, netdef_size);
+}
+
+/* Smallest number of bytes an input takes in the cache, see io_inputs() */
+#define CACHE_INPUT_MIN_SIZE (2 * sizeof(guint32) + 2 * sizeof(guint64))
+
+/* The input files the state got parsed from */
+static void
+io_inputs(CacheIO* io, GArray* inputs)
+{
+    guint count = io_count(io, inputs, inputs->len);
+
+    if (!io->out) {
+        /* do not let a broken count allocate an arbitrary amount of memory */
+        if (count && count - 1 > (gsize) (io->end - io->pos) / CACHE_INPUT_MIN_SIZE) {
+            io->failed = TRUE;
+            return;
+        }
+        g_array_set_size(inputs, count ? count - 1 : 0);
+    }
+    for (guint i = 0; i < inputs->len && !io->failed; ++i) {
+        CacheInput* input = &g_array_index(inputs, CacheInput, i);
+        io_str(io, &input->path);
+        io_uint64(io, &input->size);
+        io_uint64(io, (guint64*) &input->mtime);
+        io_str(io, &input->checksum);
+    }
+}
+
+/* Position of @nd in @positions plus one, 0 for none */
+static guint
+netdef_position(GHashTable* positions, const NetplanNetDefinition* nd)
+{
+    return nd ? GPOINTER_TO_UINT(g_hash_table_lookup(positions, nd)) : 0;
+}
+
+/* The parser state of a checkpoint: the global @backend and @ovs_settings,
+ * then the definitions in @netdefs order */
+static void
+io_save_state(CacheIO* io, const GList* netdefs, NetplanBackend backend, const NetplanOVSSettings* ovs_settings)
+{
+    GHashTable* positions = g_hash_table_new(g_direct_hash, g_direct_equal);
+    NetplanOVSSettings ovs = *ovs_settings;
+    guint pos = 0;
+
+    io_uint(io, (guint*) &backend);
+    io_ovs_settings(io, &ovs);
+    for (const GList* l = netdefs; l; l = l->next)
+        g_hash_table_insert(positions, l->data, GUINT_TO_POINTER(++pos));
+    io_count(io, netdefs, pos);
+    for (const GList* l = netdefs; l; l = l->next) {
+        NetplanNetDefinition* nd = l->data;
+        guint vlan_link = netdef_position(positions, nd->vlan_link);
+        guint sriov_link = netdef_position(positions, nd->sriov_link);
+
+        io_uint(io, (guint*) &nd->type);
+        io_uint(io, (guint*) &nd->backend);
+        io_str(io, &nd->id);
+        io_netdef(io, nd);
+        io_uint(io, &vlan_link);
+        io_uint(io, &sriov_link);
+    }
+    g_hash_table_destroy(positions);
+}
+
+/* Counterpart of io_save_state(): creates the definitions in the current
+ * parser. Returns the number of them, or -1 if the state is broken; some
+ * definitions might have been created nevertheless then. */
+static gint
+io_load_state(CacheIO* io, NetplanBackend* backend, NetplanOVSSettings* ovs_settings)
+{
+    GPtrArray* loaded = g_ptr_array_new();
+    /* vlan_link and sriov_link of each definition, as positions in @loaded */
+    GArray* links = g_array_new(FALSE, FALSE, sizeof(guint));
+    gint ret = -1;
+    guint count;
+
+    io_uint(io, (guint*) backend);
+    io_ovs_settings(io, ovs_settings);
+    count = io_count(io, NULL, 0);
+    for (guint i = 1; i < count && !io->failed; ++i) {
+        NetplanNetDefinition* nd;
+        guint type = 0, nd_backend = 0, link;
+        g_autofree char* id = NULL;
+
+        io_uint(io, &type);
+        io_uint(io, &nd_backend);
+        io_str(io, &id);
+        if (io->failed || !id || type >= NETPLAN_DEF_TYPE_MAX_ || nd_backend >= NETPLAN_BACKEND_MAX_)
+            goto cleanup;
+        nd = netplan_netdef_new(id, type, nd_backend);
+        io_netdef(io, nd);
+        g_ptr_array_add(loaded, nd);
+        for (guint j = 0; j < 2; ++j) {
+            io_uint(io, &link);
+            g_array_append_val(links, link);
+        }
+    }
+    if (io->failed || io->pos != io->end || *backend >= NETPLAN_BACKEND_MAX_)
+        goto cleanup;
+
+    for (guint i = 0; i < loaded->len; ++i) {
+        NetplanNetDefinition* nd = g_ptr_array_index(loaded, i);
+        guint vlan_link = g_array_index(links, guint, 2 * i);
+        guint sriov_link = g_array_index(links, guint, 2 * i + 1);
+        if (vlan_link > loaded->len || sriov_link > loaded->len)
+            goto cleanup;
+        nd->vlan_link = vlan_link ? g_ptr_array_index(loaded, vlan_link - 1) : NULL;
+        nd->sriov_link = sriov_link ? g_ptr_array_index(loaded, sriov_link - 1) : NULL;
+    }
+    ret = loaded->len;
+
+cleanup:
+    g_ptr_array_free(loaded, TRUE);
+    g_array_free(links, TRUE);
+    return ret;
+}
+
+static void
+clear_cache_input(gpointer data)
+{
+    CacheInput* input = data;
+    g_free(input->path);
+    g_free(input->checksum);
+}
+
+static GArray*
+cache_inputs_new()
+{
+    GArray* inputs = g_array_new(FALSE, TRUE, sizeof(CacheInput));
+    g_array_set_clear_func(inputs, clear_cache_input);
+    return inputs;
+}
+
+static void
+clear_cache_checkpoint(gpointer data)
+{
+    CacheCheckpoint* checkpoint = data;
+    g_byte_array_unref(checkpoint->state);
+}
+
+static void
+add_checkpoint(NetplanStateCache* cache, guint position, GByteArray* state)
+{
+    CacheCheckpoint checkpoint = { position, state };
+    g_array_append_val(cache->checkpoints, checkpoint);
+}
+
+/**
+ * Prepare the state cache below @rootdir for parsing the YAML @files (in
+ * this order). This records their current size, mtime and checksum, which
+ * the cache has to match.
+ * Returns: %NULL if any of the files cannot be read, the parse cannot be
+ *          cached then.
+ */
+NetplanStateCache*
+netplan_state_cache_new(const char* rootdir, const GPtrArray* files)
+{
+    NetplanStateCache* cache = g_new0(NetplanStateCache, 1);
+
+    cache->path = g_build_path(G_DIR_SEPARATOR_S, rootdir ?: G_DIR_SEPARATOR_S, NETPLAN_STATE_CACHE_PATH, NULL);
+    cache->inputs = cache_inputs_new();
+    cache->checkpoints = g_array_new(FALSE, FALSE, sizeof(CacheCheckpoint));
+    g_array_set_clear_func(cache->checkpoints, clear_cache_checkpoint);
+    for (guint i = 0; i < files->len; ++i) {
+        CacheInput input = { g_strdup(g_ptr_array_index(files, i)) };
+        g_autofree gchar* contents = NULL;
+        gsize length;
+        GStatBuf st;
+
+        g_array_append_val(cache->inputs, input);
+        if (g_stat(input.path, &st) != 0 || !g_file_get_contents(input.path, &contents, &length, NULL)) {
+            netplan_state_cache_free(cache);
+            return NULL;
+        }
+        g_array_index(cache->inputs, CacheInput, i).size = st.st_size;
+        g_array_index(cache->inputs, CacheInput, i).mtime = st.st_mtime;
+        g_array_index(cache->inputs, CacheInput, i).checksum =
+            g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar*) contents, length);
+    }
+    return cache;
+}
+
+void
+netplan_state_cache_free(NetplanStateCache* cache)
+{
+    if (!cache)
+        return;
+    g_free(cache->path);
+    g_array_free(cache->inputs, TRUE);
+    g_array_free(cache->checkpoints, TRUE);
+    g_free(cache);
+}
+
+/* Whether the input files recorded as @a and @b are the same */
+static gboolean
+same_input(const CacheInput* a, const CacheInput* b)
+{
+    return g_strcmp0(a->path, b->path) == 0 && a->size == b->size && a->mtime == b->mtime &&
+           g_strcmp0(a->checksum, b->checksum) == 0;
+}
+
+/* Read the header and inputs of the cache file and return how many of the
+ * inputs, from the first one on, are still the same as those of @cache */
+static guint
+unchanged_inputs(CacheIO* io, const NetplanStateCache* cache)
+{
+    g_autofree char* magic = NULL;
+    g_autofree char* build = NULL;
+    guint size = 0;
+    GArray* inputs = NULL;
+    guint n = 0;
+
+    io_format(io, &magic, &build, &size);
+    if (io->failed || g_strcmp0(magic, CACHE_MAGIC) != 0 || g_strcmp0(build, build_id()) != 0 ||
+        size != sizeof(NetplanNetDefinition))
+        return 0;
+
+    inputs = cache_inputs_new();
+    io_inputs(io, inputs);
+    for (; !io->failed && n < inputs->len && n < cache->inputs->len; ++n)
+        if (!same_input(&g_array_index(inputs, CacheInput, n), &g_array_index(cache->inputs, CacheInput, n)))
+            break;
+    g_array_free(inputs, TRUE);
+    return io->failed ? 0 : n;
+}
+
+/* Whether the state after @position input files should be kept */
+static gboolean
+wants_checkpoint(const NetplanStateCache* cache, guint position)
+{
+    return position > 0 && position + CACHE_CHECKPOINTS >= cache->inputs->len;
+}
+
+/* Load the state of the last checkpoint of @cache into the current parser.
+ * Returns: the number of definitions loaded, or -1 on error */
+static gint
+load_last_checkpoint(const NetplanStateCache* cache, NetplanBackend* backend, NetplanOVSSettings* ovs_settings)
+{
+    const CacheCheckpoint* last = &g_array_index(cache->checkpoints, CacheCheckpoint, cache->checkpoints->len - 1);
+    CacheIO io = { NULL, last->state->data, last->state->data + last->state->len };
+
+    return io_load_state(&io, backend, ovs_settings);
+}
+
+/**
+ * Load the parser state from the latest checkpoint of @cache which is still
+ * valid for its input files: the definitions get created as if they had been
+ * parsed, into the current parser, whose global @backend and @ovs_settings
+ * get set. The remaining input files need to be parsed on top of that, and
+ * netplan_state_cache_checkpoint() be called after each of them.
+ * Returns: the number of input files the loaded state covers, i.e. the index
+ *          of the first file which still needs to be parsed. 0 if nothing got
+ *          loaded, because the cache is missing, stale or broken; some of the
+ *          definitions might have been created nevertheless then.
+ */
+guint
+netplan_state_cache_load(NetplanStateCache* cache, NetplanBackend* backend, NetplanOVSSettings* ovs_settings)
+{
+    CacheIO io = { NULL };
+    CacheCheckpoint* last;
+    GMappedFile* map = NULL;
+    guint ret = 0;
+    guint valid = 0, count;
+    gint n_netdefs;
+    GStatBuf st;
+    int fd;
+
+    fd = g_open(cache->path, O_RDONLY, 0);
+    if (fd < 0)
+        return 0;
+    /* it holds secrets, and could smuggle in any configuration: only trust
+     * it if nobody else could have put it there */
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077)) {
+        g_debug("Ignoring state cache %s, it is not private to this user", cache->path);
+        goto cleanup;
+    }
+    map = g_mapped_file_new_from_fd(fd, FALSE, NULL);
+    if (!map)
+        goto cleanup; // LCOV_EXCL_LINE
+    io.pos = (const guint8*) g_mapped_file_get_contents(map);
+    io.end = io.pos + g_mapped_file_get_length(map);
+    if (!io.pos || (valid = unchanged_inputs(&io, cache)) == 0) {
+        g_debug("State cache %s is not valid for the current configuration", cache->path);
+        goto cleanup;
+    }
+
+    /* Keep the checkpoints which are still valid, to be saved again; the
+     * last of them is the one to continue from */
+    count = io_count(&io, NULL, 0);
+    for (guint i = 1; i < count && !io.failed; ++i) {
+        guint position = 0;
+        guint64 len = 0;
+
+        io_uint(&io, &position);
+        io_uint64(&io, &len);
+        if (io.failed || len > (guint64) (io.end - io.pos))
+            goto cleanup;
+        if (position <= valid && wants_checkpoint(cache, position)) {
+            GByteArray* state = g_byte_array_sized_new(len);
+            g_byte_array_append(state, io.pos, len);
+            add_checkpoint(cache, position, state);
+        }
+        io.pos += len;
+    }
+    if (io.failed || io.pos != io.end || cache->checkpoints->len == 0)
+        goto cleanup;
+
+    last = &g_array_index(cache->checkpoints, CacheCheckpoint, cache->checkpoints->len - 1);
+    n_netdefs = load_last_checkpoint(cache, backend, ovs_settings);
+    if (n_netdefs < 0)
+        goto cleanup;
+    g_debug("Loaded %d definitions of the first %u out of %u input files from state cache %s",
+            n_netdefs, last->position, cache->inputs->len, cache->path);
+    ret = last->position;
+
+cleanup:
+    if (ret == 0)
+        g_array_set_size(cache->checkpoints, 0);
+    if (map)
+        g_mapped_file_unref(map);
+    close(fd);
+    return ret;
+}
+
+/**
+ * Like netplan_state_cache_load(), but continue from @previous, the cache of
+ * an earlier parse which is still in memory, instead of the cache file. This
+ * is for long running users of the library, which re-parse the same hierarchy
+ * over and over: the inputs get compared in memory, and the checkpoints which
+ * are still valid get shared with @previous instead of being read again.
+ * Returns: the number of input files the loaded state covers, 0 if nothing
+ *          got loaded.
+ */
+guint
+netplan_state_cache_resume(NetplanStateCache* cache, const NetplanStateCache* previous,
+                           NetplanBackend* backend, NetplanOVSSettings* ovs_settings)
+{
+    guint valid = 0;
+    gint n_netdefs;
+    guint position;
+
+    while (valid < cache->inputs->len && valid < previous->inputs->len &&
+           same_input(&g_array_index(cache->inputs, CacheInput, valid),
+                      &g_array_index(previous->inputs, CacheInput, valid)))
+        valid++;
+    for (guint i = 0; i < previous->checkpoints->len; ++i) {
+        const CacheCheckpoint* checkpoint = &g_array_index(previous->checkpoints, CacheCheckpoint, i);
+        if (checkpoint->position <= valid && wants_checkpoint(cache, checkpoint->position))
+            add_checkpoint(cache, checkpoint->position, g_byte_array_ref(checkpoint->state));
+    }
+    if (cache->checkpoints->len == 0)
+        return 0;
+
+    position = g_array_index(cache->checkpoints, CacheCheckpoint, cache->checkpoints->len - 1).position;
+    n_netdefs = load_last_checkpoint(cache, backend, ovs_settings);
+    if (n_netdefs < 0) {
+        g_array_set_size(cache->checkpoints, 0); // LCOV_EXCL_LINE
+        return 0; // LCOV_EXCL_LINE
+    }
+    g_debug("Resumed from %d definitions of the first %u out of %u input files", n_netdefs, position,
+            cache->inputs->len);
+    return position;
+}
+
+/**
+ * Record the parser state (@netdefs in order, the global @backend and
+ * @ovs_settings) after parsing the first @position input files of @cache,
+ * if the cache wants to keep it. To be called in order after each file.
+ */
+void
+netplan_state_cache_checkpoint(NetplanStateCache* cache, guint position, const GList* netdefs,
+                               NetplanBackend backend, const NetplanOVSSettings* ovs_settings)
+{
+    CacheIO io = { NULL };
+
+    if (!wants_checkpoint(cache, position))
+        return;
+    io.out = g_byte_array_new();
+    io_save_state(&io, netdefs, backend, ovs_settings);
+    add_checkpoint(cache, position, io.out);
+}
+
+/**
+ * Save @cache with its checkpoints, for the next parse of the same files.
+ * Failing to do so is not an error, the next parse just cannot use it.
+ */
+void
+netplan_state_cache_save(const NetplanStateCache* cache)
+{
+    CacheIO io = { g_byte_array_new() };
+    g_autofree gchar* dir = g_path_get_dirname(cache->path);
+    g_autofree gchar* tmp = g_strconcat(cache->path, ".XXXXXX", NULL);
+    char* magic = CACHE_MAGIC;
+    char* build = (char*) build_id();
+    guint netdef_size = sizeof(NetplanNetDefinition);
+    int fd;
+
+    /* without a build ID, a cache of another build could not be told apart */
+    if (!*build) {
+        g_debug("Not saving state cache, libnetplan has no build ID"); // LCOV_EXCL_LINE
+        g_byte_array_free(io.out, TRUE); // LCOV_EXCL_LINE
+        return; // LCOV_EXCL_LINE
+    }
+    io_format(&io, &magic, &build, &netdef_size);
+    io_inputs(&io, cache->inputs);
+    io_count(&io, cache->checkpoints, cache->checkpoints->len);
+    for (guint i = 0; i < cache->checkpoints->len; ++i) {
+        CacheCheckpoint* checkpoint = &g_array_index(cache->checkpoints, CacheCheckpoint, i);
+        guint64 len = checkpoint->state->len;
+        io_uint(&io, &checkpoint->position);
+        io_uint64(&io, &len);
+        io_bytes(&io, checkpoint->state->data, len);
+    }
+
+    /* Written privately and swapped in atomically, as readers do not lock.
+     * The directory is not created here: it is up to the installation to
+     * provide it where the cache is wanted. */
+    if (!g_file_test(dir, G_FILE_TEST_IS_DIR)) {
+        g_debug("Not saving state cache, %s does not exist", dir);
+    } else if ((fd = g_mkstemp_full(tmp, O_WRONLY, 0600)) < 0) {
+        g_debug("Cannot write state cache %s: %s", cache->path, g_strerror(errno));
+    } else {
+        gboolean written = write(fd, io.out->data, io.out->len) == io.out->len;
+        written = close(fd) == 0 && written;
+        if (!written || g_rename(tmp, cache->path) != 0) {
+            g_debug("Cannot write state cache %s: %s", cache->path, g_strerror(errno));
+            g_unlink(tmp);
+        } else
+            g_debug("Saved %u checkpoints to state cache %s", cache->checkpoints->len, cache->path);
+    }
+
+    g_byte_array_free(io.out, TRUE);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2021 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "parse.h"
+
+/* Location of the cache below the root directory */
+#define NETPLAN_STATE_CACHE_PATH "var/cache/netplan/state.cache"
+
+/* Opaque handle for the state cache of one set of input files */
+typedef struct netplan_state_cache NetplanStateCache;
+
+NetplanStateCache* netplan_state_cache_new(const char* rootdir, const GPtrArray* files);
+guint netplan_state_cache_load(NetplanStateCache* cache, NetplanBackend* backend, NetplanOVSSettings* ovs_settings);
+guint netplan_state_cache_resume(NetplanStateCache* cache, const NetplanStateCache* previous,
+                                 NetplanBackend* backend, NetplanOVSSettings* ovs_settings);
+void netplan_state_cache_checkpoint(NetplanStateCache* cache, guint position, const GList* netdefs,
+                                    NetplanBackend backend, const NetplanOVSSettings* ovs_settings);
+void netplan_state_cache_save(const NetplanStateCache* cache);
+void netplan_state_cache_free(NetplanStateCache* cache);
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -7,6 +8,8 @@
 #include <glob.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
@@ -16,26 +19,119 @@
 
 #include "_features.h"
 #include "util.h"
+#include "parse.h"
+#include "netplan.h"
+
+typedef struct netplan_data NetplanData;
+typedef struct netplan_config_data NetplanConfigData;
 
 typedef struct {
     sd_bus_slot *slot;
-    gboolean invalidated;
-} NetplanConfigData;
+    gchar *path; /* /io/netplan/Netplan/job/<N> */
+} NetplanJob;
 
+/* A 'netplan <verb>' child process, run without blocking the mainloop */
 typedef struct {
+    NetplanData *d;
+    const char *verb; /* "apply", "generate" or "set" */
+    gboolean announce; /* track each run as a job object */
+    NetplanConfigData *config; /* config object a 'netplan set' works on, or NULL */
+    gchar **args; /* further arguments of the next/running child, or NULL */
+    GPid pid; /* running child process, or -1 */
+    sd_event_source *es;
+    NetplanJob *job;
+    sd_event_source *stderr_es;
+    int stderr_fd;
+    GString *stderr; /* collected stderr of the running child */
+    GPtrArray *waiting; /* calls to be answered once the running child exits */
+    GPtrArray *queued; /* calls received meanwhile, to be answered by a follow-up run */
+} NetplanRun;
+
+struct netplan_config_data {
+    sd_bus_slot *slot;
+    gboolean invalidated;
+    gchar *root_dir; /* /tmp/netplan-config-<ID> */
+    gchar *yaml; /* cached Get() output, or NULL if not known */
+    gboolean modified; /* Set() was called, or the copy of the main config is not known to be consistent */
+    guint state_generation; /* of the main config it got copied from, see NetplanData */
+    NetplanParser *parser; /* parsed state, once it differs from the main config's */
+    NetplanRun set; /* 'netplan set' of the Set() call being processed */
+    GPtrArray *pending; /* Get()/Set() calls received meanwhile, to be processed in order */
+};
+
+struct netplan_data {
     sd_bus *bus;
     sd_event_source *try_es;
     GPid try_pid; /* semaphore. There can only be one 'netplan try' child process at a time */
+    NetplanJob *try_job;
+    sd_bus_message *try_reply; /* pending Apply()/Cancel() call, accepting/rejecting the 'netplan try' */
+    gboolean try_accepted;
+    NetplanRun apply;
+    NetplanRun generate;
     const char *config_id; /* current config ID, during any io.netplan.Netplan.Config calls */
     char *handler_id; /* copy of pending config ID, during io.netplan.Netplan.Config.Try() */
     char *config_dirty; /* Currently pending Set() config object id */
     GHashTable *config_data; /* data of to the /io/netplan/Netplan/config/<ID> objects */
-} NetplanData;
+    guint job_count; /* number of jobs created so far, for unique job object paths */
+    int state_inotify_fd; /* watching the main /{etc,run,lib}/netplan/ dirs, or -1 if not cacheable */
+    int state_wd[3]; /* watch descriptors of the NETPLAN_SUBDIRS parents */
+    guint state_generation; /* bumped whenever the main config changed */
+    NetplanParser *state_parser; /* parsed state of the main config */
+    gchar *state_yaml; /* cached Get() output of the main config, or NULL if stale */
+};
 
 static const char* NETPLAN_SUBDIRS[3] = {"etc", "run", "lib"};
 static const char* NETPLAN_GLOBAL_CONFIG = "BACKUP";
 static char* NETPLAN_ROOT = "/"; /* Can be modified for testing netplan-dbus */
 
+static const sd_bus_vtable job_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_SIGNAL("Progress", "s", 0),
+    SD_BUS_SIGNAL("Finished", "bs", 0),
+    SD_BUS_VTABLE_END
+};
+
+/* Export a new /io/netplan/Netplan/job/<N> object, tracking a long running
+ * operation (e.g. KIND "apply" or "try"), and announce it via the
+ * io.netplan.Netplan.JobStarted() signal. */
+static NetplanJob*
+_job_new(NetplanData *d, const char *kind)
+{
+    NetplanJob *job = g_new0(NetplanJob, 1);
+    int r = 0;
+
+    job->path = g_strdup_printf("/io/netplan/Netplan/job/%u", ++d->job_count);
+    r = sd_bus_add_object_vtable(d->bus, &job->slot, job->path,
+                                 "io.netplan.Netplan.Job", job_vtable, d);
+    if (r >= 0)
+        r = sd_bus_emit_signal(d->bus, "/io/netplan/Netplan", "io.netplan.Netplan",
+                               "JobStarted", "os", job->path, kind);
+    if (r < 0)
+        fprintf(stderr, "Could not announce job %s: %s\n", job->path, strerror(-r)); // LCOV_EXCL_LINE
+    return job;
+}
+
+static void
+_job_progress(NetplanData *d, NetplanJob *job, const char *state)
+{
+    int r = sd_bus_emit_signal(d->bus, job->path, "io.netplan.Netplan.Job", "Progress", "s", state);
+    if (r < 0)
+        fprintf(stderr, "Could not send .Progress() signal: %s\n", strerror(-r)); // LCOV_EXCL_LINE
+}
+
+/* Send the .Finished() signal and remove the job object from the bus */
+static void
+_job_finish(NetplanData *d, NetplanJob *job, gboolean success, const char *error)
+{
+    int r = sd_bus_emit_signal(d->bus, job->path, "io.netplan.Netplan.Job", "Finished",
+                               "bs", success, error ?: "");
+    if (r < 0)
+        fprintf(stderr, "Could not send .Finished() signal: %s\n", strerror(-r)); // LCOV_EXCL_LINE
+    sd_bus_slot_unref(job->slot);
+    g_free(job->path);
+    g_free(job);
+}
+
 static void
 invalidate_other_config(gpointer key, gpointer value, gpointer user_data)
 {
@@ -50,14 +146,14 @@ invalidate_other_config(gpointer key, gpointer value, gpointer user_data)
 }
 
 static int
-terminate_try_child_process(int status, NetplanData *d, const char *config_id)
+terminate_try_child_process(const siginfo_t *si, NetplanData *d, const char *config_id)
 {
     sd_bus_message *msg = NULL;
     g_autofree gchar *path = NULL;
     int r = 0;
 
-    if (!WIFEXITED(status))
-        fprintf(stderr, "'netplan try' exited with status: %d\n", WEXITSTATUS(status)); // LCOV_EXCL_LINE
+    if (si->si_code != CLD_EXITED)
+        fprintf(stderr, "'netplan try' killed by signal: %d\n", si->si_status); // LCOV_EXCL_LINE
 
     /* Cleanup current 'netplan try' child process */
     sd_event_source_unref(d->try_es);
@@ -89,14 +185,16 @@ terminate_try_child_process(int status, NetplanData *d, const char *config_id)
 static int
 _try_accept(bool accept, sd_bus_message *m, NetplanData *d, sd_bus_error *ret_error)
 {
-    g_autoptr(GError) error = NULL;
-    int status = -1;
     int signal = SIGUSR1;
     if (!accept) signal = SIGINT;
 
     /* Do not send the accept/reject signal, if this call is for another config state */
     if (d->handler_id != NULL && g_strcmp0(d->config_id, d->handler_id))
         return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED, "Another 'netplan try' process is already running");
+    if (d->try_reply != NULL)
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
+                                 "The current 'netplan try' process is already being %s",
+                                 d->try_accepted ? "accepted" : "rejected");
 
     /* ATTENTION: There might be a race here:
      * When this accept/reject method is called at the same time as the 'netplan try'
@@ -106,20 +204,23 @@ _try_accept(bool accept, sd_bus_message *m, NetplanData *d, sd_bus_error *ret_er
      * interrupted by another exception/signal */
 
     /* Send confirm (SIGUSR1) or cancel (SIGINT) signal to 'netplan try' process.
-     * Wait for the child process to stop, synchronously.
-     * Check return code/errors. */
+     * The call is answered from netplan_try_done_cb(), once the child process
+     * stopped, without blocking the mainloop meanwhile. */
     kill(d->try_pid, signal);
-    waitpid(d->try_pid, &status, 0);
-    g_spawn_check_exit_status(status, &error);
-    if (error != NULL)
-        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED, "netplan try failed: %s", error->message); // LCOV_EXCL_LINE
-
-    terminate_try_child_process(status, d, d->config_id);
-    return sd_bus_reply_method_return(m, "b", true);
+    d->try_reply = sd_bus_message_ref(m);
+    d->try_accepted = accept;
+    _job_progress(d, d->try_job, accept ? "accepting" : "reverting");
+    return 1;
 }
 
+/* Make the YAML files in "/DST_ROOT/{etc,run,lib}/netplan/" a snapshot of the
+ * ones in "/SRC_ROOT/{etc,run,lib}/netplan/". Every file is copied to a
+ * temporary name first and renamed into place, and files which are gone from
+ * SRC_ROOT are deleted last, so that readers never see partially written files
+ * or an empty config in DST_ROOT. g_file_copy() uses reflinks (or in-kernel copies), where the
+ * filesystem allows for it. */
 static int
-_copy_yaml_state(char *src_root, char *dst_root, sd_bus_error *ret_error)
+_replace_yaml_state(const char *src_root, const char *dst_root, sd_bus_error *ret_error)
 {
     glob_t gl;
     g_autoptr(GError) err = NULL;
@@ -130,29 +231,32 @@ _copy_yaml_state(char *src_root, char *dst_root, sd_bus_error *ret_error)
                                  "Failed glob for YAML files\n");
         // LCOV_EXCL_STOP
 
-    /* Copy all *.yaml files from "/SRC_ROOT/{etc,run,lib}/netplan/" to
-     * "/DST_ROOT/{etc,run,lib}/netplan/" */
     GFile *source = NULL;
     GFile *dest = NULL;
     gchar *dest_path = NULL;
+    gchar *tmp_path = NULL;
     size_t len = strlen(src_root);
     for (size_t i = 0; i < gl.gl_pathc; ++i) {
         dest_path = g_strjoin(NULL, dst_root, (gl.gl_pathv[i])+len, NULL);
+        tmp_path = g_strjoin(NULL, dest_path, ".dbus-tmp", NULL);
         source = g_file_new_for_path(gl.gl_pathv[i]);
-        dest = g_file_new_for_path(dest_path);
+        dest = g_file_new_for_path(tmp_path);
         g_file_copy(source, dest, G_FILE_COPY_OVERWRITE
                                  |G_FILE_COPY_NOFOLLOW_SYMLINKS
                                  |G_FILE_COPY_ALL_METADATA,
                     NULL, NULL, NULL, &err);
+        if (err == NULL && g_rename(tmp_path, dest_path) < 0)
+            g_set_error(&err, G_FILE_ERROR, g_file_error_from_errno(errno), "%s", g_strerror(errno)); // LCOV_EXCL_LINE
         if (err != NULL) {
             // LCOV_EXCL_START
             r = sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
                                   "Failed to copy file %s -> %s: %s\n",
-                                  g_file_get_path(source), g_file_get_path(dest),
-                                  err->message);
+                                  gl.gl_pathv[i], dest_path, err->message);
+            unlink(tmp_path);
             g_object_unref(source);
             g_object_unref(dest);
             g_free(dest_path);
+            g_free(tmp_path);
             globfree(&gl);
             return r;
             // LCOV_EXCL_STOP
@@ -160,11 +264,207 @@ _copy_yaml_state(char *src_root, char *dst_root, sd_bus_error *ret_error)
         g_object_unref(source);
         g_object_unref(dest);
         g_free(dest_path);
+        g_free(tmp_path);
+    }
+    globfree(&gl);
+
+    /* Delete the files which are not part of the new state */
+    if (find_yaml_glob(dst_root, &gl) != 0)
+        // LCOV_EXCL_START
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
+                                 "Failed glob for YAML files\n");
+        // LCOV_EXCL_STOP
+    len = strlen(dst_root);
+    for (size_t i = 0; i < gl.gl_pathc; ++i) {
+        g_autofree gchar *src_path = g_strjoin(NULL, src_root, (gl.gl_pathv[i])+len, NULL);
+        if (!g_file_test(src_path, G_FILE_TEST_EXISTS|G_FILE_TEST_IS_SYMLINK))
+            unlink(gl.gl_pathv[i]);
     }
     globfree(&gl);
     return r;
 }
 
+/**
+ * 'netplan apply', 'netplan generate' and 'netplan set' child processes
+ */
+
+static int netplan_run_stderr_cb(sd_event_source *es, int fd, uint32_t revents, void* userdata);
+static int netplan_run_done_cb(sd_event_source *es, const siginfo_t *si, void* userdata);
+static void _config_resume(NetplanData *d, NetplanConfigData *cd);
+
+static void
+_run_init(NetplanRun *run, NetplanData *d, const char *verb, gboolean announce)
+{
+    run->d = d;
+    run->verb = verb;
+    run->announce = announce;
+    run->pid = -1;
+    run->stderr_fd = -1;
+    run->waiting = g_ptr_array_new_with_free_func((GDestroyNotify) sd_bus_message_unref);
+    run->queued = g_ptr_array_new_with_free_func((GDestroyNotify) sd_bus_message_unref);
+}
+
+static void
+_run_stderr_read(NetplanRun *run, sd_event_source *es)
+{
+    char buf[4096];
+    ssize_t len;
+
+    while ((len = read(run->stderr_fd, buf, sizeof(buf))) > 0)
+        g_string_append_len(run->stderr, buf, len);
+    /* EOF, stop polling the hung up pipe */
+    if (len == 0 && es)
+        sd_event_source_set_enabled(es, SD_EVENT_OFF);
+}
+
+/* Launch a 'netplan <verb> [args]' child process and watch it from the
+ * mainloop, answering all calls in run->waiting once it exits. */
+static int
+_run_spawn(NetplanData *d, NetplanRun *run, sd_bus_error *ret_error)
+{
+    g_autoptr(GError) err = NULL;
+    g_autoptr(GPtrArray) argv = g_ptr_array_new();
+    sd_event *event = sd_bus_get_event(d->bus);
+    int r = 0;
+
+    g_ptr_array_add(argv, SBINDIR "/" "netplan");
+    // for tests only: allow changing what netplan to run
+    if (getenv("DBUS_TEST_NETPLAN_CMD") != 0)
+       argv->pdata[0] = getenv("DBUS_TEST_NETPLAN_CMD");
+    g_ptr_array_add(argv, (gchar*) run->verb);
+    for (gchar **arg = run->args; arg && *arg; ++arg)
+        g_ptr_array_add(argv, *arg);
+    g_ptr_array_add(argv, NULL);
+
+    g_spawn_async_with_pipes("/", (gchar**) argv->pdata, NULL,
+                             G_SPAWN_DO_NOT_REAP_CHILD|G_SPAWN_STDOUT_TO_DEV_NULL,
+                             NULL, NULL, &run->pid, NULL, NULL, &run->stderr_fd, &err);
+    if (err) {
+        // LCOV_EXCL_START
+        run->pid = -1;
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
+                                 "cannot run netplan %s: %s", run->verb, err->message);
+        // LCOV_EXCL_STOP
+    }
+
+    run->stderr = g_string_new(NULL);
+    fcntl(run->stderr_fd, F_SETFL, fcntl(run->stderr_fd, F_GETFL) | O_NONBLOCK);
+    r = sd_event_add_io(event, &run->stderr_es, run->stderr_fd, EPOLLIN, netplan_run_stderr_cb, run);
+    if (r >= 0)
+        r = sd_event_add_child(event, &run->es, run->pid, WEXITED, netplan_run_done_cb, run);
+    if (r < 0)
+        // LCOV_EXCL_START
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
+                                 "cannot watch 'netplan %s' child: %s", run->verb, strerror(-r));
+        // LCOV_EXCL_STOP
+
+    if (run->announce) {
+        run->job = _job_new(d, run->verb);
+        _job_progress(d, run->job, "running");
+    }
+    return r;
+}
+
+static void
+_run_done(NetplanData *d, NetplanRun *run, const siginfo_t *si)
+{
+    GPtrArray *waiting = run->waiting;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    g_autofree gchar *failure = NULL;
+
+    /* Collect what is left in the pipe and cleanup the child process */
+    _run_stderr_read(run, NULL);
+    sd_event_source_unref(run->stderr_es);
+    run->stderr_es = NULL;
+    close(run->stderr_fd);
+    run->stderr_fd = -1;
+    sd_event_source_unref(run->es);
+    run->es = NULL;
+    g_spawn_close_pid(run->pid);
+    run->pid = -1;
+    g_clear_pointer(&run->args, g_strfreev);
+
+    if (si->si_code != CLD_EXITED || si->si_status != 0)
+        failure = g_strdup_printf("netplan %s failed: %s %d\nstderr: '%s'", run->verb,
+                                  si->si_code == CLD_EXITED ? "exited with status" : "killed by signal",
+                                  si->si_status, run->stderr->str);
+    if (run->job)
+        _job_finish(d, run->job, !failure, failure);
+    run->job = NULL;
+    for (guint i = 0; i < waiting->len; ++i) {
+        sd_bus_message *m = g_ptr_array_index(waiting, i);
+        if (!failure)
+            sd_bus_reply_method_return(m, "b", true);
+        else
+            sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED, "%s", failure);
+    }
+    g_ptr_array_free(waiting, TRUE);
+    g_string_free(run->stderr, TRUE);
+    run->stderr = NULL;
+
+    /* Start over for the calls which came in while running, as the config
+     * might have changed since the last run was started */
+    run->waiting = run->queued;
+    run->queued = g_ptr_array_new_with_free_func((GDestroyNotify) sd_bus_message_unref);
+    if (run->waiting->len > 0 && _run_spawn(d, run, &error) < 0) {
+        // LCOV_EXCL_START
+        for (guint i = 0; i < run->waiting->len; ++i)
+            sd_bus_reply_method_error(g_ptr_array_index(run->waiting, i), &error);
+        g_ptr_array_set_size(run->waiting, 0);
+        sd_bus_error_free(&error);
+        // LCOV_EXCL_STOP
+    }
+}
+
+/* Answer @m once a 'netplan <verb>' run, which started after this call, exits */
+static int
+_run_call(NetplanData *d, NetplanRun *run, sd_bus_message *m, sd_bus_error *ret_error)
+{
+    int r = 0;
+
+    /* Another run is going on already, which might not pick up the
+     * latest config. Queue up for a follow-up run instead of joining it. */
+    if (run->pid > 0) {
+        g_ptr_array_add(run->queued, sd_bus_message_ref(m));
+        return 1;
+    }
+
+    r = _run_spawn(d, run, ret_error);
+    if (r < 0)
+        return r; // LCOV_EXCL_LINE
+    g_ptr_array_add(run->waiting, sd_bus_message_ref(m));
+    /* handled, the reply is sent from _run_done() */
+    return 1;
+}
+
+static void
+_run_clear(NetplanRun *run)
+{
+    g_ptr_array_free(run->waiting, TRUE);
+    g_ptr_array_free(run->queued, TRUE);
+    g_strfreev(run->args);
+}
+
+static int
+netplan_run_stderr_cb(sd_event_source *es, int fd, uint32_t revents, void* userdata)
+{
+    NetplanRun *run = userdata;
+    _run_stderr_read(run, es);
+    return 0;
+}
+
+static int
+netplan_run_done_cb(sd_event_source *es, const siginfo_t *si, void* userdata)
+{
+    NetplanRun *run = userdata;
+    _run_done(run->d, run, si);
+    /* Continue with the calls on the config object, which had to wait for
+     * this 'netplan set' */
+    if (run->config)
+        _config_resume(run->d, run->config);
+    return 0;
+}
+
 static bool
 _clear_tmp_state(const char *config_id, NetplanData *d)
 {
@@ -190,6 +490,11 @@ _clear_tmp_state(const char *config_id, NetplanData *d)
         /* Clear config object from DBus, by unref the appropriate slot */
         NetplanConfigData *cd = g_hash_table_lookup(d->config_data, config_id);
         sd_bus_slot_unref(cd->slot); /* Clear value/slot */
+        _run_clear(&cd->set);
+        g_ptr_array_free(cd->pending, TRUE);
+        g_free(cd->root_dir);
+        g_free(cd->yaml);
+        netplan_parser_free(cd->parser);
         g_free(cd); /* Clear value/struct */
         g_hash_table_remove(d->config_data, config_id); /* Clear key */
         d->config_dirty = NULL;
@@ -206,65 +511,24 @@ _clear_tmp_state(const char *config_id, NetplanData *d)
 static int
 method_apply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
-    g_autoptr(GError) err = NULL;
-    g_autofree gchar *stdout = NULL;
-    g_autofree gchar *stderr = NULL;
-    gint exit_status = 0;
     NetplanData *d = userdata;
 
     /* Accept the current 'netplan try', if active.
-     * Otherwise execute 'netplan apply' directly. */
+     * Otherwise execute 'netplan apply' asynchronously and reply once it
+     * finished, without blocking the mainloop meanwhile. */
     if (d->try_pid > 0)
         return _try_accept(TRUE, m, userdata, ret_error);
-
-    gchar *argv[] = {SBINDIR "/" "netplan", "apply", NULL};
-
-    // for tests only: allow changing what netplan to run
-    if (getenv("DBUS_TEST_NETPLAN_CMD") != 0)
-       argv[0] = getenv("DBUS_TEST_NETPLAN_CMD");
-
-    g_spawn_sync("/", argv, NULL, 0, NULL, NULL, &stdout, &stderr, &exit_status, &err);
-    // LCOV_EXCL_START
-    if (err != NULL)
-        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
-                                 "cannot run netplan apply: %s", err->message);
-    g_spawn_check_exit_status(exit_status, &err);
-    if (err != NULL)
-       return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
-                                "netplan apply failed: %s\nstdout: '%s'\nstderr: '%s'",
-                                err->message, stdout, stderr);
-    // LCOV_EXCL_STOP
-
-    return sd_bus_reply_method_return(m, "b", true);
+    return _run_call(d, &d->apply, m, ret_error);
 }
 
 static int
 method_generate(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
-    g_autoptr(GError) err = NULL;
-    g_autofree gchar *stdout = NULL;
-    g_autofree gchar *stderr = NULL;
-    gint exit_status = 0;
-
-    gchar *argv[] = {SBINDIR "/" "netplan", "generate", NULL};
-
-    // for tests only: allow changing what netplan to run
-    if (getenv("DBUS_TEST_NETPLAN_CMD") != 0)
-       argv[0] = getenv("DBUS_TEST_NETPLAN_CMD");
-
-    g_spawn_sync("/", argv, NULL, 0, NULL, NULL, &stdout, &stderr, &exit_status, &err);
-    // LCOV_EXCL_START
-    if (err != NULL)
-        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
-                                 "cannot run netplan generate: %s", err->message);
-    g_spawn_check_exit_status(exit_status, &err);
-    if (err != NULL)
-       return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
-                                "netplan generate failed: %s\nstdout: '%s'\nstderr: '%s'",
-                                err->message, stdout, stderr);
-    // LCOV_EXCL_STOP
+    NetplanData *d = userdata;
 
-    return sd_bus_reply_method_return(m, "b", true);
+    /* Like Apply(), reply once 'netplan generate' finished, without
+     * blocking the mainloop meanwhile */
+    return _run_call(d, &d->generate, m, ret_error);
 }
 
 static int
@@ -312,93 +576,208 @@ method_info(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
     return sd_bus_send(NULL, reply, NULL);
 }
 
+static void
+_state_watch_add_subdir(NetplanData *d, int i)
+{
+    g_autofree gchar *path = g_strdup_printf("%s/%s/netplan", NETPLAN_ROOT, NETPLAN_SUBDIRS[i]);
+    /* Might not exist (yet), which is what the watch on its parent is for */
+    inotify_add_watch(d->state_inotify_fd, path,
+                      IN_ONLYDIR|IN_CREATE|IN_DELETE|IN_MODIFY|IN_CLOSE_WRITE|IN_ATTRIB
+                      |IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF);
+}
+
+/* Watch /{etc,run,lib}/ (for the netplan/ subdir coming and going) and
+ * /{etc,run,lib}/netplan/ (for its YAML files), to know when the cached Get()
+ * output of the main config is stale. */
+static void
+_state_watch_init(NetplanData *d)
+{
+    d->state_inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    for (int i = 0; i < 3 && d->state_inotify_fd >= 0; i++) {
+        g_autofree gchar *path = g_strdup_printf("%s/%s", NETPLAN_ROOT, NETPLAN_SUBDIRS[i]);
+        d->state_wd[i] = inotify_add_watch(d->state_inotify_fd, path,
+                                           IN_ONLYDIR|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO);
+        if (d->state_wd[i] < 0) {
+            // LCOV_EXCL_START
+            /* Cannot notice the netplan/ subdir appearing, never cache */
+            close(d->state_inotify_fd);
+            d->state_inotify_fd = -1;
+            // LCOV_EXCL_STOP
+        } else
+            _state_watch_add_subdir(d, i);
+    }
+}
+
+static gboolean
+_state_event_relevant(NetplanData *d, const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // LCOV_EXCL_START
+        /* Events got lost, a netplan/ subdir might have been re-created */
+        for (int i = 0; i < 3; i++)
+            _state_watch_add_subdir(d, i);
+        return TRUE;
+        // LCOV_EXCL_STOP
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (ev->wd != d->state_wd[i])
+            continue;
+        /* Only the netplan/ entry of /{etc,run,lib}/ is of interest */
+        if (g_strcmp0(ev->name, "netplan"))
+            return FALSE;
+        _state_watch_add_subdir(d, i);
+        return TRUE;
+    }
+    /* Some event inside a netplan/ subdir, or about the subdir itself.
+     * Ignore anything but YAML files, e.g. editor swap files. */
+    return !ev->len || g_str_has_suffix(ev->name, ".yaml");
+}
+
+/* Drain the pending inotify events and drop the cached state, if any of them
+ * touched the config. This is done synchronously at the time of the Config()
+ * or Get() call, instead of from the mainloop, so that changes which were
+ * written right before the call cannot be missed. */
+static void
+_state_watch_check(NetplanData *d)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev = NULL;
+    ssize_t len;
+
+    while ((len = read(d->state_inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *) p;
+            if (_state_event_relevant(d, ev)) {
+                g_free(d->state_yaml);
+                d->state_yaml = NULL;
+                d->state_generation++;
+            }
+        }
+    }
+}
+
+/* Bring the resident @parser up to date with the YAML hierarchy below
+ * @root_dir and serialize its state into @yaml. Only the files from the first
+ * one which changed since the last update on get parsed again. */
 static int
-method_get(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+_parse_config(NetplanParser *parser, const char *root_dir, gchar **yaml, sd_bus_error *ret_error)
 {
-    NetplanData *d = userdata;
     g_autoptr(GError) err = NULL;
-    g_autofree gchar *stdout = NULL;
-    g_autofree gchar *stderr = NULL;
-    g_autofree gchar *root_dir = NULL;
-    gint exit_status = 0;
-
-    if (d->config_id)
-        root_dir = g_strdup_printf("--root-dir=%s/netplan-config-%s", g_get_tmp_dir(), d->config_id);
-    gchar *argv[] = {SBINDIR "/" "netplan", "get", "all", root_dir, NULL};
 
-    // for tests only: allow changing what netplan to run
-    if (getenv("DBUS_TEST_NETPLAN_CMD") != 0)
-       argv[0] = getenv("DBUS_TEST_NETPLAN_CMD");
+    if (!netplan_parser_update_hierarchy(parser, root_dir, &err))
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED, "netplan get failed: %s", err->message);
+    *yaml = netplan_parser_conf_to_string(parser) ?: g_strdup("");
+    return 0;
+}
 
-    g_spawn_sync("/", argv, NULL, 0, NULL, NULL, &stdout, &stderr, &exit_status, &err);
-    if (err != NULL)
-        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED, "cannot run netplan get: %s", err->message); // LCOV_EXCL_LINE
+/* Answer @m with the merged YAML config of @cd's state, parsed in-process */
+static int
+_config_get(NetplanData *d, NetplanConfigData *cd, sd_bus_message *m, sd_bus_error *ret_error)
+{
+    gchar *yaml = NULL;
+    int r = 0;
 
-    g_spawn_check_exit_status(exit_status, &err);
-    if (err != NULL)
-       return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED, "netplan get failed: %s\nstdout: '%s'\nstderr: '%s'", err->message, stdout, stderr); // LCOV_EXCL_LINE
+    /* Nothing but Set() changes the state of a config object */
+    if (cd->yaml)
+        return sd_bus_reply_method_return(m, "s", cd->yaml);
+
+    /* Still a copy of the main config? Then serve it from the main config's
+     * state, which is shared by all of its copies, as long as the main
+     * config does not change. */
+    if (!cd->modified) {
+        _state_watch_check(d);
+        if (d->state_generation == cd->state_generation && !d->state_yaml) {
+            r = _parse_config(d->state_parser, NETPLAN_ROOT, &yaml, ret_error);
+            if (r < 0)
+                return r;
+            /* Unless it changed while being parsed */
+            _state_watch_check(d);
+            if (d->state_generation == cd->state_generation)
+                d->state_yaml = yaml;
+            else
+                g_free(yaml);
+        }
+        if (d->state_generation == cd->state_generation) {
+            cd->yaml = g_strdup(d->state_yaml);
+            return sd_bus_reply_method_return(m, "s", cd->yaml);
+        }
+    }
 
-    return sd_bus_reply_method_return(m, "s", stdout);
+    if (!cd->parser)
+        cd->parser = netplan_parser_new();
+    r = _parse_config(cd->parser, cd->root_dir, &cd->yaml, ret_error);
+    if (r < 0)
+        return r;
+    return sd_bus_reply_method_return(m, "s", cd->yaml);
 }
 
+/* Run 'netplan set' for the Set() call @m on @cd, answering it once done */
 static int
-method_set(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+_config_set(NetplanData *d, NetplanConfigData *cd, sd_bus_message *m, sd_bus_error *ret_error)
 {
-    NetplanData *d = userdata;
-    g_autoptr(GError) err = NULL;
-    g_autofree gchar *stdout = NULL;
-    g_autofree gchar *stderr = NULL;
-    g_autofree gchar *origin = NULL;
-    g_autofree gchar *root_dir = NULL;
-    gint exit_status = 0;
-    char *args[2] = {NULL, NULL};
+    g_autoptr(GPtrArray) args = g_ptr_array_new();
     char *config_delta = NULL;
     char *origin_hint = NULL;
-    guint cur_arg = 0;
 
     if (sd_bus_message_read(m, "ss", &config_delta, &origin_hint) < 0)
         return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED, "cannot extract config_delta or origin_hint"); // LCOV_EXCL_LINE
 
-    if (!!strcmp(origin_hint, "")) {
-        origin = g_strdup_printf("--origin-hint=%s", origin_hint);
-        args[cur_arg] = origin;
-        cur_arg++;
-    }
+    g_ptr_array_add(args, g_strdup(config_delta));
+    if (!!strcmp(origin_hint, ""))
+        g_ptr_array_add(args, g_strdup_printf("--origin-hint=%s", origin_hint));
+    g_ptr_array_add(args, g_strdup_printf("--root-dir=%s", cd->root_dir));
+    g_ptr_array_add(args, NULL);
+    cd->set.args = (gchar**) g_ptr_array_free(g_steal_pointer(&args), FALSE);
+
+    /* Even a failed 'netplan set' might have changed something */
+    g_clear_pointer(&cd->yaml, g_free);
+    cd->modified = TRUE;
+    return _run_call(d, &cd->set, m, ret_error);
+}
 
-    if (d->config_id) {
-        root_dir = g_strdup_printf("--root-dir=%s/netplan-config-%s", g_get_tmp_dir(), d->config_id);
-        args[cur_arg] = root_dir;
-        cur_arg++;
+/* Process the Get()/Set() calls on @cd, which came in while a 'netplan set'
+ * was running on it, until the next Set() needs to wait for its child */
+static void
+_config_resume(NetplanData *d, NetplanConfigData *cd)
+{
+    while (cd->set.pid < 0 && cd->pending->len > 0) {
+        sd_bus_message *m = sd_bus_message_ref(g_ptr_array_index(cd->pending, 0));
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        int r = 0;
+
+        g_ptr_array_remove_index(cd->pending, 0);
+        if (!g_strcmp0(sd_bus_message_get_member(m), "Set"))
+            r = _config_set(d, cd, m, &error);
+        else
+            r = _config_get(d, cd, m, &error);
+        if (r < 0)
+            sd_bus_reply_method_error(m, &error);
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(m);
     }
-    gchar *argv[] = {SBINDIR "/" "netplan", "set", config_delta, args[0], args[1], NULL};
-
-    // for tests only: allow changing what netplan to run
-    if (getenv("DBUS_TEST_NETPLAN_CMD") != 0)
-       argv[0] = getenv("DBUS_TEST_NETPLAN_CMD");
-
-    g_spawn_sync("/", argv, NULL, 0, NULL, NULL, &stdout, &stderr, &exit_status, &err);
-    if (err != NULL)
-        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED, "cannot run netplan set %s: %s", config_delta, err->message); // LCOV_EXCL_LINE
-
-    g_spawn_check_exit_status(exit_status, &err);
-    if (err != NULL)
-       return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED, "netplan set failed: %s\nstdout: '%s'\nstderr: '%s'", err->message, stdout, stderr); // LCOV_EXCL_LINE
-
-    return sd_bus_reply_method_return(m, "b", true);
 }
 
 static int
-netplan_try_cancelled_cb(sd_event_source *es, const siginfo_t *si, void* userdata)
+netplan_try_done_cb(sd_event_source *es, const siginfo_t *si, void* userdata)
 {
     NetplanData *d = userdata;
     g_autofree gchar *state_dir = NULL;
+    g_autofree gchar *failure = NULL;
+    sd_bus_message *reply_to = d->try_reply;
+    gboolean accepted = reply_to && d->try_accepted;
     int r = 0;
-    if (d->handler_id) {
-        /* Delete GLOBAL state */
-        unlink_glob(NETPLAN_ROOT, "/{etc,run,lib}/netplan/*.yaml");
+
+    if (si->si_code != CLD_EXITED || si->si_status != 0)
+        failure = g_strdup_printf("netplan try failed: %s %d",
+                                  si->si_code == CLD_EXITED ? "exited with status" : "killed by signal",
+                                  si->si_status);
+
+    /* Reverted, either via Cancel() or by timing out */
+    if (d->handler_id && !accepted) {
         /* Restore GLOBAL backup config state to main rootdir */
         state_dir = g_strdup_printf("%s/netplan-config-%s", g_get_tmp_dir(), NETPLAN_GLOBAL_CONFIG);
-        _copy_yaml_state(state_dir, NETPLAN_ROOT, NULL);
+        _replace_yaml_state(state_dir, NETPLAN_ROOT, NULL);
 
         /* Un-invalidate all other current config objects */
         if (!g_strcmp0(d->handler_id, d->config_dirty))
@@ -407,12 +786,27 @@ netplan_try_cancelled_cb(sd_event_source *es, const siginfo_t *si, void* userdat
         /* Clear GLOBAL backup and config state */
         _clear_tmp_state(NETPLAN_GLOBAL_CONFIG, d);
         _clear_tmp_state(d->handler_id, d);
-    }
+    } else if (accepted)
+        /* The GLOBAL backup is not needed anymore */
+        _clear_tmp_state(NETPLAN_GLOBAL_CONFIG, d);
 
-    r = terminate_try_child_process(si->si_status, d, d->handler_id);
+    r = terminate_try_child_process(si, d, d->handler_id);
     /* free and reset handler_id, i.e. copy of config state ID */
     g_free(d->handler_id);
     d->handler_id = NULL; /* unlock pending config ID */
+
+    _job_finish(d, d->try_job, accepted && !failure, failure ?: (accepted ? NULL : "reverted"));
+    d->try_job = NULL;
+
+    /* Answer the Apply()/Cancel() call, which stopped the 'netplan try' */
+    if (reply_to) {
+        d->try_reply = NULL;
+        if (failure)
+            sd_bus_reply_method_errorf(reply_to, SD_BUS_ERROR_FAILED, "%s", failure); // LCOV_EXCL_LINE
+        else
+            sd_bus_reply_method_return(reply_to, "b", true);
+        sd_bus_message_unref(reply_to);
+    }
     return r;
 }
 
@@ -450,13 +844,15 @@ method_try(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
     if (d->config_id)
         d->handler_id = g_strdup(d->config_id); /* to free in event handler */
     r = sd_event_add_child(sd_bus_get_event(d->bus), &d->try_es, d->try_pid,
-                           WEXITED, netplan_try_cancelled_cb, d);
+                           WEXITED, netplan_try_done_cb, d);
     if (r < 0)
         // LCOV_EXCL_START
         return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
                                  "cannot watch 'netplan try' child: %s", strerror(-r));
         // LCOV_EXCL_STOP
 
+    d->try_job = _job_new(d, "try");
+    _job_progress(d, d->try_job, "running");
     return sd_bus_reply_method_return(m, "b", true);
 }
 
@@ -477,26 +873,30 @@ method_config_apply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
     if (cd->invalidated)
         return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
                                  "This config was invalidated by another config object\n");
+    if (cd->set.pid > 0)
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
+                                 "A Set() is currently in progress on this config object\n");
     /* Invalidate all other current config objects */
     g_hash_table_foreach(d->config_data, invalidate_other_config, (void*)d->config_id);
     d->config_dirty = g_strdup(d->config_id);
 
     if (d->try_pid < 0) {
-        /* Delete GLOBAL state */
-        unlink_glob(NETPLAN_ROOT, "/{etc,run,lib}/netplan/*.yaml");
         /* Copy current config state to GLOBAL */
         state_dir = g_strdup_printf("%s/netplan-config-%s", g_get_tmp_dir(), d->config_id);
-        _copy_yaml_state(state_dir, NETPLAN_ROOT, ret_error);
+        _replace_yaml_state(state_dir, NETPLAN_ROOT, ret_error);
         d->handler_id = g_strdup(d->config_id);
     }
 
     r = method_apply(m, d, ret_error);
     _clear_tmp_state(d->config_id, d);
 
-    /* unlock current config ID and handler ID */
+    /* unlock current config ID and handler ID, unless a 'netplan try' is
+     * still running (i.e. being accepted), whose exit handler needs it */
     d->config_id = NULL;
-    g_free(d->handler_id);
-    d->handler_id = NULL;
+    if (d->try_pid < 0) {
+        g_free(d->handler_id);
+        d->handler_id = NULL;
+    }
     return r;
 }
 
@@ -505,24 +905,32 @@ method_config_get(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
     NetplanData *d = userdata;
     /* trim 27 chars (i.e. "/io/netplan/Netplan/config/") from path to get the config ID */
-    d->config_id = sd_bus_message_get_path(m) + 27;
-    int r = method_get(m, userdata, ret_error);
-    /* Reset config_id for next method call */
-    d->config_id = NULL;
-    return r;
+    NetplanConfigData *cd = g_hash_table_lookup(d->config_data, sd_bus_message_get_path(m) + 27);
+    /* Reflect the Set() calls before this one, once they are done */
+    if (cd->set.pid > 0) {
+        g_ptr_array_add(cd->pending, sd_bus_message_ref(m));
+        return 1;
+    }
+    return _config_get(d, cd, m, ret_error);
 }
 
 static int
 method_config_set(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
     NetplanData *d = userdata;
+    int r = 1;
     /* trim 27 chars (i.e. "/io/netplan/Netplan/config/") from path to get the config ID */
     d->config_id = sd_bus_message_get_path(m) + 27;
     NetplanConfigData *cd = g_hash_table_lookup(d->config_data, d->config_id);
     if (cd->invalidated)
         return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
                                  "This config was invalidated by another config object\n");
-    int r = method_set(m, d, ret_error);
+    /* Run 'netplan set' without blocking the mainloop, one at a time per
+     * config object, as each of them works on the result of the previous */
+    if (cd->set.pid > 0)
+        g_ptr_array_add(cd->pending, sd_bus_message_ref(m));
+    else
+        r = _config_set(d, cd, m, ret_error);
     /* Invalidate all other current config objects */
     g_hash_table_foreach(d->config_data, invalidate_other_config, (void*)d->config_id);
     d->config_dirty = g_strdup(d->config_id);
@@ -541,10 +949,16 @@ method_config_try(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
     if (d->try_pid > 0)
         return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
                                  "Another Try() is currently in progress: PID %d\n", d->try_pid);
+    if (d->apply.pid > 0)
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
+                                 "An Apply() is currently in progress: PID %d\n", d->apply.pid);
     NetplanConfigData *cd = g_hash_table_lookup(d->config_data, config_id);
     if (cd->invalidated)
         return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
                                  "This config was invalidated by another config object\n");
+    if (cd->set.pid > 0)
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
+                                 "A Set() is currently in progress on this config object\n");
 
     int r = 0;
     /* Lock current child process temporarily until we have a real PID */
@@ -567,14 +981,11 @@ method_config_try(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
     }
 
     /* Copy main *.yaml files from /{etc,run,lib}/netplan/ to GLOBAL backup dir */
-    _copy_yaml_state(NETPLAN_ROOT, path, ret_error);
-
-    /* Clear main *.yaml files */
-    unlink_glob(NETPLAN_ROOT, "/{etc,run,lib}/netplan/*.yaml");
+    _replace_yaml_state(NETPLAN_ROOT, path, ret_error);
 
     /* Copy current config *.yaml state to main rootdir (i.e. /etc/netplan/) */
     state_dir = g_strdup_printf("%s/netplan-config-%s", g_get_tmp_dir(), d->config_id);
-    _copy_yaml_state(state_dir, NETPLAN_ROOT, ret_error);
+    _replace_yaml_state(state_dir, NETPLAN_ROOT, ret_error);
 
     /* Exec try */
     r = method_try(m, userdata, ret_error);
@@ -586,35 +997,31 @@ static int
 method_config_cancel(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
     NetplanData *d = userdata;
-    g_autofree gchar *state_dir = NULL;
     int r = 0;
     /* trim 27 chars (i.e. "/io/netplan/Netplan/config/") from path to get the config ID */
     d->config_id = sd_bus_message_get_path(m) + 27;
+    NetplanConfigData *cd = g_hash_table_lookup(d->config_data, d->config_id);
+    if (cd->set.pid > 0) {
+        d->config_id = NULL;
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
+                                 "A Set() is currently in progress on this config object\n");
+    }
     if (!g_strcmp0(d->config_id, d->config_dirty))
         /* Un-invalidate all other current config objects */
          g_hash_table_foreach(d->config_data, invalidate_other_config, NULL);
 
     /* Cancel the current 'netplan try' process */
-    if (d->try_pid > 0)
+    if (d->try_pid > 0) {
         r = _try_accept(FALSE, m, d, ret_error);
-    else
+        /* Restoring the GLOBAL state and clearing this config object is done
+         * by netplan_try_done_cb(), once 'netplan try' reverted */
+        if (r > 0 || !g_strcmp0(d->config_id, d->handler_id)) {
+            d->config_id = NULL;
+            return r;
+        }
+    } else
         r = sd_bus_reply_method_return(m, "b", true);
 
-    if (d->handler_id && !g_strcmp0(d->config_id, d->handler_id)) {
-        /* Delete GLOBAL state */
-        unlink_glob(NETPLAN_ROOT, "/{etc,run,lib}/netplan/*.yaml");
-        /* Restore GLOBAL backup config state to main rootdir */
-        state_dir = g_strdup_printf("%s/netplan-config-%s", g_get_tmp_dir(), NETPLAN_GLOBAL_CONFIG);
-        _copy_yaml_state(state_dir, NETPLAN_ROOT, ret_error);
-
-        /* Clear GLOBAL backup and config state */
-        _clear_tmp_state(NETPLAN_GLOBAL_CONFIG, d);
-
-        /* Clear pending Try() handler ID */
-        g_free(d->handler_id);
-        d->handler_id = NULL;
-    }
-
     /* Clear tmp state */
     _clear_tmp_state(d->config_id, d);
     d->config_id = NULL;
@@ -663,8 +1070,19 @@ method_config(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
                                  "Failed to add 'config' object: %s\n", strerror(-r));
     NetplanConfigData *cd = g_new0(NetplanConfigData, 1);
     cd->slot = slot;
+    cd->root_dir = g_strdup(path);
+    _run_init(&cd->set, d, "set", FALSE);
+    cd->set.config = cd;
+    cd->pending = g_ptr_array_new_with_free_func((GDestroyNotify) sd_bus_message_unref);
     /* Cannot Set()/Apply() if another Set() is currently pending */
     cd->invalidated = d->config_dirty ? TRUE : FALSE;
+    /* A copy of the main config, whose Get() output might be known already */
+    if (d->state_inotify_fd >= 0) {
+        _state_watch_check(d);
+        cd->yaml = g_strdup(d->state_yaml);
+        cd->state_generation = d->state_generation;
+    } else
+        cd->modified = TRUE; /* Cannot tell if it is still the main config */
     if (!g_hash_table_insert(d->config_data, g_strdup(id), cd))
         return sd_bus_error_setf(ret_error, SD_BUS_ERROR_FAILED,
                                  "Failed to add object data to HashTable\n");
@@ -684,7 +1102,15 @@ method_config(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
     }
 
     /* Copy all *.yaml files from /{etc,run,lib}/netplan/ to temp dir */
-    _copy_yaml_state(NETPLAN_ROOT, path, ret_error);
+    _replace_yaml_state(NETPLAN_ROOT, path, ret_error);
+    /* The main config changed while being copied, the copy is of unknown state */
+    if (!cd->modified) {
+        _state_watch_check(d);
+        if (d->state_generation != cd->state_generation) {
+            g_clear_pointer(&cd->yaml, g_free);
+            cd->modified = TRUE;
+        }
+    }
 
     return sd_bus_reply_method_return(m, "o", obj_path);
 }
@@ -695,6 +1121,7 @@ static const sd_bus_vtable netplan_vtable[] = {
     SD_BUS_METHOD("Generate", "", "b", method_generate, 0),
     SD_BUS_METHOD("Info", "", "a(sv)", method_info, 0),
     SD_BUS_METHOD("Config", "", "o", method_config, 0),
+    SD_BUS_SIGNAL("JobStarted", "os", 0),
     SD_BUS_VTABLE_END
 };
 
@@ -724,6 +1151,19 @@ main(int argc, char *argv[])
     if (getenv("DBUS_TEST_NETPLAN_ROOT") != 0)
         NETPLAN_ROOT = getenv("DBUS_TEST_NETPLAN_ROOT");
 
+    /* Initialize the userdata */
+    data->try_pid = -1;
+    _run_init(&data->apply, data, "apply", TRUE);
+    _run_init(&data->generate, data, "generate", TRUE);
+    data->config_id = NULL;
+    data->handler_id = NULL;
+    data->config_dirty = NULL;
+    /* TODO: define a proper free/cleanup function for sd_bus_slot_unref() */
+    data->config_data = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    data->state_parser = netplan_parser_new();
+    data->state_yaml = NULL;
+    _state_watch_init(data);
+
     /* TODO: consider sd_bus_default(&bus) for easier testing on session/user bus */
     r = sd_bus_open_system(&bus);
     if (r < 0) {
@@ -741,14 +1181,7 @@ main(int argc, char *argv[])
         // LCOV_EXCL_STOP
     }
 
-    /* Initialize the userdata */
     data->bus = bus;
-    data->try_pid = -1;
-    data->config_id = NULL;
-    data->handler_id = NULL;
-    data->config_dirty = NULL;
-    /* TODO: define a proper free/cleanup function for sd_bus_slot_unref() */
-    data->config_data = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
     r = sd_bus_add_object_vtable(bus, &slot,
                                  "/io/netplan/Netplan",  /* object path */
@@ -788,6 +1221,12 @@ main(int argc, char *argv[])
     if (r < 0)
         fprintf(stderr, "Failed mainloop: %s\n", strerror(-r)); // LCOV_EXCL_LINE
 finish:
+    _run_clear(&data->apply);
+    _run_clear(&data->generate);
+    if (data->state_inotify_fd >= 0)
+        close(data->state_inotify_fd);
+    netplan_parser_free(data->state_parser);
+    g_free(data->state_yaml);
     g_free(data);
     sd_event_unref(event);
     sd_bus_slot_unref(slot);
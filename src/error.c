@@ -39,32 +39,47 @@ write_error_marker(GString *message, int column)
     g_string_append_printf(message, "^");
 }
 
+/* The contents of the YAML file being processed, see set_error_input() */
+static __thread const char* input_data;
+static __thread gsize input_length;
+/* Offsets of the starts of the lines in input_data, built on first use */
+static __thread GArray* input_lines;
+
+/**
+ * Set the contents of the YAML file being processed, which the context of
+ * errors about its nodes gets taken from. Unset it again with NULL.
+ */
+void
+set_error_input(const char* data, gsize length)
+{
+    input_data = data;
+    input_length = length;
+    g_clear_pointer(&input_lines, g_array_unref);
+}
+
 static char *
-get_syntax_error_context(const int line_num, const int column, GError **error)
+get_syntax_error_context(const int line_num, const int column)
 {
     GString *message = NULL;
-    GFile *cur_file = g_file_new_for_path(current_file);
-    GFileInputStream *file_stream;
-    GDataInputStream *stream;
-    gsize len;
-    gchar* line = NULL;
+    gsize start = input_length;
+    gsize end;
+
+    if (!input_lines) {
+        input_lines = g_array_new(FALSE, FALSE, sizeof(gsize));
+        for (gsize i = 0; i < input_length; i++)
+            if (i == 0 || input_data[i - 1] == '\n')
+                g_array_append_val(input_lines, i);
+    }
+    if (line_num < input_lines->len)
+        start = g_array_index(input_lines, gsize, line_num);
+    for (end = start; end < input_length && input_data[end] != '\n'; end++);
 
     message = g_string_sized_new(200);
-    file_stream = g_file_read(cur_file, NULL, error);
-    stream = g_data_input_stream_new (G_INPUT_STREAM(file_stream));
-    g_object_unref(file_stream);
-
-    for (int i = 0; i < line_num + 1; i++) {
-        g_free(line);
-        line = g_data_input_stream_read_line(stream, &len, NULL, error);
-    }
-    g_string_append_printf(message, "%s\n", line);
+    g_string_append_len(message, input_data + start, end - start);
+    g_string_append_c(message, '\n');
 
     write_error_marker(message, column);
 
-    g_object_unref(stream);
-    g_object_unref(cur_file);
-
     return g_string_free(message, FALSE);
 }
 
@@ -86,16 +101,13 @@ get_parser_error_context(const yaml_parser_t *parser, GError **error)
     }
     if (current <= parser->buffer.start)
         line = parser->buffer.start;
+    /* the buffer is not NUL terminated after its last character */
     current = line + 1;
-    while (current <= parser->buffer.last) {
-        if (*current == '\n') {
-            *current = '\0';
-            break;
-        }
+    while (current < parser->buffer.last && *current != '\n')
         current++;
-    }
 
-    g_string_append_printf(message, "%s\n", line);
+    g_string_append_len(message, (const char*) line, MIN(current, parser->buffer.last) - line);
+    g_string_append_c(message, '\n');
 
     write_error_marker(message, parser->problem_mark.column);
 
@@ -106,14 +118,18 @@ gboolean
 parser_error(const yaml_parser_t* parser, const char* yaml, GError** error)
 {
     char *error_context = get_parser_error_context(parser, error);
-    if ((char)*parser->buffer.pointer == '\t')
+    /* the character the parser stopped at; anything after the last one in
+     * its buffer is undefined, so the end of the buffer counts as '\0' */
+    char next = parser->buffer.pointer < parser->buffer.last ? (char)*parser->buffer.pointer : '\0';
+
+    if (next == '\t')
         g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE,
                     "%s:%zu:%zu: Invalid YAML: tabs are not allowed for indent:\n%s",
                     yaml,
                     parser->problem_mark.line + 1,
                     parser->problem_mark.column + 1,
                     error_context);
-    else if (((char)*parser->buffer.pointer == ' ' || (char)*parser->buffer.pointer == '\0')
+    else if ((next == ' ' || next == '\n' || next == '\0')
              && !parser->token_available)
         g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE,
                     "%s:%zu:%zu: Invalid YAML: aliases are not supported:\n%s",
@@ -142,6 +158,44 @@ parser_error(const yaml_parser_t* parser, const char* yaml, GError** error)
     return FALSE;
 }
 
+/**
+ * Put an error about an alias at @mark into @error, for aliases which do not
+ * refer to a previously anchored node.
+ */
+gboolean
+alias_error(const yaml_mark_t* mark, GError** error)
+{
+    char *error_context = get_syntax_error_context(mark->line, mark->column);
+
+    g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE,
+                "%s:%zu:%zu: Invalid YAML: aliases are not supported:\n%s",
+                current_file,
+                mark->line + 1,
+                mark->column + 1,
+                error_context);
+    g_free(error_context);
+    return FALSE;
+}
+
+/**
+ * Put an error about the alias at @mark into @error, for aliases which make
+ * the document expand to too many nodes.
+ */
+gboolean
+alias_expansion_error(const yaml_mark_t* mark, GError** error)
+{
+    char *error_context = get_syntax_error_context(mark->line, mark->column);
+
+    g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE,
+                "%s:%zu:%zu: Invalid YAML: aliases expand to too many nodes:\n%s",
+                current_file,
+                mark->line + 1,
+                mark->column + 1,
+                error_context);
+    g_free(error_context);
+    return FALSE;
+}
+
 /**
  * Put a YAML specific error message for @node into @error.
  */
@@ -155,7 +209,7 @@ yaml_error(const yaml_node_t* node, GError** error, const char* msg, ...)
     va_start(argp, msg);
     g_vasprintf(&s, msg, argp);
     if (node != NULL) {
-        error_context = get_syntax_error_context(node->start_mark.line, node->start_mark.column, error);
+        error_context = get_syntax_error_context(node->start_mark.line, node->start_mark.column);
         g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE,
                     "%s:%zu:%zu: Error in network definition: %s\n%s",
                     current_file,
@@ -24,8 +24,17 @@
 #include <yaml.h>
 
 
+void
+set_error_input(const char* data, gsize length);
+
 gboolean
 parser_error(const yaml_parser_t* parser, const char* yaml, GError** error);
 
+gboolean
+alias_error(const yaml_mark_t* mark, GError** error);
+
+gboolean
+alias_expansion_error(const yaml_mark_t* mark, GError** error);
+
 gboolean
 yaml_error(const yaml_node_t* node, GError** error, const char* msg, ...);
@@ -29,30 +29,23 @@
 #include "util.h"
 #include "parse.h"
 #include "networkd.h"
-#include "nm.h"
-#include "openvswitch.h"
-#include "sriov.h"
+#include "timings.h"
 
 static gchar* rootdir;
 static gchar** files;
-static gboolean any_networkd;
-static gboolean any_sriov;
 static gchar* mapping_iface;
+static gboolean show_changes;
+static gboolean show_timings;
 
 static GOptionEntry options[] = {
     {"root-dir", 'r', 0, G_OPTION_ARG_FILENAME, &rootdir, "Search for and generate configuration files in this root directory instead of /"},
     {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &files, "Read configuration from this/these file(s) instead of /etc/netplan/*.yaml", "[config file ..]"},
     {"mapping", 0, 0, G_OPTION_ARG_STRING, &mapping_iface, "Only show the device to backend mapping for the specified interface."},
+    {"changes", 0, 0, G_OPTION_ARG_NONE, &show_changes, "Print which files got added, changed or removed."},
+    {"timings", 0, 0, G_OPTION_ARG_NONE, &show_timings, "Print where the time went as JSON to stderr (also with NETPLAN_TIMINGS=1)."},
     {NULL}
 };
 
-static void
-reload_udevd(void)
-{
-    const gchar *argv[] = { "/bin/udevadm", "control", "--reload", NULL };
-    g_spawn_sync(NULL, (gchar**)argv, NULL, G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, NULL, NULL, NULL, NULL);
-};
-
 // LCOV_EXCL_START
 /* covered via 'cloud-init' integration test */
 static gboolean
@@ -60,12 +53,16 @@ check_called_just_in_time()
 {
     const gchar *argv[] = { "/bin/systemctl", "is-system-running", NULL };
     gchar *output = NULL;
-    g_spawn_sync(NULL, (gchar**)argv, NULL, G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, &output, NULL, NULL, NULL);
+    netplan_timed(NETPLAN_PHASE_JIT_START,
+                  g_spawn_sync(NULL, (gchar**)argv, NULL, G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, &output, NULL, NULL, NULL));
+    netplan_timings_count(NETPLAN_COUNTER_CHILDREN_SPAWNED, 1);
     if (output != NULL && strstr(output, "initializing") != NULL) {
         g_free(output);
         const gchar *argv2[] = { "/bin/systemctl", "is-active", "network.target", NULL };
         gint exit_code = 0;
-        g_spawn_sync(NULL, (gchar**)argv2, NULL, G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, NULL, NULL, &exit_code, NULL);
+        netplan_timed(NETPLAN_PHASE_JIT_START,
+                      g_spawn_sync(NULL, (gchar**)argv2, NULL, G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, NULL, NULL, &exit_code, NULL));
+        netplan_timings_count(NETPLAN_COUNTER_CHILDREN_SPAWNED, 1);
         /* return TRUE, if network.target is not yet active */
         return !g_spawn_check_exit_status(exit_code, NULL);
     }
@@ -77,24 +74,27 @@ static void
 start_unit_jit(gchar *unit)
 {
     const gchar *argv[] = { "/bin/systemctl", "start", "--no-block", "--no-ask-password", unit, NULL };
-    g_spawn_sync(NULL, (gchar**)argv, NULL, G_SPAWN_DEFAULT, NULL, NULL, NULL, NULL, NULL, NULL);
+    netplan_timed(NETPLAN_PHASE_JIT_START,
+                  g_spawn_sync(NULL, (gchar**)argv, NULL, G_SPAWN_DEFAULT, NULL, NULL, NULL, NULL, NULL, NULL));
+    netplan_timings_count(NETPLAN_COUNTER_CHILDREN_SPAWNED, 1);
 };
 // LCOV_EXCL_STOP
 
+/**
+ * Add the definitions in @matches to @found, skipping those already in there.
+ */
 static void
-nd_iterator_list(gpointer value, gpointer user_data)
+add_found(GPtrArray* found, const GPtrArray* matches)
 {
-    NetplanNetDefinition* def = (NetplanNetDefinition*) value;
-    if (write_networkd_conf(def, (const char*) user_data))
-        any_networkd = TRUE;
-
-    write_ovs_conf(def, (const char*) user_data);
-    write_nm_conf(def, (const char*) user_data);
-    if (def->sriov_explicit_vf_count < G_MAXUINT || def->sriov_link)
-        any_sriov = TRUE;
+    if (!matches)
+        return;
+    for (guint i = 0; i < matches->len; i++) {
+        gpointer nd = g_ptr_array_index (matches, i);
+        if (!g_ptr_array_find (found, nd, NULL))
+            g_ptr_array_add (found, nd);
+    }
 }
 
-
 static int
 find_interface(gchar* interface)
 {
@@ -103,8 +103,7 @@ find_interface(gchar* interface)
     GFile *driver_file;
     gchar *driver_path;
     gchar *driver = NULL;
-    gpointer key, value;
-    GHashTableIter iter;
+    NetplanNetDefinition *by_id;
     int ret = EXIT_FAILURE;
 
     found = g_ptr_array_new ();
@@ -125,25 +124,15 @@ find_interface(gchar* interface)
     g_object_unref (driver_file);
     g_free (driver_path);
 
-    g_hash_table_iter_init (&iter, netdefs);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        NetplanNetDefinition *nd = (NetplanNetDefinition *) value;
-        if (!g_strcmp0(nd->set_name, interface))
-            g_ptr_array_add (found, (gpointer) nd);
-        else if (!g_strcmp0(nd->id, interface))
-            g_ptr_array_add (found, (gpointer) nd);
-        else if (!g_strcmp0(nd->match.original_name, interface))
-            g_ptr_array_add (found, (gpointer) nd);
-    }
+    add_found (found, netplan_netdefs_lookup (NETPLAN_NETDEF_INDEX_SET_NAME, interface));
+    by_id = g_hash_table_lookup (netdefs, interface);
+    if (by_id && !g_ptr_array_find (found, by_id, NULL))
+        g_ptr_array_add (found, (gpointer) by_id);
+    add_found (found, netplan_netdefs_lookup (NETPLAN_NETDEF_INDEX_MATCH_NAME, interface));
     if (found->len == 0 && driver != NULL) {
         /* testing for driver matching is done via autopkgtest */
         // LCOV_EXCL_START
-        g_hash_table_iter_init (&iter, netdefs);
-        while (g_hash_table_iter_next (&iter, &key, &value)) {
-            NetplanNetDefinition *nd = (NetplanNetDefinition *) value;
-            if (!g_strcmp0(nd->match.driver, driver))
-                g_ptr_array_add (found, (gpointer) nd);
-        }
+        add_found (found, netplan_netdefs_lookup (NETPLAN_NETDEF_INDEX_MATCH_DRIVER, driver));
         // LCOV_EXCL_STOP
     }
 
@@ -178,6 +167,8 @@ int main(int argc, char** argv)
     /* are we being called as systemd generator? */
     gboolean called_as_generator = (strstr(argv[0], "systemd/system-generators/") != NULL);
     g_autofree char* generator_run_stamp = NULL;
+    g_autoptr(GPtrArray) changes = NULL;
+    NetplanOutputSummary summary = { 0 };
     glob_t gl;
 
     /* Parse CLI options */
@@ -196,6 +187,8 @@ int main(int argc, char** argv)
         g_fprintf(stderr, "failed to parse options: %s\n", error->message);
         return 1;
     }
+    if (show_timings || g_strcmp0(getenv("NETPLAN_TIMINGS"), "1") == 0)
+        netplan_timings_enable();
 
     if (called_as_generator) {
         if (files == NULL || g_strv_length(files) != 3 || files[0] == NULL) {
@@ -222,39 +215,26 @@ int main(int argc, char** argv)
         exit(1);
     }
 
-    /* Clean up generated config from previous runs */
-    cleanup_networkd_conf(rootdir);
-    cleanup_nm_conf(rootdir);
-    cleanup_ovs_conf(rootdir);
-    cleanup_sriov_conf(rootdir);
-
     if (mapping_iface && netdefs)
         return find_interface(mapping_iface);
+    netplan_timings_count(NETPLAN_COUNTER_NETDEFS, netdefs ? g_hash_table_size(netdefs) : 0);
 
-    /* Generate backend specific configuration files from merged data. */
-    write_ovs_conf_finish(rootdir); // OVS cleanup unit is always written
-    if (netdefs) {
-        g_debug("Generating output files..");
-        g_list_foreach (netdefs_ordered, nd_iterator_list, rootdir);
-        write_nm_conf_finish(rootdir);
-        if (any_sriov) write_sriov_conf_finish(rootdir);
-        /* We may have written .rules & .link files, thus we must
-         * invalidate udevd cache of its config as by default it only
-         * invalidates cache at most every 3 seconds. Not sure if this
-         * should live in `generate' or `apply', but it is confusing
-         * when udevd ignores just-in-time created rules files.
-         */
-        reload_udevd();
+    changes = netplan_write_output(rootdir, &summary, &error);
+    if (!changes) {
+        g_fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    if (show_changes) {
+        for (guint i = 0; i < changes->len; i++) {
+            const NetplanOutputChange* change = g_ptr_array_index(changes, i);
+            if (change->type != NETPLAN_OUTPUT_UNCHANGED)
+                g_printf("%s %s\n", netplan_output_change_type_to_str[change->type], change->path);
+        }
     }
-
-    /* Disable /usr/lib/NetworkManager/conf.d/10-globally-managed-devices.conf
-     * (which restricts NM to wifi and wwan) if global renderer is NM */
-    if (netplan_get_global_backend() == NETPLAN_BACKEND_NM)
-        g_string_free_to_file(g_string_new(NULL), rootdir, "/run/NetworkManager/conf.d/10-globally-managed-devices.conf", NULL);
 
     if (called_as_generator) {
         /* Ensure networkd starts if we have any configuration for it */
-        if (any_networkd)
+        if (summary.any_networkd)
             enable_networkd(files[0]);
 
         /* Leave a stamp file so that we don't regenerate the configuration
@@ -274,7 +254,7 @@ int main(int argc, char** argv)
          */
         // LCOV_EXCL_START
         /* covered via 'cloud-init' integration test */
-        if (any_networkd) {
+        if (summary.any_networkd) {
             start_unit_jit("systemd-networkd.socket");
             start_unit_jit("systemd-networkd-wait-online.service");
             start_unit_jit("systemd-networkd.service");
@@ -291,5 +271,6 @@ int main(int argc, char** argv)
         // LCOV_EXCL_STOP
     }
 
+    netplan_timings_print(stderr);
     return 0;
 }
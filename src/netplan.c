@@ -15,11 +15,18 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include <glib.h>
 #include <yaml.h>
 
 #include "netplan.h"
 #include "parse.h"
+#include "validation.h"
 
 gchar *tmp = NULL;
 
@@ -266,6 +273,9 @@ error: return FALSE; // LCOV_EXCL_LINE
 static gboolean
 write_addresses(yaml_event_t* event, yaml_emitter_t* emitter, const NetplanNetDefinition* def)
 {
+    char addr[NETPLAN_ADDRESS_STRLEN];
+    const char* text;
+
     YAML_SCALAR_PLAIN(event, emitter, "addresses");
     YAML_SEQUENCE_OPEN(event, emitter);
     if (def->address_options) {
@@ -281,12 +291,16 @@ write_addresses(yaml_event_t* event, yaml_emitter_t* emitter, const NetplanNetDe
         }
     }
     if (def->ip4_addresses) {
-        for (unsigned i = 0; i < def->ip4_addresses->len; ++i)
-            YAML_SCALAR_QUOTED(event, emitter, g_array_index(def->ip4_addresses, char*, i));
+        for (unsigned i = 0; i < def->ip4_addresses->len; ++i) {
+            text = format_address(&g_array_index(def->ip4_addresses, NetplanAddress, i), TRUE, addr);
+            YAML_SCALAR_QUOTED(event, emitter, text);
+        }
     }
     if (def->ip6_addresses) {
-        for (unsigned i = 0; i < def->ip6_addresses->len; ++i)
-            YAML_SCALAR_QUOTED(event, emitter, g_array_index(def->ip6_addresses, char*, i));
+        for (unsigned i = 0; i < def->ip6_addresses->len; ++i) {
+            text = format_address(&g_array_index(def->ip6_addresses, NetplanAddress, i), TRUE, addr);
+            YAML_SCALAR_QUOTED(event, emitter, text);
+        }
     }
 
     YAML_SEQUENCE_CLOSE(event, emitter);
@@ -297,18 +311,25 @@ error: return FALSE; // LCOV_EXCL_LINE
 static gboolean
 write_nameservers(yaml_event_t* event, yaml_emitter_t* emitter, const NetplanNetDefinition* def)
 {
+    char addr[NETPLAN_ADDRESS_STRLEN];
+    const char* text;
+
     YAML_SCALAR_PLAIN(event, emitter, "nameservers");
     YAML_MAPPING_OPEN(event, emitter);
     if (def->ip4_nameservers || def->ip6_nameservers){
         YAML_SCALAR_PLAIN(event, emitter, "addresses");
         YAML_SEQUENCE_OPEN(event, emitter);
         if (def->ip4_nameservers) {
-            for (unsigned i = 0; i < def->ip4_nameservers->len; ++i)
-                YAML_SCALAR_PLAIN(event, emitter, g_array_index(def->ip4_nameservers, char*, i));
+            for (unsigned i = 0; i < def->ip4_nameservers->len; ++i) {
+                text = format_address(&g_array_index(def->ip4_nameservers, NetplanAddress, i), FALSE, addr);
+                YAML_SCALAR_PLAIN(event, emitter, text);
+            }
         }
         if (def->ip6_nameservers) {
-            for (unsigned i = 0; i < def->ip6_nameservers->len; ++i)
-                YAML_SCALAR_PLAIN(event, emitter, g_array_index(def->ip6_nameservers, char*, i));
+            for (unsigned i = 0; i < def->ip6_nameservers->len; ++i) {
+                text = format_address(&g_array_index(def->ip6_nameservers, NetplanAddress, i), FALSE, addr);
+                YAML_SCALAR_PLAIN(event, emitter, text);
+            }
         }
         YAML_SEQUENCE_CLOSE(event, emitter);
     }
@@ -413,7 +434,8 @@ write_tunnel_settings(yaml_event_t* event, yaml_emitter_t* emitter, const Netpla
                 YAML_SCALAR_PLAIN(event, emitter, "allowed-ips");
                 YAML_SEQUENCE_OPEN(event, emitter);
                 for (unsigned i = 0; i < peer->allowed_ips->len; ++i) {
-                    char *ip = g_array_index(peer->allowed_ips, char*, i);
+                    char addr[NETPLAN_ADDRESS_STRLEN];
+                    const char *ip = format_address(&g_array_index(peer->allowed_ips, NetplanAddress, i), TRUE, addr);
                     YAML_SCALAR_QUOTED(event, emitter, ip);
                 }
                 YAML_SEQUENCE_CLOSE(event, emitter);
@@ -593,8 +615,9 @@ write_openvswitch(yaml_event_t* event, yaml_emitter_t* emitter, const NetplanOVS
 error: return FALSE; // LCOV_EXCL_LINE
 }
 
+/* Emit @def, looking up the bond/bridge members among @defs */
 void
-_serialize_yaml(yaml_event_t* event, yaml_emitter_t* emitter, const NetplanNetDefinition* def)
+_serialize_yaml(yaml_event_t* event, yaml_emitter_t* emitter, const NetplanNetDefinition* def, GHashTable* defs)
 {
     GArray* tmp_arr = NULL;
     GHashTableIter iter;
@@ -627,8 +650,11 @@ _serialize_yaml(yaml_event_t* event, yaml_emitter_t* emitter, const NetplanNetDe
     if (def->ip4_nameservers || def->ip6_nameservers || def->search_domains)
         write_nameservers(event, emitter, def);
 
-    YAML_STRING_PLAIN(event, emitter, "gateway4", def->gateway4);
-    YAML_STRING_PLAIN(event, emitter, "gateway6", def->gateway6);
+    char addr[NETPLAN_ADDRESS_STRLEN];
+    if (def->gateway4.ip.family)
+        YAML_STRING_PLAIN(event, emitter, "gateway4", format_address(&def->gateway4, FALSE, addr));
+    if (def->gateway6.ip.family)
+        YAML_STRING_PLAIN(event, emitter, "gateway6", format_address(&def->gateway6, FALSE, addr));
 
     if (g_strcmp0(def->dhcp_identifier, "duid") != 0)
         YAML_STRING(event, emitter, "dhcp-identifier", def->dhcp_identifier);
@@ -674,7 +700,7 @@ _serialize_yaml(yaml_event_t* event, yaml_emitter_t* emitter, const NetplanNetDe
     /* Search interfaces */
     if (def->type == NETPLAN_DEF_TYPE_BRIDGE || def->type == NETPLAN_DEF_TYPE_BOND) {
         tmp_arr = g_array_new(FALSE, FALSE, sizeof(NetplanNetDefinition*));
-        g_hash_table_iter_init(&iter, netdefs);
+        g_hash_table_iter_init(&iter, defs);
         while (g_hash_table_iter_next (&iter, &key, &value)) {
             NetplanNetDefinition *nd = (NetplanNetDefinition *) value;
             if (g_strcmp0(nd->bond, def->id) == 0 || g_strcmp0(nd->bridge, def->id) == 0)
@@ -825,7 +851,7 @@ write_netplan_conf(const NetplanNetDefinition* def, const char* rootdir)
     if (netplan_def_type_to_str[def->type]) {
         YAML_SCALAR_PLAIN(event, emitter, netplan_def_type_to_str[def->type]);
         YAML_MAPPING_OPEN(event, emitter);
-        _serialize_yaml(event, emitter, def);
+        _serialize_yaml(event, emitter, def, netdefs);
         YAML_MAPPING_CLOSE(event, emitter);
     }
 
@@ -853,6 +879,98 @@ contains_netdef_type(gpointer key, gpointer value, gpointer user_data)
     return nd->type == *type;
 }
 
+/* Whether write_netplan_conf_full() has anything to serialize of the
+ * definitions @defs, the global @backend and @ovs_settings */
+static gboolean
+has_conf_full_data(GHashTable* defs, NetplanBackend backend, const NetplanOVSSettings* ovs_settings)
+{
+    return (   (backend != NETPLAN_BACKEND_NONE)
+            || has_openvswitch(ovs_settings, NETPLAN_BACKEND_NONE, NULL)
+            || (defs && g_hash_table_size(defs) > 0));
+}
+
+/* Emit a full YAML stream of the definitions @defs, the global @backend and
+ * @ovs_settings into an initialized @emitter, which gets torn down afterwards */
+static gboolean
+serialize_netplan_conf_full(yaml_emitter_t* emitter, GHashTable* defs, NetplanBackend backend,
+                            const NetplanOVSSettings* ovs_settings)
+{
+    yaml_event_t event_data;
+    yaml_event_t* event = &event_data;
+    GHashTable *ovs_ports = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    yaml_stream_start_event_initialize(event, YAML_UTF8_ENCODING);
+    if (!yaml_emitter_emit(emitter, event)) goto error;
+    yaml_document_start_event_initialize(event, NULL, NULL, NULL, 1);
+    if (!yaml_emitter_emit(emitter, event)) goto error;
+    YAML_MAPPING_OPEN(event, emitter);
+    /* build the netplan boilerplate YAML structure */
+    YAML_SCALAR_PLAIN(event, emitter, "network");
+    YAML_MAPPING_OPEN(event, emitter);
+    /* We support version 2 only, currently */
+    YAML_STRING_PLAIN(event, emitter, "version", "2");
+
+    if (backend == NETPLAN_BACKEND_NM) {
+        YAML_STRING_PLAIN(event, emitter, "renderer", "NetworkManager");
+    } else if (backend == NETPLAN_BACKEND_NETWORKD) {
+        YAML_STRING_PLAIN(event, emitter, "renderer", "networkd");
+    }
+
+    /* Go through the netdefs type-by-type */
+    if (defs && g_hash_table_size(defs) > 0) {
+        for (unsigned i = 0; i < NETPLAN_DEF_TYPE_MAX_; ++i) {
+            /* Per-netdef config */
+            if (g_hash_table_find(defs, contains_netdef_type, &i)) {
+                if (netplan_def_type_to_str[i]) {
+                    YAML_SCALAR_PLAIN(event, emitter, netplan_def_type_to_str[i]);
+                    YAML_MAPPING_OPEN(event, emitter);
+                    g_hash_table_iter_init(&iter, defs);
+                    while (g_hash_table_iter_next (&iter, &key, &value)) {
+                        NetplanNetDefinition *def = (NetplanNetDefinition *) value;
+                        if (def->type == i)
+                            _serialize_yaml(event, emitter, def, defs);
+                    }
+                    YAML_MAPPING_CLOSE(event, emitter);
+                } else if (i == NETPLAN_DEF_TYPE_PORT) {
+                    g_hash_table_iter_init(&iter, defs);
+                    while (g_hash_table_iter_next (&iter, &key, &value)) {
+                        NetplanNetDefinition *def = (NetplanNetDefinition *) value;
+                        if (def->type == i) {
+                            if (!ovs_ports)
+                                ovs_ports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+                            /* Insert each port:peer combination only once */
+                            if (!g_hash_table_lookup(ovs_ports, def->id))
+                                g_hash_table_insert(ovs_ports, g_strdup(def->peer), g_strdup(def->id));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    write_openvswitch(event, emitter, ovs_settings, NETPLAN_BACKEND_NONE, ovs_ports);
+
+    /* Close remaining mappings */
+    YAML_MAPPING_CLOSE(event, emitter);
+
+    /* Tear down the YAML emitter */
+    YAML_OUT_STOP(event, emitter);
+    if (ovs_ports)
+        g_hash_table_destroy(ovs_ports);
+    return TRUE;
+
+    // LCOV_EXCL_START
+error:
+    g_warning("Error generating YAML: %s", emitter->problem);
+    yaml_emitter_delete(emitter);
+    if (ovs_ports)
+        g_hash_table_destroy(ovs_ports);
+    return FALSE;
+    // LCOV_EXCL_STOP
+}
+
 /**
  * Generate the Netplan YAML configuration for all currently parsed netdefs
  * @file_hint: Name hint for the generated output YAML file
@@ -863,87 +981,316 @@ void
 write_netplan_conf_full(const char* file_hint, const char* rootdir)
 {
     g_autofree gchar *path = NULL;
-    GHashTable *ovs_ports = NULL;
-    GHashTableIter iter;
-    gpointer key, value;
 
-    gboolean global_values = (   (netplan_get_global_backend() != NETPLAN_BACKEND_NONE)
-                              || has_openvswitch(&ovs_settings_global, NETPLAN_BACKEND_NONE, NULL));
-
-    if (global_values || (netdefs && g_hash_table_size(netdefs) > 0)) {
+    if (has_conf_full_data(netdefs, netplan_get_global_backend(), &ovs_settings_global)) {
         path = g_build_path(G_DIR_SEPARATOR_S, rootdir ?: G_DIR_SEPARATOR_S, "etc", "netplan", file_hint, NULL);
 
         /* Start rendering YAML output */
-        yaml_emitter_t emitter_data;
-        yaml_event_t event_data;
-        yaml_emitter_t* emitter = &emitter_data;
-        yaml_event_t* event = &event_data;
+        yaml_emitter_t emitter;
         FILE *output = fopen(path, "wb");
 
-        YAML_OUT_START(event, emitter, output);
-        /* build the netplan boilerplate YAML structure */
-        YAML_SCALAR_PLAIN(event, emitter, "network");
-        YAML_MAPPING_OPEN(event, emitter);
-        /* We support version 2 only, currently */
-        YAML_STRING_PLAIN(event, emitter, "version", "2");
+        yaml_emitter_initialize(&emitter);
+        yaml_emitter_set_output_file(&emitter, output);
+        serialize_netplan_conf_full(&emitter, netdefs, netplan_get_global_backend(), &ovs_settings_global);
+        fclose(output);
+    } else {
+        g_debug("No data/netdefs to serialize into YAML.");
+    }
+}
 
-        if (netplan_get_global_backend() == NETPLAN_BACKEND_NM) {
-            YAML_STRING_PLAIN(event, emitter, "renderer", "NetworkManager");
-        } else if (netplan_get_global_backend() == NETPLAN_BACKEND_NETWORKD) {
-            YAML_STRING_PLAIN(event, emitter, "renderer", "networkd");
-        }
+static int
+append_to_gstring(void* data, unsigned char* buffer, size_t size)
+{
+    g_string_append_len((GString*) data, (const gchar*) buffer, size);
+    return 1;
+}
 
-        /* Go through the netdefs type-by-type */
-        if (netdefs && g_hash_table_size(netdefs) > 0) {
-            for (unsigned i = 0; i < NETPLAN_DEF_TYPE_MAX_; ++i) {
-                /* Per-netdef config */
-                if (g_hash_table_find(netdefs, contains_netdef_type, &i)) {
-                    if (netplan_def_type_to_str[i]) {
-                        YAML_SCALAR_PLAIN(event, emitter, netplan_def_type_to_str[i]);
-                        YAML_MAPPING_OPEN(event, emitter);
-                        g_hash_table_iter_init(&iter, netdefs);
-                        while (g_hash_table_iter_next (&iter, &key, &value)) {
-                            NetplanNetDefinition *def = (NetplanNetDefinition *) value;
-                            if (def->type == i)
-                                _serialize_yaml(event, emitter, def);
-                        }
-                        YAML_MAPPING_CLOSE(event, emitter);
-                    } else if (i == NETPLAN_DEF_TYPE_PORT) {
-                        g_hash_table_iter_init(&iter, netdefs);
-                        while (g_hash_table_iter_next (&iter, &key, &value)) {
-                            NetplanNetDefinition *def = (NetplanNetDefinition *) value;
-                            if (def->type == i) {
-                                if (!ovs_ports)
-                                    ovs_ports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
-                                /* Insert each port:peer combination only once */
-                                if (!g_hash_table_lookup(ovs_ports, def->id))
-                                    g_hash_table_insert(ovs_ports, g_strdup(def->peer), g_strdup(def->id));
-                            }
-                        }
-                    }
-                }
+static gchar*
+conf_full_to_string(GHashTable* defs, NetplanBackend backend, const NetplanOVSSettings* ovs_settings)
+{
+    yaml_emitter_t emitter;
+    GString* out = NULL;
+
+    if (!has_conf_full_data(defs, backend, ovs_settings))
+        return NULL;
+
+    out = g_string_new(NULL);
+    yaml_emitter_initialize(&emitter);
+    yaml_emitter_set_output(&emitter, append_to_gstring, out);
+    if (!serialize_netplan_conf_full(&emitter, defs, backend, ovs_settings)) {
+        g_string_free(out, TRUE); // LCOV_EXCL_LINE
+        return NULL; // LCOV_EXCL_LINE
+    }
+    return g_string_free(out, FALSE);
+}
+
+/**
+ * Serialize all currently parsed netdefs and global settings into a newly
+ * allocated YAML string, the in-memory counterpart of write_netplan_conf_full().
+ * Returns %NULL if there is nothing to serialize.
+ */
+gchar*
+netplan_conf_full_to_string()
+{
+    return conf_full_to_string(netdefs, netplan_get_global_backend(), &ovs_settings_global);
+}
+
+/**
+ * Serialize the definitions and global settings of @parser, like
+ * netplan_conf_full_to_string() does for the process-global parser.
+ */
+gchar*
+netplan_parser_conf_to_string(const NetplanParser* parser)
+{
+    return conf_full_to_string(netplan_parser_get_netdefs(parser), netplan_parser_get_backend(parser),
+                               netplan_parser_get_ovs_settings(parser));
+}
+
+/* Whether @line is blank, or a comment indented by at most @indent */
+static gboolean
+is_trailing_filler(const char* line, size_t indent)
+{
+    size_t i = strspn(line, " \t\r");
+    return line[i] == '\0' || (line[i] == '#' && i <= indent);
+}
+
+/**
+ * Find the lines which the pair @key: @value of a block mapping takes up in
+ * @lines (the text it got loaded from, split at newlines), as [@start, @end).
+ * Comments after it which are not indented deeper than @key, and blank lines,
+ * are not included: they rather belong to what follows.
+ * Returns: FALSE if the pair does not start a line of its own
+ */
+static gboolean
+yaml_pair_lines(gchar** lines, const yaml_node_t* key, const yaml_node_t* value, guint* start, guint* end)
+{
+    const char* line = lines[key->start_mark.line];
+    const char* last = lines[value->end_mark.line];
+
+    if (strspn(line, " ") != key->start_mark.column)
+        return FALSE;
+    *start = key->start_mark.line;
+    /* Block collections end where the next token starts; if that is on the
+     * same line as (the end of) the value, it ends on that line */
+    *end = value->end_mark.line;
+    if (last && strspn(last, " ") < MIN(value->end_mark.column, strlen(last)))
+        (*end)++;
+    while (*end > *start + 1 && is_trailing_filler(lines[*end - 1], key->start_mark.column))
+        (*end)--;
+    return TRUE;
+}
+
+/**
+ * Find the lines of the netdef @netdef_id in the YAML text @contents of
+ * @path, see yaml_pair_lines(). If it is the only netdef of its type, these
+ * are the lines of the whole type section.
+ * @keep_file: set to FALSE if nothing but the version would be left
+ */
+static gboolean
+find_netdef_lines(const char* path, const char* contents, gchar** lines, const char* netdef_id,
+                  guint* start, guint* end, gboolean* keep_file, GError** error)
+{
+    yaml_parser_t parser;
+    yaml_document_t doc;
+    yaml_node_t* root;
+    yaml_node_t* network = NULL;
+    yaml_node_pair_t* found_section = NULL;
+    yaml_node_pair_t* found = NULL;
+    guint n_section = 0;
+    guint n_kept = 0;
+    gboolean ret = FALSE;
+
+    yaml_parser_initialize(&parser);
+    yaml_parser_set_input_string(&parser, (const unsigned char*) contents, strlen(contents));
+    if (!yaml_parser_load(&parser, &doc)) {
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE,
+                    "%s:%zu:%zu: Invalid YAML: %s", path, parser.problem_mark.line + 1,
+                    parser.problem_mark.column + 1, parser.problem);
+        yaml_parser_delete(&parser);
+        return FALSE;
+    }
+    yaml_parser_delete(&parser);
+
+    root = yaml_document_get_root_node(&doc);
+    if (root && root->type == YAML_MAPPING_NODE) {
+        for (yaml_node_pair_t* p = root->data.mapping.pairs.start; p < root->data.mapping.pairs.top; p++) {
+            yaml_node_t* k = yaml_document_get_node(&doc, p->key);
+            if (k->type == YAML_SCALAR_NODE && !g_strcmp0((char*) k->data.scalar.value, "network"))
+                network = yaml_document_get_node(&doc, p->value);
+            else
+                n_kept++;
+        }
+    }
+    if (network && network->type == YAML_MAPPING_NODE) {
+        for (yaml_node_pair_t* p = network->data.mapping.pairs.start; p < network->data.mapping.pairs.top; p++) {
+            yaml_node_t* k = yaml_document_get_node(&doc, p->key);
+            yaml_node_t* v = yaml_document_get_node(&doc, p->value);
+            gboolean is_section = FALSE;
+
+            if (k->type != YAML_SCALAR_NODE)
+                continue; // LCOV_EXCL_LINE
+            if (!g_strcmp0((char*) k->data.scalar.value, "version"))
+                continue;
+            n_kept++;
+            for (unsigned t = 0; t < NETPLAN_DEF_TYPE_MAX_; t++)
+                if (!g_strcmp0(netplan_def_type_to_str[t], (char*) k->data.scalar.value))
+                    is_section = TRUE;
+            if (found || !is_section || v->type != YAML_MAPPING_NODE)
+                continue;
+            for (yaml_node_pair_t* q = v->data.mapping.pairs.start; q < v->data.mapping.pairs.top; q++) {
+                yaml_node_t* id = yaml_document_get_node(&doc, q->key);
+                if (id->type == YAML_SCALAR_NODE && !g_strcmp0((char*) id->data.scalar.value, netdef_id))
+                    found = q;
+            }
+            if (found) {
+                found_section = p;
+                n_section = v->data.mapping.pairs.top - v->data.mapping.pairs.start;
             }
         }
+    }
 
-        write_openvswitch(event, emitter, &ovs_settings_global, NETPLAN_BACKEND_NONE, ovs_ports);
+    if (!found) {
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "%s: netdef '%s' is not defined in this file", path, netdef_id);
+        goto cleanup;
+    }
+    /* drop the section along with its only netdef */
+    if (n_section == 1) {
+        found = found_section;
+        n_kept--;
+    }
+    *keep_file = n_kept > 0;
+    if (!yaml_pair_lines(lines, yaml_document_get_node(&doc, found->key),
+                         yaml_document_get_node(&doc, found->value), start, end)) {
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "%s: cannot remove netdef '%s' from a flow style mapping", path, netdef_id);
+        goto cleanup;
+    }
+    ret = TRUE;
 
-        /* Close remaining mappings */
-        YAML_MAPPING_CLOSE(event, emitter);
+cleanup:
+    yaml_document_delete(&doc);
+    return ret;
+}
 
-        /* Tear down the YAML emitter */
-        YAML_OUT_STOP(event, emitter);
-        fclose(output);
-        return;
+/**
+ * Parse the YAML hierarchy below @rootdir into @parser, with the file
+ * @replaced parsed from @replacement instead (or skipped, if that is %NULL).
+ */
+static gboolean
+parse_hierarchy_replacing(NetplanParser* parser, const char* rootdir, const struct stat* replaced,
+                          const char* replacement, GError** error)
+{
+    g_autoptr(GPtrArray) files = yaml_hierarchy_files(rootdir);
+    struct stat st;
 
+    if (!files) {
         // LCOV_EXCL_START
-error:
-        g_warning("Error generating YAML: %s", emitter->problem);
-        yaml_emitter_delete(emitter);
-        fclose(output);
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Cannot list YAML files below %s", rootdir ?: "/");
+        return FALSE;
+        // LCOV_EXCL_STOP
+    }
+    for (guint i = 0; i < files->len; i++) {
+        const char* file = g_ptr_array_index(files, i);
+
+        if (stat(file, &st) == 0 && st.st_dev == replaced->st_dev && st.st_ino == replaced->st_ino) {
+            if (!replacement)
+                continue;
+            file = replacement;
+        }
+        if (!netplan_parser_parse_file(parser, file, error))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Remove the netdef @netdef_id from /etc/netplan/<@file_hint>.yaml, like
+ * "netplan set <type>.<id>=NULL --origin-hint <file_hint>" does. Only the
+ * lines of that netdef (or of its type section, if it is the only one) get
+ * removed from the file, so that comments and formatting of everything else
+ * are kept; the file is removed if nothing but the version is left. The
+ * result must still be valid along with the rest of the YAML hierarchy,
+ * otherwise the file is left alone. The currently parsed netdefs are not
+ * touched.
+ * @rootdir: If not %NULL, operate in this root directory
+ *           (useful for testing).
+ */
+gboolean
+netplan_delete_netdef_from_file(const char* netdef_id, const char* file_hint, const char* rootdir, GError** error)
+{
+    g_autofree gchar *filename = g_strconcat(file_hint, ".yaml", NULL);
+    g_autofree gchar *path = g_build_path(G_DIR_SEPARATOR_S, rootdir ?: G_DIR_SEPARATOR_S, "etc", "netplan", filename, NULL);
+    g_autofree gchar *contents = NULL;
+    g_autofree gchar *tmp_path = NULL;
+    g_auto(GStrv) lines = NULL;
+    GError* perror = NULL;
+    NetplanParser* parser = NULL;
+    gboolean keep_file = TRUE;
+    guint start, end;
+    struct stat st;
+    gboolean ret = FALSE;
+    int fd;
+
+    if (stat(path, &st) < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Cannot open %s: %s", path, g_strerror(errno));
+        return FALSE;
+    }
+    if (!g_file_get_contents(path, &contents, NULL, error))
+        return FALSE; // LCOV_EXCL_LINE
+    lines = g_strsplit(contents, "\n", -1);
+    if (!find_netdef_lines(path, contents, lines, netdef_id, &start, &end, &keep_file, error))
+        return FALSE;
+
+    if (keep_file) {
+        g_autoptr(GPtrArray) kept = g_ptr_array_new();
+        g_autofree gchar* dir = g_path_get_dirname(path);
+
+        for (guint i = 0; lines[i]; i++)
+            if (i < start || i >= end)
+                g_ptr_array_add(kept, lines[i]);
+        g_ptr_array_add(kept, NULL);
+        g_free(contents);
+        contents = g_strjoinv("\n", (gchar**) kept->pdata);
+
+        /* written next to it, to be renamed over it once validated */
+        tmp_path = g_strdup_printf("%s/.%s.XXXXXX", dir, filename);
+        fd = g_mkstemp_full(tmp_path, O_WRONLY, st.st_mode & 07777);
+        if (fd < 0) {
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "Cannot create %s: %s", tmp_path, g_strerror(errno));
+            return FALSE;
+        }
+        close(fd);
+        if (!g_file_set_contents(tmp_path, contents, -1, error) || chmod(tmp_path, st.st_mode & 07777) < 0)
+            goto cleanup; // LCOV_EXCL_LINE
+    }
+
+    parser = netplan_parser_new();
+    if (!parse_hierarchy_replacing(parser, rootdir, &st, tmp_path, error))
+        goto cleanup;
+    netplan_parser_finish(parser, &perror);
+    if (perror) {
+        g_propagate_error(error, perror);
+        goto cleanup;
+    }
+
+    if (keep_file ? rename(tmp_path, path) < 0 : unlink(path) < 0) {
+        // LCOV_EXCL_START
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Cannot %s %s: %s", keep_file ? "replace" : "remove", path, g_strerror(errno));
+        goto cleanup;
         // LCOV_EXCL_STOP
-    } else {
-        g_debug("No data/netdefs to serialize into YAML.");
     }
+    g_clear_pointer(&tmp_path, g_free);
+    ret = TRUE;
+
+cleanup:
+    if (tmp_path)
+        unlink(tmp_path);
+    netplan_parser_free(parser);
+    return ret;
 }
 
 /* XXX: implement the following functions, once needed:
@@ -143,3 +143,6 @@ static const char* const netplan_addr_gen_mode_to_str[NETPLAN_ADDRGEN_MAX] = {
 };
 
 void write_netplan_conf(const NetplanNetDefinition* def, const char* rootdir);
+gboolean netplan_delete_netdef_from_file(const char* netdef_id, const char* file_hint, const char* rootdir, GError** error);
+gchar* netplan_conf_full_to_string();
+gchar* netplan_parser_conf_to_string(const NetplanParser* parser);
@@ -43,11 +43,12 @@ wifi_append_freq(gpointer key, gpointer value, gpointer user_data)
 /**
  * append wowlan_triggers= string for wpa_supplicant.conf
  */
-static void
-append_wifi_wowlan_flags(NetplanWifiWowlanFlag flag, GString* str) {
+static gboolean
+append_wifi_wowlan_flags(NetplanWifiWowlanFlag flag, GString* str, GError** error) {
     if (flag & NETPLAN_WIFI_WOWLAN_TYPES[0].flag || flag >= NETPLAN_WIFI_WOWLAN_TCP) {
-        g_fprintf(stderr, "ERROR: unsupported wowlan_triggers mask: 0x%x\n", flag);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "ERROR: unsupported wowlan_triggers mask: 0x%x", flag);
+        return FALSE;
     }
     for (unsigned i = 0; NETPLAN_WIFI_WOWLAN_TYPES[i].name != NULL; ++i) {
         if (flag & NETPLAN_WIFI_WOWLAN_TYPES[i].flag) {
@@ -56,6 +57,7 @@ append_wifi_wowlan_flags(NetplanWifiWowlanFlag flag, GString* str) {
     }
     /* replace trailing space with newline */
     str = g_string_overwrite(str, str->len-1, "\n");
+    return TRUE;
 }
 
 /**
@@ -186,13 +188,14 @@ write_wireguard_params(GString* s, const NetplanNetDefinition* def)
     for (guint i = 0; i < def->wireguard_peers->len; i++) {
         NetplanWireguardPeer *peer = g_array_index (def->wireguard_peers, NetplanWireguardPeer*, i);
         GString *peer_s = g_string_sized_new(200);
+        char addr[NETPLAN_ADDRESS_STRLEN];
 
         g_string_append_printf(peer_s, "PublicKey=%s\n", peer->public_key);
         g_string_append(peer_s, "AllowedIPs=");
         for (guint i = 0; i < peer->allowed_ips->len; ++i) {
             if (i > 0 )
                 g_string_append_c(peer_s, ',');
-            g_string_append_printf(peer_s, "%s", g_array_index(peer->allowed_ips, char*, i));
+            g_string_append(peer_s, format_address(&g_array_index(peer->allowed_ips, NetplanAddress, i), TRUE, addr));
         }
         g_string_append_c(peer_s, '\n');
 
@@ -220,7 +223,6 @@ static void
 write_link_file(const NetplanNetDefinition* def, const char* rootdir, const char* path)
 {
     GString* s = NULL;
-    mode_t orig_umask;
 
     /* Don't write .link files for virtual devices; they use .netdev instead.
      * Don't write .link files for MODEM devices, as they aren't supported by networkd.
@@ -244,9 +246,7 @@ write_link_file(const NetplanNetDefinition* def, const char* rootdir, const char
     if (def->mtubytes)
         g_string_append_printf(s, "MTUBytes=%u\n", def->mtubytes);
 
-    orig_umask = umask(022);
-    g_string_free_to_file(s, rootdir, path, ".link");
-    umask(orig_umask);
+    g_string_free_to_file_umask(s, rootdir, path, ".link", 022);
 }
 
 
@@ -345,7 +345,6 @@ static void
 write_netdev_file(const NetplanNetDefinition* def, const char* rootdir, const char* path)
 {
     GString* s = NULL;
-    mode_t orig_umask;
 
     g_assert(def->type >= NETPLAN_DEF_TYPE_VIRTUAL);
 
@@ -414,9 +413,7 @@ write_netdev_file(const NetplanNetDefinition* def, const char* rootdir, const ch
 
     /* these do not contain secrets and need to be readable by
      * systemd-networkd - LP: #1736965 */
-    orig_umask = umask(022);
-    g_string_free_to_file(s, rootdir, path, ".netdev");
-    umask(orig_umask);
+    g_string_free_to_file_umask(s, rootdir, path, ".netdev", 022);
 }
 
 static void
@@ -489,10 +486,10 @@ write_addr_option(NetplanAddressOptions* o, GString* s)
 
 #define DHCP_OVERRIDES_ERROR                                            \
     "ERROR: %s: networkd requires that %s has the same value in both "  \
-    "dhcp4_overrides and dhcp6_overrides\n"
+    "dhcp4_overrides and dhcp6_overrides"
 
-static void
-combine_dhcp_overrides(const NetplanNetDefinition* def, NetplanDHCPOverrides* combined_dhcp_overrides)
+static gboolean
+combine_dhcp_overrides(const NetplanNetDefinition* def, NetplanDHCPOverrides* combined_dhcp_overrides, GError** error)
 {
     /* if only one of dhcp4 or dhcp6 is enabled, those overrides are used */
     if (def->dhcp4 && !def->dhcp6) {
@@ -504,61 +501,62 @@ combine_dhcp_overrides(const NetplanNetDefinition* def, NetplanDHCPOverrides* co
          * we enforce that they are the same.
          */
         if (def->dhcp4_overrides.use_dns != def->dhcp6_overrides.use_dns) {
-            g_fprintf(stderr, DHCP_OVERRIDES_ERROR, def->id, "use-dns");
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, DHCP_OVERRIDES_ERROR, def->id, "use-dns");
+            return FALSE;
         }
         if (g_strcmp0(def->dhcp4_overrides.use_domains, def->dhcp6_overrides.use_domains) != 0){
-            g_fprintf(stderr, DHCP_OVERRIDES_ERROR, def->id, "use-domains");
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, DHCP_OVERRIDES_ERROR, def->id, "use-domains");
+            return FALSE;
         }
         if (def->dhcp4_overrides.use_ntp != def->dhcp6_overrides.use_ntp) {
-            g_fprintf(stderr, DHCP_OVERRIDES_ERROR, def->id, "use-ntp");
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, DHCP_OVERRIDES_ERROR, def->id, "use-ntp");
+            return FALSE;
         }
         if (def->dhcp4_overrides.send_hostname != def->dhcp6_overrides.send_hostname) {
-            g_fprintf(stderr, DHCP_OVERRIDES_ERROR, def->id, "send-hostname");
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, DHCP_OVERRIDES_ERROR, def->id, "send-hostname");
+            return FALSE;
         }
         if (def->dhcp4_overrides.use_hostname != def->dhcp6_overrides.use_hostname) {
-            g_fprintf(stderr, DHCP_OVERRIDES_ERROR, def->id, "use-hostname");
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, DHCP_OVERRIDES_ERROR, def->id, "use-hostname");
+            return FALSE;
         }
         if (def->dhcp4_overrides.use_mtu != def->dhcp6_overrides.use_mtu) {
-            g_fprintf(stderr, DHCP_OVERRIDES_ERROR, def->id, "use-mtu");
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, DHCP_OVERRIDES_ERROR, def->id, "use-mtu");
+            return FALSE;
         }
         if (g_strcmp0(def->dhcp4_overrides.hostname, def->dhcp6_overrides.hostname) != 0) {
-            g_fprintf(stderr, DHCP_OVERRIDES_ERROR, def->id, "hostname");
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, DHCP_OVERRIDES_ERROR, def->id, "hostname");
+            return FALSE;
         }
         if (def->dhcp4_overrides.metric != def->dhcp6_overrides.metric) {
-            g_fprintf(stderr, DHCP_OVERRIDES_ERROR, def->id, "route-metric");
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, DHCP_OVERRIDES_ERROR, def->id, "route-metric");
+            return FALSE;
         }
         if (def->dhcp4_overrides.use_routes != def->dhcp6_overrides.use_routes) {
-            g_fprintf(stderr, DHCP_OVERRIDES_ERROR, def->id, "use-routes");
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, DHCP_OVERRIDES_ERROR, def->id, "use-routes");
+            return FALSE;
         }
         /* Just use dhcp4_overrides now, since we know they are the same. */
         *combined_dhcp_overrides = def->dhcp4_overrides;
     }
+    return TRUE;
 }
 
 /**
  * Write the needed networkd .network configuration for the selected netplan definition.
+ * Returns FALSE and sets @error if @def cannot be expressed in networkd.
  */
-void
-write_network_file(const NetplanNetDefinition* def, const char* rootdir, const char* path)
+gboolean
+write_network_file(const NetplanNetDefinition* def, const char* rootdir, const char* path, GError** error)
 {
     GString* network = NULL;
     GString* link = NULL;
     GString* s = NULL;
-    mode_t orig_umask;
     gboolean is_optional = def->optional;
 
     if (def->type == NETPLAN_DEF_TYPE_VLAN && def->sriov_vlan_filter) {
         g_debug("%s is defined as a hardware SR-IOV filtered VLAN, postponing creation", def->id);
-        return;
+        return TRUE;
     }
 
     /* Prepare the [Link] section of the .network file. */
@@ -622,20 +620,24 @@ write_network_file(const NetplanNetDefinition* def, const char* rootdir, const c
         g_string_append(network, "LinkLocalAddressing=no\n");
     }
 
+    char addr[NETPLAN_ADDRESS_STRLEN];
     if (def->ip4_addresses)
         for (unsigned i = 0; i < def->ip4_addresses->len; ++i)
-            g_string_append_printf(network, "Address=%s\n", g_array_index(def->ip4_addresses, char*, i));
+            g_string_append_printf(network, "Address=%s\n",
+                                   format_address(&g_array_index(def->ip4_addresses, NetplanAddress, i), TRUE, addr));
     if (def->ip6_addresses)
         for (unsigned i = 0; i < def->ip6_addresses->len; ++i)
-            g_string_append_printf(network, "Address=%s\n", g_array_index(def->ip6_addresses, char*, i));
+            g_string_append_printf(network, "Address=%s\n",
+                                   format_address(&g_array_index(def->ip6_addresses, NetplanAddress, i), TRUE, addr));
     if (def->ip6_addr_gen_token) {
         g_string_append_printf(network, "IPv6Token=static:%s\n", def->ip6_addr_gen_token);
     } else if (def->ip6_addr_gen_mode > NETPLAN_ADDRGEN_EUI64) {
         /* EUI-64 mode is enabled by default, if no IPv6Token= is specified */
         /* TODO: Enable stable-privacy mode for networkd, once PR#16618 has been released:
          *       https://github.com/systemd/systemd/pull/16618 */
-        g_fprintf(stderr, "ERROR: %s: ipv6-address-generation mode is not supported by networkd\n", def->id);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "ERROR: %s: ipv6-address-generation mode is not supported by networkd", def->id);
+        goto fail;
     }
     if (def->accept_ra == NETPLAN_RA_MODE_ENABLED)
         g_string_append_printf(network, "IPv6AcceptRA=yes\n");
@@ -643,16 +645,18 @@ write_network_file(const NetplanNetDefinition* def, const char* rootdir, const c
         g_string_append_printf(network, "IPv6AcceptRA=no\n");
     if (def->ip6_privacy)
         g_string_append(network, "IPv6PrivacyExtensions=yes\n");
-    if (def->gateway4)
-        g_string_append_printf(network, "Gateway=%s\n", def->gateway4);
-    if (def->gateway6)
-        g_string_append_printf(network, "Gateway=%s\n", def->gateway6);
+    if (def->gateway4.ip.family)
+        g_string_append_printf(network, "Gateway=%s\n", format_address(&def->gateway4, FALSE, addr));
+    if (def->gateway6.ip.family)
+        g_string_append_printf(network, "Gateway=%s\n", format_address(&def->gateway6, FALSE, addr));
     if (def->ip4_nameservers)
         for (unsigned i = 0; i < def->ip4_nameservers->len; ++i)
-            g_string_append_printf(network, "DNS=%s\n", g_array_index(def->ip4_nameservers, char*, i));
+            g_string_append_printf(network, "DNS=%s\n",
+                                   format_address(&g_array_index(def->ip4_nameservers, NetplanAddress, i), FALSE, addr));
     if (def->ip6_nameservers)
         for (unsigned i = 0; i < def->ip6_nameservers->len; ++i)
-            g_string_append_printf(network, "DNS=%s\n", g_array_index(def->ip6_nameservers, char*, i));
+            g_string_append_printf(network, "DNS=%s\n",
+                                   format_address(&g_array_index(def->ip6_nameservers, NetplanAddress, i), FALSE, addr));
     if (def->search_domains) {
         g_string_append_printf(network, "Domains=%s", g_array_index(def->search_domains, char*, 0));
         for (unsigned i = 1; i < def->search_domains->len; ++i)
@@ -728,7 +732,8 @@ write_network_file(const NetplanNetDefinition* def, const char* rootdir, const c
             g_string_append_printf(network, "ClientIdentifier=%s\n", def->dhcp_identifier);
 
         NetplanDHCPOverrides combined_dhcp_overrides;
-        combine_dhcp_overrides(def, &combined_dhcp_overrides);
+        if (!combine_dhcp_overrides(def, &combined_dhcp_overrides, error))
+            goto fail;
 
         if (combined_dhcp_overrides.metric == NETPLAN_METRIC_UNSPEC) {
             g_string_append_printf(network, "RouteMetric=%i\n", (def->type == NETPLAN_DEF_TYPE_WIFI ? 600 : 100));
@@ -777,10 +782,14 @@ write_network_file(const NetplanNetDefinition* def, const char* rootdir, const c
 
         /* these do not contain secrets and need to be readable by
          * systemd-networkd - LP: #1736965 */
-        orig_umask = umask(022);
-        g_string_free_to_file(s, rootdir, path, ".network");
-        umask(orig_umask);
+        g_string_free_to_file_umask(s, rootdir, path, ".network", 022);
     }
+    return TRUE;
+
+fail:
+    g_string_free(link, TRUE);
+    g_string_free(network, TRUE);
+    return FALSE;
 }
 
 static void
@@ -788,7 +797,6 @@ write_rules_file(const NetplanNetDefinition* def, const char* rootdir)
 {
     GString* s = NULL;
     g_autofree char* path = g_strjoin(NULL, "run/udev/rules.d/99-netplan-", def->id, ".rules", NULL);
-    mode_t orig_umask;
 
     /* do we need to write a .rules file?
      * It's only required for reliably setting the name of a physical device
@@ -822,13 +830,11 @@ write_rules_file(const NetplanNetDefinition* def, const char* rootdir)
 
     g_string_append_printf(s, "NAME=\"%s\"\n", def->set_name);
 
-    orig_umask = umask(022);
-    g_string_free_to_file(s, rootdir, path, NULL);
-    umask(orig_umask);
+    g_string_free_to_file_umask(s, rootdir, path, NULL, 022);
 }
 
-static void
-append_wpa_auth_conf(GString* s, const NetplanAuthenticationSettings* auth, const char* id)
+static gboolean
+append_wpa_auth_conf(GString* s, const NetplanAuthenticationSettings* auth, const char* id, GError** error)
 {
     switch (auth->key_management) {
         case NETPLAN_AUTH_KEY_MANAGEMENT_NONE:
@@ -882,16 +888,18 @@ append_wpa_auth_conf(GString* s, const NetplanAuthenticationSettings* auth, cons
                 /* must be a hex-digit key representation */
                 for (unsigned i = 0; i < 64; ++i)
                     if (!isxdigit(auth->password[i])) {
-                        g_fprintf(stderr, "ERROR: %s: PSK length of 64 is only supported for hex-digit representation\n", id);
-                        exit(1);
+                        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                                    "ERROR: %s: PSK length of 64 is only supported for hex-digit representation", id);
+                        return FALSE;
                     }
                 /* this is required to be unquoted */
                 g_string_append_printf(s, "  psk=%s\n", auth->password);
             } else if (len < 8 || len > 63) {
                 /* per wpa_supplicant spec, passphrase needs to be between 8
                    and 63 characters */
-                g_fprintf(stderr, "ERROR: %s: ASCII passphrase must be between 8 and 63 characters (inclusive)\n", id);
-                exit(1);
+                g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                            "ERROR: %s: ASCII passphrase must be between 8 and 63 characters (inclusive)", id);
+                return FALSE;
             } else {
                 g_string_append_printf(s, "  psk=\"%s\"\n", auth->password);
             }
@@ -918,7 +926,7 @@ append_wpa_auth_conf(GString* s, const NetplanAuthenticationSettings* auth, cons
     if (auth->phase2_auth) {
         g_string_append_printf(s, "  phase2=\"auth=%s\"\n", auth->phase2_auth);
     }
-
+    return TRUE;
 }
 
 /* netplan-feature: generated-supplicant */
@@ -945,19 +953,19 @@ write_wpa_unit(const NetplanNetDefinition* def, const char* rootdir)
     g_string_free_to_file(s, rootdir, path, NULL);
 }
 
-static void
-write_wpa_conf(const NetplanNetDefinition* def, const char* rootdir)
+static gboolean
+write_wpa_conf(const NetplanNetDefinition* def, const char* rootdir, GError** error)
 {
     GHashTableIter iter;
     GString* s = g_string_new("ctrl_interface=/run/wpa_supplicant\n\n");
     g_autofree char* path = g_strjoin(NULL, "run/netplan/wpa-", def->id, ".conf", NULL);
-    mode_t orig_umask;
 
     g_debug("%s: Creating wpa_supplicant configuration file %s", def->id, path);
     if (def->type == NETPLAN_DEF_TYPE_WIFI) {
         if (def->wowlan && def->wowlan > NETPLAN_WIFI_WOWLAN_DEFAULT) {
             g_string_append(s, "wowlan_triggers=");
-            append_wifi_wowlan_flags(def->wowlan, s);
+            if (!append_wifi_wowlan_flags(def->wowlan, s, error))
+                goto fail;
         }
         NetplanWifiAccessPoint* ap;
         g_hash_table_iter_init(&iter, def->access_points);
@@ -972,9 +980,12 @@ write_wpa_conf(const NetplanNetDefinition* def, const char* rootdir)
             if (ap->band == NETPLAN_WIFI_BAND_24) {
                 // initialize 2.4GHz frequency hashtable
                 if(!wifi_frequency_24)
-                    wifi_get_freq24(1);
+                    wifi_get_freq24(1, NULL);
                 if (ap->channel) {
-                    g_string_append_printf(s, "  freq_list=%d\n", wifi_get_freq24(ap->channel));
+                    int freq = wifi_get_freq24(ap->channel, error);
+                    if (!freq)
+                        goto fail;
+                    g_string_append_printf(s, "  freq_list=%d\n", freq);
                 } else {
                     g_string_append_printf(s, "  freq_list=");
                     g_hash_table_foreach(wifi_frequency_24, wifi_append_freq, s);
@@ -984,9 +995,12 @@ write_wpa_conf(const NetplanNetDefinition* def, const char* rootdir)
             } else if (ap->band == NETPLAN_WIFI_BAND_5) {
                 // initialize 5GHz frequency hashtable
                 if(!wifi_frequency_5)
-                    wifi_get_freq5(7);
+                    wifi_get_freq5(7, NULL);
                 if (ap->channel) {
-                    g_string_append_printf(s, "  freq_list=%d\n", wifi_get_freq5(ap->channel));
+                    int freq = wifi_get_freq5(ap->channel, error);
+                    if (!freq)
+                        goto fail;
+                    g_string_append_printf(s, "  freq_list=%d\n", freq);
                 } else {
                     g_string_append_printf(s, "  freq_list=");
                     g_hash_table_foreach(wifi_frequency_5, wifi_append_freq, s);
@@ -1002,13 +1016,15 @@ write_wpa_conf(const NetplanNetDefinition* def, const char* rootdir)
                     g_string_append(s, "  mode=1\n");
                     break;
                 default:
-                    g_fprintf(stderr, "ERROR: %s: %s: networkd does not support this wifi mode\n", def->id, ap->ssid);
-                    exit(1);
+                    g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                                "ERROR: %s: %s: networkd does not support this wifi mode", def->id, ap->ssid);
+                    goto fail;
             }
 
             /* wifi auth trumps netdef auth */
             if (ap->has_auth) {
-                append_wpa_auth_conf(s, &ap->auth, ap->ssid);
+                if (!append_wpa_auth_conf(s, &ap->auth, ap->ssid, error))
+                    goto fail;
             }
             else {
                 g_string_append(s, "  key_mgmt=NONE\n");
@@ -1019,14 +1035,18 @@ write_wpa_conf(const NetplanNetDefinition* def, const char* rootdir)
     else {
         /* wired 802.1x auth or similar */
         g_string_append(s, "network={\n");
-        append_wpa_auth_conf(s, &def->auth, def->id);
+        if (!append_wpa_auth_conf(s, &def->auth, def->id, error))
+            goto fail;
         g_string_append(s, "}\n");
     }
 
     /* use tight permissions as this contains secrets */
-    orig_umask = umask(077);
-    g_string_free_to_file(s, rootdir, path, NULL);
-    umask(orig_umask);
+    g_string_free_to_file_umask(s, rootdir, path, NULL, 077);
+    return TRUE;
+
+fail:
+    g_string_free(s, TRUE);
+    return FALSE;
 }
 
 /**
@@ -1034,10 +1054,11 @@ write_wpa_conf(const NetplanNetDefinition* def, const char* rootdir)
  * parsed #netdefs.
  * @rootdir: If not %NULL, generate configuration in this root directory
  *           (useful for testing).
- * Returns: TRUE if @def applies to networkd, FALSE otherwise.
+ * @has_been_written: set to whether @def applies to networkd
+ * Returns: FALSE with @error set if @def cannot be rendered for networkd
  */
 gboolean
-write_networkd_conf(const NetplanNetDefinition* def, const char* rootdir)
+write_networkd_conf(const NetplanNetDefinition* def, const char* rootdir, gboolean* has_been_written, GError** error)
 {
     g_autofree char* path_base = g_strjoin(NULL, "run/systemd/network/10-netplan-", def->id, NULL);
 
@@ -1046,45 +1067,43 @@ write_networkd_conf(const NetplanNetDefinition* def, const char* rootdir)
     write_link_file(def, rootdir, path_base);
     write_rules_file(def, rootdir);
 
+    *has_been_written = FALSE;
     if (def->backend != NETPLAN_BACKEND_NETWORKD) {
         g_debug("networkd: definition %s is not for us (backend %i)", def->id, def->backend);
-        return FALSE;
+        return TRUE;
     }
 
     if (def->type == NETPLAN_DEF_TYPE_MODEM) {
-        g_fprintf(stderr, "ERROR: %s: networkd backend does not support GSM/CDMA modem configuration\n", def->id);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "ERROR: %s: networkd backend does not support GSM/CDMA modem configuration", def->id);
+        return FALSE;
     }
 
     if (def->type == NETPLAN_DEF_TYPE_WIFI || def->has_auth) {
         g_autofree char* link = g_strjoin(NULL, rootdir ?: "", "/run/systemd/system/systemd-networkd.service.wants/netplan-wpa-", def->id, ".service", NULL);
         g_autofree char* slink = g_strjoin(NULL, "/run/systemd/system/netplan-wpa-", def->id, ".service", NULL);
         if (def->type == NETPLAN_DEF_TYPE_WIFI && def->has_match) {
-            g_fprintf(stderr, "ERROR: %s: networkd backend does not support wifi with match:, only by interface name\n", def->id);
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                        "ERROR: %s: networkd backend does not support wifi with match:, only by interface name", def->id);
+            return FALSE;
         }
 
         g_debug("Creating wpa_supplicant config");
-        write_wpa_conf(def, rootdir);
+        if (!write_wpa_conf(def, rootdir, error))
+            return FALSE;
 
         g_debug("Creating wpa_supplicant unit %s", slink);
         write_wpa_unit(def, rootdir);
 
         g_debug("Creating wpa_supplicant service enablement link %s", link);
-        safe_mkdir_p_dir(link);
-
-        if (symlink(slink, link) < 0 && errno != EEXIST) {
-            // LCOV_EXCL_START
-            g_fprintf(stderr, "failed to create enablement symlink: %m\n");
-            exit(1);
-            // LCOV_EXCL_STOP
-        }
-
+        safe_symlink(slink, link);
     }
 
     if (def->type >= NETPLAN_DEF_TYPE_VIRTUAL)
         write_netdev_file(def, rootdir, path_base);
-    write_network_file(def, rootdir, path_base);
+    if (!write_network_file(def, rootdir, path_base, error))
+        return FALSE;
+    *has_been_written = TRUE;
     return TRUE;
 }
 
@@ -1112,20 +1131,8 @@ enable_networkd(const char* generator_dir)
 {
     g_autofree char* link = g_build_path(G_DIR_SEPARATOR_S, generator_dir, "multi-user.target.wants", "systemd-networkd.service", NULL);
     g_debug("We created networkd configuration, adding %s enablement symlink", link);
-    safe_mkdir_p_dir(link);
-    if (symlink("../systemd-networkd.service", link) < 0 && errno != EEXIST) {
-        // LCOV_EXCL_START
-        g_fprintf(stderr, "failed to create enablement symlink: %m\n");
-        exit(1);
-        // LCOV_EXCL_STOP
-    }
+    safe_symlink("../systemd-networkd.service", link);
 
     g_autofree char* link2 = g_build_path(G_DIR_SEPARATOR_S, generator_dir, "network-online.target.wants", "systemd-networkd-wait-online.service", NULL);
-    safe_mkdir_p_dir(link2);
-    if (symlink("/lib/systemd/system/systemd-networkd-wait-online.service", link2) < 0 && errno != EEXIST) {
-        // LCOV_EXCL_START
-        g_fprintf(stderr, "failed to create enablement symlink: %m\n");
-        exit(1);
-        // LCOV_EXCL_STOP
-    }
+    safe_symlink("/lib/systemd/system/systemd-networkd-wait-online.service", link2);
 }
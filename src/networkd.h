@@ -19,8 +19,8 @@
 
 #include "parse.h"
 
-gboolean write_networkd_conf(const NetplanNetDefinition* def, const char* rootdir);
+gboolean write_networkd_conf(const NetplanNetDefinition* def, const char* rootdir, gboolean* has_been_written, GError** error);
 void cleanup_networkd_conf(const char* rootdir);
 void enable_networkd(const char* generator_dir);
 
-void write_network_file(const NetplanNetDefinition* def, const char* rootdir, const char* path);
+gboolean write_network_file(const NetplanNetDefinition* def, const char* rootdir, const char* path, GError** error);
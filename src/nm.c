@@ -189,6 +189,20 @@ addr_gen_mode_str(const NetplanAddrGenMode mode)
     }
 }
 
+/**
+ * Write the NetplanAddress array @addresses as the string list @key of @group.
+ */
+static void
+write_address_list(GKeyFile *kf, const char* group, const char* key, const GArray* addresses, gboolean with_prefix)
+{
+    char addrs[addresses->len][NETPLAN_ADDRESS_STRLEN];
+    const gchar* list[addresses->len];
+
+    for (guint i = 0; i < addresses->len; ++i)
+        list[i] = format_address(&g_array_index(addresses, NetplanAddress, i), with_prefix, addrs[i]);
+    g_key_file_set_string_list(kf, group, key, list, addresses->len);
+}
+
 static void
 write_search_domains(const NetplanNetDefinition* def, const char* group, GKeyFile *kf)
 {
@@ -200,8 +214,8 @@ write_search_domains(const NetplanNetDefinition* def, const char* group, GKeyFil
     }
 }
 
-static void
-write_routes(const NetplanNetDefinition* def, GKeyFile *kf, int family)
+static gboolean
+write_routes(const NetplanNetDefinition* def, GKeyFile *kf, int family, GError** error)
 {
     const gchar* group = NULL;
     gchar* tmp_key = NULL;
@@ -227,8 +241,9 @@ write_routes(const NetplanNetDefinition* def, GKeyFile *kf, int family)
                 destination = cur_route->to;
 
             if (cur_route->type && g_ascii_strcasecmp(cur_route->type, "unicast") != 0) {
-                g_fprintf(stderr, "ERROR: %s: NetworkManager only supports unicast routes\n", def->id);
-                exit(1);
+                g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                            "ERROR: %s: NetworkManager only supports unicast routes", def->id);
+                return FALSE;
             }
 
             if (!g_strcmp0(cur_route->scope, "global")) {
@@ -238,8 +253,9 @@ write_routes(const NetplanNetDefinition* def, GKeyFile *kf, int family)
                 g_debug("%s: NetworkManager does not support setting a scope for routes, it will auto-detect them.", def->id);
             } else if (cur_route->scope) {
                 /* Error out if scope is not set to its default value of 'global' */
-                g_fprintf(stderr, "ERROR: %s: NetworkManager does not support setting a scope for routes\n", def->id);
-                exit(1);
+                g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                            "ERROR: %s: NetworkManager does not support setting a scope for routes", def->id);
+                return FALSE;
             }
 
             tmp_key = g_strdup_printf("route%d", j);
@@ -281,6 +297,7 @@ write_routes(const NetplanNetDefinition* def, GKeyFile *kf, int family)
             j++;
         }
     }
+    return TRUE;
 }
 
 static void
@@ -359,8 +376,8 @@ write_bridge_params(const NetplanNetDefinition* def, GKeyFile *kf)
     }
 }
 
-static void
-write_wireguard_params(const NetplanNetDefinition* def, GKeyFile *kf)
+static gboolean
+write_wireguard_params(const NetplanNetDefinition* def, GKeyFile *kf, GError** error)
 {
     gchar* tmp_group = NULL;
     g_assert(def->tunnel.private_key);
@@ -370,8 +387,9 @@ write_wireguard_params(const NetplanNetDefinition* def, GKeyFile *kf)
      * string could (theoretically) start with '/', so we use is_wireguard_key()
      * as well to check for more specific characteristics (if needed). */
     if (def->tunnel.private_key[0] == '/' && !is_wireguard_key(def->tunnel.private_key)) {
-        g_fprintf(stderr, "%s: private key needs to be base64 encoded when using the NM backend\n", def->id);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "%s: private key needs to be base64 encoded when using the NM backend", def->id);
+        return FALSE;
     } else
         g_key_file_set_string(kf, "wireguard", "private-key", def->tunnel.private_key);
 
@@ -396,21 +414,20 @@ write_wireguard_params(const NetplanNetDefinition* def, GKeyFile *kf)
          * as well to check for more specific characteristics (if needed). */
         if (peer->preshared_key) {
             if (peer->preshared_key[0] == '/' && !is_wireguard_key(peer->preshared_key)) {
-                g_fprintf(stderr, "%s: shared key needs to be base64 encoded when using the NM backend\n", def->id);
-                exit(1);
+                g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                            "%s: shared key needs to be base64 encoded when using the NM backend", def->id);
+                g_free(tmp_group);
+                return FALSE;
             } else {
                 g_key_file_set_value(kf, tmp_group, "preshared-key", peer->preshared_key);
                 g_key_file_set_uint64(kf, tmp_group, "preshared-key-flags", 0);
             }
         }
-        if (peer->allowed_ips && peer->allowed_ips->len > 0) {
-            const gchar* list[peer->allowed_ips->len];
-            for (guint j = 0; j < peer->allowed_ips->len; ++j)
-                list[j] = g_array_index(peer->allowed_ips, char*, j);
-            g_key_file_set_string_list(kf, tmp_group, "allowed-ips", list, peer->allowed_ips->len);
-        }
+        if (peer->allowed_ips && peer->allowed_ips->len > 0)
+            write_address_list(kf, tmp_group, "allowed-ips", peer->allowed_ips, TRUE);
         g_free(tmp_group);
     }
+    return TRUE;
 }
 
 static void
@@ -488,11 +505,23 @@ write_wifi_auth_parameters(const NetplanAuthenticationSettings* auth, GKeyFile *
     write_dot1x_auth_parameters(auth, kf);
 }
 
+/* Namespace for the UUIDs generated from netdef IDs: the version 5 UUID of
+ * "netplan.io" in the DNS namespace (RFC 4122) */
+static const uuid_t netplan_uuid_namespace = {
+    0x5e, 0x74, 0xf9, 0x78, 0x17, 0x26, 0x59, 0x3a,
+    0xba, 0xb5, 0x92, 0x9e, 0xb5, 0x24, 0x13, 0x7d
+};
+
+/**
+ * Derive a UUID for @def from its ID, unless one was set explicitly. It must
+ * be stable across runs, so that regenerating unchanged configuration gives
+ * the same connection profiles, and NetworkManager does not see new ones.
+ */
 static void
 maybe_generate_uuid(NetplanNetDefinition* def)
 {
     if (uuid_is_null(def->uuid))
-        uuid_generate(def->uuid);
+        uuid_generate_sha1(def->uuid, netplan_uuid_namespace, def->id, strlen(def->id));
 }
 
 /**
@@ -551,18 +580,18 @@ write_fallback_key_value(GQuark key_id, gpointer value, gpointer user_data)
  * @ap: The access point for which to create a connection. Must be %NULL for
  *      non-wifi types.
  */
-static void
-write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const NetplanWifiAccessPoint* ap)
+static gboolean
+write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const NetplanWifiAccessPoint* ap, GError** error)
 {
     g_autoptr(GKeyFile) kf = NULL;
-    g_autoptr(GError) error = NULL;
     g_autofree gchar* conf_path = NULL;
-    g_autofree gchar* full_path = NULL;
+    g_autofree gchar* kf_data = NULL;
+    gsize kf_len;
     g_autofree gchar* nd_nm_id = NULL;
     const gchar* nm_type = NULL;
     gchar* tmp_key = NULL;
-    mode_t orig_umask;
     char uuidstr[37];
+    char addr[NETPLAN_ADDRESS_STRLEN];
     const char *match_interface_name = NULL;
 
     if (def->type == NETPLAN_DEF_TYPE_WIFI)
@@ -572,7 +601,7 @@ write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const
 
     if (def->type == NETPLAN_DEF_TYPE_VLAN && def->sriov_vlan_filter) {
         g_debug("%s is defined as a hardware SR-IOV filtered VLAN, postponing creation", def->id);
-        return;
+        return TRUE;
     }
 
     kf = g_key_file_new();
@@ -610,8 +639,9 @@ write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const
         /* XXX: For now NetworkManager only supports the "manual" activation
          * mode */
         if (!!g_strcmp0(def->activation_mode, "manual")) {
-            g_fprintf(stderr, "ERROR: %s: NetworkManager definitions do not support activation-mode %s\n", def->id, def->activation_mode);
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                        "ERROR: %s: NetworkManager definitions do not support activation-mode %s", def->id, def->activation_mode);
+            return FALSE;
         }
         /* "manual" */
         g_key_file_set_boolean(kf, "connection", "autoconnect", FALSE);
@@ -688,8 +718,9 @@ write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const
     }
 
     if (def->ipv6_mtubytes) {
-        g_fprintf(stderr, "ERROR: %s: NetworkManager definitions do not support ipv6-mtu\n", def->id);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "ERROR: %s: NetworkManager definitions do not support ipv6-mtu", def->id);
+        return FALSE;
     }
 
     if (def->type < NETPLAN_DEF_TYPE_VIRTUAL) {
@@ -744,9 +775,10 @@ write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const
         write_bond_parameters(def, kf);
 
     if (def->type == NETPLAN_DEF_TYPE_TUNNEL) {
-        if (def->tunnel.mode == NETPLAN_TUNNEL_MODE_WIREGUARD)
-            write_wireguard_params(def, kf);
-        else
+        if (def->tunnel.mode == NETPLAN_TUNNEL_MODE_WIREGUARD) {
+            if (!write_wireguard_params(def, kf, error))
+                return FALSE;
+        } else
             write_tunnel_params(def, kf);
     }
 
@@ -772,23 +804,21 @@ write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const
     if (def->ip4_addresses) {
         for (unsigned i = 0; i < def->ip4_addresses->len; ++i) {
             tmp_key = g_strdup_printf("address%i", i+1);
-            g_key_file_set_string(kf, "ipv4", tmp_key, g_array_index(def->ip4_addresses, char*, i));
+            g_key_file_set_string(kf, "ipv4", tmp_key,
+                                  format_address(&g_array_index(def->ip4_addresses, NetplanAddress, i), TRUE, addr));
             g_free(tmp_key);
         }
     }
-    if (def->gateway4)
-        g_key_file_set_string(kf, "ipv4", "gateway", def->gateway4);
-    if (def->ip4_nameservers) {
-        const gchar* list[def->ip4_nameservers->len];
-        for (unsigned i = 0; i < def->ip4_nameservers->len; ++i)
-            list[i] = g_array_index(def->ip4_nameservers, char*, i);
-        g_key_file_set_string_list(kf, "ipv4", "dns", list, def->ip4_nameservers->len);
-    }
+    if (def->gateway4.ip.family)
+        g_key_file_set_string(kf, "ipv4", "gateway", format_address(&def->gateway4, FALSE, addr));
+    if (def->ip4_nameservers)
+        write_address_list(kf, "ipv4", "dns", def->ip4_nameservers, FALSE);
 
     /* We can only write search domains and routes if we have an address */
     if (def->ip4_addresses || def->dhcp4) {
         write_search_domains(def, "ipv4", kf);
-        write_routes(def, kf, AF_INET);
+        if (!write_routes(def, kf, AF_INET, error))
+            return FALSE;
     }
 
     if (!def->dhcp4_overrides.use_routes) {
@@ -799,13 +829,14 @@ write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const
     if (def->dhcp4 && def->dhcp4_overrides.metric != NETPLAN_METRIC_UNSPEC)
         g_key_file_set_uint64(kf, "ipv4", "route-metric", def->dhcp4_overrides.metric);
 
-    if (def->dhcp6 || def->ip6_addresses || def->gateway6 || def->ip6_nameservers || def->ip6_addr_gen_mode) {
+    if (def->dhcp6 || def->ip6_addresses || def->gateway6.ip.family || def->ip6_nameservers || def->ip6_addr_gen_mode) {
         g_key_file_set_string(kf, "ipv6", "method", def->dhcp6 ? "auto" : "manual");
 
         if (def->ip6_addresses) {
             for (unsigned i = 0; i < def->ip6_addresses->len; ++i) {
                 tmp_key = g_strdup_printf("address%i", i+1);
-                g_key_file_set_string(kf, "ipv6", tmp_key, g_array_index(def->ip6_addresses, char*, i));
+                g_key_file_set_string(kf, "ipv6", tmp_key,
+                                      format_address(&g_array_index(def->ip6_addresses, NetplanAddress, i), TRUE, addr));
                 g_free(tmp_key);
             }
         }
@@ -817,20 +848,17 @@ write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const
             g_key_file_set_string(kf, "ipv6", "addr-gen-mode", addr_gen_mode_str(def->ip6_addr_gen_mode));
         if (def->ip6_privacy)
             g_key_file_set_integer(kf, "ipv6", "ip6-privacy", 2);
-        if (def->gateway6)
-            g_key_file_set_string(kf, "ipv6", "gateway", def->gateway6);
-        if (def->ip6_nameservers) {
-            const gchar* list[def->ip6_nameservers->len];
-            for (unsigned i = 0; i < def->ip6_nameservers->len; ++i)
-                list[i] = g_array_index(def->ip6_nameservers, char*, i);
-            g_key_file_set_string_list(kf, "ipv6", "dns", list, def->ip6_nameservers->len);
-        }
+        if (def->gateway6.ip.family)
+            g_key_file_set_string(kf, "ipv6", "gateway", format_address(&def->gateway6, FALSE, addr));
+        if (def->ip6_nameservers)
+            write_address_list(kf, "ipv6", "dns", def->ip6_nameservers, FALSE);
         /* nm-settings(5) specifies search-domain for both [ipv4] and [ipv6] --
          * We need to specify it here for the IPv6-only case - see LP: #1786726 */
         write_search_domains(def, "ipv6", kf);
 
         /* We can only write valid routes if there is a DHCPv6 or static IPv6 address */
-        write_routes(def, kf, AF_INET6);
+        if (!write_routes(def, kf, AF_INET6, error))
+            return FALSE;
 
         if (!def->dhcp6_overrides.use_routes) {
             g_key_file_set_boolean(kf, "ipv6", "ignore-auto-routes", TRUE);
@@ -866,10 +894,9 @@ write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const
             /* Channel is only unambiguous, if band is set. */
             if (ap->channel) {
                 /* Validate WiFi channel */
-                if (ap->band == NETPLAN_WIFI_BAND_5)
-                    wifi_get_freq5(ap->channel);
-                else
-                    wifi_get_freq24(ap->channel);
+                if (ap->band == NETPLAN_WIFI_BAND_5 ? !wifi_get_freq5(ap->channel, error)
+                                                    : !wifi_get_freq24(ap->channel, error))
+                    return FALSE;
                 g_key_file_set_uint64(kf, "wifi", "channel", ap->channel);
             }
         }
@@ -893,16 +920,9 @@ write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const
     }
 
     /* NM connection files might contain secrets, and NM insists on tight permissions */
-    full_path = g_strjoin(G_DIR_SEPARATOR_S, rootdir ?: "", conf_path, NULL);
-    orig_umask = umask(077);
-    safe_mkdir_p_dir(full_path);
-    if (!g_key_file_save_to_file(kf, full_path, &error)) {
-        // LCOV_EXCL_START
-        g_fprintf(stderr, "ERROR: cannot create file %s: %s\n", full_path, error->message);
-        exit(1);
-        // LCOV_EXCL_STO
-    }
-    umask(orig_umask);
+    kf_data = g_key_file_to_data(kf, &kf_len, NULL);
+    g_string_free_to_file_umask(g_string_new_len(kf_data, kf_len), rootdir, conf_path, NULL, 077);
+    return TRUE;
 }
 
 /**
@@ -910,23 +930,26 @@ write_nm_conf_access_point(NetplanNetDefinition* def, const char* rootdir, const
  * particular NetplanNetDefinition.
  * @rootdir: If not %NULL, generate configuration in this root directory
  *           (useful for testing).
+ * Returns: FALSE with @error set if @def cannot be rendered for NetworkManager
  */
-void
-write_nm_conf(NetplanNetDefinition* def, const char* rootdir)
+gboolean
+write_nm_conf(NetplanNetDefinition* def, const char* rootdir, GError** error)
 {
     if (def->backend != NETPLAN_BACKEND_NM) {
         g_debug("NetworkManager: definition %s is not for us (backend %i)", def->id, def->backend);
-        return;
+        return TRUE;
     }
 
     if (def->match.driver && !def->set_name) {
-        g_fprintf(stderr, "ERROR: %s: NetworkManager definitions do not support matching by driver\n", def->id);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "ERROR: %s: NetworkManager definitions do not support matching by driver", def->id);
+        return FALSE;
     }
 
     if (def->address_options) {
-        g_fprintf(stderr, "ERROR: %s: NetworkManager does not support address options\n", def->id);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "ERROR: %s: NetworkManager does not support address options", def->id);
+        return FALSE;
     }
 
     if (def->type == NETPLAN_DEF_TYPE_WIFI) {
@@ -936,10 +959,27 @@ write_nm_conf(NetplanNetDefinition* def, const char* rootdir)
         g_assert(def->access_points);
         g_hash_table_iter_init(&iter, def->access_points);
         while (g_hash_table_iter_next(&iter, &key, (gpointer) &ap))
-            write_nm_conf_access_point(def, rootdir, ap);
-    } else {
-        g_assert(def->access_points == NULL);
-        write_nm_conf_access_point(def, rootdir, NULL);
+            if (!write_nm_conf_access_point(def, rootdir, ap, error))
+                return FALSE;
+        return TRUE;
+    }
+    g_assert(def->access_points == NULL);
+    return write_nm_conf_access_point(def, rootdir, NULL, error);
+}
+
+/**
+ * Generate the connection UUIDs of the parents of VLANs which match their
+ * device rather than naming it, before rendering any netdef: the VLANs refer
+ * to them in their connections, so they must not get generated while the
+ * netdefs get rendered in parallel.
+ */
+void
+write_nm_conf_prepare(void)
+{
+    for (GList* l = netdefs_ordered; l; l = l->next) {
+        NetplanNetDefinition* def = l->data;
+        if (def->has_vlans && def->has_match)
+            maybe_generate_uuid(def);
     }
 }
 
@@ -991,9 +1031,7 @@ write_nm_conf_finish(const char* rootdir)
 void
 cleanup_nm_conf(const char* rootdir)
 {
-    g_autofree char* confpath = g_strjoin(NULL, rootdir ?: "", "/run/NetworkManager/conf.d/netplan.conf", NULL);
-    g_autofree char* global_manage_path = g_strjoin(NULL, rootdir ?: "", "/run/NetworkManager/conf.d/10-globally-managed-devices.conf", NULL);
-    unlink(confpath);
-    unlink(global_manage_path);
+    unlink_glob(rootdir, "/run/NetworkManager/conf.d/netplan.conf");
+    unlink_glob(rootdir, "/run/NetworkManager/conf.d/10-globally-managed-devices.conf");
     unlink_glob(rootdir, "/run/NetworkManager/system-connections/netplan-*");
 }
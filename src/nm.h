@@ -19,6 +19,7 @@
 
 #include "parse.h"
 
-void write_nm_conf(NetplanNetDefinition* def, const char* rootdir);
+void write_nm_conf_prepare(void);
+gboolean write_nm_conf(NetplanNetDefinition* def, const char* rootdir, GError** error);
 void write_nm_conf_finish(const char* rootdir);
 void cleanup_nm_conf(const char* rootdir);
@@ -61,14 +61,7 @@ write_ovs_systemd_unit(const char* id, const GString* cmds, const char* rootdir,
     g_string_append(s, cmds->str);
 
     g_string_free_to_file(s, rootdir, path, NULL);
-
-    safe_mkdir_p_dir(link);
-    if (symlink(path, link) < 0 && errno != EEXIST) {
-        // LCOV_EXCL_START
-        g_fprintf(stderr, "failed to create enablement symlink: %m\n");
-        exit(1);
-        // LCOV_EXCL_STOP
-    }
+    safe_symlink(path, link);
 }
 
 #define append_systemd_cmd(s, command, ...) \
@@ -158,20 +151,22 @@ setup_patch_port(GString* s, const NetplanNetDefinition* def)
 }
 
 static char*
-write_ovs_bond_interfaces(const NetplanNetDefinition* def, GString* cmds)
+write_ovs_bond_interfaces(const NetplanNetDefinition* def, GString* cmds, GError** error)
 {
     NetplanNetDefinition* tmp_nd;
     GHashTableIter iter;
     gchar* key;
     guint i = 0;
     GString* s = NULL;
-    GString* patch_ports = g_string_new("");
+    GString* patch_ports = NULL;
 
     if (!def->bridge) {
-        g_fprintf(stderr, "Bond %s needs to be a slave of an OpenVSwitch bridge\n", def->id);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "Bond %s needs to be a slave of an OpenVSwitch bridge", def->id);
+        return NULL;
     }
 
+    patch_ports = g_string_new("");
     s = g_string_new(OPENVSWITCH_OVS_VSCTL " --may-exist add-bond");
     g_string_append_printf(s, " %s %s", def->bridge, def->id);
 
@@ -186,8 +181,11 @@ write_ovs_bond_interfaces(const NetplanNetDefinition* def, GString* cmds)
         }
     }
     if (i < 2) {
-        g_fprintf(stderr, "Bond %s needs to have at least 2 slave interfaces\n", def->id);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "Bond %s needs to have at least 2 slave interfaces", def->id);
+        g_string_free(patch_ports, TRUE);
+        g_string_free(s, TRUE);
+        return NULL;
     }
 
     g_string_append(s, patch_ports->str);
@@ -205,8 +203,8 @@ write_ovs_tag_netplan(const gchar* id, const char* type, GString* cmds)
                        type, id);
 }
 
-static void
-write_ovs_bond_mode(const NetplanNetDefinition* def, GString* cmds)
+static gboolean
+write_ovs_bond_mode(const NetplanNetDefinition* def, GString* cmds, GError** error)
 {
     char* value = NULL;
     /* OVS supports only "active-backup", "balance-tcp" and "balance-slb":
@@ -218,10 +216,12 @@ write_ovs_bond_mode(const NetplanNetDefinition* def, GString* cmds)
         append_systemd_cmd(cmds, OPENVSWITCH_OVS_VSCTL " set Port %s bond_mode=%s", def->id, value);
         write_ovs_tag_setting(def->id, "Port", "bond_mode", NULL, value, cmds);
     } else {
-        g_fprintf(stderr, "%s: bond mode '%s' not supported by openvswitch\n",
-                  def->id, def->bond_params.mode);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "%s: bond mode '%s' not supported by openvswitch",
+                    def->id, def->bond_params.mode);
+        return FALSE;
     }
+    return TRUE;
 }
 
 static void
@@ -263,47 +263,52 @@ write_ovs_protocols(const NetplanOVSSettings* ovs_settings, const gchar* bridge,
 }
 
 static gboolean
-check_ovs_ssl(gchar* target)
+check_ovs_ssl(gchar* target, GError** error)
 {
     /* Check if target needs ssl */
     if (g_str_has_prefix(target, "ssl:") || g_str_has_prefix(target, "pssl:")) {
         /* Check if SSL is configured in ovs_settings_global.ssl */
         if (!ovs_settings_global.ssl.ca_certificate || !ovs_settings_global.ssl.client_certificate ||
             !ovs_settings_global.ssl.client_key) {
-            g_fprintf(stderr, "ERROR: openvswitch bridge controller target '%s' needs SSL configuration, but global 'openvswitch.ssl' settings are not set\n", target);
-            exit(1);
+            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                        "ERROR: openvswitch bridge controller target '%s' needs SSL configuration, but global 'openvswitch.ssl' settings are not set", target);
+            return FALSE;
         }
-        return TRUE;
     }
-    return FALSE;
+    return TRUE;
 }
 
-static void
-write_ovs_bridge_controller_targets(const NetplanOVSController* controller, const gchar* bridge, GString* cmds)
+static gboolean
+write_ovs_bridge_controller_targets(const NetplanOVSController* controller, const gchar* bridge, GString* cmds, GError** error)
 {
-    gchar* target = g_array_index(controller->addresses, char*, 0);
-    gboolean needs_ssl = check_ovs_ssl(target);
-    GString* s = g_string_new(target);
+    gchar* target = NULL;
+    GString* s = NULL;
 
+    for (unsigned i = 0; i < controller->addresses->len; ++i)
+        if (!check_ovs_ssl(g_array_index(controller->addresses, char*, i), error))
+            return FALSE;
+
+    target = g_array_index(controller->addresses, char*, 0);
+    s = g_string_new(target);
     for (unsigned i = 1; i < controller->addresses->len; ++i) {
         target = g_array_index(controller->addresses, char*, i);
-        if (!needs_ssl)
-            needs_ssl = check_ovs_ssl(target);
         g_string_append_printf(s, " %s", target);
     }
 
     append_systemd_cmd(cmds, OPENVSWITCH_OVS_VSCTL " set-controller %s %s", bridge, s->str);
     write_ovs_tag_setting(bridge, "Bridge", "global", "set-controller", s->str, cmds);
     g_string_free(s, TRUE);
+    return TRUE;
 }
 
 /**
  * Generate the OpenVSwitch systemd units for configuration of the selected netdef
  * @rootdir: If not %NULL, generate configuration in this root directory
  *           (useful for testing).
+ * @error: Set if the netdef cannot be expressed with the OpenVSwitch backend
  */
-void
-write_ovs_conf(const NetplanNetDefinition* def, const char* rootdir)
+gboolean
+write_ovs_conf(const NetplanNetDefinition* def, const char* rootdir, GError** error)
 {
     GString* cmds = g_string_new(NULL);
     gchar* dependency = NULL;
@@ -319,15 +324,16 @@ write_ovs_conf(const NetplanNetDefinition* def, const char* rootdir)
     if (def->backend == NETPLAN_BACKEND_OVS) {
         switch (def->type) {
             case NETPLAN_DEF_TYPE_BOND:
-                dependency = write_ovs_bond_interfaces(def, cmds);
+                dependency = write_ovs_bond_interfaces(def, cmds, error);
+                if (!dependency)
+                    goto fail;
                 write_ovs_tag_netplan(def->id, type, cmds);
                 /* Set LACP mode, default to "off" */
                 value = def->ovs_settings.lacp? def->ovs_settings.lacp : "off";
                 append_systemd_cmd(cmds, OPENVSWITCH_OVS_VSCTL " set Port %s lacp=%s", def->id, value);
                 write_ovs_tag_setting(def->id, type, "lacp", NULL, value, cmds);
-                if (def->bond_params.mode) {
-                    write_ovs_bond_mode(def, cmds);
-                }
+                if (def->bond_params.mode && !write_ovs_bond_mode(def, cmds, error))
+                    goto fail;
                 break;
 
             case NETPLAN_DEF_TYPE_BRIDGE:
@@ -353,7 +359,8 @@ write_ovs_conf(const NetplanNetDefinition* def, const char* rootdir)
                 }
                 /* Set controller target addresses */
                 if (def->ovs_settings.controller.addresses && def->ovs_settings.controller.addresses->len > 0) {
-                    write_ovs_bridge_controller_targets(&(def->ovs_settings.controller), def->id, cmds);
+                    if (!write_ovs_bridge_controller_targets(&(def->ovs_settings.controller), def->id, cmds, error))
+                        goto fail;
                     /* Set controller connection mode, only applicable if at least one controller target address was set */
                     if (def->ovs_settings.controller.connection_mode) {
                         value = def->ovs_settings.controller.connection_mode;
@@ -367,8 +374,9 @@ write_ovs_conf(const NetplanNetDefinition* def, const char* rootdir)
                 g_assert(def->peer);
                 dependency = def->bridge?: def->bond;
                 if (!dependency) {
-                    g_fprintf(stderr, "%s: OpenVSwitch patch port needs to be assigned to a bridge/bond\n", def->id);
-                    exit(1);
+                    g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                                "%s: OpenVSwitch patch port needs to be assigned to a bridge/bond", def->id);
+                    goto fail;
                 }
                 /* There is no OVS Port which we could tag netplan=true if this
                  * patch port is assigned as an OVS bond interface. Tag the
@@ -388,26 +396,29 @@ write_ovs_conf(const NetplanNetDefinition* def, const char* rootdir)
                 break;
 
             default:
-                g_fprintf(stderr, "%s: This device type is not supported with the OpenVSwitch backend\n", def->id);
-                exit(1);
-                break;
+                g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                            "%s: This device type is not supported with the OpenVSwitch backend", def->id);
+                goto fail;
         }
 
         /* Try writing out a base config */
         base_config_path = g_strjoin(NULL, "run/systemd/network/10-netplan-", def->id, NULL);
-        write_network_file(def, rootdir, base_config_path);
+        if (!write_network_file(def, rootdir, base_config_path, error))
+            goto fail;
     } else {
         /* Other interfaces must be part of an OVS bridge or bond to carry additional data */
         if (   (def->ovs_settings.external_ids && g_hash_table_size(def->ovs_settings.external_ids) > 0)
             || (def->ovs_settings.other_config && g_hash_table_size(def->ovs_settings.other_config) > 0)) {
             dependency = def->bridge?: def->bond;
             if (!dependency) {
-                g_fprintf(stderr, "%s: Interface needs to be assigned to an OVS bridge/bond to carry external-ids/other-config\n", def->id);
-                exit(1);
+                g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                            "%s: Interface needs to be assigned to an OVS bridge/bond to carry external-ids/other-config", def->id);
+                goto fail;
             }
         } else {
             g_debug("openvswitch: definition %s is not for us (backend %i)", def->id, def->backend);
-            return;
+            g_string_free(cmds, TRUE);
+            return TRUE;
         }
     }
 
@@ -429,6 +440,11 @@ write_ovs_conf(const NetplanNetDefinition* def, const char* rootdir)
     if (cmds->len > 0)
         write_ovs_systemd_unit(def->id, cmds, rootdir, netplan_type_is_physical(def->type), FALSE, dependency);
     g_string_free(cmds, TRUE);
+    return TRUE;
+
+fail:
+    g_string_free(cmds, TRUE);
+    return FALSE;
 }
 
 /**
@@ -19,6 +19,6 @@
 
 #include "parse.h"
 
-void write_ovs_conf(const NetplanNetDefinition* def, const char* rootdir);
+gboolean write_ovs_conf(const NetplanNetDefinition* def, const char* rootdir, GError** error);
 void write_ovs_conf_finish(const char* rootdir);
 void cleanup_ovs_conf(const char* rootdir);
@@ -23,6 +23,7 @@
 #include "parse-nm.h"
 #include "parse.h"
 #include "util.h"
+#include "validation.h"
 
 /**
  * NetworkManager writes the alias for '802-3-ethernet' (ethernet),
@@ -150,7 +151,10 @@ parse_addresses(GKeyFile* kf, const gchar* group, GArray** ip_arr)
         gchar *key = NULL;
         gchar *kf_value = NULL;
         gchar **split = NULL;
+        NetplanIPPrefix ip;
+        NetplanAddress address;
         for (unsigned i = 1;; ++i) {
+            address.ip.family = 0;
             key = g_strdup_printf("address%u", i);
             kf_value = g_key_file_get_string(kf, group, key, NULL);
             if (!kf_value) {
@@ -158,16 +162,17 @@ parse_addresses(GKeyFile* kf, const gchar* group, GArray** ip_arr)
                 break;
             }
             if (!*ip_arr)
-                *ip_arr = g_array_new(FALSE, FALSE, sizeof(char*));
+                *ip_arr = g_array_new(FALSE, FALSE, sizeof(NetplanAddress));
             split = g_strsplit(kf_value, ",", 2);
             g_free(kf_value);
-            /* Append "address/prefix" */
-            if (split[0]) {
-                /* no need to free 's', this will stay in the netdef */
-                gchar* s = g_strdup(split[0]);
-                g_array_append_val(*ip_arr, s);
-            }
-            if (!split[1])
+            /* Append "address/prefix"; anything else stays in the passthrough */
+            if (split[0] && strchr(split[0], '/') && parse_ip_prefix(split[0], &ip) &&
+                ip.prefix > 0 && ip.prefix <= (ip.family == AF_INET ? 32 : 128)) {
+                set_address(&address, &ip, split[0], TRUE);
+                g_array_append_val(*ip_arr, address);
+            } else
+                unhandled_data = TRUE;
+            if (!split[1] && address.ip.family)
                 _kf_clear_key(kf, group, key);
             else
                 /* XXX: how to handle additional values (like "gateway") in split[n]? */
@@ -181,6 +186,19 @@ parse_addresses(GKeyFile* kf, const gchar* group, GArray** ip_arr)
     }
 }
 
+static void
+parse_gateway(GKeyFile* kf, const gchar* group, NetplanAddress* gateway)
+{
+    g_autofree gchar* kf_value = g_key_file_get_string(kf, group, "gateway", NULL);
+    NetplanIPPrefix ip;
+
+    /* anything but an address stays in the passthrough */
+    if (kf_value && parse_ip_address(kf_value, &ip)) {
+        set_address(gateway, &ip, kf_value, FALSE);
+        _kf_clear_key(kf, group, "gateway");
+    }
+}
+
 static void
 parse_routes(GKeyFile* kf, const gchar* group, GArray** routes_arr)
 {
@@ -228,6 +246,10 @@ parse_routes(GKeyFile* kf, const gchar* group, GArray** routes_arr)
         if (split[0] && split[1] && split[2] && strtoul(split[2], NULL, 10) != NETPLAN_METRIC_UNSPEC)
             route->metric = strtoul(split[2], NULL, 10);
         g_strfreev(split);
+        if (route->to)
+            parse_ip_prefix(route->to, &route->to_ip);
+        if (route->via)
+            parse_ip_address(route->via, &route->via_ip);
 
         /* Parse route options */
         if (options_kf_value) {
@@ -246,9 +268,10 @@ parse_routes(GKeyFile* kf, const gchar* group, GArray** routes_arr)
                     route->mtubytes = strtoul(kv[1], NULL, 10);
                 else if (g_strcmp0(kv[0], "table") == 0)
                     route->table = strtoul(kv[1], NULL, 10);
-                else if (g_strcmp0(kv[0], "src") == 0)
+                else if (g_strcmp0(kv[0], "src") == 0) {
                     route->from = g_strdup(kv[1]); //no need to free, will stay in netdef
-                else
+                    parse_ip_prefix(route->from, &route->from_ip);
+                } else
                     unhandled_data = TRUE;
                 g_strfreev(kv);
             }
@@ -291,6 +314,7 @@ parse_search_domains(GKeyFile* kf, const gchar* group, GArray** domains_arr)
     if (split) {
         if (len == 0) {
             _kf_clear_key(kf, group, "dns-search");
+            g_strfreev(split);
             return;
         }
         if (!*domains_arr)
@@ -309,13 +333,23 @@ parse_nameservers(GKeyFile* kf, const gchar* group, GArray** nameserver_arr)
 {
     g_assert(nameserver_arr);
     gchar **split = g_key_file_get_string_list(kf, group, "dns", NULL, NULL);
+    NetplanIPPrefix ip;
+    NetplanAddress address;
     if (split) {
+        /* leave the whole list to the passthrough if anything is not an address */
+        for (unsigned i = 0; split[i]; ++i) {
+            if (strlen(split[i]) > 0 && !parse_ip_address(split[i], &ip)) {
+                g_strfreev(split);
+                return;
+            }
+        }
         if (!*nameserver_arr)
-            *nameserver_arr = g_array_new(FALSE, FALSE, sizeof(char*));
+            *nameserver_arr = g_array_new(FALSE, FALSE, sizeof(NetplanAddress));
         for(unsigned i = 0; split[i]; ++i) {
             if (strlen(split[i]) > 0) {
-                gchar* s = g_strdup(split[i]); //no need to free, will stay in netdef
-                g_array_append_val(*nameserver_arr, s);
+                parse_ip_address(split[i], &ip);
+                set_address(&address, &ip, split[i], FALSE);
+                g_array_append_val(*nameserver_arr, address);
             }
         }
         _kf_clear_key(kf, group, "dns");
@@ -389,7 +423,10 @@ read_passthrough(GKeyFile* kf, GData** list)
             keys = g_key_file_get_keys(kf, groups[i], &klen, NULL);
             if (klen == 0) {
                 /* empty group */
-                g_datalist_set_data_full(list, g_strconcat(groups[i], ".", NETPLAN_NM_EMPTY_GROUP, NULL), g_strdup(""), g_free);
+                group_key = g_strconcat(groups[i], ".", NETPLAN_NM_EMPTY_GROUP, NULL);
+                g_datalist_set_data_full(list, group_key, g_strdup(""), g_free);
+                g_free(group_key);
+                g_strfreev(keys);
                 continue;
             }
             for (unsigned j = 0; j < klen; ++j) {
@@ -402,7 +439,8 @@ read_passthrough(GKeyFile* kf, GData** list)
                 }
                 group_key = g_strconcat(groups[i], ".", keys[j], NULL);
                 g_datalist_set_data_full(list, group_key, value, g_free);
-                /* no need to free group_key and value: they stay in the list */
+                /* the value stays in the list, the key got interned as a GQuark */
+                g_free(group_key);
             }
             g_strfreev(keys);
         }
@@ -509,8 +547,8 @@ netplan_parse_keyfile(const char* filename, GError** error)
     parse_addresses(kf, "ipv6", &nd->ip6_addresses);
 
     /* Default gateways */
-    handle_generic_str(kf, "ipv4", "gateway", &nd->gateway4);
-    handle_generic_str(kf, "ipv6", "gateway", &nd->gateway6);
+    parse_gateway(kf, "ipv4", &nd->gateway4);
+    parse_gateway(kf, "ipv6", &nd->gateway6);
 
     /* Routes */
     parse_routes(kf, "ipv4", &nd->routes);
@@ -594,14 +632,14 @@ netplan_parse_keyfile(const char* filename, GError** error)
     /* Cleanup some implicit keys */
     tmp_str = g_key_file_get_string(kf, "ipv6", "method", NULL);
     if (tmp_str && g_strcmp0(tmp_str, "ignore") == 0 &&
-        !(nd->dhcp6 || nd->ip6_addresses || nd->gateway6 ||
+        !(nd->dhcp6 || nd->ip6_addresses || nd->gateway6.ip.family ||
             nd->ip6_nameservers || nd->ip6_addr_gen_mode))
         _kf_clear_key(kf, "ipv6", "method");
     g_free(tmp_str);
 
     tmp_str = g_key_file_get_string(kf, "ipv4", "method", NULL);
     if (tmp_str && g_strcmp0(tmp_str, "link-local") == 0 &&
-        !(nd->dhcp4 || nd->ip4_addresses || nd->gateway4 ||
+        !(nd->dhcp4 || nd->ip4_addresses || nd->gateway4.ip.family ||
             nd->ip4_nameservers))
         _kf_clear_key(kf, "ipv4", "method");
     g_free(tmp_str);
@@ -721,8 +759,8 @@ netplan_parse_keyfile(const char* filename, GError** error)
 
         /* Last: handle passthrough for everything left in the keyfile
          *       Also, transfer backend_settings from netdef to AP */
-        ap->backend_settings.nm.uuid = nd->backend_settings.nm.uuid;
-        ap->backend_settings.nm.name = nd->backend_settings.nm.name;
+        ap->backend_settings.nm.uuid = g_strdup(nd->backend_settings.nm.uuid);
+        ap->backend_settings.nm.name = g_strdup(nd->backend_settings.nm.name);
         /* No need to clear nm.uuid & nm.name from def->backend_settings,
          * as we have only one AP. */
         read_passthrough(kf, &ap->backend_settings.nm.passthrough);
@@ -17,8 +17,11 @@
  */
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <regex.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 
 #include <glib.h>
@@ -28,8 +31,11 @@
 #include <yaml.h>
 
 #include "parse.h"
+#include "cache.h"
 #include "util.h"
 #include "error.h"
+#include "probes.h"
+#include "timings.h"
 #include "validation.h"
 
 /* convenience macro to put the offset of a NetplanNetDefinition field into "void* data" */
@@ -49,76 +55,130 @@
     dst = g_strdup(src); \
 } }
 
-/* NetplanNetDefinition that is currently being processed */
-static NetplanNetDefinition* cur_netdef;
+/* State of one parse: the definitions parsed so far and what is currently
+ * being processed. */
+struct netplan_parser {
+    /* NetplanNetDefinition that is currently being processed */
+    NetplanNetDefinition* cur_netdef;
 
-/* NetplanWifiAccessPoint that is currently being processed */
-static NetplanWifiAccessPoint* cur_access_point;
+    /* NetplanWifiAccessPoint that is currently being processed */
+    NetplanWifiAccessPoint* cur_access_point;
 
-/* NetplanAuthenticationSettings that are currently being processed */
-static NetplanAuthenticationSettings* cur_auth;
+    /* NetplanAuthenticationSettings that are currently being processed */
+    NetplanAuthenticationSettings* cur_auth;
 
-/* NetplanWireguardPeer that is currently being processed */
-static NetplanWireguardPeer* cur_wireguard_peer;
+    /* NetplanWireguardPeer that is currently being processed */
+    NetplanWireguardPeer* cur_wireguard_peer;
 
-static NetplanAddressOptions* cur_addr_option;
+    NetplanAddressOptions* cur_addr_option;
 
-static NetplanIPRoute* cur_route;
-static NetplanIPRule* cur_ip_rule;
+    NetplanIPRoute* cur_route;
+    NetplanIPRule* cur_ip_rule;
 
-/* Filename of the currently parsed YAML file */
-const char* cur_filename;
+    /* Filename of the currently parsed YAML file */
+    const char* cur_filename;
 
-static NetplanBackend backend_global, backend_cur_type;
+    NetplanBackend backend_global, backend_cur_type;
 
-/* global OpenVSwitch settings */
-NetplanOVSSettings ovs_settings_global;
+    /* global OpenVSwitch settings */
+    NetplanOVSSettings ovs_settings_global;
 
-/* Global ID → NetplanNetDefinition* map for all parsed config files */
-GHashTable* netdefs;
+    /* ID → NetplanNetDefinition* map for all parsed config files */
+    GHashTable* netdefs;
 
-/* Contains the same objects as 'netdefs' but ordered by dependency */
-GList* netdefs_ordered;
+    /* Contains the same objects as 'netdefs' but ordered by dependency */
+    GList* netdefs_ordered;
+
+    /* Last element of 'netdefs_ordered', for appending in constant time */
+    GList* netdefs_ordered_last;
+
+    /* Secondary indices of 'netdefs': property value → GPtrArray of definitions
+     * (in 'netdefs_ordered' order). Built on first lookup and dropped whenever
+     * definitions get added or modified. */
+    GHashTable* netdef_indices[NETPLAN_NETDEF_INDEX_MAX_];
+
+    /* Set of IDs in currently parsed YAML file, for being able to detect
+     * "duplicate ID within one file" vs. allowing a drop-in to override/amend an
+     * existing definition */
+    GHashTable* ids_in_file;
+
+    /* Definitions may refer to each other in any order within a document. Such
+     * references are only recorded while walking the document and applied once
+     * all of its definitions are known, see resolve_deferred_refs(). */
+    GPtrArray* deferred_refs;
+
+    /* Definitions seen in the current document together with their YAML
+     * mapping (NetplanDocumentNetdef); they get validated after their
+     * references have been resolved. */
+    GArray* document_netdefs;
 
-/* Set of IDs in currently parsed YAML file, for being able to detect
- * "duplicate ID within one file" vs. allowing a drop-in to override/amend an
- * existing definition */
-static GHashTable* ids_in_file;
+    /* Some YAML got processed since the parser was created or cleared */
+    gboolean has_input;
 
-/* Global variables, defined in this file */
-int missing_ids_found;
-const char* current_file;
-GHashTable* missing_id;
+    /* Checkpoints of the last netplan_parser_update_hierarchy(), to continue
+     * from on the next one */
+    NetplanStateCache* checkpoints;
+};
+
+/* Parser behind the process-global entry points like netplan_parse_yaml() */
+static NetplanParser default_parser;
+
+/* Parser the calling thread currently works on. The handlers below are called
+ * through fixed signatures, so rather than passing it down to each of them,
+ * the netplan_parser_*() functions point this to their parser while they run. */
+static __thread NetplanParser* npp = &default_parser;
+
+/* Global variables, defined in this file. The first three mirror the state of
+ * the default parser, see publish_default_parser(). */
+GHashTable* netdefs;
+GList* netdefs_ordered;
+NetplanOVSSettings ovs_settings_global;
+__thread const char* current_file;
 
 /**
- * Load YAML file name into a yaml_document_t.
+ * Read the YAML file @yaml into memory, to be parsed from there. Regular
+ * files get mapped rather than copied.
  *
- * Returns: TRUE on success, FALSE if the document is malformed; @error gets set then.
+ * Returns: the contents, or NULL on error (@error gets set then).
  */
-static gboolean
-load_yaml(const char* yaml, yaml_document_t* doc, GError** error)
+static GBytes*
+read_yaml(const char* yaml, GError** error)
 {
-    FILE* fyaml = NULL;
-    yaml_parser_t parser;
-    gboolean ret = TRUE;
-
-    current_file = yaml;
-
-    fyaml = g_fopen(yaml, "r");
-    if (!fyaml) {
+    GMappedFile* map;
+    GBytes* contents = NULL;
+    GStatBuf st;
+    gchar* data;
+    gsize length;
+    int fd = g_open(yaml, O_RDONLY, 0);
+
+    if (fd < 0) {
         g_set_error(error, G_FILE_ERROR, errno, "Cannot open %s: %s", yaml, g_strerror(errno));
-        return FALSE;
+        return NULL;
     }
-
-    yaml_parser_initialize(&parser);
-    yaml_parser_set_input_file(&parser, fyaml);
-    if (!yaml_parser_load(&parser, doc)) {
-        ret = parser_error(&parser, yaml, error);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        map = g_mapped_file_new_from_fd(fd, FALSE, error);
+        if (map) {
+            contents = g_mapped_file_get_bytes(map);
+            g_mapped_file_unref(map);
+        }
+    } else if (g_file_get_contents(yaml, &data, &length, error)) {
+        contents = g_bytes_new_take(data, length);
     }
+    close(fd);
+    return contents;
+}
 
-    yaml_parser_delete(&parser);
-    fclose(fyaml);
-    return ret;
+/**
+ * Let @parser read @contents.
+ */
+static void
+set_yaml_input(yaml_parser_t* parser, GBytes* contents)
+{
+    gsize length;
+    const char* data = g_bytes_get_data(contents, &length);
+
+    /* empty files do not get mapped at all */
+    yaml_parser_set_input_string(parser, (const unsigned char*) (data ? data : ""), length);
 }
 
 #define YAML_VARIABLE_NODE  YAML_NO_NODE
@@ -163,21 +223,92 @@ scalar(const yaml_node_t* node)
     return (const char*) node->data.scalar.value;
 }
 
+/****************************************************
+ * Deferred references between definitions
+ ****************************************************/
+
+typedef struct deferred_ref NetplanDeferredRef;
+
+/* Apply a reference from ref->netdef (set as cur_netdef) to component */
+typedef gboolean (*deferred_ref_handler) (const NetplanDeferredRef* ref, NetplanNetDefinition* component, GError** error);
+
+/* The nodes are detached copies (see detach_node()), as the YAML gets
+ * streamed and the document they were part of might be gone by the time the
+ * reference is applied. */
+struct deferred_ref {
+    deferred_ref_handler handler;
+    /* definition containing the reference */
+    NetplanNetDefinition* netdef;
+    /* scalar node with the ID of the referenced definition */
+    yaml_node_t* node;
+    /* optional value node that belongs to the reference (e.g. a path cost) */
+    yaml_node_t* value;
+    /* node to point at when applying the reference fails */
+    yaml_node_t* context;
+    const void* data;
+};
+
+typedef struct {
+    NetplanNetDefinition* netdef;
+    /* detached copy of the definition's mapping node */
+    yaml_node_t* node;
+} NetplanDocumentNetdef;
+
+/**
+ * Return a copy of @node which does not depend on its document, for
+ * reporting errors after the document is gone. Scalars keep their value,
+ * collections lose their contents.
+ */
+static yaml_node_t*
+detach_node(const yaml_node_t* node)
+{
+    yaml_node_t* copy;
+
+    if (!node)
+        return NULL;
+    copy = g_new(yaml_node_t, 1);
+    *copy = *node;
+    copy->tag = NULL;
+    if (node->type == YAML_SCALAR_NODE)
+        copy->data.scalar.value = (yaml_char_t*) g_strndup((const char*) node->data.scalar.value, node->data.scalar.length);
+    else
+        memset(&copy->data, 0, sizeof(copy->data));
+    return copy;
+}
+
 static void
-add_missing_node(const yaml_node_t* node)
+free_detached_node(yaml_node_t* node)
 {
-    NetplanMissingNode* missing;
+    if (node && node->type == YAML_SCALAR_NODE)
+        g_free(node->data.scalar.value);
+    g_free(node);
+}
 
-    /* Let's capture the current netdef we were playing with along with the
-     * actual yaml_node_t that errors (that is an identifier not previously
-     * seen by the compiler). We can use it later to write an sensible error
-     * message and point the user in the right direction. */
-    missing = g_new0(NetplanMissingNode, 1);
-    missing->netdef_id = cur_netdef->id;
-    missing->node = node;
+static void
+free_deferred_ref(NetplanDeferredRef* ref)
+{
+    free_detached_node(ref->node);
+    free_detached_node(ref->value);
+    free_detached_node(ref->context);
+    g_free(ref);
+}
 
-    g_debug("recording missing yaml_node_t %s", scalar(node));
-    g_hash_table_insert(missing_id, (gpointer)scalar(node), missing);
+static void
+add_deferred_ref(deferred_ref_handler handler, const yaml_node_t* node, const yaml_node_t* value,
+                 const yaml_node_t* context, const void* data)
+{
+    NetplanDeferredRef* ref;
+
+    ref = g_new0(NetplanDeferredRef, 1);
+    ref->handler = handler;
+    ref->netdef = npp->cur_netdef;
+    ref->node = detach_node(node);
+    ref->value = detach_node(value);
+    ref->context = detach_node(context);
+    ref->data = data;
+
+    g_debug("%s: recording reference to %s", npp->cur_netdef->id, scalar(node));
+    g_ptr_array_add(npp->deferred_refs, ref);
 }
 
 /**
@@ -187,13 +318,13 @@ static gboolean
 assert_valid_id(yaml_node_t* node, GError** error)
 {
     static regex_t re;
-    static gboolean re_inited = FALSE;
+    static gsize re_inited = 0;
 
     assert_type(node, YAML_SCALAR_NODE);
 
-    if (!re_inited) {
+    if (g_once_init_enter(&re_inited)) {
         g_assert(regcomp(&re, "^[[:alnum:][:punct:]]+$", REG_EXTENDED|REG_NOSUB) == 0);
-        re_inited = TRUE;
+        g_once_init_leave(&re_inited, 1);
     }
 
     if (regexec(&re, scalar(node), 0, NULL, 0) != 0)
@@ -222,36 +353,111 @@ initialize_ovs_settings(NetplanOVSSettings* ovs_settings)
     ovs_settings->rstp = FALSE;
 }
 
+/**
+ * Update the global "netdefs", "netdefs_ordered" and "ovs_settings_global"
+ * after a change to the state of the default parser, which the writers and
+ * other users of the process-global API read them from.
+ */
+static void
+publish_default_parser()
+{
+    if (npp != &default_parser)
+        return;
+    netdefs = default_parser.netdefs;
+    netdefs_ordered = default_parser.netdefs_ordered;
+    ovs_settings_global = default_parser.ovs_settings_global;
+}
+
+static void
+invalidate_netdef_indices()
+{
+    for (unsigned i = 0; i < NETPLAN_NETDEF_INDEX_MAX_; ++i)
+        g_clear_pointer(&npp->netdef_indices[i], g_hash_table_destroy);
+}
+
+static const char*
+netdef_index_key(const NetplanNetDefinition* nd, NetplanNetdefIndex index)
+{
+    switch (index) {
+        case NETPLAN_NETDEF_INDEX_SET_NAME: return nd->set_name;
+        case NETPLAN_NETDEF_INDEX_MATCH_NAME: return nd->match.original_name;
+        case NETPLAN_NETDEF_INDEX_MATCH_MAC: return nd->match.mac;
+        case NETPLAN_NETDEF_INDEX_MATCH_DRIVER: return nd->match.driver;
+        default: g_assert_not_reached(); // LCOV_EXCL_LINE
+    }
+}
+
+/**
+ * Return all definitions whose property selected by @index equals @key, in
+ * definition order, or NULL if there are none. The array is owned by the
+ * parser and only valid until definitions get parsed or cleared.
+ */
+const GPtrArray*
+netplan_netdefs_lookup(NetplanNetdefIndex index, const char* key)
+{
+    g_assert(index < NETPLAN_NETDEF_INDEX_MAX_);
+
+    if (!key)
+        return NULL;
+
+    if (!npp->netdef_indices[index]) {
+        npp->netdef_indices[index] = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_ptr_array_unref);
+        for (GList* l = npp->netdefs_ordered; l != NULL; l = l->next) {
+            NetplanNetDefinition* nd = l->data;
+            const char* value = netdef_index_key(nd, index);
+            GPtrArray* entries;
+
+            if (!value)
+                continue;
+            entries = g_hash_table_lookup(npp->netdef_indices[index], value);
+            if (!entries) {
+                entries = g_ptr_array_new();
+                g_hash_table_insert(npp->netdef_indices[index], (gpointer) value, entries);
+            }
+            g_ptr_array_add(entries, nd);
+        }
+    }
+    return g_hash_table_lookup(npp->netdef_indices[index], key);
+}
+
 NetplanNetDefinition*
 netplan_netdef_new(const char* id, NetplanDefType type, NetplanBackend backend)
 {
     /* create new network definition */
-    cur_netdef = g_new0(NetplanNetDefinition, 1);
-    cur_netdef->type = type;
-    cur_netdef->backend = backend ?: NETPLAN_BACKEND_NONE;
-    cur_netdef->id = g_strdup(id);
+    npp->cur_netdef = g_new0(NetplanNetDefinition, 1);
+    npp->cur_netdef->type = type;
+    npp->cur_netdef->backend = backend ?: NETPLAN_BACKEND_NONE;
+    npp->cur_netdef->id = g_strdup(id);
 
     /* Set some default values */
-    cur_netdef->vlan_id = G_MAXUINT; /* 0 is a valid ID */
-    cur_netdef->tunnel.mode = NETPLAN_TUNNEL_MODE_UNKNOWN;
-    cur_netdef->dhcp_identifier = g_strdup("duid"); /* keep networkd's default */
+    npp->cur_netdef->vlan_id = G_MAXUINT; /* 0 is a valid ID */
+    npp->cur_netdef->tunnel.mode = NETPLAN_TUNNEL_MODE_UNKNOWN;
+    npp->cur_netdef->dhcp_identifier = g_strdup("duid"); /* keep networkd's default */
     /* systemd-networkd defaults to IPv6 LL enabled; keep that default */
-    cur_netdef->linklocal.ipv6 = TRUE;
-    cur_netdef->sriov_vlan_filter = FALSE;
-    cur_netdef->sriov_explicit_vf_count = G_MAXUINT; /* 0 is a valid number of VFs */
+    npp->cur_netdef->linklocal.ipv6 = TRUE;
+    npp->cur_netdef->sriov_vlan_filter = FALSE;
+    npp->cur_netdef->sriov_explicit_vf_count = G_MAXUINT; /* 0 is a valid number of VFs */
 
     /* DHCP override defaults */
-    initialize_dhcp_overrides(&cur_netdef->dhcp4_overrides);
-    initialize_dhcp_overrides(&cur_netdef->dhcp6_overrides);
+    initialize_dhcp_overrides(&npp->cur_netdef->dhcp4_overrides);
+    initialize_dhcp_overrides(&npp->cur_netdef->dhcp6_overrides);
 
     /* OpenVSwitch defaults */
-    initialize_ovs_settings(&cur_netdef->ovs_settings);
-
-    if (!netdefs)
-        netdefs = g_hash_table_new(g_str_hash, g_str_equal);
-    g_hash_table_insert(netdefs, cur_netdef->id, cur_netdef);
-    netdefs_ordered = g_list_append(netdefs_ordered, cur_netdef);
-    return cur_netdef;
+    initialize_ovs_settings(&npp->cur_netdef->ovs_settings);
+
+    if (!npp->netdefs)
+        npp->netdefs = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_insert(npp->netdefs, npp->cur_netdef->id, npp->cur_netdef);
+    /* g_list_append() on the last element does not need to walk the list */
+    npp->netdefs_ordered_last = g_list_append(npp->netdefs_ordered_last, npp->cur_netdef);
+    if (npp->netdefs_ordered)
+        npp->netdefs_ordered_last = npp->netdefs_ordered_last->next;
+    else
+        npp->netdefs_ordered = npp->netdefs_ordered_last;
+    invalidate_netdef_indices();
+    publish_default_parser();
+    NETPLAN_PROBE3(netdef_new, npp->cur_netdef->id, type, netplan_backend_to_name[npp->cur_netdef->backend]);
+    return npp->cur_netdef;
 }
 
 /****************************************************
@@ -274,17 +480,80 @@ typedef struct mapping_entry_handler_s {
     const void* data;
 } mapping_entry_handler;
 
+/* Entries of a mapping_entry_handler table, sorted by key for bsearch() */
+typedef struct {
+    guint len;
+    const mapping_entry_handler* entries[];
+} handler_index;
+
+/* Table → handler_index map; built on first use of each table, as the tables
+ * are composed from several macros and cannot be sorted in the source. Shared
+ * by all parsers, hence the lock. */
+static GHashTable* handler_indexes;
+G_LOCK_DEFINE_STATIC(handler_indexes);
+
+static int
+compare_handlers(const void* a, const void* b)
+{
+    const mapping_entry_handler* ha = *(const mapping_entry_handler**) a;
+    const mapping_entry_handler* hb = *(const mapping_entry_handler**) b;
+    int ret = strcmp(ha->key, hb->key);
+
+    /* keep table order for duplicate keys, the first one wins */
+    if (ret == 0)
+        ret = (ha > hb) - (ha < hb);
+    return ret;
+}
+
+static int
+compare_handler_key(const void* key, const void* entry)
+{
+    return strcmp(key, (*(const mapping_entry_handler**) entry)->key);
+}
+
+static const handler_index*
+get_handler_index(const mapping_entry_handler* handlers)
+{
+    handler_index* index;
+    guint len = 0;
+
+    G_LOCK(handler_indexes);
+    if (!handler_indexes)
+        handler_indexes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    index = g_hash_table_lookup(handler_indexes, handlers);
+    if (index)
+        goto out;
+
+    while (handlers[len].key != NULL)
+        len++;
+    index = g_malloc(sizeof(handler_index) + len * sizeof(mapping_entry_handler*));
+    for (guint i = 0; i < len; i++)
+        index->entries[i] = &handlers[i];
+    qsort(index->entries, len, sizeof(mapping_entry_handler*), compare_handlers);
+
+    /* drop shadowed duplicates */
+    index->len = 0;
+    for (guint i = 0; i < len; i++) {
+        if (index->len == 0 || strcmp(index->entries[index->len - 1]->key, index->entries[i]->key) != 0)
+            index->entries[index->len++] = index->entries[i];
+    }
+
+    g_hash_table_insert(handler_indexes, (gpointer) handlers, index);
+out:
+    G_UNLOCK(handler_indexes);
+    return index;
+}
+
 /**
  * Return the #mapping_entry_handler that matches @key, or NULL if not found.
  */
 static const mapping_entry_handler*
-get_handler(const mapping_entry_handler* handlers, const char* key)
+get_handler(const handler_index* index, const char* key)
 {
-    for (unsigned i = 0; handlers[i].key != NULL; ++i) {
-        if (g_strcmp0(handlers[i].key, key) == 0)
-            return &handlers[i];
-    }
-    return NULL;
+    const mapping_entry_handler** h;
+
+    h = bsearch(key, index->entries, index->len, sizeof(mapping_entry_handler*), compare_handler_key);
+    return h ? *h : NULL;
 }
 
 /**
@@ -300,9 +569,11 @@ static gboolean
 process_mapping(yaml_document_t* doc, yaml_node_t* node, const mapping_entry_handler* handlers, GList** out_values, GError** error)
 {
     yaml_node_pair_t* entry;
+    const handler_index* index;
 
     assert_type(node, YAML_MAPPING_NODE);
 
+    index = get_handler_index(handlers);
     for (entry = node->data.mapping.pairs.start; entry < node->data.mapping.pairs.top; entry++) {
         yaml_node_t* key, *value;
         const mapping_entry_handler* h;
@@ -312,7 +583,7 @@ process_mapping(yaml_document_t* doc, yaml_node_t* node, const mapping_entry_han
         key = yaml_document_get_node(doc, entry->key);
         value = yaml_document_get_node(doc, entry->value);
         assert_type(key, YAML_SCALAR_NODE);
-        h = get_handler(handlers, scalar(key));
+        h = get_handler(index, scalar(key));
         if (!h)
             return yaml_error(key, error, "unknown key '%s'", scalar(key));
         assert_type(value, h->type);
@@ -385,13 +656,13 @@ handle_generic_mac(yaml_document_t* doc, yaml_node_t* node, void* entryptr, cons
 {
     g_assert(entryptr);
     static regex_t re;
-    static gboolean re_inited = FALSE;
+    static gsize re_inited = 0;
 
     g_assert(node->type == YAML_SCALAR_NODE);
 
-    if (!re_inited) {
+    if (g_once_init_enter(&re_inited)) {
         g_assert(regcomp(&re, "^[[:xdigit:]][[:xdigit:]]:[[:xdigit:]][[:xdigit:]]:[[:xdigit:]][[:xdigit:]]:[[:xdigit:]][[:xdigit:]]:[[:xdigit:]][[:xdigit:]]:[[:xdigit:]][[:xdigit:]]$", REG_EXTENDED|REG_NOSUB) == 0);
-        re_inited = TRUE;
+        g_once_init_leave(&re_inited, 1);
     }
 
     if (regexec(&re, scalar(node), 0, NULL, 0) != 0)
@@ -440,7 +711,7 @@ handle_generic_map(yaml_document_t* doc, yaml_node_t* node, void* entryptr, cons
     guint offset = GPOINTER_TO_UINT(data);
     GHashTable** map = (GHashTable**) ((void*) entryptr + offset);
     if (!*map)
-        *map = g_hash_table_new(g_str_hash, g_str_equal);
+        *map = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 
     for (yaml_node_pair_t* entry = node->data.mapping.pairs.start; entry < node->data.mapping.pairs.top; entry++) {
         yaml_node_t* key, *value;
@@ -451,7 +722,6 @@ handle_generic_map(yaml_document_t* doc, yaml_node_t* node, void* entryptr, cons
         assert_type(key, YAML_SCALAR_NODE);
         assert_type(value, YAML_SCALAR_NODE);
 
-        /* TODO: make sure we free all the memory here */
         if (!g_hash_table_insert(*map, g_strdup(scalar(key)), g_strdup(scalar(value))))
             return yaml_error(node, error, "duplicate map entry '%s'", scalar(key));
     }
@@ -481,7 +751,8 @@ handle_generic_datalist(yaml_document_t* doc, yaml_node_t* node, void* entryptr,
         assert_type(key, YAML_SCALAR_NODE);
         assert_type(value, YAML_SCALAR_NODE);
 
-        g_datalist_set_data_full(list, g_strdup(scalar(key)), g_strdup(scalar(value)), g_free);
+        /* the key gets interned as a GQuark, no need to copy it */
+        g_datalist_set_data_full(list, scalar(key), g_strdup(scalar(value)), g_free);
     }
 
     return TRUE;
@@ -495,7 +766,7 @@ handle_generic_datalist(yaml_document_t* doc, yaml_node_t* node, void* entryptr,
 static gboolean
 handle_netdef_str(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_generic_str(doc, node, cur_netdef, data, error);
+    return handle_generic_str(doc, node, npp->cur_netdef, data, error);
 }
 
 /**
@@ -520,25 +791,26 @@ handle_netdef_id(yaml_document_t* doc, yaml_node_t* node, const void* data, GErr
  *        located
  */
 static gboolean
-handle_netdef_id_ref(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
+resolve_netdef_id_ref(const NetplanDeferredRef* ref, NetplanNetDefinition* component, GError** error)
 {
-    guint offset = GPOINTER_TO_UINT(data);
-    NetplanNetDefinition* ref = NULL;
+    guint offset = GPOINTER_TO_UINT(ref->data);
 
-    ref = g_hash_table_lookup(netdefs, scalar(node));
-    if (!ref) {
-        add_missing_node(node);
-    } else {
-        *((NetplanNetDefinition**) ((void*) cur_netdef + offset)) = ref;
+    *((NetplanNetDefinition**) ((void*) npp->cur_netdef + offset)) = component;
 
-        if (cur_netdef->type == NETPLAN_DEF_TYPE_VLAN && ref->backend == NETPLAN_BACKEND_OVS) {
-            g_debug("%s: VLAN defined for openvswitch interface, choosing OVS backend", cur_netdef->id);
-            cur_netdef->backend = NETPLAN_BACKEND_OVS;
-        }
+    if (npp->cur_netdef->type == NETPLAN_DEF_TYPE_VLAN && component->backend == NETPLAN_BACKEND_OVS) {
+        g_debug("%s: VLAN defined for openvswitch interface, choosing OVS backend", npp->cur_netdef->id);
+        npp->cur_netdef->backend = NETPLAN_BACKEND_OVS;
     }
     return TRUE;
 }
 
+static gboolean
+handle_netdef_id_ref(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
+{
+    add_deferred_ref(resolve_netdef_id_ref, node, NULL, node, data);
+    return TRUE;
+}
+
 
 /**
  * Generic handler for setting a cur_netdef MAC address field from a scalar node
@@ -548,7 +820,7 @@ handle_netdef_id_ref(yaml_document_t* doc, yaml_node_t* node, const void* data,
 static gboolean
 handle_netdef_mac(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_generic_mac(doc, node, cur_netdef, data, error);
+    return handle_generic_mac(doc, node, npp->cur_netdef, data, error);
 }
 
 /**
@@ -558,7 +830,7 @@ handle_netdef_mac(yaml_document_t* doc, yaml_node_t* node, const void* data, GEr
 static gboolean
 handle_netdef_bool(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_generic_bool(doc, node, cur_netdef, data, error);
+    return handle_generic_bool(doc, node, npp->cur_netdef, data, error);
 }
 
 /**
@@ -568,29 +840,24 @@ handle_netdef_bool(yaml_document_t* doc, yaml_node_t* node, const void* data, GE
 static gboolean
 handle_netdef_guint(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_generic_guint(doc, node, cur_netdef, data, error);
+    return handle_generic_guint(doc, node, npp->cur_netdef, data, error);
 }
 
 static gboolean
 handle_netdef_ip4(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
     guint offset = GPOINTER_TO_UINT(data);
-    char** dest = (char**) ((void*) cur_netdef + offset);
-    g_autofree char* addr = NULL;
-    char* prefix_len;
-
-    /* these addresses can't have /prefix_len */
-    addr = g_strdup(scalar(node));
-    prefix_len = strrchr(addr, '/');
+    char** dest = (char**) ((void*) npp->cur_netdef + offset);
 
     /* FIXME: stop excluding this from coverage; refactor address handling instead */
     // LCOV_EXCL_START
-    if (prefix_len)
+    /* these addresses can't have /prefix_len */
+    if (strchr(scalar(node), '/'))
         return yaml_error(node, error,
                           "invalid address: a single IPv4 address (without /prefixlength) is required");
 
     /* is it an IPv4 address? */
-    if (!is_ip4_address(addr))
+    if (!is_ip4_address(scalar(node)))
         return yaml_error(node, error,
                           "invalid IPv4 address: %s", scalar(node));
     // LCOV_EXCL_STOP
@@ -605,22 +872,17 @@ static gboolean
 handle_netdef_ip6(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
     guint offset = GPOINTER_TO_UINT(data);
-    char** dest = (char**) ((void*) cur_netdef + offset);
-    g_autofree char* addr = NULL;
-    char* prefix_len;
-
-    /* these addresses can't have /prefix_len */
-    addr = g_strdup(scalar(node));
-    prefix_len = strrchr(addr, '/');
+    char** dest = (char**) ((void*) npp->cur_netdef + offset);
 
     /* FIXME: stop excluding this from coverage; refactor address handling instead */
     // LCOV_EXCL_START
-    if (prefix_len)
+    /* these addresses can't have /prefix_len */
+    if (strchr(scalar(node), '/'))
         return yaml_error(node, error,
                           "invalid address: a single IPv6 address (without /prefixlength) is required");
 
     /* is it an IPv6 address? */
-    if (!is_ip6_address(addr))
+    if (!is_ip6_address(scalar(node)))
         return yaml_error(node, error,
                           "invalid IPv6 address: %s", scalar(node));
     // LCOV_EXCL_STOP
@@ -634,11 +896,11 @@ handle_netdef_ip6(yaml_document_t* doc, yaml_node_t* node, const void* data, GEr
 static gboolean
 handle_netdef_addrgen(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    g_assert(cur_netdef);
+    g_assert(npp->cur_netdef);
     if (strcmp(scalar(node), "eui64") == 0)
-        cur_netdef->ip6_addr_gen_mode = NETPLAN_ADDRGEN_EUI64;
+        npp->cur_netdef->ip6_addr_gen_mode = NETPLAN_ADDRGEN_EUI64;
     else if (strcmp(scalar(node), "stable-privacy") == 0)
-        cur_netdef->ip6_addr_gen_mode = NETPLAN_ADDRGEN_STABLEPRIVACY;
+        npp->cur_netdef->ip6_addr_gen_mode = NETPLAN_ADDRGEN_STABLEPRIVACY;
     else
         return yaml_error(node, error, "unknown ipv6-address-generation '%s'", scalar(node));
     return TRUE;
@@ -647,9 +909,9 @@ handle_netdef_addrgen(yaml_document_t* doc, yaml_node_t* node, const void* _, GE
 static gboolean
 handle_netdef_addrtok(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    g_assert(cur_netdef);
+    g_assert(npp->cur_netdef);
     gboolean ret = handle_netdef_str(doc, node, data, error);
-    if (!is_ip6_address(cur_netdef->ip6_addr_gen_token))
+    if (!is_ip6_address(npp->cur_netdef->ip6_addr_gen_token))
         return yaml_error(node, error, "invalid ipv6-address-token '%s'", scalar(node));
     return ret;
 }
@@ -657,15 +919,15 @@ handle_netdef_addrtok(yaml_document_t* doc, yaml_node_t* node, const void* data,
 static gboolean
 handle_netdef_map(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    g_assert(cur_netdef);
-    return handle_generic_map(doc, node, cur_netdef, data, error);
+    g_assert(npp->cur_netdef);
+    return handle_generic_map(doc, node, npp->cur_netdef, data, error);
 }
 
 static gboolean
 handle_netdef_datalist(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    g_assert(cur_netdef);
-    return handle_generic_datalist(doc, node, cur_netdef, data, error);
+    g_assert(npp->cur_netdef);
+    return handle_generic_datalist(doc, node, npp->cur_netdef, data, error);
 }
 
 /****************************************************
@@ -686,9 +948,9 @@ static const mapping_entry_handler match_handlers[] = {
 static gboolean
 handle_auth_str(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    g_assert(cur_auth);
+    g_assert(npp->cur_auth);
     guint offset = GPOINTER_TO_UINT(data);
-    char** dest = (char**) ((void*) cur_auth + offset);
+    char** dest = (char**) ((void*) npp->cur_auth + offset);
     g_free(*dest);
     *dest = g_strdup(scalar(node));
     return TRUE;
@@ -697,15 +959,15 @@ handle_auth_str(yaml_document_t* doc, yaml_node_t* node, const void* data, GErro
 static gboolean
 handle_auth_key_management(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    g_assert(cur_auth);
+    g_assert(npp->cur_auth);
     if (strcmp(scalar(node), "none") == 0)
-        cur_auth->key_management = NETPLAN_AUTH_KEY_MANAGEMENT_NONE;
+        npp->cur_auth->key_management = NETPLAN_AUTH_KEY_MANAGEMENT_NONE;
     else if (strcmp(scalar(node), "psk") == 0)
-        cur_auth->key_management = NETPLAN_AUTH_KEY_MANAGEMENT_WPA_PSK;
+        npp->cur_auth->key_management = NETPLAN_AUTH_KEY_MANAGEMENT_WPA_PSK;
     else if (strcmp(scalar(node), "eap") == 0)
-        cur_auth->key_management = NETPLAN_AUTH_KEY_MANAGEMENT_WPA_EAP;
+        npp->cur_auth->key_management = NETPLAN_AUTH_KEY_MANAGEMENT_WPA_EAP;
     else if (strcmp(scalar(node), "802.1x") == 0)
-        cur_auth->key_management = NETPLAN_AUTH_KEY_MANAGEMENT_8021X;
+        npp->cur_auth->key_management = NETPLAN_AUTH_KEY_MANAGEMENT_8021X;
     else
         return yaml_error(node, error, "unknown key management type '%s'", scalar(node));
     return TRUE;
@@ -714,13 +976,13 @@ handle_auth_key_management(yaml_document_t* doc, yaml_node_t* node, const void*
 static gboolean
 handle_auth_method(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    g_assert(cur_auth);
+    g_assert(npp->cur_auth);
     if (strcmp(scalar(node), "tls") == 0)
-        cur_auth->eap_method = NETPLAN_AUTH_EAP_TLS;
+        npp->cur_auth->eap_method = NETPLAN_AUTH_EAP_TLS;
     else if (strcmp(scalar(node), "peap") == 0)
-        cur_auth->eap_method = NETPLAN_AUTH_EAP_PEAP;
+        npp->cur_auth->eap_method = NETPLAN_AUTH_EAP_PEAP;
     else if (strcmp(scalar(node), "ttls") == 0)
-        cur_auth->eap_method = NETPLAN_AUTH_EAP_TTLS;
+        npp->cur_auth->eap_method = NETPLAN_AUTH_EAP_TTLS;
     else
         return yaml_error(node, error, "unknown EAP method '%s'", scalar(node));
     return TRUE;
@@ -747,8 +1009,8 @@ static const mapping_entry_handler auth_handlers[] = {
 static NetplanBackend
 get_default_backend_for_type(NetplanDefType type)
 {
-    if (backend_global != NETPLAN_BACKEND_NONE)
-        return backend_global;
+    if (npp->backend_global != NETPLAN_BACKEND_NONE)
+        return npp->backend_global;
 
     /* networkd can handle all device types at the moment, so nothing
      * type-specific */
@@ -758,43 +1020,43 @@ get_default_backend_for_type(NetplanDefType type)
 static gboolean
 handle_access_point_str(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_generic_str(doc, node, cur_access_point, data, error);
+    return handle_generic_str(doc, node, npp->cur_access_point, data, error);
 }
 
 static gboolean
 handle_access_point_datalist(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    g_assert(cur_access_point);
-    return handle_generic_datalist(doc, node, cur_access_point, data, error);
+    g_assert(npp->cur_access_point);
+    return handle_generic_datalist(doc, node, npp->cur_access_point, data, error);
 }
 
 static gboolean
 handle_access_point_guint(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_generic_guint(doc, node, cur_access_point, data, error);
+    return handle_generic_guint(doc, node, npp->cur_access_point, data, error);
 }
 
 static gboolean
 handle_access_point_mac(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_generic_mac(doc, node, cur_access_point, data, error);
+    return handle_generic_mac(doc, node, npp->cur_access_point, data, error);
 }
 
 static gboolean
 handle_access_point_bool(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_generic_bool(doc, node, cur_access_point, data, error);
+    return handle_generic_bool(doc, node, npp->cur_access_point, data, error);
 }
 
 static gboolean
 handle_access_point_password(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    g_assert(cur_access_point);
+    g_assert(npp->cur_access_point);
     /* shortcut for WPA-PSK */
-    cur_access_point->has_auth = TRUE;
-    cur_access_point->auth.key_management = NETPLAN_AUTH_KEY_MANAGEMENT_WPA_PSK;
-    g_free(cur_access_point->auth.password);
-    cur_access_point->auth.password = g_strdup(scalar(node));
+    npp->cur_access_point->has_auth = TRUE;
+    npp->cur_access_point->auth.key_management = NETPLAN_AUTH_KEY_MANAGEMENT_WPA_PSK;
+    g_free(npp->cur_access_point->auth.password);
+    npp->cur_access_point->auth.password = g_strdup(scalar(node));
     return TRUE;
 }
 
@@ -803,12 +1065,12 @@ handle_access_point_auth(yaml_document_t* doc, yaml_node_t* node, const void* _,
 {
     gboolean ret;
 
-    g_assert(cur_access_point);
-    cur_access_point->has_auth = TRUE;
+    g_assert(npp->cur_access_point);
+    npp->cur_access_point->has_auth = TRUE;
 
-    cur_auth = &cur_access_point->auth;
+    npp->cur_auth = &npp->cur_access_point->auth;
     ret = process_mapping(doc, node, auth_handlers, NULL, error);
-    cur_auth = NULL;
+    npp->cur_auth = NULL;
 
     return ret;
 }
@@ -816,13 +1078,13 @@ handle_access_point_auth(yaml_document_t* doc, yaml_node_t* node, const void* _,
 static gboolean
 handle_access_point_mode(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    g_assert(cur_access_point);
+    g_assert(npp->cur_access_point);
     if (strcmp(scalar(node), "infrastructure") == 0)
-        cur_access_point->mode = NETPLAN_WIFI_MODE_INFRASTRUCTURE;
+        npp->cur_access_point->mode = NETPLAN_WIFI_MODE_INFRASTRUCTURE;
     else if (strcmp(scalar(node), "adhoc") == 0)
-        cur_access_point->mode = NETPLAN_WIFI_MODE_ADHOC;
+        npp->cur_access_point->mode = NETPLAN_WIFI_MODE_ADHOC;
     else if (strcmp(scalar(node), "ap") == 0)
-        cur_access_point->mode = NETPLAN_WIFI_MODE_AP;
+        npp->cur_access_point->mode = NETPLAN_WIFI_MODE_AP;
     else
         return yaml_error(node, error, "unknown wifi mode '%s'", scalar(node));
     return TRUE;
@@ -831,11 +1093,11 @@ handle_access_point_mode(yaml_document_t* doc, yaml_node_t* node, const void* _,
 static gboolean
 handle_access_point_band(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    g_assert(cur_access_point);
+    g_assert(npp->cur_access_point);
     if (strcmp(scalar(node), "5GHz") == 0 || strcmp(scalar(node), "5G") == 0)
-        cur_access_point->band = NETPLAN_WIFI_BAND_5;
+        npp->cur_access_point->band = NETPLAN_WIFI_BAND_5;
     else if (strcmp(scalar(node), "2.4GHz") == 0 || strcmp(scalar(node), "2.4G") == 0)
-        cur_access_point->band = NETPLAN_WIFI_BAND_24;
+        npp->cur_access_point->band = NETPLAN_WIFI_BAND_24;
     else
         return yaml_error(node, error, "unknown wifi band '%s'", scalar(node));
     return TRUE;
@@ -894,24 +1156,24 @@ parse_renderer(yaml_node_t* node, NetplanBackend* backend, GError** error)
 static gboolean
 handle_netdef_renderer(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    if (cur_netdef->type == NETPLAN_DEF_TYPE_VLAN) {
+    if (npp->cur_netdef->type == NETPLAN_DEF_TYPE_VLAN) {
         if (strcmp(scalar(node), "sriov") == 0) {
-            cur_netdef->sriov_vlan_filter = TRUE;
+            npp->cur_netdef->sriov_vlan_filter = TRUE;
             return TRUE;
         }
     }
 
-    return parse_renderer(node, &cur_netdef->backend, error);
+    return parse_renderer(node, &npp->cur_netdef->backend, error);
 }
 
 static gboolean
 handle_accept_ra(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    gboolean ret = handle_generic_bool(doc, node, cur_netdef, data, error);
-    if (cur_netdef->accept_ra)
-        cur_netdef->accept_ra = NETPLAN_RA_MODE_ENABLED;
+    gboolean ret = handle_generic_bool(doc, node, npp->cur_netdef, data, error);
+    if (npp->cur_netdef->accept_ra)
+        npp->cur_netdef->accept_ra = NETPLAN_RA_MODE_ENABLED;
     else
-        cur_netdef->accept_ra = NETPLAN_RA_MODE_DISABLED;
+        npp->cur_netdef->accept_ra = NETPLAN_RA_MODE_DISABLED;
     return ret;
 }
 
@@ -927,7 +1189,7 @@ handle_activation_mode(yaml_document_t* doc, yaml_node_t* node, const void* data
 static gboolean
 handle_match(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    cur_netdef->has_match = TRUE;
+    npp->cur_netdef->has_match = TRUE;
     return process_mapping(doc, node, match_handlers, NULL, error);
 }
 
@@ -954,7 +1216,7 @@ handle_wowlan(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** e
 
         for (unsigned i = 0; NETPLAN_WIFI_WOWLAN_TYPES[i].name != NULL; ++i) {
             if (g_ascii_strcasecmp(scalar(entry), NETPLAN_WIFI_WOWLAN_TYPES[i].name) == 0) {
-                cur_netdef->wowlan |= NETPLAN_WIFI_WOWLAN_TYPES[i].flag;
+                npp->cur_netdef->wowlan |= NETPLAN_WIFI_WOWLAN_TYPES[i].flag;
                 found = TRUE;
                 break;
             }
@@ -962,7 +1224,7 @@ handle_wowlan(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** e
         if (!found)
             return yaml_error(node, error, "invalid value for wakeonwlan: '%s'", scalar(entry));
     }
-    if (cur_netdef->wowlan > NETPLAN_WIFI_WOWLAN_DEFAULT && cur_netdef->wowlan & NETPLAN_WIFI_WOWLAN_TYPES[0].flag)
+    if (npp->cur_netdef->wowlan > NETPLAN_WIFI_WOWLAN_DEFAULT && npp->cur_netdef->wowlan & NETPLAN_WIFI_WOWLAN_TYPES[0].flag)
         return yaml_error(node, error, "'default' is an exclusive flag for wakeonwlan");
     return TRUE;
 }
@@ -972,11 +1234,11 @@ handle_auth(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** err
 {
     gboolean ret;
 
-    cur_netdef->has_auth = TRUE;
+    npp->cur_netdef->has_auth = TRUE;
 
-    cur_auth = &cur_netdef->auth;
+    npp->cur_auth = &npp->cur_netdef->auth;
     ret = process_mapping(doc, node, auth_handlers, NULL, error);
-    cur_auth = NULL;
+    npp->cur_auth = NULL;
 
     return ret;
 }
@@ -988,13 +1250,13 @@ handle_address_option_lifetime(yaml_document_t* doc, yaml_node_t* node, const vo
         g_ascii_strcasecmp(scalar(node), "forever") != 0) {
         return yaml_error(node, error, "invalid lifetime value '%s'", scalar(node));
     }
-    return handle_generic_str(doc, node, cur_addr_option, data, error);
+    return handle_generic_str(doc, node, npp->cur_addr_option, data, error);
 }
 
 static gboolean
 handle_address_option_label(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_generic_str(doc, node, cur_addr_option, data, error);
+    return handle_generic_str(doc, node, npp->cur_addr_option, data, error);
 }
 
 const mapping_entry_handler address_option_handlers[] = {
@@ -1003,20 +1265,94 @@ const mapping_entry_handler address_option_handlers[] = {
     {NULL}
 };
 
+/**
+ * Return the set of address strings in the NetplanAddressOptions @array, from
+ * *@set. It gets built there on first use, e.g. for definitions from the
+ * state cache.
+ */
+static GHashTable*
+address_options_set(GArray* array, GHashTable** set)
+{
+    if (!*set) {
+        *set = g_hash_table_new(g_str_hash, g_str_equal);
+        for (guint i = 0; i < array->len; ++i)
+            g_hash_table_add(*set, g_array_index(array, NetplanAddressOptions*, i)->address);
+    }
+    return *set;
+}
+
+static guint
+ip_prefix_hash(gconstpointer key)
+{
+    const NetplanIPPrefix* ip = key;
+    guint hash = ip->family * 131 + ip->prefix;
+
+    for (guint i = 0; i < sizeof(ip->addr); ++i)
+        hash = hash * 31 + ip->addr[i];
+    return hash;
+}
+
+static gboolean
+ip_prefix_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(NetplanIPPrefix)) == 0;
+}
+
+/**
+ * Return the set of the NetplanIPPrefix of the NetplanAddress @array, like
+ * address_options_set(). The set has copies of them, since the elements of
+ * @array move when it grows.
+ */
+static GHashTable*
+address_set(GArray* array, GHashTable** set)
+{
+    if (!*set) {
+        *set = g_hash_table_new_full(ip_prefix_hash, ip_prefix_equal, g_free, NULL);
+        for (guint i = 0; i < array->len; ++i) {
+            NetplanIPPrefix* ip = g_new(NetplanIPPrefix, 1);
+            *ip = g_array_index(array, NetplanAddress, i).ip;
+            g_hash_table_add(*set, ip);
+        }
+    }
+    return *set;
+}
+
+/**
+ * Append @ip, parsed from @text, to the NetplanAddress array @array, unless
+ * its set *@set says it already contains it (e.g. when parsing the same YAML
+ * again on multiple passes).
+ */
+static void
+append_address(GArray* array, GHashTable** set, const NetplanIPPrefix* ip, const char* text)
+{
+    GHashTable* addresses = address_set(array, set);
+    NetplanAddress address;
+    NetplanIPPrefix* key;
+
+    if (g_hash_table_contains(addresses, ip))
+        return;
+    set_address(&address, ip, text, TRUE);
+    g_array_append_val(array, address);
+    key = g_new(NetplanIPPrefix, 1);
+    *key = *ip;
+    g_hash_table_add(addresses, key);
+}
+
 /*
  * Handler for setting an array of IP addresses from a sequence node, inside a given struct
  * @entryptr: pointer to the beginning of the do-be-modified data structure
  * @data: offset into entryptr struct where the array to write is located
  */
 static gboolean
-handle_generic_addresses(yaml_document_t* doc, yaml_node_t* node, gboolean check_zero_prefix, GArray** ip4, GArray** ip6, GError** error)
+handle_generic_addresses(yaml_document_t* doc, yaml_node_t* node, gboolean check_zero_prefix,
+                         GArray** ip4, GHashTable** ip4_set, GArray** ip6, GHashTable** ip6_set, GError** error)
 {
     g_assert(ip4);
     g_assert(ip6);
     for (yaml_node_item_t *i = node->data.sequence.items.start; i < node->data.sequence.items.top; i++) {
-        g_autofree char* addr = NULL;
-        char* prefix_len;
-        guint64 prefix_len_num;
+        NetplanIPPrefix ip;
+        gboolean valid;
+        GHashTable* options_set;
         yaml_node_t *entry = yaml_document_get_node(doc, *i);
         yaml_node_t *key = NULL;
         yaml_node_t *value = NULL;
@@ -1032,71 +1368,51 @@ handle_generic_addresses(yaml_document_t* doc, yaml_node_t* node, gboolean check
         }
         assert_type(entry, YAML_SCALAR_NODE);
 
-        /* split off /prefix_len */
-        addr = g_strdup(scalar(entry));
-        prefix_len = strrchr(addr, '/');
-        if (!prefix_len)
+        if (!strchr(scalar(entry), '/'))
             return yaml_error(node, error, "address '%s' is missing /prefixlength", scalar(entry));
-        *prefix_len = '\0';
-        prefix_len++; /* skip former '/' into first char of prefix */
-        prefix_len_num = g_ascii_strtoull(prefix_len, NULL, 10);
+        valid = parse_ip_prefix(scalar(entry), &ip);
 
         if (value) {
-            if (!is_ip4_address(addr) && !is_ip6_address(addr))
+            if (!valid)
                 return yaml_error(node, error, "malformed address '%s', must be X.X.X.X/NN or X:X:X:X:X:X:X:X/NN", scalar(entry));
 
-            if (!cur_netdef->address_options)
-                cur_netdef->address_options = g_array_new(FALSE, FALSE, sizeof(NetplanAddressOptions*));
+            if (!npp->cur_netdef->address_options)
+                npp->cur_netdef->address_options = g_array_new(FALSE, FALSE, sizeof(NetplanAddressOptions*));
 
-            for (unsigned i = 0; i < cur_netdef->address_options->len; ++i) {
-                NetplanAddressOptions* opts = g_array_index(cur_netdef->address_options, NetplanAddressOptions*, i);
-                /* check for multi-pass parsing, return early if options for this address already exist */
-                if (!g_strcmp0(scalar(key), opts->address))
-                    return TRUE;
-            }
+            /* check for multi-pass parsing, skip the address if options for it already exist */
+            options_set = address_options_set(npp->cur_netdef->address_options, &npp->cur_netdef->address_options_set);
+            if (g_hash_table_contains(options_set, scalar(key)))
+                continue;
 
-            cur_addr_option = g_new0(NetplanAddressOptions, 1);
-            cur_addr_option->address = g_strdup(scalar(key));
+            npp->cur_addr_option = g_new0(NetplanAddressOptions, 1);
+            npp->cur_addr_option->address = g_strdup(scalar(key));
 
             if (!process_mapping(doc, value, address_option_handlers, NULL, error))
                 return FALSE;
 
-            g_array_append_val(cur_netdef->address_options, cur_addr_option);
+            g_array_append_val(npp->cur_netdef->address_options, npp->cur_addr_option);
+            g_hash_table_add(options_set, npp->cur_addr_option->address);
             continue;
         }
 
         /* is it an IPv4 address? */
-        if (is_ip4_address(addr)) {
-            if ((check_zero_prefix && prefix_len_num == 0) || prefix_len_num > 32)
+        if (ip.family == AF_INET) {
+            if ((check_zero_prefix && ip.prefix == 0) || ip.prefix > 32)
                 return yaml_error(node, error, "invalid prefix length in address '%s'", scalar(entry));
 
             if (!*ip4)
-                *ip4 = g_array_new(FALSE, FALSE, sizeof(char*));
-
-            /* Do not append the same IP (on multiple passes), if it is already contained */
-            for (unsigned i = 0; i < (*ip4)->len; ++i)
-                if (!g_strcmp0(scalar(entry), g_array_index(*ip4, char*, i)))
-                    goto skip_ip4;
-            char* s = g_strdup(scalar(entry));
-            g_array_append_val(*ip4, s);
-skip_ip4:
+                *ip4 = g_array_new(FALSE, FALSE, sizeof(NetplanAddress));
+            append_address(*ip4, ip4_set, &ip, scalar(entry));
             continue;
         }
 
         /* is it an IPv6 address? */
-        if (is_ip6_address(addr)) {
-            if ((check_zero_prefix && prefix_len_num == 0) || prefix_len_num > 128)
+        if (ip.family == AF_INET6) {
+            if ((check_zero_prefix && ip.prefix == 0) || ip.prefix > 128)
                 return yaml_error(node, error, "invalid prefix length in address '%s'", scalar(entry));
             if (!*ip6)
-                *ip6 = g_array_new(FALSE, FALSE, sizeof(char*));
-
-            /* Do not append the same IP (on multiple passes), if it is already contained */
-            for (unsigned i = 0; i < (*ip6)->len; ++i)
-                if (!g_strcmp0(scalar(entry), g_array_index(*ip6, char*, i)))
-                    goto skip_ip6;
-            char* s = g_strdup(scalar(entry));
-            g_array_append_val(*ip6, s);
-skip_ip6:
+                *ip6 = g_array_new(FALSE, FALSE, sizeof(NetplanAddress));
+            append_address(*ip6, ip6_set, &ip, scalar(entry));
             continue;
         }
 
@@ -1109,15 +1425,31 @@ skip_ip6:
 static gboolean
 handle_addresses(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    return handle_generic_addresses(doc, node, TRUE, &(cur_netdef->ip4_addresses), &(cur_netdef->ip6_addresses), error);
+    return handle_generic_addresses(doc, node, TRUE, &(npp->cur_netdef->ip4_addresses), &(npp->cur_netdef->ip4_address_set),
+                                    &(npp->cur_netdef->ip6_addresses), &(npp->cur_netdef->ip6_address_set), error);
+}
+
+/**
+ * Set the gateway @dest to the address @node of @family, unless it is set
+ * already.
+ */
+static gboolean
+handle_gateway(yaml_node_t* node, guint family, NetplanAddress* dest, GError** error)
+{
+    NetplanIPPrefix ip;
+
+    if (!parse_ip_address(scalar(node), &ip) || ip.family != family)
+        return yaml_error(node, error, "invalid IPv%c address '%s'", family == AF_INET ? '4' : '6', scalar(node));
+    if (!dest->ip.family)
+        set_address(dest, &ip, scalar(node), FALSE);
+    return TRUE;
 }
 
 static gboolean
 handle_gateway4(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    if (!is_ip4_address(scalar(node)))
-        return yaml_error(node, error, "invalid IPv4 address '%s'", scalar(node));
-    set_str_if_null(cur_netdef->gateway4, scalar(node));
+    if (!handle_gateway(node, AF_INET, &npp->cur_netdef->gateway4, error))
+        return FALSE;
     g_warning("`gateway4` has been deprecated, use default routes instead.\n"
               "See the 'Default routes' section of the documentation for more details.");
     return TRUE;
@@ -1126,9 +1458,8 @@ handle_gateway4(yaml_document_t* doc, yaml_node_t* node, const void* _, GError**
 static gboolean
 handle_gateway6(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    if (!is_ip6_address(scalar(node)))
-        return yaml_error(node, error, "invalid IPv6 address '%s'", scalar(node));
-    set_str_if_null(cur_netdef->gateway6, scalar(node));
+    if (!handle_gateway(node, AF_INET6, &npp->cur_netdef->gateway6, error))
+        return FALSE;
     g_warning("`gateway6` has been deprecated, use default routes instead.\n"
               "See the 'Default routes' section of the documentation for more details.");
     return TRUE;
@@ -1145,29 +1476,46 @@ handle_wifi_access_points(yaml_document_t* doc, yaml_node_t* node, const void* d
         value = yaml_document_get_node(doc, entry->value);
         assert_type(value, YAML_MAPPING_NODE);
 
-        g_assert(cur_access_point == NULL);
-        cur_access_point = g_new0(NetplanWifiAccessPoint, 1);
-        cur_access_point->ssid = g_strdup(scalar(key));
-        g_debug("%s: adding wifi AP '%s'", cur_netdef->id, cur_access_point->ssid);
+        g_assert(npp->cur_access_point == NULL);
+        npp->cur_access_point = g_new0(NetplanWifiAccessPoint, 1);
+        npp->cur_access_point->ssid = g_strdup(scalar(key));
+        g_debug("%s: adding wifi AP '%s'", npp->cur_netdef->id, npp->cur_access_point->ssid);
 
-        if (!cur_netdef->access_points)
-            cur_netdef->access_points = g_hash_table_new(g_str_hash, g_str_equal);
-        if (!g_hash_table_insert(cur_netdef->access_points, cur_access_point->ssid, cur_access_point)) {
+        if (!npp->cur_netdef->access_points)
+            npp->cur_netdef->access_points = g_hash_table_new(g_str_hash, g_str_equal);
+        if (!g_hash_table_insert(npp->cur_netdef->access_points, npp->cur_access_point->ssid, npp->cur_access_point)) {
             /* Even in the error case, NULL out cur_access_point. Otherwise we
              * have an assert failure if we do a multi-pass parse. */
             gboolean ret;
 
-            ret = yaml_error(key, error, "%s: Duplicate access point SSID '%s'", cur_netdef->id, cur_access_point->ssid);
-            cur_access_point = NULL;
+            ret = yaml_error(key, error, "%s: Duplicate access point SSID '%s'", npp->cur_netdef->id, npp->cur_access_point->ssid);
+            npp->cur_access_point = NULL;
             return ret;
         }
 
         if (!process_mapping(doc, value, wifi_access_point_handlers, NULL, error)) {
-            cur_access_point = NULL;
+            npp->cur_access_point = NULL;
             return FALSE;
         }
 
-        cur_access_point = NULL;
+        npp->cur_access_point = NULL;
+    }
+    return TRUE;
+}
+
+static gboolean
+resolve_bridge_interface(const NetplanDeferredRef* ref, NetplanNetDefinition* component, GError** error)
+{
+    if (component->bridge && g_strcmp0(component->bridge, npp->cur_netdef->id) != 0)
+        return yaml_error(ref->context, error, "%s: interface '%s' is already assigned to bridge %s",
+                          npp->cur_netdef->id, scalar(ref->node), component->bridge);
+    if (component->bond)
+        return yaml_error(ref->context, error, "%s: interface '%s' is already assigned to bond %s",
+                          npp->cur_netdef->id, scalar(ref->node), component->bond);
+    set_str_if_null(component->bridge, npp->cur_netdef->id);
+    if (component->backend == NETPLAN_BACKEND_OVS) {
+        g_debug("%s: Bridge contains openvswitch interface, choosing OVS backend", npp->cur_netdef->id);
+        npp->cur_netdef->backend = NETPLAN_BACKEND_OVS;
     }
     return TRUE;
 }
@@ -1180,28 +1528,12 @@ handle_wifi_access_points(yaml_document_t* doc, yaml_node_t* node, const void* d
 static gboolean
 handle_bridge_interfaces(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    /* all entries must refer to already defined IDs */
+    /* all entries must refer to IDs defined somewhere in the document */
     for (yaml_node_item_t *i = node->data.sequence.items.start; i < node->data.sequence.items.top; i++) {
         yaml_node_t *entry = yaml_document_get_node(doc, *i);
-        NetplanNetDefinition *component;
 
         assert_type(entry, YAML_SCALAR_NODE);
-        component = g_hash_table_lookup(netdefs, scalar(entry));
-        if (!component) {
-            add_missing_node(entry);
-        } else {
-            if (component->bridge && g_strcmp0(component->bridge, cur_netdef->id) != 0)
-                return yaml_error(node, error, "%s: interface '%s' is already assigned to bridge %s",
-                                  cur_netdef->id, scalar(entry), component->bridge);
-            if (component->bond)
-                return yaml_error(node, error, "%s: interface '%s' is already assigned to bond %s",
-                                  cur_netdef->id, scalar(entry), component->bond);
-            set_str_if_null(component->bridge, cur_netdef->id);
-            if (component->backend == NETPLAN_BACKEND_OVS) {
-                g_debug("%s: Bridge contains openvswitch interface, choosing OVS backend", cur_netdef->id);
-                cur_netdef->backend = NETPLAN_BACKEND_OVS;
-            }
-        }
+        add_deferred_ref(resolve_bridge_interface, entry, NULL, node, NULL);
     }
 
     return TRUE;
@@ -1230,13 +1562,30 @@ handle_bond_mode(yaml_document_t* doc, yaml_node_t* node, const void* data, GErr
     if (!strcmp(scalar(node), "balance-tcp") ||
         !strcmp(scalar(node), "balance-slb")) {
         g_debug("%s: mode '%s' only supported with openvswitch, choosing this backend",
-                cur_netdef->id, scalar(node));
-        cur_netdef->backend = NETPLAN_BACKEND_OVS;
+                npp->cur_netdef->id, scalar(node));
+        npp->cur_netdef->backend = NETPLAN_BACKEND_OVS;
     }
 
     return handle_netdef_str(doc, node, data, error);
 }
 
+static gboolean
+resolve_bond_interface(const NetplanDeferredRef* ref, NetplanNetDefinition* component, GError** error)
+{
+    if (component->bridge)
+        return yaml_error(ref->context, error, "%s: interface '%s' is already assigned to bridge %s",
+                          npp->cur_netdef->id, scalar(ref->node), component->bridge);
+    if (component->bond && g_strcmp0(component->bond, npp->cur_netdef->id) != 0)
+        return yaml_error(ref->context, error, "%s: interface '%s' is already assigned to bond %s",
+                          npp->cur_netdef->id, scalar(ref->node), component->bond);
+    component->bond = g_strdup(npp->cur_netdef->id);
+    if (component->backend == NETPLAN_BACKEND_OVS) {
+        g_debug("%s: Bond contains openvswitch interface, choosing OVS backend", npp->cur_netdef->id);
+        npp->cur_netdef->backend = NETPLAN_BACKEND_OVS;
+    }
+    return TRUE;
+}
+
 /**
  * Handler for bond "interfaces:" list.
  * @data: ignored
@@ -1244,28 +1593,12 @@ handle_bond_mode(yaml_document_t* doc, yaml_node_t* node, const void* data, GErr
 static gboolean
 handle_bond_interfaces(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    /* all entries must refer to already defined IDs */
+    /* all entries must refer to IDs defined somewhere in the document */
     for (yaml_node_item_t *i = node->data.sequence.items.start; i < node->data.sequence.items.top; i++) {
         yaml_node_t *entry = yaml_document_get_node(doc, *i);
-        NetplanNetDefinition *component;
 
         assert_type(entry, YAML_SCALAR_NODE);
-        component = g_hash_table_lookup(netdefs, scalar(entry));
-        if (!component) {
-            add_missing_node(entry);
-        } else {
-            if (component->bridge)
-                return yaml_error(node, error, "%s: interface '%s' is already assigned to bridge %s",
-                                  cur_netdef->id, scalar(entry), component->bridge);
-            if (component->bond && g_strcmp0(component->bond, cur_netdef->id) != 0)
-                return yaml_error(node, error, "%s: interface '%s' is already assigned to bond %s",
-                                  cur_netdef->id, scalar(entry), component->bond);
-            component->bond = g_strdup(cur_netdef->id);
-            if (component->backend == NETPLAN_BACKEND_OVS) {
-                g_debug("%s: Bond contains openvswitch interface, choosing OVS backend", cur_netdef->id);
-                cur_netdef->backend = NETPLAN_BACKEND_OVS;
-            }
-        }
+        add_deferred_ref(resolve_bond_interface, entry, NULL, node, NULL);
     }
 
     return TRUE;
@@ -1278,10 +1611,10 @@ handle_nameservers_search(yaml_document_t* doc, yaml_node_t* node, const void* _
     for (yaml_node_item_t *i = node->data.sequence.items.start; i < node->data.sequence.items.top; i++) {
         yaml_node_t *entry = yaml_document_get_node(doc, *i);
         assert_type(entry, YAML_SCALAR_NODE);
-        if (!cur_netdef->search_domains)
-            cur_netdef->search_domains = g_array_new(FALSE, FALSE, sizeof(char*));
+        if (!npp->cur_netdef->search_domains)
+            npp->cur_netdef->search_domains = g_array_new(FALSE, FALSE, sizeof(char*));
         char* s = g_strdup(scalar(entry));
-        g_array_append_val(cur_netdef->search_domains, s);
+        g_array_append_val(npp->cur_netdef->search_domains, s);
     }
     return TRUE;
 }
@@ -1291,23 +1624,26 @@ handle_nameservers_addresses(yaml_document_t* doc, yaml_node_t* node, const void
 {
     for (yaml_node_item_t *i = node->data.sequence.items.start; i < node->data.sequence.items.top; i++) {
         yaml_node_t *entry = yaml_document_get_node(doc, *i);
+        NetplanIPPrefix ip;
+        NetplanAddress address;
         assert_type(entry, YAML_SCALAR_NODE);
+        parse_ip_address(scalar(entry), &ip);
 
         /* is it an IPv4 address? */
-        if (is_ip4_address(scalar(entry))) {
-            if (!cur_netdef->ip4_nameservers)
-                cur_netdef->ip4_nameservers = g_array_new(FALSE, FALSE, sizeof(char*));
-            char* s = g_strdup(scalar(entry));
-            g_array_append_val(cur_netdef->ip4_nameservers, s);
+        if (ip.family == AF_INET) {
+            if (!npp->cur_netdef->ip4_nameservers)
+                npp->cur_netdef->ip4_nameservers = g_array_new(FALSE, FALSE, sizeof(NetplanAddress));
+            set_address(&address, &ip, scalar(entry), FALSE);
+            g_array_append_val(npp->cur_netdef->ip4_nameservers, address);
             continue;
         }
 
         /* is it an IPv6 address? */
-        if (is_ip6_address(scalar(entry))) {
-            if (!cur_netdef->ip6_nameservers)
-                cur_netdef->ip6_nameservers = g_array_new(FALSE, FALSE, sizeof(char*));
-            char* s = g_strdup(scalar(entry));
-            g_array_append_val(cur_netdef->ip6_nameservers, s);
+        if (ip.family == AF_INET6) {
+            if (!npp->cur_netdef->ip6_nameservers)
+                npp->cur_netdef->ip6_nameservers = g_array_new(FALSE, FALSE, sizeof(NetplanAddress));
+            set_address(&address, &ip, scalar(entry), FALSE);
+            g_array_append_val(npp->cur_netdef->ip6_nameservers, address);
             continue;
         }
 
@@ -1336,8 +1672,8 @@ handle_link_local(yaml_document_t* doc, yaml_node_t* node, const void* _, GError
             return yaml_error(node, error, "invalid value for link-local: '%s'", scalar(entry));
     }
 
-    cur_netdef->linklocal.ipv4 = ipv4;
-    cur_netdef->linklocal.ipv6 = ipv6;
+    npp->cur_netdef->linklocal.ipv4 = ipv4;
+    npp->cur_netdef->linklocal.ipv6 = ipv6;
 
     return TRUE;
 }
@@ -1361,7 +1697,7 @@ handle_optional_addresses(yaml_document_t* doc, yaml_node_t* node, const void* _
 
         for (unsigned i = 0; NETPLAN_OPTIONAL_ADDRESS_TYPES[i].name != NULL; ++i) {
             if (g_ascii_strcasecmp(scalar(entry), NETPLAN_OPTIONAL_ADDRESS_TYPES[i].name) == 0) {
-                cur_netdef->optional_addresses |= NETPLAN_OPTIONAL_ADDRESS_TYPES[i].flag;
+                npp->cur_netdef->optional_addresses |= NETPLAN_OPTIONAL_ADDRESS_TYPES[i].flag;
                 found = TRUE;
                 break;
             }
@@ -1373,26 +1709,6 @@ handle_optional_addresses(yaml_document_t* doc, yaml_node_t* node, const void* _
     return TRUE;
 }
 
-static int
-get_ip_family(const char* address)
-{
-    g_autofree char *ip_str;
-    char *prefix_len;
-
-    ip_str = g_strdup(address);
-    prefix_len = strrchr(ip_str, '/');
-    if (prefix_len)
-        *prefix_len = '\0';
-
-    if (is_ip4_address(ip_str))
-        return AF_INET;
-
-    if (is_ip6_address(ip_str))
-        return AF_INET6;
-
-    return -1;
-}
-
 static gboolean
 check_and_set_family(int family, guint* dest)
 {
@@ -1409,56 +1725,65 @@ check_and_set_family(int family, guint* dest)
 static gboolean
 handle_routes_bool(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    g_assert(cur_route);
-    return handle_generic_bool(doc, node, cur_route, data, error);
+    g_assert(npp->cur_route);
+    return handle_generic_bool(doc, node, npp->cur_route, data, error);
 }
 
 static gboolean
 handle_routes_scope(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    if (cur_route->scope)
-        g_free(cur_route->scope);
-    cur_route->scope = g_strdup(scalar(node));
+    if (npp->cur_route->scope)
+        g_free(npp->cur_route->scope);
+    npp->cur_route->scope = g_strdup(scalar(node));
 
-    if (g_ascii_strcasecmp(cur_route->scope, "global") == 0 ||
-        g_ascii_strcasecmp(cur_route->scope, "link") == 0 ||
-        g_ascii_strcasecmp(cur_route->scope, "host") == 0)
+    if (g_ascii_strcasecmp(npp->cur_route->scope, "global") == 0 ||
+        g_ascii_strcasecmp(npp->cur_route->scope, "link") == 0 ||
+        g_ascii_strcasecmp(npp->cur_route->scope, "host") == 0)
         return TRUE;
 
-    return yaml_error(node, error, "invalid route scope '%s'", cur_route->scope);
+    return yaml_error(node, error, "invalid route scope '%s'", npp->cur_route->scope);
 }
 
 static gboolean
 handle_routes_type(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    if (cur_route->type)
-        g_free(cur_route->type);
-    cur_route->type = g_strdup(scalar(node));
-
-    if (g_ascii_strcasecmp(cur_route->type, "unicast") == 0 ||
-        g_ascii_strcasecmp(cur_route->type, "unreachable") == 0 ||
-        g_ascii_strcasecmp(cur_route->type, "blackhole") == 0 ||
-        g_ascii_strcasecmp(cur_route->type, "prohibit") == 0)
+    if (npp->cur_route->type)
+        g_free(npp->cur_route->type);
+    npp->cur_route->type = g_strdup(scalar(node));
+
+    if (g_ascii_strcasecmp(npp->cur_route->type, "unicast") == 0 ||
+        g_ascii_strcasecmp(npp->cur_route->type, "unreachable") == 0 ||
+        g_ascii_strcasecmp(npp->cur_route->type, "blackhole") == 0 ||
+        g_ascii_strcasecmp(npp->cur_route->type, "prohibit") == 0)
         return TRUE;
 
-    return yaml_error(node, error, "invalid route type '%s'", cur_route->type);
+    return yaml_error(node, error, "invalid route type '%s'", npp->cur_route->type);
 }
 
 static gboolean
 handle_routes_ip(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
     guint offset = GPOINTER_TO_UINT(data);
-    int family = get_ip_family(scalar(node));
-    char** dest = (char**) ((void*) cur_route + offset);
+    char** dest = (char**) ((void*) npp->cur_route + offset);
+    NetplanIPPrefix* dest_ip;
+    NetplanIPPrefix ip;
 
-    if (family < 0)
-        return yaml_error(node, error, "invalid IP family '%d'", family);
+    if (!parse_ip_prefix(scalar(node), &ip))
+        return yaml_error(node, error, "invalid IP family '%d'", -1);
 
-    if (!check_and_set_family(family, &cur_route->family))
+    if (!check_and_set_family(ip.family, &npp->cur_route->family))
         return yaml_error(node, error, "IP family mismatch in route to %s", scalar(node));
 
+    if (offset == offsetof(NetplanIPRoute, to))
+        dest_ip = &npp->cur_route->to_ip;
+    else if (offset == offsetof(NetplanIPRoute, from))
+        dest_ip = &npp->cur_route->from_ip;
+    else
+        dest_ip = &npp->cur_route->via_ip;
+
     g_free(*dest);
     *dest = g_strdup(scalar(node));
+    *dest_ip = ip;
 
     return TRUE;
 }
@@ -1469,7 +1794,7 @@ handle_routes_destination(yaml_document_t *doc, yaml_node_t *node, const void *d
     const char *addr = scalar(node);
     if (g_strcmp0(addr, "default") != 0)
         return handle_routes_ip(doc, node, route_offset(to), error);
-    set_str_if_null(cur_route->to, addr);
+    set_str_if_null(npp->cur_route->to, addr);
     return TRUE;
 }
 
@@ -1477,17 +1802,21 @@ static gboolean
 handle_ip_rule_ip(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
     guint offset = GPOINTER_TO_UINT(data);
-    int family = get_ip_family(scalar(node));
-    char** dest = (char**) ((void*) cur_ip_rule + offset);
+    char** dest = (char**) ((void*) npp->cur_ip_rule + offset);
+    NetplanIPPrefix ip;
 
-    if (family < 0)
-        return yaml_error(node, error, "invalid IP family '%d'", family);
+    if (!parse_ip_prefix(scalar(node), &ip))
+        return yaml_error(node, error, "invalid IP family '%d'", -1);
 
-    if (!check_and_set_family(family, &cur_ip_rule->family))
+    if (!check_and_set_family(ip.family, &npp->cur_ip_rule->family))
         return yaml_error(node, error, "IP family mismatch in route to %s", scalar(node));
 
     g_free(*dest);
     *dest = g_strdup(scalar(node));
+    if (offset == offsetof(NetplanIPRule, to))
+        npp->cur_ip_rule->to_ip = ip;
+    else
+        npp->cur_ip_rule->from_ip = ip;
 
     return TRUE;
 }
@@ -1495,22 +1824,22 @@ handle_ip_rule_ip(yaml_document_t* doc, yaml_node_t* node, const void* data, GEr
 static gboolean
 handle_ip_rule_guint(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    g_assert(cur_ip_rule);
-    return handle_generic_guint(doc, node, cur_ip_rule, data, error);
+    g_assert(npp->cur_ip_rule);
+    return handle_generic_guint(doc, node, npp->cur_ip_rule, data, error);
 }
 
 static gboolean
 handle_routes_guint(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    g_assert(cur_route);
-    return handle_generic_guint(doc, node, cur_route, data, error);
+    g_assert(npp->cur_route);
+    return handle_generic_guint(doc, node, npp->cur_route, data, error);
 }
 
 static gboolean
 handle_ip_rule_tos(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    gboolean ret = handle_generic_guint(doc, node, cur_ip_rule, data, error);
-    if (cur_ip_rule->tos > 255)
+    gboolean ret = handle_generic_guint(doc, node, npp->cur_ip_rule, data, error);
+    if (npp->cur_ip_rule->tos > 255)
         return yaml_error(node, error, "invalid ToS (must be between 0 and 255): %s", scalar(node));
     return ret;
 }
@@ -1519,39 +1848,64 @@ handle_ip_rule_tos(yaml_document_t* doc, yaml_node_t* node, const void* data, GE
  * Grammar and handlers for network config "bridge_params" entry
  ****************************************************/
 
+static gboolean
+resolve_bridge_path_cost(const NetplanDeferredRef* ref, NetplanNetDefinition* component, GError** error)
+{
+    guint v;
+    gchar* endptr;
+    guint* ref_ptr;
+
+    ref_ptr = ((guint*) ((void*) component + GPOINTER_TO_UINT(ref->data)));
+    if (*ref_ptr)
+        return yaml_error(ref->context, error, "%s: interface '%s' already has a path cost of %u",
+                          npp->cur_netdef->id, scalar(ref->node), *ref_ptr);
+
+    v = g_ascii_strtoull(scalar(ref->value), &endptr, 10);
+    if (*endptr != '\0' || v > G_MAXUINT)
+        return yaml_error(ref->context, error, "invalid unsigned int value '%s'", scalar(ref->value));
+
+    g_debug("%s: adding path '%s' of cost: %d", npp->cur_netdef->id, scalar(ref->node), v);
+
+    *ref_ptr = v;
+    return TRUE;
+}
+
 static gboolean
 handle_bridge_path_cost(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
     for (yaml_node_pair_t* entry = node->data.mapping.pairs.start; entry < node->data.mapping.pairs.top; entry++) {
         yaml_node_t* key, *value;
-        guint v;
-        gchar* endptr;
-        NetplanNetDefinition *component;
-        guint* ref_ptr;
 
         key = yaml_document_get_node(doc, entry->key);
         assert_type(key, YAML_SCALAR_NODE);
         value = yaml_document_get_node(doc, entry->value);
         assert_type(value, YAML_SCALAR_NODE);
 
-        component = g_hash_table_lookup(netdefs, scalar(key));
-        if (!component) {
-            add_missing_node(key);
-        } else {
-            ref_ptr = ((guint*) ((void*) component + GPOINTER_TO_UINT(data)));
-            if (*ref_ptr)
-                return yaml_error(node, error, "%s: interface '%s' already has a path cost of %u",
-                                  cur_netdef->id, scalar(key), *ref_ptr);
+        add_deferred_ref(resolve_bridge_path_cost, key, value, node, data);
+    }
+    return TRUE;
+}
+
+static gboolean
+resolve_bridge_port_priority(const NetplanDeferredRef* ref, NetplanNetDefinition* component, GError** error)
+{
+    guint v;
+    gchar* endptr;
+    guint* ref_ptr;
 
-            v = g_ascii_strtoull(scalar(value), &endptr, 10);
-            if (*endptr != '\0' || v > G_MAXUINT)
-                return yaml_error(node, error, "invalid unsigned int value '%s'", scalar(value));
+    ref_ptr = ((guint*) ((void*) component + GPOINTER_TO_UINT(ref->data)));
+    if (*ref_ptr)
+        return yaml_error(ref->context, error, "%s: interface '%s' already has a port priority of %u",
+                          npp->cur_netdef->id, scalar(ref->node), *ref_ptr);
 
-            g_debug("%s: adding path '%s' of cost: %d", cur_netdef->id, scalar(key), v);
+    v = g_ascii_strtoull(scalar(ref->value), &endptr, 10);
+    if (*endptr != '\0' || v > 63)
+        return yaml_error(ref->context, error, "invalid port priority value (must be between 0 and 63): %s",
+                          scalar(ref->value));
 
-            *ref_ptr = v;
-        }
-    }
+    g_debug("%s: adding port '%s' of priority: %d", npp->cur_netdef->id, scalar(ref->node), v);
+
+    *ref_ptr = v;
     return TRUE;
 }
 
@@ -1560,34 +1914,13 @@ handle_bridge_port_priority(yaml_document_t* doc, yaml_node_t* node, const void*
 {
     for (yaml_node_pair_t* entry = node->data.mapping.pairs.start; entry < node->data.mapping.pairs.top; entry++) {
         yaml_node_t* key, *value;
-        guint v;
-        gchar* endptr;
-        NetplanNetDefinition *component;
-        guint* ref_ptr;
 
         key = yaml_document_get_node(doc, entry->key);
         assert_type(key, YAML_SCALAR_NODE);
         value = yaml_document_get_node(doc, entry->value);
         assert_type(value, YAML_SCALAR_NODE);
 
-        component = g_hash_table_lookup(netdefs, scalar(key));
-        if (!component) {
-            add_missing_node(key);
-        } else {
-            ref_ptr = ((guint*) ((void*) component + GPOINTER_TO_UINT(data)));
-            if (*ref_ptr)
-                return yaml_error(node, error, "%s: interface '%s' already has a port priority of %u",
-                                  cur_netdef->id, scalar(key), *ref_ptr);
-
-            v = g_ascii_strtoull(scalar(value), &endptr, 10);
-            if (*endptr != '\0' || v > 63)
-                return yaml_error(node, error, "invalid port priority value (must be between 0 and 63): %s",
-                                  scalar(value));
-
-            g_debug("%s: adding port '%s' of priority: %d", cur_netdef->id, scalar(key), v);
-
-            *ref_ptr = v;
-        }
+        add_deferred_ref(resolve_bridge_port_priority, key, value, node, data);
     }
     return TRUE;
 }
@@ -1607,8 +1940,8 @@ static const mapping_entry_handler bridge_params_handlers[] = {
 static gboolean
 handle_bridge(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    cur_netdef->custom_bridging = TRUE;
-    cur_netdef->bridge_params.stp = TRUE;
+    npp->cur_netdef->custom_bridging = TRUE;
+    npp->cur_netdef->bridge_params.stp = TRUE;
     return process_mapping(doc, node, bridge_params_handlers, NULL, error);
 }
 
@@ -1631,66 +1964,73 @@ static const mapping_entry_handler routes_handlers[] = {
     {NULL}
 };
 
+/**
+ * Handle the route @entry of the "routes:" sequence @node.
+ */
 static gboolean
-handle_routes(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
+handle_route(yaml_document_t* doc, yaml_node_t* node, yaml_node_t* entry, GError** error)
 {
-    if (!cur_netdef->routes)
-        cur_netdef->routes = g_array_new(FALSE, TRUE, sizeof(NetplanIPRoute*));
-
-    /* Avoid adding the same routes in a 2nd parsing pass by comparing
-     * the array size to the YAML sequence size. Skip if they are equal. */
-    guint item_count = node->data.sequence.items.top - node->data.sequence.items.start;
-    if (cur_netdef->routes->len == item_count) {
-        g_debug("%s: all routes have already been added", cur_netdef->id);
-        return TRUE;
+    assert_type(entry, YAML_MAPPING_NODE);
+
+    if (!npp->cur_netdef->routes)
+        npp->cur_netdef->routes = g_array_new(FALSE, TRUE, sizeof(NetplanIPRoute*));
+
+    g_assert(npp->cur_route == NULL);
+    npp->cur_route = g_new0(NetplanIPRoute, 1);
+    npp->cur_route->type = g_strdup("unicast");
+    npp->cur_route->scope = g_strdup("global");
+    npp->cur_route->family = G_MAXUINT; /* 0 is a valid family ID */
+    npp->cur_route->metric = NETPLAN_METRIC_UNSPEC; /* 0 is a valid metric */
+    npp->cur_route->table = NETPLAN_ROUTE_TABLE_UNSPEC;
+    g_debug("%s: adding new route", npp->cur_netdef->id);
+
+    if (!process_mapping(doc, entry, routes_handlers, NULL, error))
+        goto err;
+
+    /* "default" has no address of its own, but takes the family of the others */
+    if (npp->cur_route->to && !npp->cur_route->to_ip.family && npp->cur_route->family != G_MAXUINT)
+        npp->cur_route->to_ip.family = npp->cur_route->family;
+
+    if (       (   g_ascii_strcasecmp(npp->cur_route->scope, "link") == 0
+                || g_ascii_strcasecmp(npp->cur_route->scope, "host") == 0)
+            && !npp->cur_route->to) {
+        yaml_error(node, error, "link and host routes must specify a 'to' IP");
+        goto err;
+    } else if (  g_ascii_strcasecmp(npp->cur_route->type, "unicast") == 0
+            && g_ascii_strcasecmp(npp->cur_route->scope, "global") == 0
+            && (!npp->cur_route->to || !npp->cur_route->via)) {
+        yaml_error(node, error, "unicast route must include both a 'to' and 'via' IP");
+        goto err;
+    } else if (g_ascii_strcasecmp(npp->cur_route->type, "unicast") != 0 && !npp->cur_route->to) {
+        yaml_error(node, error, "non-unicast routes must specify a 'to' IP");
+        goto err;
     }
 
-    for (yaml_node_item_t *i = node->data.sequence.items.start; i < node->data.sequence.items.top; i++) {
-        yaml_node_t *entry = yaml_document_get_node(doc, *i);
-        assert_type(entry, YAML_MAPPING_NODE);
-
-        g_assert(cur_route == NULL);
-        cur_route = g_new0(NetplanIPRoute, 1);
-        cur_route->type = g_strdup("unicast");
-        cur_route->scope = g_strdup("global");
-        cur_route->family = G_MAXUINT; /* 0 is a valid family ID */
-        cur_route->metric = NETPLAN_METRIC_UNSPEC; /* 0 is a valid metric */
-        cur_route->table = NETPLAN_ROUTE_TABLE_UNSPEC;
-        g_debug("%s: adding new route", cur_netdef->id);
-
-        if (!process_mapping(doc, entry, routes_handlers, NULL, error))
-            goto err;
-
-        if (       (   g_ascii_strcasecmp(cur_route->scope, "link") == 0
-                    || g_ascii_strcasecmp(cur_route->scope, "host") == 0)
-                && !cur_route->to) {
-            yaml_error(node, error, "link and host routes must specify a 'to' IP");
-            goto err;
-        } else if (  g_ascii_strcasecmp(cur_route->type, "unicast") == 0
-                && g_ascii_strcasecmp(cur_route->scope, "global") == 0
-                && (!cur_route->to || !cur_route->via)) {
-            yaml_error(node, error, "unicast route must include both a 'to' and 'via' IP");
-            goto err;
-        } else if (g_ascii_strcasecmp(cur_route->type, "unicast") != 0 && !cur_route->to) {
-            yaml_error(node, error, "non-unicast routes must specify a 'to' IP");
-            goto err;
-        }
-
-        g_array_append_val(cur_netdef->routes, cur_route);
-        cur_route = NULL;
-    }
+    g_array_append_val(npp->cur_netdef->routes, npp->cur_route);
+    npp->cur_route = NULL;
     return TRUE;
 
 err:
-    if (cur_route) {
-        g_free(cur_route);
-        cur_route = NULL;
-    }
+    g_free(npp->cur_route);
+    npp->cur_route = NULL;
     return FALSE;
 }
 
-static const mapping_entry_handler ip_rules_handlers[] = {
-    {"from", YAML_SCALAR_NODE, handle_ip_rule_ip, NULL, ip_rule_offset(from)},
+static gboolean
+handle_routes(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
+{
+    if (!npp->cur_netdef->routes)
+        npp->cur_netdef->routes = g_array_new(FALSE, TRUE, sizeof(NetplanIPRoute*));
+
+    for (yaml_node_item_t *i = node->data.sequence.items.start; i < node->data.sequence.items.top; i++) {
+        if (!handle_route(doc, node, yaml_document_get_node(doc, *i), error))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static const mapping_entry_handler ip_rules_handlers[] = {
+    {"from", YAML_SCALAR_NODE, handle_ip_rule_ip, NULL, ip_rule_offset(from)},
     {"mark", YAML_SCALAR_NODE, handle_ip_rule_guint, NULL, ip_rule_offset(fwmark)},
     {"priority", YAML_SCALAR_NODE, handle_ip_rule_guint, NULL, ip_rule_offset(priority)},
     {"table", YAML_SCALAR_NODE, handle_ip_rule_guint, NULL, ip_rule_offset(table)},
@@ -1699,33 +2039,40 @@ static const mapping_entry_handler ip_rules_handlers[] = {
     {NULL}
 };
 
+/**
+ * Handle the rule @entry of the "routing-policy:" sequence @node.
+ */
 static gboolean
-handle_ip_rules(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
+handle_ip_rule(yaml_document_t* doc, yaml_node_t* node, yaml_node_t* entry, GError** error)
 {
-    for (yaml_node_item_t *i = node->data.sequence.items.start; i < node->data.sequence.items.top; i++) {
-        yaml_node_t *entry = yaml_document_get_node(doc, *i);
-
-        cur_ip_rule = g_new0(NetplanIPRule, 1);
-        cur_ip_rule->family = G_MAXUINT; /* 0 is a valid family ID */
-        cur_ip_rule->priority = NETPLAN_IP_RULE_PRIO_UNSPEC;
-        cur_ip_rule->table = NETPLAN_ROUTE_TABLE_UNSPEC;
-        cur_ip_rule->tos = NETPLAN_IP_RULE_TOS_UNSPEC;
-        cur_ip_rule->fwmark = NETPLAN_IP_RULE_FW_MARK_UNSPEC;
+    npp->cur_ip_rule = g_new0(NetplanIPRule, 1);
+    npp->cur_ip_rule->family = G_MAXUINT; /* 0 is a valid family ID */
+    npp->cur_ip_rule->priority = NETPLAN_IP_RULE_PRIO_UNSPEC;
+    npp->cur_ip_rule->table = NETPLAN_ROUTE_TABLE_UNSPEC;
+    npp->cur_ip_rule->tos = NETPLAN_IP_RULE_TOS_UNSPEC;
+    npp->cur_ip_rule->fwmark = NETPLAN_IP_RULE_FW_MARK_UNSPEC;
+
+    if (process_mapping(doc, entry, ip_rules_handlers, NULL, error)) {
+        if (!npp->cur_netdef->ip_rules) {
+            npp->cur_netdef->ip_rules = g_array_new(FALSE, FALSE, sizeof(NetplanIPRule*));
+        }
 
-        if (process_mapping(doc, entry, ip_rules_handlers, NULL, error)) {
-            if (!cur_netdef->ip_rules) {
-                cur_netdef->ip_rules = g_array_new(FALSE, FALSE, sizeof(NetplanIPRule*));
-            }
+        g_array_append_val(npp->cur_netdef->ip_rules, npp->cur_ip_rule);
+    }
 
-            g_array_append_val(cur_netdef->ip_rules, cur_ip_rule);
-        }
+    if (!npp->cur_ip_rule->from && !npp->cur_ip_rule->to)
+        return yaml_error(node, error, "IP routing policy must include either a 'from' or 'to' IP");
 
-        if (!cur_ip_rule->from && !cur_ip_rule->to)
-            return yaml_error(node, error, "IP routing policy must include either a 'from' or 'to' IP");
+    npp->cur_ip_rule = NULL;
 
-        cur_ip_rule = NULL;
+    return !(error && *error);
+}
 
-        if (error && *error)
+static gboolean
+handle_ip_rules(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
+{
+    for (yaml_node_item_t *i = node->data.sequence.items.start; i < node->data.sequence.items.top; i++) {
+        if (!handle_ip_rule(doc, node, yaml_document_get_node(doc, *i), error))
             return FALSE;
     }
     return TRUE;
@@ -1738,15 +2085,15 @@ handle_ip_rules(yaml_document_t* doc, yaml_node_t* node, const void* _, GError**
 static gboolean
 handle_arp_ip_targets(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    if (!cur_netdef->bond_params.arp_ip_targets) {
-        cur_netdef->bond_params.arp_ip_targets = g_array_new(FALSE, FALSE, sizeof(char *));
+    if (!npp->cur_netdef->bond_params.arp_ip_targets) {
+        npp->cur_netdef->bond_params.arp_ip_targets = g_array_new(FALSE, FALSE, sizeof(char *));
     }
 
     /* Avoid adding the same arp_ip_targets in a 2nd parsing pass by comparing
      * the array size to the YAML sequence size. Skip if they are equal. */
     guint item_count = node->data.sequence.items.top - node->data.sequence.items.start;
-    if (cur_netdef->bond_params.arp_ip_targets->len == item_count) {
-        g_debug("%s: all arp ip targets have already been added", cur_netdef->id);
+    if (npp->cur_netdef->bond_params.arp_ip_targets->len == item_count) {
+        g_debug("%s: all arp ip targets have already been added", npp->cur_netdef->id);
         return TRUE;
     }
 
@@ -1760,7 +2107,7 @@ handle_arp_ip_targets(yaml_document_t* doc, yaml_node_t* node, const void* _, GE
         /* is it an IPv4 address? */
         if (is_ip4_address(addr)) {
             char* s = g_strdup(scalar(entry));
-            g_array_append_val(cur_netdef->bond_params.arp_ip_targets, s);
+            g_array_append_val(npp->cur_netdef->bond_params.arp_ip_targets, s);
             continue;
         }
 
@@ -1771,30 +2118,31 @@ handle_arp_ip_targets(yaml_document_t* doc, yaml_node_t* node, const void* _, GE
 }
 
 static gboolean
-handle_bond_primary_slave(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
+resolve_bond_primary_slave(const NetplanDeferredRef* ref, NetplanNetDefinition* component, GError** error)
 {
-    NetplanNetDefinition *component;
     char** ref_ptr;
 
-    component = g_hash_table_lookup(netdefs, scalar(node));
-    if (!component) {
-        add_missing_node(node);
-    } else {
-        /* If this is not the primary pass, the primary slave might already be equally set. */
-        if (!g_strcmp0(cur_netdef->bond_params.primary_slave, scalar(node))) {
-            return TRUE;
-        } else if (cur_netdef->bond_params.primary_slave)
-            return yaml_error(node, error, "%s: bond already has a primary slave: %s",
-                              cur_netdef->id, cur_netdef->bond_params.primary_slave);
+    /* A drop-in file might set the same primary slave again. */
+    if (!g_strcmp0(npp->cur_netdef->bond_params.primary_slave, scalar(ref->node))) {
+        return TRUE;
+    } else if (npp->cur_netdef->bond_params.primary_slave)
+        return yaml_error(ref->context, error, "%s: bond already has a primary slave: %s",
+                          npp->cur_netdef->id, npp->cur_netdef->bond_params.primary_slave);
 
-        ref_ptr = ((char**) ((void*) component + GPOINTER_TO_UINT(data)));
-        *ref_ptr = g_strdup(scalar(node));
-        cur_netdef->bond_params.primary_slave = g_strdup(scalar(node));
-    }
+    ref_ptr = ((char**) ((void*) component + GPOINTER_TO_UINT(ref->data)));
+    *ref_ptr = g_strdup(scalar(ref->node));
+    npp->cur_netdef->bond_params.primary_slave = g_strdup(scalar(ref->node));
 
     return TRUE;
 }
 
+static gboolean
+handle_bond_primary_slave(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
+{
+    add_deferred_ref(resolve_bond_primary_slave, node, NULL, node, data);
+    return TRUE;
+}
+
 static const mapping_entry_handler bond_params_handlers[] = {
     {"mode", YAML_SCALAR_NODE, handle_bond_mode, NULL, netdef_offset(bond_params.mode)},
     {"lacp-rate", YAML_SCALAR_NODE, handle_netdef_str, NULL, netdef_offset(bond_params.lacp_rate)},
@@ -1832,15 +2180,15 @@ handle_bonding(yaml_document_t* doc, yaml_node_t* node, const void* _, GError**
 static gboolean
 handle_dhcp_identifier(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    if (cur_netdef->dhcp_identifier)
-        g_free(cur_netdef->dhcp_identifier);
-    cur_netdef->dhcp_identifier = g_strdup(scalar(node));
+    if (npp->cur_netdef->dhcp_identifier)
+        g_free(npp->cur_netdef->dhcp_identifier);
+    npp->cur_netdef->dhcp_identifier = g_strdup(scalar(node));
 
-    if (g_ascii_strcasecmp(cur_netdef->dhcp_identifier, "duid") == 0 ||
-        g_ascii_strcasecmp(cur_netdef->dhcp_identifier, "mac") == 0)
+    if (g_ascii_strcasecmp(npp->cur_netdef->dhcp_identifier, "duid") == 0 ||
+        g_ascii_strcasecmp(npp->cur_netdef->dhcp_identifier, "mac") == 0)
         return TRUE;
 
-    return yaml_error(node, error, "invalid DHCP client identifier type '%s'", cur_netdef->dhcp_identifier);
+    return yaml_error(node, error, "invalid DHCP client identifier type '%s'", npp->cur_netdef->dhcp_identifier);
 }
 
 /****************************************************
@@ -1885,12 +2233,12 @@ handle_tunnel_mode(yaml_document_t* doc, yaml_node_t* node, const void* _, GErro
     // Skip over unknown (0) tunnel mode.
     for (i = 1; i < NETPLAN_TUNNEL_MODE_MAX_; ++i) {
         if (g_strcmp0(netplan_tunnel_mode_table[i], key) == 0) {
-            cur_netdef->tunnel.mode = i;
+            npp->cur_netdef->tunnel.mode = i;
             return TRUE;
         }
     }
 
-    return yaml_error(node, error, "%s: tunnel mode '%s' is not supported", cur_netdef->id, key);
+    return yaml_error(node, error, "%s: tunnel mode '%s' is not supported", npp->cur_netdef->id, key);
 }
 
 static const mapping_entry_handler tunnel_keys_handlers[] = {
@@ -1929,8 +2277,8 @@ handle_tunnel_key_mapping(yaml_document_t* doc, yaml_node_t* node, const void* _
 static gboolean
 handle_wireguard_peer_str(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    g_assert(cur_wireguard_peer);
-    return handle_generic_str(doc, node, cur_wireguard_peer, data, error);
+    g_assert(npp->cur_wireguard_peer);
+    return handle_generic_str(doc, node, npp->cur_wireguard_peer, data, error);
 }
 
 /**
@@ -1940,15 +2288,16 @@ handle_wireguard_peer_str(yaml_document_t* doc, yaml_node_t* node, const void* d
 static gboolean
 handle_wireguard_peer_guint(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    g_assert(cur_wireguard_peer);
-    return handle_generic_guint(doc, node, cur_wireguard_peer, data, error);
+    g_assert(npp->cur_wireguard_peer);
+    return handle_generic_guint(doc, node, npp->cur_wireguard_peer, data, error);
 }
 
 static gboolean
 handle_wireguard_allowed_ips(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    return handle_generic_addresses(doc, node, FALSE, &(cur_wireguard_peer->allowed_ips),
-                                    &(cur_wireguard_peer->allowed_ips), error);
+    return handle_generic_addresses(doc, node, FALSE,
+                                    &(npp->cur_wireguard_peer->allowed_ips), &(npp->cur_wireguard_peer->allowed_ips_set),
+                                    &(npp->cur_wireguard_peer->allowed_ips), &(npp->cur_wireguard_peer->allowed_ips_set), error);
 }
 
 static gboolean
@@ -2013,14 +2362,14 @@ const mapping_entry_handler wireguard_peer_handlers[] = {
 static gboolean
 handle_wireguard_peers(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    if (!cur_netdef->wireguard_peers)
-        cur_netdef->wireguard_peers = g_array_new(FALSE, TRUE, sizeof(NetplanWireguardPeer*));
+    if (!npp->cur_netdef->wireguard_peers)
+        npp->cur_netdef->wireguard_peers = g_array_new(FALSE, TRUE, sizeof(NetplanWireguardPeer*));
 
     /* Avoid adding the same peers in a 2nd parsing pass by comparing
      * the array size to the YAML sequence size. Skip if they are equal. */
     guint item_count = node->data.sequence.items.top - node->data.sequence.items.start;
-    if (cur_netdef->wireguard_peers->len == item_count) {
-        g_debug("%s: all wireguard peers have already been added", cur_netdef->id);
+    if (npp->cur_netdef->wireguard_peers->len == item_count) {
+        g_debug("%s: all wireguard peers have already been added", npp->cur_netdef->id);
         return TRUE;
     }
 
@@ -2028,17 +2377,17 @@ handle_wireguard_peers(yaml_document_t* doc, yaml_node_t* node, const void* _, G
         yaml_node_t *entry = yaml_document_get_node(doc, *i);
         assert_type(entry, YAML_MAPPING_NODE);
 
-        g_assert(cur_wireguard_peer == NULL);
-        cur_wireguard_peer = g_new0(NetplanWireguardPeer, 1);
-        cur_wireguard_peer->allowed_ips = g_array_new(FALSE, FALSE, sizeof(char*));
-        g_debug("%s: adding new wireguard peer", cur_netdef->id);
+        g_assert(npp->cur_wireguard_peer == NULL);
+        npp->cur_wireguard_peer = g_new0(NetplanWireguardPeer, 1);
+        npp->cur_wireguard_peer->allowed_ips = g_array_new(FALSE, FALSE, sizeof(NetplanAddress));
+        g_debug("%s: adding new wireguard peer", npp->cur_netdef->id);
 
-        g_array_append_val(cur_netdef->wireguard_peers, cur_wireguard_peer);
+        g_array_append_val(npp->cur_netdef->wireguard_peers, npp->cur_wireguard_peer);
         if (!process_mapping(doc, entry, wireguard_peer_handlers, NULL, error)) {
-            cur_wireguard_peer = NULL;
+            npp->cur_wireguard_peer = NULL;
             return FALSE;
         }
-        cur_wireguard_peer = NULL;
+        npp->cur_wireguard_peer = NULL;
     }
     return TRUE;
 }
@@ -2050,7 +2399,7 @@ handle_wireguard_peers(yaml_document_t* doc, yaml_node_t* node, const void* _, G
 static gboolean
 handle_ovs_bond_lacp(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    if (cur_netdef->type != NETPLAN_DEF_TYPE_BOND)
+    if (npp->cur_netdef->type != NETPLAN_DEF_TYPE_BOND)
         return yaml_error(node, error, "Key 'lacp' is only valid for interface type 'openvswitch bond'");
 
     if (g_strcmp0(scalar(node), "active") && g_strcmp0(scalar(node), "passive") && g_strcmp0(scalar(node), "off"))
@@ -2062,7 +2411,7 @@ handle_ovs_bond_lacp(yaml_document_t* doc, yaml_node_t* node, const void* data,
 static gboolean
 handle_ovs_bridge_bool(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    if (cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE)
+    if (npp->cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE)
         return yaml_error(node, error, "Key is only valid for interface type 'openvswitch bridge'");
 
     return handle_netdef_bool(doc, node, data, error);
@@ -2071,7 +2420,7 @@ handle_ovs_bridge_bool(yaml_document_t* doc, yaml_node_t* node, const void* data
 static gboolean
 handle_ovs_bridge_fail_mode(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    if (cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE)
+    if (npp->cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE)
         return yaml_error(node, error, "Key 'fail-mode' is only valid for interface type 'openvswitch bridge'");
 
     if (g_strcmp0(scalar(node), "standalone") && g_strcmp0(scalar(node), "secure"))
@@ -2113,16 +2462,16 @@ handle_ovs_protocol(yaml_document_t* doc, yaml_node_t* node, void* entryptr, con
 static gboolean
 handle_ovs_bridge_protocol(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    if (cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE)
+    if (npp->cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE)
         return yaml_error(node, error, "Key 'protocols' is only valid for interface type 'openvswitch bridge'");
 
-    return handle_ovs_protocol(doc, node, cur_netdef, data, error);
+    return handle_ovs_protocol(doc, node, npp->cur_netdef, data, error);
 }
 
 static gboolean
 handle_ovs_bridge_controller_connection_mode(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    if (cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE)
+    if (npp->cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE)
         return yaml_error(node, error, "Key 'controller.connection-mode' is only valid for interface type 'openvswitch bridge'");
 
     if (g_strcmp0(scalar(node), "in-band") && g_strcmp0(scalar(node), "out-of-band"))
@@ -2134,7 +2483,7 @@ handle_ovs_bridge_controller_connection_mode(yaml_document_t* doc, yaml_node_t*
 static gboolean
 handle_ovs_bridge_controller_addresses(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    if (cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE)
+    if (npp->cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE)
         return yaml_error(node, error, "Key 'controller.addresses' is only valid for interface type 'openvswitch bridge'");
 
     for (yaml_node_item_t *i = node->data.sequence.items.start; i < node->data.sequence.items.top; i++) {
@@ -2155,25 +2504,25 @@ handle_ovs_bridge_controller_addresses(yaml_document_t* doc, yaml_node_t* node,
         is_port = !g_strcmp0(vec[0], "ptcp") || !g_strcmp0(vec[0], "pssl");
         is_unix = !g_strcmp0(vec[0], "unix") || !g_strcmp0(vec[0], "punix");
 
-        if (!cur_netdef->ovs_settings.controller.addresses)
-            cur_netdef->ovs_settings.controller.addresses = g_array_new(FALSE, FALSE, sizeof(char*));
+        if (!npp->cur_netdef->ovs_settings.controller.addresses)
+            npp->cur_netdef->ovs_settings.controller.addresses = g_array_new(FALSE, FALSE, sizeof(char*));
 
         /* Format: [p]unix:file */
         if (is_unix && vec[1] != NULL && vec[2] == NULL) {
             char* s = g_strdup(scalar(entry));
-            g_array_append_val(cur_netdef->ovs_settings.controller.addresses, s);
+            g_array_append_val(npp->cur_netdef->ovs_settings.controller.addresses, s);
             g_strfreev(vec);
             continue;
         /* Format tcp:host[:port] or ssl:host[:port] */
         } else if (is_host && validate_ovs_target(TRUE, vec[1])) {
             char* s = g_strdup(scalar(entry));
-            g_array_append_val(cur_netdef->ovs_settings.controller.addresses, s);
+            g_array_append_val(npp->cur_netdef->ovs_settings.controller.addresses, s);
             g_strfreev(vec);
             continue;
         /* Format ptcp:[port][:host] or pssl:[port][:host] */
         } else if (is_port && validate_ovs_target(FALSE, vec[1])) {
             char* s = g_strdup(scalar(entry));
-            g_array_append_val(cur_netdef->ovs_settings.controller.addresses, s);
+            g_array_append_val(npp->cur_netdef->ovs_settings.controller.addresses, s);
             g_strfreev(vec);
             continue;
         }
@@ -2210,7 +2559,7 @@ handle_ovs_backend(yaml_document_t* doc, yaml_node_t* node, const void* _, GErro
     gboolean ret = process_mapping(doc, node, ovs_backend_settings_handlers, &values, error);
     guint len = g_list_length(values);
 
-    if (cur_netdef->type != NETPLAN_DEF_TYPE_BOND && cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE) {
+    if (npp->cur_netdef->type != NETPLAN_DEF_TYPE_BOND && npp->cur_netdef->type != NETPLAN_DEF_TYPE_BRIDGE) {
         GList *other_config = g_list_find_custom(values, "other-config", (GCompareFunc) strcmp);
         GList *external_ids = g_list_find_custom(values, "external-ids", (GCompareFunc) strcmp);
         /* Non-bond/non-bridge interfaces might still be handled by the networkd backend */
@@ -2224,7 +2573,7 @@ handle_ovs_backend(yaml_document_t* doc, yaml_node_t* node, const void* _, GErro
     /* Set the renderer for this device to NETPLAN_BACKEND_OVS, implicitly.
      * But only if empty "openvswitch: {}" or "openvswitch:" with more than
      * "other-config" or "external-ids" keys is given. */
-    cur_netdef->backend = NETPLAN_BACKEND_OVS;
+    npp->cur_netdef->backend = NETPLAN_BACKEND_OVS;
     return ret;
 }
 
@@ -2352,6 +2701,7 @@ static const mapping_entry_handler modem_def_handlers[] = {
     {"sim-id", YAML_SCALAR_NODE, handle_netdef_str, NULL, netdef_offset(modem_params.sim_id)},
     {"sim-operator-id", YAML_SCALAR_NODE, handle_netdef_str, NULL, netdef_offset(modem_params.sim_operator_id)},
     {"username", YAML_SCALAR_NODE, handle_netdef_str, NULL, netdef_offset(modem_params.username)},
+    {NULL}
 };
 
 static const mapping_entry_handler tunnel_def_handlers[] = {
@@ -2394,19 +2744,19 @@ handle_network_version(yaml_document_t* doc, yaml_node_t* node, const void* _, G
 static gboolean
 handle_network_renderer(yaml_document_t* doc, yaml_node_t* node, const void* _, GError** error)
 {
-    return parse_renderer(node, &backend_global, error);
+    return parse_renderer(node, &npp->backend_global, error);
 }
 
 static gboolean
 handle_network_ovs_settings_global(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_generic_map(doc, node, &ovs_settings_global, data, error);
+    return handle_generic_map(doc, node, &npp->ovs_settings_global, data, error);
 }
 
 static gboolean
 handle_network_ovs_settings_global_protocol(yaml_document_t* doc, yaml_node_t* node, const void* data, GError** error)
 {
-    return handle_ovs_protocol(doc, node, &ovs_settings_global, data, error);
+    return handle_ovs_protocol(doc, node, &npp->ovs_settings_global, data, error);
 }
 
 static gboolean
@@ -2434,11 +2784,9 @@ handle_network_ovs_settings_global_ports(yaml_document_t* doc, yaml_node_t* node
         assert_type(peer, YAML_SCALAR_NODE);
 
         /* Create port 1 netdef */
-        component = netdefs ? g_hash_table_lookup(netdefs, scalar(port)) : NULL;
+        component = npp->netdefs ? g_hash_table_lookup(npp->netdefs, scalar(port)) : NULL;
         if (!component) {
             component = netplan_netdef_new(scalar(port), NETPLAN_DEF_TYPE_PORT, NETPLAN_BACKEND_OVS);
-            if (g_hash_table_remove(missing_id, scalar(port)))
-                missing_ids_found++;
         }
 
         if (component->peer && g_strcmp0(component->peer, scalar(peer)))
@@ -2448,11 +2796,9 @@ handle_network_ovs_settings_global_ports(yaml_document_t* doc, yaml_node_t* node
 
         /* Create port 2 (peer) netdef */
         component = NULL;
-        component = netdefs ? g_hash_table_lookup(netdefs, scalar(peer)) : NULL;
+        component = npp->netdefs ? g_hash_table_lookup(npp->netdefs, scalar(peer)) : NULL;
         if (!component) {
             component = netplan_netdef_new(scalar(peer), NETPLAN_DEF_TYPE_PORT, NETPLAN_BACKEND_OVS);
-            if (g_hash_table_remove(missing_id, scalar(peer)))
-                missing_ids_found++;
         }
 
         if (component->peer && g_strcmp0(component->peer, scalar(port)))
@@ -2463,6 +2809,79 @@ handle_network_ovs_settings_global_ports(yaml_document_t* doc, yaml_node_t* node
     return TRUE;
 }
 
+/**
+ * Check that @key is valid as the ID of a definition.
+ */
+static gboolean
+check_netdef_id(yaml_node_t* key, GError** error)
+{
+    if (!assert_valid_id(key, error))
+        return FALSE;
+    /* globbing is not allowed for IDs */
+    if (strpbrk(scalar(key), "*[]?"))
+        return yaml_error(key, error, "Definition ID '%s' must not use globbing", scalar(key));
+    return TRUE;
+}
+
+/**
+ * Make the definition with ID @key and type @type the current one, creating
+ * it if needed.
+ *
+ * Returns: the handlers for the mapping of the definition, or NULL on error.
+ */
+static const mapping_entry_handler*
+begin_netdef(yaml_node_t* key, NetplanDefType type, GError** error)
+{
+    npp->cur_netdef = npp->netdefs ? g_hash_table_lookup(npp->netdefs, scalar(key)) : NULL;
+    if (npp->cur_netdef) {
+        /* already exists, overriding/amending previous definition */
+        if (npp->cur_netdef->type != type) {
+            yaml_error(key, error, "Updated definition '%s' changes device type", scalar(key));
+            return NULL;
+        }
+    } else {
+        npp->cur_netdef = netplan_netdef_new(scalar(key), type, npp->backend_cur_type);
+    }
+    g_assert(npp->cur_filename);
+    npp->cur_netdef->filename = g_strdup(npp->cur_filename);
+
+    // XXX: breaks multi-pass parsing.
+    //if (!g_hash_table_add(ids_in_file, cur_netdef->id))
+    //    return yaml_error(key, error, "Duplicate net definition ID '%s'", cur_netdef->id);
+
+    switch (npp->cur_netdef->type) {
+        case NETPLAN_DEF_TYPE_BOND: return bond_def_handlers;
+        case NETPLAN_DEF_TYPE_BRIDGE: return bridge_def_handlers;
+        case NETPLAN_DEF_TYPE_ETHERNET: return ethernet_def_handlers;
+        case NETPLAN_DEF_TYPE_MODEM: return modem_def_handlers;
+        case NETPLAN_DEF_TYPE_TUNNEL: return tunnel_def_handlers;
+        case NETPLAN_DEF_TYPE_VLAN: return vlan_def_handlers;
+        case NETPLAN_DEF_TYPE_WIFI: return wifi_def_handlers;
+        case NETPLAN_DEF_TYPE_NM:
+            g_warning("netplan: %s: handling NetworkManager passthrough device, settings are not fully supported.", npp->cur_netdef->id);
+            return ethernet_def_handlers;
+        default: g_assert_not_reached(); // LCOV_EXCL_LINE
+    }
+}
+
+/**
+ * Finish processing the current definition, after all entries of its
+ * mapping @node have been handled.
+ */
+static void
+end_netdef(const yaml_node_t* node)
+{
+    /* definition-level conditions are validated once references to other
+     * definitions have been resolved, see process_document() */
+    NetplanDocumentNetdef doc_netdef = { npp->cur_netdef, detach_node(node) };
+    g_array_append_val(npp->document_netdefs, doc_netdef);
+
+    /* convenience shortcut: physical device without match: means match
+     * name on ID */
+    if (npp->cur_netdef->type < NETPLAN_DEF_TYPE_VIRTUAL && !npp->cur_netdef->has_match)
+        set_str_if_null(npp->cur_netdef->match.original_name, npp->cur_netdef->id);
+}
+
 /**
  * Callback for a net device type entry like "ethernets:" in "network:"
  * @data: netdef_type (as pointer)
@@ -2475,72 +2894,29 @@ handle_network_type(yaml_document_t* doc, yaml_node_t* node, const void* data, G
         const mapping_entry_handler* handlers;
 
         key = yaml_document_get_node(doc, entry->key);
-        if (!assert_valid_id(key, error))
+        if (!check_netdef_id(key, error))
             return FALSE;
-        /* globbing is not allowed for IDs */
-        if (strpbrk(scalar(key), "*[]?"))
-            return yaml_error(key, error, "Definition ID '%s' must not use globbing", scalar(key));
 
         value = yaml_document_get_node(doc, entry->value);
 
         /* special-case "renderer:" key to set the per-type backend */
         if (strcmp(scalar(key), "renderer") == 0) {
-            if (!parse_renderer(value, &backend_cur_type, error))
+            if (!parse_renderer(value, &npp->backend_cur_type, error))
                 return FALSE;
             continue;
         }
 
         assert_type(value, YAML_MAPPING_NODE);
 
-        /* At this point we've seen a new starting definition, if it has been
-         * already mentioned in another netdef, removing it from our "missing"
-         * list. */
-        if(g_hash_table_remove(missing_id, scalar(key)))
-            missing_ids_found++;
-
-        cur_netdef = netdefs ? g_hash_table_lookup(netdefs, scalar(key)) : NULL;
-        if (cur_netdef) {
-            /* already exists, overriding/amending previous definition */
-            if (cur_netdef->type != GPOINTER_TO_UINT(data))
-                return yaml_error(key, error, "Updated definition '%s' changes device type", scalar(key));
-        } else {
-            cur_netdef = netplan_netdef_new(scalar(key), GPOINTER_TO_UINT(data), backend_cur_type);
-        }
-        g_assert(cur_filename);
-        cur_netdef->filename = g_strdup(cur_filename);
-
-        // XXX: breaks multi-pass parsing.
-        //if (!g_hash_table_add(ids_in_file, cur_netdef->id))
-        //    return yaml_error(key, error, "Duplicate net definition ID '%s'", cur_netdef->id);
-
+        handlers = begin_netdef(key, GPOINTER_TO_UINT(data), error);
+        if (!handlers)
+            return FALSE;
         /* and fill it with definitions */
-        switch (cur_netdef->type) {
-            case NETPLAN_DEF_TYPE_BOND: handlers = bond_def_handlers; break;
-            case NETPLAN_DEF_TYPE_BRIDGE: handlers = bridge_def_handlers; break;
-            case NETPLAN_DEF_TYPE_ETHERNET: handlers = ethernet_def_handlers; break;
-            case NETPLAN_DEF_TYPE_MODEM: handlers = modem_def_handlers; break;
-            case NETPLAN_DEF_TYPE_TUNNEL: handlers = tunnel_def_handlers; break;
-            case NETPLAN_DEF_TYPE_VLAN: handlers = vlan_def_handlers; break;
-            case NETPLAN_DEF_TYPE_WIFI: handlers = wifi_def_handlers; break;
-            case NETPLAN_DEF_TYPE_NM:
-                g_warning("netplan: %s: handling NetworkManager passthrough device, settings are not fully supported.", cur_netdef->id);
-                handlers = ethernet_def_handlers;
-                break;
-            default: g_assert_not_reached(); // LCOV_EXCL_LINE
-        }
         if (!process_mapping(doc, value, handlers, NULL, error))
             return FALSE;
-
-        /* validate definition-level conditions */
-        if (!validate_netdef_grammar(cur_netdef, value, error))
-            return FALSE;
-
-        /* convenience shortcut: physical device without match: means match
-         * name on ID */
-        if (cur_netdef->type < NETPLAN_DEF_TYPE_VIRTUAL && !cur_netdef->has_match)
-            set_str_if_null(cur_netdef->match.original_name, cur_netdef->id);
+        end_netdef(value);
     }
-    backend_cur_type = NETPLAN_BACKEND_NONE;
+    npp->backend_cur_type = NETPLAN_BACKEND_NONE;
     return TRUE;
 }
 
@@ -2556,9 +2932,9 @@ handle_ovs_global_ssl(yaml_document_t* doc, yaml_node_t* node, const void* _, GE
 {
     gboolean ret;
 
-    cur_auth = &(ovs_settings_global.ssl);
+    npp->cur_auth = &(npp->ovs_settings_global.ssl);
     ret = process_mapping(doc, node, ovs_global_ssl_handlers, NULL, error);
-    cur_auth = NULL;
+    npp->cur_auth = NULL;
 
     return ret;
 }
@@ -2596,195 +2972,1571 @@ static const mapping_entry_handler root_handlers[] = {
     {NULL}
 };
 
-/**
- * Handle multiple-pass parsing of the yaml document.
- */
-static gboolean
-process_document(yaml_document_t* doc, GError** error)
-{
-    gboolean ret;
-    int previously_found;
-    int still_missing;
-
-    g_assert(missing_id == NULL);
-    missing_id = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
-
-    do {
-        g_debug("starting new processing pass");
-
-        previously_found = missing_ids_found;
-        missing_ids_found = 0;
+/****************************************************
+ * Streaming YAML ingestion
+ ****************************************************/
 
-        g_clear_error(error);
+/* Rather than loading the whole node graph of a file with yaml_parser_load()
+ * before processing it, netplan_parse_yaml() walks the libyaml event stream:
+ * The root, "network:" and definition mappings get dispatched key by key, and
+ * only the value of each key is composed into a document of its own, which is
+ * dropped again right after its handler ran. Long sequences of routes and
+ * routing policy rules even get composed item by item. So the memory used for
+ * nodes is bounded by the largest such value, instead of by the file size.
+ * Small files get their events parsed ahead of time on worker threads (see
+ * parse_yaml_files()), but then take the very same path. */
+
+/* Aliases may expand to at most this many nodes per node of the file itself,
+ * plus YAML_ALIAS_EXPANSION_MIN; this stops documents like "billion laughs",
+ * whose few nodes refer to each other over and over again */
+#define YAML_ALIAS_EXPANSION_RATIO 16
+#define YAML_ALIAS_EXPANSION_MIN 65536
+
+/* A file which got read and YAML-parsed ahead of time, see preparse_yaml() */
+typedef struct {
+    GBytes* contents;
+    GArray* events; /* yaml_event_t */
+    guint pos; /* of the next event to be handed out */
+    GError* error; /* of the YAML parser, after the last of the events */
+    NetplanTiming load;
+} preparsed_yaml;
+
+typedef struct yaml_anchored yaml_anchored;
+
+/* A recorded event; an alias within an anchored node gets recorded as such,
+ * instead of the events of the node it refers to */
+typedef struct {
+    yaml_event_t event; /* YAML_NO_EVENT for an alias */
+    yaml_anchored* alias; /* the node the alias refers to */
+} yaml_recorded_event;
+
+/* An anchored node, for expanding aliases to it */
+struct yaml_anchored {
+    GArray* events; /* yaml_recorded_event */
+    gsize nodes; /* the number of nodes it expands to */
+};
 
-        ret = process_mapping(doc, yaml_document_get_root_node(doc), root_handlers, NULL, error);
+typedef struct {
+    yaml_anchored* node;
+    guint pos;
+} yaml_replay_frame;
 
-        still_missing = g_hash_table_size(missing_id);
+typedef struct {
+    yaml_parser_t parser;
+    /* if set, the events are taken from here instead of from the parser */
+    preparsed_yaml* preparsed;
+    const char* filename;
+    /* next event, if peeked at already */
+    yaml_event_t event;
+    gboolean peeked;
+    /* if the peeked event is part of an alias being replayed */
+    gboolean peeked_replayed;
+    /* all yaml_anchored nodes, which may refer to each other */
+    GPtrArray* nodes;
+    /* anchor → yaml_anchored; those may refer to nodes which are long gone */
+    GHashTable* anchors;
+    /* yaml_recording of anchored nodes which are still being read */
+    GPtrArray* recordings;
+    /* yaml_replay_frame of the (nested) aliases currently being replayed */
+    GArray* replay;
+    /* nodes read from the file, and the ones aliases expanded to */
+    gsize parsed_nodes;
+    gsize expanded_nodes;
+} yaml_stream;
+
+typedef struct {
+    char* anchor;
+    yaml_anchored* node;
+    guint depth;
+} yaml_recording;
+
+/* Handler for an @item of the sequence @node */
+typedef gboolean (*sequence_item_handler) (yaml_document_t* doc, yaml_node_t* node, yaml_node_t* item, GError** error);
+
+/* Sequence handlers which just loop over the items, with the handler for each
+ * item; the streaming parser hands those the items one by one. */
+static const struct {
+    node_handler handler;
+    sequence_item_handler item_handler;
+} sequence_item_handlers[] = {
+    {handle_routes, handle_route},
+    {handle_ip_rules, handle_ip_rule},
+};
 
-        if (still_missing > 0 && missing_ids_found == previously_found)
-            break;
-    } while (still_missing > 0 || missing_ids_found > 0);
+static void
+clear_recorded_event(yaml_recorded_event* rec)
+{
+    if (!rec->alias)
+        yaml_event_delete(&rec->event);
+}
 
-    if (g_hash_table_size(missing_id) > 0) {
-        GHashTableIter iter;
-        gpointer key, value;
-        NetplanMissingNode *missing;
+static void
+free_anchored(yaml_anchored* node)
+{
+    g_array_unref(node->events);
+    g_free(node);
+}
 
-        g_clear_error(error);
+static gboolean
+is_node_event(const yaml_event_t* event)
+{
+    return event->type == YAML_SCALAR_EVENT || event->type == YAML_SEQUENCE_START_EVENT
+           || event->type == YAML_MAPPING_START_EVENT;
+}
 
-        /* Get the first missing identifier we can get from our list, to
-         * approximate early failure and give the user a meaningful error. */
-        g_hash_table_iter_init (&iter, missing_id);
-        g_hash_table_iter_next (&iter, &key, &value);
-        missing = (NetplanMissingNode*) value;
+/**
+ * Read and YAML-parse the first document of @filename into @p, which can be
+ * done on a worker thread. The events are taken from @p by the stream_yaml()
+ * of the file later on, so that it gets processed just like a streamed one.
+ * Errors of the parser are only reported once their position is reached
+ * then, all other errors right away.
+ */
+static void
+preparse_yaml(const char* filename, preparsed_yaml* p)
+{
+    yaml_parser_t parser;
+    yaml_event_t event;
 
-        return yaml_error(missing->node, error, "%s: interface '%s' is not defined",
-                          missing->netdef_id,
-                          key);
+    NETPLAN_PROBE1(load_start, filename);
+    p->contents = read_yaml(filename, &p->error);
+    if (!p->contents) {
+        NETPLAN_PROBE3(load_end, filename, 0, FALSE);
+        return;
     }
 
-    g_hash_table_destroy(missing_id);
-    missing_id = NULL;
-    return ret;
+    yaml_parser_initialize(&parser);
+    set_yaml_input(&parser, p->contents);
+    p->events = g_array_new(FALSE, FALSE, sizeof(yaml_event_t));
+    g_array_set_clear_func(p->events, (GDestroyNotify) yaml_event_delete);
+    do {
+        if (!yaml_parser_parse(&parser, &event)) {
+            parser_error(&parser, filename, &p->error);
+            break;
+        }
+        g_array_append_val(p->events, event);
+    } while (event.type != YAML_DOCUMENT_END_EVENT && event.type != YAML_STREAM_END_EVENT);
+    NETPLAN_PROBE3(load_end, filename, g_bytes_get_size(p->contents), p->error == NULL);
+    yaml_parser_delete(&parser);
+}
+
+static void
+clear_preparsed_yaml(preparsed_yaml* p)
+{
+    g_clear_pointer(&p->contents, g_bytes_unref);
+    g_clear_pointer(&p->events, g_array_unref);
+    g_clear_error(&p->error);
 }
 
 /**
- * Parse given YAML file and create/update global "netdefs" list.
+ * Parse the next event of @s into s->event, from the file or the preparsed
+ * events.
  */
-gboolean
-netplan_parse_yaml(const char* filename, GError** error)
+static gboolean
+stream_parse(yaml_stream* s, GError** error)
 {
-    yaml_document_t doc;
-    gboolean ret;
+    preparsed_yaml* p = s->preparsed;
 
-    if (!load_yaml(filename, &doc, error))
-        return FALSE;
+    if (!p) {
+        if (yaml_parser_parse(&s->parser, &s->event))
+            return TRUE;
+        return parser_error(&s->parser, s->filename, error);
+    }
 
-    /* empty file? */
-    if (yaml_document_get_root_node(&doc) == NULL)
+    if (p->pos < p->events->len) {
+        yaml_event_t* event = &g_array_index(p->events, yaml_event_t, p->pos++);
+        /* take it over, the array does not need to free it anymore */
+        s->event = *event;
+        memset(event, 0, sizeof(*event));
         return TRUE;
+    }
+    if (p->error) {
+        g_propagate_error(error, p->error);
+        p->error = NULL;
+        return FALSE;
+    }
+    /* past the end of the document, like yaml_parser_parse() */
+    memset(&s->event, 0, sizeof(s->event)); // LCOV_EXCL_LINE
+    return TRUE; // LCOV_EXCL_LINE
+}
 
-    g_assert(ids_in_file == NULL);
-    ids_in_file = g_hash_table_new(g_str_hash, NULL);
+static void
+copy_event(const yaml_event_t* event, yaml_event_t* copy)
+{
+    /* anchors are not copied, the copies are only used for expanding aliases */
+    switch (event->type) {
+        case YAML_SCALAR_EVENT:
+            yaml_scalar_event_initialize(copy, NULL, event->data.scalar.tag,
+                                         event->data.scalar.value, event->data.scalar.length,
+                                         event->data.scalar.plain_implicit, event->data.scalar.quoted_implicit,
+                                         event->data.scalar.style);
+            break;
+        case YAML_SEQUENCE_START_EVENT:
+            yaml_sequence_start_event_initialize(copy, NULL, event->data.sequence_start.tag,
+                                                 event->data.sequence_start.implicit, event->data.sequence_start.style);
+            break;
+        case YAML_SEQUENCE_END_EVENT:
+            yaml_sequence_end_event_initialize(copy);
+            break;
+        case YAML_MAPPING_START_EVENT:
+            yaml_mapping_start_event_initialize(copy, NULL, event->data.mapping_start.tag,
+                                                event->data.mapping_start.implicit, event->data.mapping_start.style);
+            break;
+        case YAML_MAPPING_END_EVENT:
+            yaml_mapping_end_event_initialize(copy);
+            break;
+        default: g_assert_not_reached(); // LCOV_EXCL_LINE
+    }
+    copy->start_mark = event->start_mark;
+    copy->end_mark = event->end_mark;
+}
 
-    cur_filename = filename;
-    ret = process_document(&doc, error);
+static const yaml_char_t*
+event_anchor(const yaml_event_t* event)
+{
+    switch (event->type) {
+        case YAML_SCALAR_EVENT: return event->data.scalar.anchor;
+        case YAML_SEQUENCE_START_EVENT: return event->data.sequence_start.anchor;
+        case YAML_MAPPING_START_EVENT: return event->data.mapping_start.anchor;
+        default: return NULL;
+    }
+}
 
-    cur_filename = NULL;
-    cur_netdef = NULL;
-    yaml_document_delete(&doc);
-    g_hash_table_destroy(ids_in_file);
-    ids_in_file = NULL;
-    return ret;
+/**
+ * Append @rec to the recording @r, and finish it once its node is complete.
+ */
+static void
+recording_append(yaml_stream* s, guint i, yaml_recorded_event* rec)
+{
+    yaml_recording* r = g_ptr_array_index(s->recordings, i);
+
+    g_array_append_val(r->node->events, *rec);
+    if (rec->alias)
+        r->node->nodes += rec->alias->nodes;
+    else if (rec->event.type == YAML_SEQUENCE_START_EVENT || rec->event.type == YAML_MAPPING_START_EVENT) {
+        r->node->nodes++;
+        r->depth++;
+    } else if (rec->event.type == YAML_SEQUENCE_END_EVENT || rec->event.type == YAML_MAPPING_END_EVENT)
+        r->depth--;
+    else
+        r->node->nodes++;
+
+    if (r->depth == 0) {
+        g_hash_table_replace(s->anchors, r->anchor, r->node);
+        g_ptr_array_remove_index(s->recordings, i);
+        g_free(r);
+    }
 }
 
+/**
+ * Record the consumed @event, which was read from the file, for all anchored
+ * nodes it is part of.
+ */
 static void
-finish_iterator(gpointer key, gpointer value, gpointer user_data)
+stream_record(yaml_stream* s, const yaml_event_t* event)
 {
-    GError **error = (GError **)user_data;
-    NetplanNetDefinition* nd = value;
+    const yaml_char_t* anchor = event_anchor(event);
+
+    if (anchor) {
+        yaml_recording* r = g_new0(yaml_recording, 1);
+        r->anchor = g_strdup((const char*) anchor);
+        r->node = g_new0(yaml_anchored, 1);
+        r->node->events = g_array_new(FALSE, FALSE, sizeof(yaml_recorded_event));
+        g_array_set_clear_func(r->node->events, (GDestroyNotify) clear_recorded_event);
+        g_ptr_array_add(s->nodes, r->node);
+        g_ptr_array_add(s->recordings, r);
+    }
 
-    /* Take more steps to make sure we always have a backend set for netdefs */
-    if (nd->backend == NETPLAN_BACKEND_NONE) {
-        nd->backend = get_default_backend_for_type(nd->type);
-        g_debug("%s: setting default backend to %i", nd->id, nd->backend);
+    for (guint i = s->recordings->len; i-- > 0;) {
+        yaml_recorded_event rec = { .alias = NULL };
+        copy_event(event, &rec.event);
+        recording_append(s, i, &rec);
     }
+}
 
-    /* Do a final pass of validation for backend-specific conditions */
-    if (validate_backend_rules(nd, error))
-        g_debug("Configuration is valid");
+/**
+ * Record the alias to @node for all anchored nodes it is part of. The events
+ * it expands to do not get recorded themselves.
+ */
+static void
+stream_record_alias(yaml_stream* s, yaml_anchored* node)
+{
+    for (guint i = s->recordings->len; i-- > 0;) {
+        yaml_recorded_event rec = { .alias = node };
+        recording_append(s, i, &rec);
+    }
 }
 
 /**
- * Post-processing after parsing all config files
+ * Return the next event of @s, without consuming it. Aliases get replaced by
+ * the events of the node they refer to.
+ *
+ * Returns: the event, or NULL on error (@error gets set then).
  */
-GHashTable *
-netplan_finish_parse(GError** error)
+static const yaml_event_t*
+stream_peek(yaml_stream* s, GError** error)
 {
-    if (netdefs) {
-        GError *recoverable = NULL;
-        g_debug("We have some netdefs, pass them through a final round of validation");
-        if (!validate_default_route_consistency(netdefs, &recoverable)) {
-            g_warning("Problem encountered while validating default route consistency."
-                      "Please set up multiple routing tables and use `routing-policy` instead.\n"
-                      "Error: %s", (recoverable) ? recoverable->message : "");
-            g_clear_error(&recoverable);
+    yaml_anchored* node;
+
+    if (s->peeked)
+        return &s->event;
+
+    while (s->replay->len > 0) {
+        yaml_replay_frame* frame = &g_array_index(s->replay, yaml_replay_frame, s->replay->len - 1);
+        yaml_recorded_event* rec;
+
+        if (frame->pos == frame->node->events->len) {
+            g_array_set_size(s->replay, s->replay->len - 1);
+            continue;
+        }
+        rec = &g_array_index(frame->node->events, yaml_recorded_event, frame->pos++);
+        if (rec->alias) {
+            yaml_replay_frame nested = { rec->alias, 0 };
+            g_array_append_val(s->replay, nested);
+            continue;
         }
-        g_hash_table_foreach(netdefs, finish_iterator, error);
+        copy_event(&rec->event, &s->event);
+        s->peeked = s->peeked_replayed = TRUE;
+        return &s->event;
     }
 
-    if (error && *error)
+    if (!stream_parse(s, error))
         return NULL;
+    if (s->event.type != YAML_ALIAS_EVENT) {
+        if (is_node_event(&s->event))
+            s->parsed_nodes++;
+        s->peeked = TRUE;
+        s->peeked_replayed = FALSE;
+        return &s->event;
+    }
 
-    return netdefs;
+    /* nodes which are still being read cannot be referred to either */
+    node = g_hash_table_lookup(s->anchors, s->event.data.alias.anchor);
+    if (!node) {
+        alias_error(&s->event.start_mark, error);
+        yaml_event_delete(&s->event);
+        return NULL;
+    }
+    s->expanded_nodes += node->nodes;
+    if (s->expanded_nodes > YAML_ALIAS_EXPANSION_MIN + s->parsed_nodes * YAML_ALIAS_EXPANSION_RATIO) {
+        alias_expansion_error(&s->event.start_mark, error);
+        yaml_event_delete(&s->event);
+        return NULL;
+    }
+    yaml_event_delete(&s->event);
+    stream_record_alias(s, node);
+    yaml_replay_frame frame = { node, 0 };
+    g_array_append_val(s->replay, frame);
+    return stream_peek(s, error);
 }
 
 /**
- * Return current global backend.
+ * Consume the next event of @s, into @event if that is not NULL.
  */
-NetplanBackend
-netplan_get_global_backend()
+static gboolean
+stream_next(yaml_stream* s, yaml_event_t* event, GError** error)
 {
-    return backend_global;
+    if (!stream_peek(s, error))
+        return FALSE;
+    s->peeked = FALSE;
+    if (!s->peeked_replayed)
+        stream_record(s, &s->event);
+    if (event)
+        *event = s->event;
+    else
+        yaml_event_delete(&s->event);
+    return TRUE;
 }
 
 /**
- * Clear NetplanNetDefinition hashtable
+ * Add a scalar node to @doc, which takes over the value of the scalar @event
+ * instead of copying it.
+ *
+ * Returns: the node ID in @doc.
  */
-guint
-netplan_clear_netdefs()
+static int
+add_scalar_node(yaml_document_t* doc, yaml_event_t* event)
 {
-    guint n = 0;
-    if(netdefs) {
-        n = g_hash_table_size(netdefs);
-        /* FIXME: make sure that any dynamically allocated netdef data is freed */
-        if (n > 0)
-            g_hash_table_remove_all(netdefs);
-        netdefs = NULL;
-    }
-    if(netdefs_ordered) {
-        g_clear_list(&netdefs_ordered, g_free);
-        netdefs_ordered = NULL;
-    }
-    backend_global = NETPLAN_BACKEND_NONE;
-    ovs_settings_global = (NetplanOVSSettings){0};
-    return n;
+    int id = yaml_document_add_scalar(doc, NULL, (yaml_char_t*) "", 0, event->data.scalar.style);
+    yaml_node_t* node = yaml_document_get_node(doc, id);
+
+    /* libyaml allocates with plain malloc() */
+    free(node->data.scalar.value);
+    node->data.scalar.value = event->data.scalar.value;
+    node->data.scalar.length = event->data.scalar.length;
+    event->data.scalar.value = NULL;
+    return id;
 }
 
-void
-process_input_file(const char* f)
+/**
+ * Compose the next node of @s into @doc, like yaml_parser_load() would.
+ *
+ * Returns: the node ID in @doc, or 0 on error (@error gets set then).
+ */
+static int
+stream_compose(yaml_stream* s, yaml_document_t* doc, GError** error)
 {
-    GError* error = NULL;
-
-    g_debug("Processing input file %s..", f);
-    if (!netplan_parse_yaml(f, &error)) {
-        g_fprintf(stderr, "%s\n", error->message);
-        exit(1);
+    yaml_event_t event;
+    const yaml_event_t* next;
+    yaml_mark_t start_mark;
+    int id, key, value;
+
+    if (!stream_next(s, &event, error))
+        return 0;
+    start_mark = event.start_mark;
+
+    switch (event.type) {
+        case YAML_SCALAR_EVENT:
+            id = add_scalar_node(doc, &event);
+            break;
+        case YAML_SEQUENCE_START_EVENT:
+            id = yaml_document_add_sequence(doc, NULL, event.data.sequence_start.style);
+            yaml_event_delete(&event);
+            while ((next = stream_peek(s, error)) && next->type != YAML_SEQUENCE_END_EVENT) {
+                if (!(value = stream_compose(s, doc, error)))
+                    return 0;
+                yaml_document_append_sequence_item(doc, id, value);
+            }
+            if (!next || !stream_next(s, &event, error))
+                return 0;
+            break;
+        case YAML_MAPPING_START_EVENT:
+            id = yaml_document_add_mapping(doc, NULL, event.data.mapping_start.style);
+            yaml_event_delete(&event);
+            while ((next = stream_peek(s, error)) && next->type != YAML_MAPPING_END_EVENT) {
+                if (!(key = stream_compose(s, doc, error)) || !(value = stream_compose(s, doc, error)))
+                    return 0;
+                yaml_document_append_mapping_pair(doc, id, key, value);
+            }
+            if (!next || !stream_next(s, &event, error))
+                return 0;
+            break;
+        default: g_assert_not_reached(); // LCOV_EXCL_LINE
     }
+
+    /* yaml_document_add_*() do not take marks, but errors need them */
+    yaml_document_get_node(doc, id)->start_mark = start_mark;
+    yaml_document_get_node(doc, id)->end_mark = event.end_mark;
+    yaml_event_delete(&event);
+    return id;
 }
 
-gboolean
-process_yaml_hierarchy(const char* rootdir)
+/**
+ * Consume the start event of a collection from @s, into a node without any
+ * contents, which serves as the target of errors about the collection.
+ */
+static gboolean
+stream_collection_start(yaml_stream* s, yaml_node_t* node, GError** error)
 {
-    glob_t gl;
-    /* Files with asciibetically higher names override/append settings from
-     * earlier ones (in all config dirs); files in /run/netplan/
-     * shadow files in /etc/netplan/ which shadow files in /lib/netplan/.
-     * To do that, we put all found files in a hash table, then sort it by
-     * file name, and add the entries from /run after the ones from /etc
-     * and those after the ones from /lib. */
-    if (find_yaml_glob(rootdir, &gl) != 0)
+    yaml_event_t event;
+
+    if (!stream_next(s, &event, error))
         return FALSE; // LCOV_EXCL_LINE
-    /* keys are strdup()ed, free them; values point into the glob_t, don't free them */
-    g_autoptr(GHashTable) configs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-    g_autoptr(GList) config_keys = NULL;
+    memset(node, 0, sizeof(*node));
+    if (event.type == YAML_MAPPING_START_EVENT) {
+        node->type = YAML_MAPPING_NODE;
+        node->data.mapping.style = event.data.mapping_start.style;
+    } else {
+        node->type = YAML_SEQUENCE_NODE;
+        node->data.sequence.style = event.data.sequence_start.style;
+    }
+    node->start_mark = event.start_mark;
+    node->end_mark = event.end_mark;
+    yaml_event_delete(&event);
+    return TRUE;
+}
 
-    for (size_t i = 0; i < gl.gl_pathc; ++i)
-        g_hash_table_insert(configs, g_path_get_basename(gl.gl_pathv[i]), gl.gl_pathv[i]);
+/**
+ * Add a copy of the empty sequence @node to @doc.
+ *
+ * Returns: the node ID in @doc.
+ */
+static int
+add_sequence_node(yaml_document_t* doc, const yaml_node_t* node)
+{
+    int id = yaml_document_add_sequence(doc, NULL, node->data.sequence.style);
 
-    config_keys = g_list_sort(g_hash_table_get_keys(configs), (GCompareFunc) strcmp);
+    yaml_document_get_node(doc, id)->start_mark = node->start_mark;
+    yaml_document_get_node(doc, id)->end_mark = node->end_mark;
+    return id;
+}
 
-    for (GList* i = config_keys; i != NULL; i = i->next)
-        process_input_file(g_hash_table_lookup(configs, i->data));
-    return TRUE;
+/**
+ * Hand the items of the sequence, which starts with the next event of @s, to
+ * @item_handler one by one. Each item gets composed into a document of its
+ * own, together with a copy of the (empty) sequence node.
+ * @h: the handler of the whole sequence
+ */
+static gboolean
+stream_sequence(yaml_stream* s, const mapping_entry_handler* h, sequence_item_handler item_handler, GError** error)
+{
+    const yaml_event_t* next;
+    yaml_node_t sequence;
+    yaml_document_t doc;
+    int node, item;
+    gboolean ret = TRUE;
+
+    if (!stream_collection_start(s, &sequence, error) || !(next = stream_peek(s, error)))
+        return FALSE;
+
+    /* let the handler see empty sequences, too */
+    if (next->type == YAML_SEQUENCE_END_EVENT) {
+        yaml_document_initialize(&doc, NULL, NULL, NULL, 1, 1);
+        node = add_sequence_node(&doc, &sequence);
+        ret = h->handler(&doc, yaml_document_get_node(&doc, node), h->data, error);
+        yaml_document_delete(&doc);
+    }
+
+    while (ret && (next = stream_peek(s, error)) && next->type != YAML_SEQUENCE_END_EVENT) {
+        yaml_document_initialize(&doc, NULL, NULL, NULL, 1, 1);
+        node = add_sequence_node(&doc, &sequence);
+        item = stream_compose(s, &doc, error);
+        ret = item && item_handler(&doc, yaml_document_get_node(&doc, node), yaml_document_get_node(&doc, item), error);
+        yaml_document_delete(&doc);
+    }
+    return ret && next && stream_next(s, NULL, error);
+}
+
+static gboolean
+stream_mapping(yaml_stream* s, const mapping_entry_handler* handlers, GError** error);
+
+/**
+ * Stream the entries of a net device type mapping like "ethernets:", whose
+ * start got consumed already, like handle_network_type() does for a loaded
+ * one. Each definition gets streamed key by key.
+ * @data: netdef_type (as pointer)
+ */
+static gboolean
+stream_network_type(yaml_stream* s, const void* data, GError** error)
+{
+    const yaml_event_t* next;
+
+    while ((next = stream_peek(s, error)) && next->type != YAML_MAPPING_END_EVENT) {
+        const mapping_entry_handler* handlers;
+        yaml_document_t doc;
+        yaml_node_t mapping;
+        int key, value;
+        gboolean ret = FALSE;
+
+        yaml_document_initialize(&doc, NULL, NULL, NULL, 1, 1);
+        if (!(key = stream_compose(s, &doc, error))
+            || !check_netdef_id(yaml_document_get_node(&doc, key), error)
+            || !(next = stream_peek(s, error)))
+            goto next;
+
+        /* special-case "renderer:" key to set the per-type backend */
+        if (strcmp(scalar(yaml_document_get_node(&doc, key)), "renderer") == 0) {
+            value = stream_compose(s, &doc, error);
+            ret = value && parse_renderer(yaml_document_get_node(&doc, value), &npp->backend_cur_type, error);
+            goto next;
+        }
+
+        if (next->type != YAML_MAPPING_START_EVENT) {
+            value = stream_compose(s, &doc, error);
+            ret = value && assert_type_fn(yaml_document_get_node(&doc, value), YAML_MAPPING_NODE, error);
+            goto next;
+        }
+
+        handlers = begin_netdef(yaml_document_get_node(&doc, key), GPOINTER_TO_UINT(data), error);
+        if (handlers && stream_collection_start(s, &mapping, error) && stream_mapping(s, handlers, error)) {
+            end_netdef(&mapping);
+            ret = TRUE;
+        }
+next:
+        yaml_document_delete(&doc);
+        if (!ret)
+            return FALSE;
+    }
+    if (!next || !stream_next(s, NULL, error))
+        return FALSE;
+    npp->backend_cur_type = NETPLAN_BACKEND_NONE;
+    return TRUE;
+}
+
+/**
+ * Stream the entries of a mapping, whose start got consumed already, to
+ * @handlers like process_mapping() does for a loaded one.
+ */
+static gboolean
+stream_mapping(yaml_stream* s, const mapping_entry_handler* handlers, GError** error)
+{
+    const handler_index* index = get_handler_index(handlers);
+    const yaml_event_t* next;
+
+    while ((next = stream_peek(s, error)) && next->type != YAML_MAPPING_END_EVENT) {
+        const mapping_entry_handler* h;
+        sequence_item_handler item_handler = NULL;
+        yaml_document_t doc;
+        yaml_node_t* key;
+        int id;
+        gboolean ret = FALSE;
+
+        yaml_document_initialize(&doc, NULL, NULL, NULL, 1, 1);
+        if (!(id = stream_compose(s, &doc, error)))
+            goto next;
+        key = yaml_document_get_node(&doc, id);
+        if (!assert_type_fn(key, YAML_SCALAR_NODE, error))
+            goto next;
+        h = get_handler(index, scalar(key));
+        if (!h) {
+            yaml_error(key, error, "unknown key '%s'", scalar(key));
+            goto next;
+        }
+        if (!(next = stream_peek(s, error)))
+            goto next;
+
+        for (guint i = 0; i < G_N_ELEMENTS(sequence_item_handlers); i++)
+            if (h->handler == sequence_item_handlers[i].handler)
+                item_handler = sequence_item_handlers[i].item_handler;
+
+        if (h->map_handlers && next->type == YAML_MAPPING_START_EVENT) {
+            ret = stream_next(s, NULL, error) && stream_mapping(s, h->map_handlers, error);
+        } else if (h->handler == handle_network_type && next->type == YAML_MAPPING_START_EVENT) {
+            ret = stream_next(s, NULL, error) && stream_network_type(s, h->data, error);
+        } else if (item_handler && next->type == YAML_SEQUENCE_START_EVENT) {
+            ret = stream_sequence(s, h, item_handler, error);
+        } else {
+            /* anything else gets composed and handled as a whole; values for
+             * map_handlers which are mappings got streamed above, so other
+             * ones fail the type check */
+            yaml_node_t* value;
+
+            if (!(id = stream_compose(s, &doc, error)))
+                goto next;
+            value = yaml_document_get_node(&doc, id);
+            ret = assert_type_fn(value, h->type, error) && h->handler(&doc, value, h->data, error);
+        }
+next:
+        yaml_document_delete(&doc);
+        if (!ret)
+            return FALSE;
+    }
+    return next && stream_next(s, NULL, error);
+}
+
+/**
+ * Stream the first document of @s to the root handlers.
+ */
+static gboolean
+stream_document(yaml_stream* s, GError** error)
+{
+    const yaml_event_t* next;
+    yaml_document_t doc;
+    int root;
+    gboolean ret;
+
+    if (!stream_next(s, NULL, error) || !(next = stream_peek(s, error)))
+        return FALSE;
+    /* empty file? */
+    if (next->type == YAML_STREAM_END_EVENT)
+        return TRUE;
+    if (!stream_next(s, NULL, error) || !(next = stream_peek(s, error)))
+        return FALSE; // LCOV_EXCL_LINE
+
+    if (next->type == YAML_MAPPING_START_EVENT)
+        ret = stream_next(s, NULL, error) && stream_mapping(s, root_handlers, error);
+    else {
+        yaml_document_initialize(&doc, NULL, NULL, NULL, 1, 1);
+        root = stream_compose(s, &doc, error);
+        ret = root && process_mapping(&doc, yaml_document_get_node(&doc, root), root_handlers, NULL, error);
+        yaml_document_delete(&doc);
+    }
+    /* the end of the document, which might still be malformed */
+    return ret && stream_next(s, NULL, error);
+}
+
+/**
+ * Apply the deferred references of @nd, after the ones of all definitions it
+ * refers to. Properties propagate along references (e.g. a bond containing an
+ * openvswitch interface becomes an openvswitch bond itself), so this ensures
+ * the referenced definitions are final by the time they are looked at.
+ * Reference cycles are broken at the first definition seen twice.
+ */
+static gboolean
+resolve_netdef_refs(NetplanNetDefinition* nd, GHashTable* refs_by_netdef, GHashTable* resolved, GError** error)
+{
+    GPtrArray* refs;
+
+    if (!g_hash_table_add(resolved, nd))
+        return TRUE;
+
+    refs = g_hash_table_lookup(refs_by_netdef, nd);
+    if (!refs)
+        return TRUE;
+
+    for (guint i = 0; i < refs->len; i++) {
+        NetplanDeferredRef* ref = g_ptr_array_index(refs, i);
+        if (!resolve_netdef_refs(g_hash_table_lookup(npp->netdefs, scalar(ref->node)), refs_by_netdef, resolved, error))
+            return FALSE;
+    }
+
+    for (guint i = 0; i < refs->len; i++) {
+        NetplanDeferredRef* ref = g_ptr_array_index(refs, i);
+        npp->cur_netdef = ref->netdef;
+        if (!ref->handler(ref, g_hash_table_lookup(npp->netdefs, scalar(ref->node)), error))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Resolve all references recorded while processing the current document,
+ * in a single topologically ordered pass.
+ */
+static gboolean
+resolve_deferred_refs(GError** error)
+{
+    GHashTable* refs_by_netdef;
+    GHashTable* resolved;
+    gboolean ret = TRUE;
+
+    /* every referenced ID must be defined by now; report the first one (in
+     * document order) which is not */
+    for (guint i = 0; i < npp->deferred_refs->len; i++) {
+        NetplanDeferredRef* ref = g_ptr_array_index(npp->deferred_refs, i);
+        if (!npp->netdefs || !g_hash_table_contains(npp->netdefs, scalar(ref->node)))
+            return yaml_error(ref->node, error, "%s: interface '%s' is not defined",
+                              ref->netdef->id, scalar(ref->node));
+    }
+
+    refs_by_netdef = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_ptr_array_unref);
+    for (guint i = 0; i < npp->deferred_refs->len; i++) {
+        NetplanDeferredRef* ref = g_ptr_array_index(npp->deferred_refs, i);
+        GPtrArray* refs = g_hash_table_lookup(refs_by_netdef, ref->netdef);
+        if (!refs) {
+            refs = g_ptr_array_new();
+            g_hash_table_insert(refs_by_netdef, ref->netdef, refs);
+        }
+        g_ptr_array_add(refs, ref);
+    }
+
+    resolved = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (guint i = 0; ret && i < npp->deferred_refs->len; i++) {
+        NetplanDeferredRef* ref = g_ptr_array_index(npp->deferred_refs, i);
+        ret = resolve_netdef_refs(ref->netdef, refs_by_netdef, resolved, error);
+    }
+
+    g_hash_table_destroy(resolved);
+    g_hash_table_destroy(refs_by_netdef);
+    return ret;
+}
+
+/**
+ * Process the yaml document to be read from @stream, in a single pass. Then
+ * resolve the references between its definitions and validate them.
+ */
+static gboolean
+process_document(yaml_stream* stream, GError** error)
+{
+    gboolean ret;
+
+    g_assert(npp->deferred_refs == NULL);
+    npp->deferred_refs = g_ptr_array_new_with_free_func((GDestroyNotify) free_deferred_ref);
+    npp->document_netdefs = g_array_new(FALSE, FALSE, sizeof(NetplanDocumentNetdef));
+    NETPLAN_PROBE1(document_start, npp->cur_filename);
+
+    ret = stream_document(stream, error);
+    netplan_timings_count(NETPLAN_COUNTER_DOCUMENTS, 1);
+    netplan_timings_count(NETPLAN_COUNTER_DEFERRED_REFS, npp->deferred_refs->len);
+    if (ret)
+        ret = resolve_deferred_refs(error);
+
+    /* validate definition-level conditions */
+    for (guint i = 0; ret && i < npp->document_netdefs->len; i++) {
+        NetplanDocumentNetdef* entry = &g_array_index(npp->document_netdefs, NetplanDocumentNetdef, i);
+        ret = validate_netdef_grammar(entry->netdef, entry->node, error);
+    }
+    NETPLAN_PROBE3(document_end, npp->cur_filename, npp->document_netdefs->len, ret);
+
+    g_ptr_array_free(npp->deferred_refs, TRUE);
+    npp->deferred_refs = NULL;
+    for (guint i = 0; i < npp->document_netdefs->len; i++)
+        free_detached_node(g_array_index(npp->document_netdefs, NetplanDocumentNetdef, i).node);
+    g_array_free(npp->document_netdefs, TRUE);
+    npp->document_netdefs = NULL;
+    return ret;
+}
+
+/**
+ * Create/update global "netdefs" list from @filename, to be read from @stream.
+ */
+static gboolean
+process_yaml(const char* filename, GBytes* contents, yaml_stream* stream, GError** error)
+{
+    gsize length;
+    const char* data = g_bytes_get_data(contents, &length);
+    gboolean ret;
+
+    current_file = filename;
+    set_error_input(data, length);
+
+    /* existing definitions might get amended */
+    invalidate_netdef_indices();
+
+    g_assert(npp->ids_in_file == NULL);
+    npp->ids_in_file = g_hash_table_new(g_str_hash, NULL);
+
+    npp->cur_filename = filename;
+    npp->has_input = TRUE;
+    ret = process_document(stream, error);
+
+    npp->cur_filename = NULL;
+    npp->cur_netdef = NULL;
+    g_hash_table_destroy(npp->ids_in_file);
+    npp->ids_in_file = NULL;
+    set_error_input(NULL, 0);
+    publish_default_parser();
+    return ret;
+}
+
+/**
+ * Stream the YAML file @filename, rather than loading it as a whole. Its
+ * events come from @preparsed instead, if given.
+ */
+static gboolean
+stream_yaml(const char* filename, preparsed_yaml* preparsed, GError** error)
+{
+    yaml_stream s = { .filename = filename, .preparsed = preparsed };
+    NetplanTiming load, parse;
+    GBytes* contents;
+    gboolean ret;
+
+    if (preparsed) {
+        load = preparsed->load;
+        contents = preparsed->contents;
+    } else {
+        /* the YAML parsing is interleaved with the processing here, so only
+         * reading the file counts as loading it */
+        NETPLAN_PROBE1(load_start, filename);
+        netplan_timing_start(&load);
+        contents = read_yaml(filename, error);
+        netplan_timing_stop(&load);
+        NETPLAN_PROBE3(load_end, filename, contents ? g_bytes_get_size(contents) : 0, contents != NULL);
+        if (!contents)
+            return FALSE;
+    }
+    netplan_timing_start(&parse);
+    if (!preparsed) {
+        yaml_parser_initialize(&s.parser);
+        set_yaml_input(&s.parser, contents);
+    }
+    s.nodes = g_ptr_array_new_with_free_func((GDestroyNotify) free_anchored);
+    s.anchors = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    s.recordings = g_ptr_array_new();
+    s.replay = g_array_new(FALSE, FALSE, sizeof(yaml_replay_frame));
+
+    ret = process_yaml(filename, contents, &s, error);
+
+    if (s.peeked)
+        yaml_event_delete(&s.event);
+    g_array_free(s.replay, TRUE);
+    for (guint i = 0; i < s.recordings->len; i++) {
+        yaml_recording* r = g_ptr_array_index(s.recordings, i);
+        g_free(r->anchor);
+        g_free(r);
+    }
+    g_ptr_array_free(s.recordings, TRUE);
+    g_hash_table_destroy(s.anchors);
+    g_ptr_array_free(s.nodes, TRUE);
+    if (!preparsed) {
+        yaml_parser_delete(&s.parser);
+        g_bytes_unref(contents);
+    }
+    netplan_timing_stop(&parse);
+    netplan_timings_add_file(filename, &load, &parse);
+    return ret;
+}
+
+/**
+ * Parse given YAML file and create/update global "netdefs" list.
+ */
+gboolean
+netplan_parse_yaml(const char* filename, GError** error)
+{
+    current_file = filename;
+    return stream_yaml(filename, NULL, error);
+}
+
+static void
+finish_iterator(gpointer key, gpointer value, gpointer user_data)
+{
+    GError **error = (GError **)user_data;
+    NetplanNetDefinition* nd = value;
+
+    /* Take more steps to make sure we always have a backend set for netdefs */
+    if (nd->backend == NETPLAN_BACKEND_NONE) {
+        nd->backend = get_default_backend_for_type(nd->type);
+        g_debug("%s: setting default backend to %i", nd->id, nd->backend);
+    }
+
+    /* Do a final pass of validation for backend-specific conditions */
+    if (validate_backend_rules(nd, error))
+        g_debug("Configuration is valid");
+}
+
+/**
+ * Post-processing after parsing all config files
+ */
+GHashTable *
+netplan_finish_parse(GError** error)
+{
+    NetplanTiming validate;
+
+    netplan_timing_start(&validate);
+    if (npp->netdefs) {
+        GError *recoverable = NULL;
+        g_debug("We have some netdefs, pass them through a final round of validation");
+        if (!validate_route_consistency(npp->netdefs, &recoverable)) {
+            g_warning("Problem encountered while validating route consistency.\n"
+                      "%s", (recoverable) ? recoverable->message : "");
+            g_clear_error(&recoverable);
+        }
+        g_hash_table_foreach(npp->netdefs, finish_iterator, error);
+    }
+    netplan_timing_stop(&validate);
+    netplan_timings_add(NETPLAN_PHASE_VALIDATE, &validate);
+
+    if (error && *error)
+        return NULL;
+
+    return npp->netdefs;
+}
+
+/**
+ * Return current global backend.
+ */
+NetplanBackend
+netplan_get_global_backend()
+{
+    return npp->backend_global;
+}
+
+/**
+ * Free @array, calling @destructor on each of its pointer elements first.
+ */
+static void
+free_garray_with_destructor(GArray** array, GDestroyNotify destructor)
+{
+    if (!*array)
+        return;
+    for (guint i = 0; i < (*array)->len; ++i)
+        destructor(g_array_index(*array, gpointer, i));
+    g_array_free(*array, TRUE);
+    *array = NULL;
+}
+
+static void
+free_address_array(GArray** array)
+{
+    if (!*array)
+        return;
+    for (guint i = 0; i < (*array)->len; ++i)
+        g_free(g_array_index(*array, NetplanAddress, i).text);
+    g_array_free(*array, TRUE);
+    *array = NULL;
+}
+
+static void
+free_address_options(NetplanAddressOptions* opts)
+{
+    g_free(opts->address);
+    g_free(opts->lifetime);
+    g_free(opts->label);
+    g_free(opts);
+}
+
+static void
+free_route(NetplanIPRoute* route)
+{
+    g_free(route->type);
+    g_free(route->scope);
+    g_free(route->from);
+    g_free(route->to);
+    g_free(route->via);
+    g_free(route);
+}
+
+static void
+free_ip_rule(NetplanIPRule* rule)
+{
+    g_free(rule->from);
+    g_free(rule->to);
+    g_free(rule);
+}
+
+static void
+free_wireguard_peer(NetplanWireguardPeer* peer)
+{
+    g_free(peer->endpoint);
+    g_free(peer->public_key);
+    g_free(peer->preshared_key);
+    g_clear_pointer(&peer->allowed_ips_set, g_hash_table_destroy);
+    free_address_array(&peer->allowed_ips);
+    g_free(peer);
+}
+
+static void
+free_auth_settings(NetplanAuthenticationSettings* auth)
+{
+    g_free(auth->identity);
+    g_free(auth->anonymous_identity);
+    g_free(auth->password);
+    g_free(auth->ca_certificate);
+    g_free(auth->client_certificate);
+    g_free(auth->client_key);
+    g_free(auth->client_key_password);
+    g_free(auth->phase2_auth);
+}
+
+static void
+free_backend_settings(NetplanBackendSettings* settings)
+{
+    /* networkd.unit shares its storage with nm.name */
+    g_free(settings->nm.name);
+    g_free(settings->nm.uuid);
+    g_free(settings->nm.stable_id);
+    g_free(settings->nm.device);
+    g_datalist_clear(&settings->nm.passthrough);
+}
+
+static void
+free_ovs_settings(NetplanOVSSettings* ovs)
+{
+    g_clear_pointer(&ovs->external_ids, g_hash_table_destroy);
+    g_clear_pointer(&ovs->other_config, g_hash_table_destroy);
+    g_free(ovs->lacp);
+    g_free(ovs->fail_mode);
+    free_garray_with_destructor(&ovs->protocols, g_free);
+    g_free(ovs->controller.connection_mode);
+    free_garray_with_destructor(&ovs->controller.addresses, g_free);
+    free_auth_settings(&ovs->ssl);
+}
+
+static void
+free_access_point(NetplanWifiAccessPoint* ap)
+{
+    g_free(ap->ssid);
+    g_free(ap->bssid);
+    free_auth_settings(&ap->auth);
+    free_backend_settings(&ap->backend_settings);
+    g_free(ap);
+}
+
+/**
+ * Free @nd along with all the data it owns. Definitions it links to
+ * (vlan_link, sriov_link) are owned by netdefs_ordered themselves.
+ */
+static void
+free_netdef(NetplanNetDefinition* nd)
+{
+    g_free(nd->id);
+    g_free(nd->dhcp_identifier);
+    g_free(nd->dhcp4_overrides.use_domains);
+    g_free(nd->dhcp4_overrides.hostname);
+    g_free(nd->dhcp6_overrides.use_domains);
+    g_free(nd->dhcp6_overrides.hostname);
+    g_clear_pointer(&nd->ip4_address_set, g_hash_table_destroy);
+    g_clear_pointer(&nd->ip6_address_set, g_hash_table_destroy);
+    g_clear_pointer(&nd->address_options_set, g_hash_table_destroy);
+    free_address_array(&nd->ip4_addresses);
+    free_address_array(&nd->ip6_addresses);
+    free_garray_with_destructor(&nd->address_options, (GDestroyNotify) free_address_options);
+    g_free(nd->ip6_addr_gen_token);
+    g_free(nd->gateway4.text);
+    g_free(nd->gateway6.text);
+    free_address_array(&nd->ip4_nameservers);
+    free_address_array(&nd->ip6_nameservers);
+    free_garray_with_destructor(&nd->search_domains, g_free);
+    free_garray_with_destructor(&nd->routes, (GDestroyNotify) free_route);
+    free_garray_with_destructor(&nd->ip_rules, (GDestroyNotify) free_ip_rule);
+    free_garray_with_destructor(&nd->wireguard_peers, (GDestroyNotify) free_wireguard_peer);
+    g_free(nd->bridge);
+    g_free(nd->bond);
+    g_free(nd->peer);
+    g_free(nd->set_mac);
+    g_free(nd->set_name);
+    g_free(nd->match.driver);
+    g_free(nd->match.mac);
+    g_free(nd->match.original_name);
+
+    if (nd->access_points) {
+        /* the SSID keys belong to the access points */
+        GHashTableIter iter;
+        gpointer value;
+        g_hash_table_iter_init(&iter, nd->access_points);
+        while (g_hash_table_iter_next(&iter, NULL, &value))
+            free_access_point(value);
+        g_hash_table_destroy(nd->access_points);
+    }
+
+    g_free(nd->bond_params.mode);
+    g_free(nd->bond_params.lacp_rate);
+    g_free(nd->bond_params.monitor_interval);
+    g_free(nd->bond_params.transmit_hash_policy);
+    g_free(nd->bond_params.selection_logic);
+    g_free(nd->bond_params.arp_interval);
+    free_garray_with_destructor(&nd->bond_params.arp_ip_targets, g_free);
+    g_free(nd->bond_params.arp_validate);
+    g_free(nd->bond_params.arp_all_targets);
+    g_free(nd->bond_params.up_delay);
+    g_free(nd->bond_params.down_delay);
+    g_free(nd->bond_params.fail_over_mac_policy);
+    g_free(nd->bond_params.primary_reselect_policy);
+    g_free(nd->bond_params.learn_interval);
+    g_free(nd->bond_params.primary_slave);
+
+    g_free(nd->modem_params.apn);
+    g_free(nd->modem_params.device_id);
+    g_free(nd->modem_params.network_id);
+    g_free(nd->modem_params.number);
+    g_free(nd->modem_params.password);
+    g_free(nd->modem_params.pin);
+    g_free(nd->modem_params.sim_id);
+    g_free(nd->modem_params.sim_operator_id);
+    g_free(nd->modem_params.username);
+
+    g_free(nd->bridge_params.ageing_time);
+    g_free(nd->bridge_params.forward_delay);
+    g_free(nd->bridge_params.hello_time);
+    g_free(nd->bridge_params.max_age);
+
+    g_free(nd->tunnel.local_ip);
+    g_free(nd->tunnel.remote_ip);
+    g_free(nd->tunnel.input_key);
+    g_free(nd->tunnel.output_key);
+    g_free(nd->tunnel.private_key);
+
+    free_auth_settings(&nd->auth);
+    free_ovs_settings(&nd->ovs_settings);
+    free_backend_settings(&nd->backend_settings);
+    g_free(nd->filename);
+    g_free(nd->activation_mode);
+    g_free(nd);
+}
+
+/**
+ * Clear NetplanNetDefinition hashtable
+ */
+guint
+netplan_clear_netdefs()
+{
+    guint n = 0;
+    if(npp->netdefs) {
+        n = g_hash_table_size(npp->netdefs);
+        g_clear_pointer(&npp->netdefs, g_hash_table_destroy);
+    }
+    invalidate_netdef_indices();
+    /* netdefs_ordered owns the definitions */
+    g_clear_list(&npp->netdefs_ordered, (GDestroyNotify) free_netdef);
+    npp->netdefs_ordered_last = NULL;
+    npp->has_input = FALSE;
+    npp->backend_global = NETPLAN_BACKEND_NONE;
+    free_ovs_settings(&npp->ovs_settings_global);
+    npp->ovs_settings_global = (NetplanOVSSettings){0};
+    publish_default_parser();
+    return n;
+}
+
+void
+process_input_file(const char* f)
+{
+    GError* error = NULL;
+
+    g_debug("Processing input file %s..", f);
+    if (!netplan_parse_yaml(f, &error)) {
+        g_fprintf(stderr, "%s\n", error->message);
+        exit(1);
+    }
+}
+
+/**
+ * Return the sorted list of YAML files making up the configuration below
+ * @rootdir, or NULL if they cannot be enumerated.
+ */
+GPtrArray*
+yaml_hierarchy_files(const char* rootdir)
+{
+    glob_t gl;
+    GPtrArray* files;
+    NetplanTiming timing;
+    /* Files with asciibetically higher names override/append settings from
+     * earlier ones (in all config dirs); files in /run/netplan/
+     * shadow files in /etc/netplan/ which shadow files in /lib/netplan/.
+     * To do that, we put all found files in a hash table, then sort it by
+     * file name, and add the entries from /run after the ones from /etc
+     * and those after the ones from /lib. */
+    netplan_timing_start(&timing);
+    if (find_yaml_glob(rootdir, &gl) != 0)
+        return NULL; // LCOV_EXCL_LINE
+    /* keys are strdup()ed, free them; values point into the glob_t, don't free them */
+    g_autoptr(GHashTable) configs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_autoptr(GList) config_keys = NULL;
+
+    for (size_t i = 0; i < gl.gl_pathc; ++i)
+        g_hash_table_insert(configs, g_path_get_basename(gl.gl_pathv[i]), gl.gl_pathv[i]);
+
+    config_keys = g_list_sort(g_hash_table_get_keys(configs), (GCompareFunc) strcmp);
+
+    files = g_ptr_array_new_with_free_func(g_free);
+    for (GList* i = config_keys; i != NULL; i = i->next)
+        g_ptr_array_add(files, g_strdup(g_hash_table_lookup(configs, i->data)));
+    globfree(&gl);
+    netplan_timing_stop(&timing);
+    netplan_timings_add(NETPLAN_PHASE_GLOB, &timing);
+    return files;
+}
+
+/* Files of at least this size do not get preparsed as a whole, but streamed
+ * when it is their turn, to keep the memory needed for them down */
+#define PRELOAD_YAML_MAX_SIZE (256 * 1024)
+
+typedef struct {
+    const char* filename;
+    preparsed_yaml yaml; /* set by the worker */
+    gboolean loaded; /* set by the worker, under preload_state.lock */
+    gboolean stream;
+} preload_entry;
+
+typedef struct {
+    GMutex lock;
+    GCond loaded;
+} preload_state;
+
+static void
+preload_yaml_worker(gpointer data, gpointer user_data)
+{
+    preload_entry* entry = data;
+    preload_state* state = user_data;
+
+    netplan_timing_start(&entry->yaml.load);
+    preparse_yaml(entry->filename, &entry->yaml);
+    netplan_timing_stop(&entry->yaml.load);
+    g_mutex_lock(&state->lock);
+    entry->loaded = TRUE;
+    g_cond_broadcast(&state->loaded);
+    g_mutex_unlock(&state->lock);
+}
+
+/* Record the state after parsing the first @position files in @cache, if any */
+static void
+checkpoint_state(NetplanStateCache* cache, guint position)
+{
+    if (cache)
+        netplan_state_cache_checkpoint(cache, position, npp->netdefs_ordered, npp->backend_global,
+                                       &npp->ovs_settings_global);
+}
+
+/**
+ * Parse the given YAML @files in order from index @first on, into the global
+ * "netdefs" list. Reading and YAML-parsing the files is independent of each
+ * other, so this happens on a pool of worker threads, while the loaded
+ * documents get processed strictly in the given order here. That keeps the
+ * result (and which error gets reported first) the same as parsing them one
+ * by one. Big files are streamed here instead, see PRELOAD_YAML_MAX_SIZE.
+ * The state after each file is offered to @cache, if given.
+ */
+static gboolean
+parse_yaml_files(const GPtrArray* files, guint first, NetplanStateCache* cache, GError** error)
+{
+    preload_state state;
+    preload_entry* entries = NULL;
+    GThreadPool* pool = NULL;
+    /* At least one worker, so that loading overlaps with processing here,
+     * even on a single core */
+    guint threads = CLAMP(g_get_num_processors(), 1, files->len - first);
+    gboolean ret = TRUE;
+    guint i;
+
+    /* Use an exclusive pool, whose threads are gone again when we return:
+     * the threads of a shared pool would not survive a fork() of the
+     * process, while the pool would still count on them. */
+    if (files->len - first >= 2)
+        pool = g_thread_pool_new(preload_yaml_worker, &state, threads, TRUE, NULL);
+    if (!pool) {
+        for (i = first; i < files->len && ret; ++i) {
+            g_debug("Processing input file %s..", (char*) g_ptr_array_index(files, i));
+            ret = netplan_parse_yaml(g_ptr_array_index(files, i), error);
+            if (ret)
+                checkpoint_state(cache, i + 1);
+        }
+        return ret;
+    }
+
+    g_mutex_init(&state.lock);
+    g_cond_init(&state.loaded);
+    entries = g_new0(preload_entry, files->len);
+    for (i = first; i < files->len; ++i) {
+        GStatBuf st;
+
+        entries[i].filename = g_ptr_array_index(files, i);
+        if (g_stat(entries[i].filename, &st) == 0 && st.st_size >= PRELOAD_YAML_MAX_SIZE)
+            entries[i].stream = entries[i].loaded = TRUE;
+        else
+            g_thread_pool_push(pool, &entries[i], NULL);
+    }
+
+    for (i = first; i < files->len && ret; ++i) {
+        g_mutex_lock(&state.lock);
+        while (!entries[i].loaded)
+            g_cond_wait(&state.loaded, &state.lock);
+        g_mutex_unlock(&state.lock);
+
+        g_debug("Processing input file %s..", entries[i].filename);
+        if (entries[i].stream) {
+            ret = netplan_parse_yaml(entries[i].filename, error);
+        } else if (!entries[i].yaml.contents) {
+            g_propagate_error(error, entries[i].yaml.error);
+            entries[i].yaml.error = NULL;
+            ret = FALSE;
+        } else {
+            ret = stream_yaml(entries[i].filename, &entries[i].yaml, error);
+        }
+        clear_preparsed_yaml(&entries[i].yaml);
+        if (ret)
+            checkpoint_state(cache, i + 1);
+    }
+
+    /* After an error: drop the queued files, wait for the running ones and
+     * discard whatever got preparsed but not processed */
+    g_thread_pool_free(pool, TRUE, TRUE);
+    for (; i < files->len; ++i)
+        clear_preparsed_yaml(&entries[i].yaml);
+    g_free(entries);
+    g_cond_clear(&state.loaded);
+    g_mutex_clear(&state.lock);
+    return ret;
+}
+
+/**
+ * Parse the YAML @files of the hierarchy below @rootdir, like
+ * parse_yaml_files(). If nothing got parsed yet, this goes through the state
+ * cache: the state after the leading files which did not change since it was
+ * saved gets loaded from there, and only the files from the first changed one
+ * on get parsed (none at all if nothing changed). The cache is updated then.
+ */
+static gboolean
+parse_yaml_hierarchy_files(const char* rootdir, const GPtrArray* files, GError** error)
+{
+    NetplanStateCache* cache = NULL;
+    guint first = 0;
+    gboolean ret;
+
+    /* the cache holds the state of parsing the hierarchy on its own */
+    if (!npp->has_input && !npp->netdefs_ordered)
+        netplan_timed(NETPLAN_PHASE_CACHE, cache = netplan_state_cache_new(rootdir, files));
+    if (cache) {
+        netplan_timed(NETPLAN_PHASE_CACHE,
+                      first = netplan_state_cache_load(cache, &npp->backend_global, &npp->ovs_settings_global));
+        npp->cur_netdef = NULL;
+        if (first > 0) {
+            npp->has_input = TRUE;
+            publish_default_parser();
+        } else {
+            /* drop whatever a stale or broken cache left behind */
+            netplan_clear_netdefs();
+        }
+        if (first == files->len) {
+            netplan_state_cache_free(cache);
+            return TRUE;
+        }
+    }
+
+    ret = parse_yaml_files(files, first, cache, error);
+    if (ret && cache)
+        netplan_timed(NETPLAN_PHASE_CACHE, netplan_state_cache_save(cache));
+    netplan_state_cache_free(cache);
+    return ret;
+}
+
+gboolean
+process_yaml_hierarchy(const char* rootdir)
+{
+    g_autoptr(GPtrArray) files = yaml_hierarchy_files(rootdir);
+    GError* error = NULL;
+    if (!files)
+        return FALSE; // LCOV_EXCL_LINE
+
+    if (!parse_yaml_hierarchy_files(rootdir, files, &error)) {
+        g_fprintf(stderr, "%s\n", error->message);
+        exit(1);
+    }
+    return TRUE;
+}
+
+/**
+ * Parse the full YAML hierarchy below @rootdir into the global "netdefs"
+ * list, like process_yaml_hierarchy(), but report errors through @error
+ * instead of exiting. For long running users of the library.
+ */
+gboolean
+netplan_parse_yaml_hierarchy(const char* rootdir, GError** error)
+{
+    g_autoptr(GPtrArray) files = yaml_hierarchy_files(rootdir);
+    if (!files) {
+        // LCOV_EXCL_START
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Cannot list YAML files below %s", rootdir ?: "/");
+        return FALSE;
+        // LCOV_EXCL_STOP
+    }
+
+    return parse_yaml_hierarchy_files(rootdir, files, error);
+}
+
+/****************************************************
+ * Parser handles
+ ****************************************************/
+
+/**
+ * Create a new, empty parser. Unlike the process-global entry points above,
+ * which all work on one implicit parser, any number of these can be used at
+ * the same time, e.g. to validate configurations in parallel threads. A single
+ * parser must only be used by one thread at a time, though.
+ */
+NetplanParser*
+netplan_parser_new()
+{
+    return g_new0(NetplanParser, 1);
+}
+
+/**
+ * Parse the YAML file @filename into the definitions of @parser, like
+ * netplan_parse_yaml().
+ */
+gboolean
+netplan_parser_parse_file(NetplanParser* parser, const char* filename, GError** error)
+{
+    NetplanParser* prev = npp;
+    gboolean ret;
+
+    npp = parser;
+    ret = netplan_parse_yaml(filename, error);
+    npp = prev;
+    return ret;
+}
+
+/**
+ * Parse the full YAML hierarchy below @rootdir into the definitions of
+ * @parser, like netplan_parse_yaml_hierarchy().
+ */
+gboolean
+netplan_parser_parse_hierarchy(NetplanParser* parser, const char* rootdir, GError** error)
+{
+    NetplanParser* prev = npp;
+    gboolean ret;
+
+    npp = parser;
+    ret = netplan_parse_yaml_hierarchy(rootdir, error);
+    npp = prev;
+    return ret;
+}
+
+/**
+ * Bring the definitions of @parser up to date with the YAML hierarchy below
+ * @rootdir, for long running users of the library which keep a parser around
+ * and need to follow changes of the hierarchy. Like
+ * netplan_parser_parse_hierarchy(), but instead of the on-disk state cache,
+ * this continues from the checkpoints the previous update of @parser left in
+ * memory: only the files from the first changed one on get parsed again.
+ */
+gboolean
+netplan_parser_update_hierarchy(NetplanParser* parser, const char* rootdir, GError** error)
+{
+    g_autoptr(GPtrArray) files = yaml_hierarchy_files(rootdir);
+    NetplanParser* prev = npp;
+    NetplanStateCache* cache = NULL;
+    guint first = 0;
+    gboolean ret;
+
+    if (!files) {
+        // LCOV_EXCL_START
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Cannot list YAML files below %s", rootdir ?: "/");
+        return FALSE;
+        // LCOV_EXCL_STOP
+    }
+
+    npp = parser;
+    netplan_clear_netdefs();
+    netplan_timed(NETPLAN_PHASE_CACHE, cache = netplan_state_cache_new(rootdir, files));
+    if (cache && parser->checkpoints) {
+        netplan_timed(NETPLAN_PHASE_CACHE,
+                      first = netplan_state_cache_resume(cache, parser->checkpoints,
+                                                         &parser->backend_global, &parser->ovs_settings_global));
+        parser->cur_netdef = NULL;
+        if (first > 0) {
+            parser->has_input = TRUE;
+            publish_default_parser();
+        } else {
+            /* drop whatever a broken checkpoint left behind */
+            netplan_clear_netdefs();
+        }
+    }
+    ret = first == files->len || parse_yaml_files(files, first, cache, error);
+    /* Even after an error, the checkpoints before the broken file are valid */
+    netplan_state_cache_free(parser->checkpoints);
+    parser->checkpoints = cache;
+    npp = prev;
+    return ret;
+}
+
+/**
+ * Post-process the definitions of @parser after parsing all files, like
+ * netplan_finish_parse().
+ *
+ * Returns: the ID → NetplanNetDefinition* map owned by @parser, or NULL on
+ *          error or if nothing was defined.
+ */
+GHashTable*
+netplan_parser_finish(NetplanParser* parser, GError** error)
+{
+    NetplanParser* prev = npp;
+    GHashTable* ret;
+
+    npp = parser;
+    ret = netplan_finish_parse(error);
+    npp = prev;
+    return ret;
+}
+
+/**
+ * Return the global backend ("renderer") of the definitions in @parser.
+ */
+NetplanBackend
+netplan_parser_get_backend(const NetplanParser* parser)
+{
+    return parser->backend_global;
+}
+
+/**
+ * Return the ID → NetplanNetDefinition* map of the definitions in @parser,
+ * as parsed so far, or NULL if nothing was defined.
+ */
+GHashTable*
+netplan_parser_get_netdefs(const NetplanParser* parser)
+{
+    return parser->netdefs;
+}
+
+/**
+ * Return the global OpenVSwitch settings of the definitions in @parser.
+ */
+const NetplanOVSSettings*
+netplan_parser_get_ovs_settings(const NetplanParser* parser)
+{
+    return &parser->ovs_settings_global;
+}
+
+/**
+ * Free @parser together with all of its definitions.
+ */
+void
+netplan_parser_free(NetplanParser* parser)
+{
+    NetplanParser* prev = npp;
+
+    if (!parser)
+        return;
+    npp = parser;
+    netplan_clear_netdefs();
+    npp = prev;
+    netplan_state_cache_free(parser->checkpoints);
+    g_free(parser);
 }
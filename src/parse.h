@@ -24,15 +24,9 @@
 #define NETPLAN_VERSION_MAX	3
 
 
-/* file that is currently being processed, for useful error messages */
-extern const char* current_file;
-
-/* List of "seen" ids not found in netdefs yet by the parser.
- * These are removed when it exists in this list and we reach the point of
- * creating a netdef for that id; so by the time we're done parsing the yaml
- * document it should be empty. */
-extern GHashTable *missing_id;
-extern int missing_ids_found;
+/* file that is currently being processed (by the calling thread), for useful
+ * error messages */
+extern __thread const char* current_file;
 
 /****************************************************
  * Parsed definitions
@@ -176,11 +170,6 @@ typedef enum {
     NETPLAN_AUTH_EAP_METHOD_MAX,
 } NetplanAuthEAPMethod;
 
-typedef struct missing_node {
-    char* netdef_id;
-    const yaml_node_t* node;
-} NetplanMissingNode;
-
 typedef struct authentication_settings {
     NetplanAuthKeyManagementType key_management;
     NetplanAuthEAPMethod eap_method;
@@ -237,6 +226,21 @@ typedef union {
     } networkd;
 } NetplanBackendSettings;
 
+/* An IP address or network in binary, parsed once from its text form. The
+ * text is kept alongside for writing it out again as it was given. */
+typedef struct {
+    guint family; /* AF_INET or AF_INET6, 0 if not set */
+    guint prefix; /* prefix length as given, the full address length if none was */
+    guint8 addr[16]; /* in network byte order, IPv4 only uses the first 4 bytes */
+} NetplanIPPrefix;
+
+/* An address, gateway or nameserver of a definition. Its text is only kept
+ * if format_address() would write it differently, like "2001:DB8::1". */
+typedef struct {
+    NetplanIPPrefix ip;
+    char* text;
+} NetplanAddress;
+
 /**
  * Represent a configuration stanza
  */
@@ -264,16 +268,23 @@ struct net_definition {
     NetplanDHCPOverrides dhcp4_overrides;
     NetplanDHCPOverrides dhcp6_overrides;
     NetplanRAMode accept_ra;
-    GArray* ip4_addresses;
-    GArray* ip6_addresses;
+    GArray* ip4_addresses; /* NetplanAddress */
+    GArray* ip6_addresses; /* NetplanAddress */
     GArray* address_options;
+    /* sets of the addresses in the three arrays above (their NetplanIPPrefix
+     * and address strings, respectively), for not adding an address twice on
+     * multiple passes; built on first use, see append_address(), and kept in
+     * sync with the arrays */
+    GHashTable* ip4_address_set;
+    GHashTable* ip6_address_set;
+    GHashTable* address_options_set;
     gboolean ip6_privacy;
     guint ip6_addr_gen_mode;
     char* ip6_addr_gen_token;
-    char* gateway4;
-    char* gateway6;
-    GArray* ip4_nameservers;
-    GArray* ip6_nameservers;
+    NetplanAddress gateway4; /* ip.family 0 if not set */
+    NetplanAddress gateway6;
+    GArray* ip4_nameservers; /* NetplanAddress */
+    GArray* ip6_nameservers; /* NetplanAddress */
     GArray* search_domains;
     GArray* routes;
     GArray* ip_rules;
@@ -422,7 +433,9 @@ typedef struct {
     char *endpoint;
     char *public_key;
     char *preshared_key;
-    GArray *allowed_ips;
+    GArray *allowed_ips; /* NetplanAddress */
+    /* see ip4_address_set of NetplanNetDefinition */
+    GHashTable *allowed_ips_set;
     guint keepalive;
 } NetplanWireguardPeer;
 
@@ -470,6 +483,10 @@ typedef struct {
     char* from;
     char* to;
     char* via;
+    /* binary forms of the above; to_ip is zero for "default" */
+    NetplanIPPrefix from_ip;
+    NetplanIPPrefix to_ip;
+    NetplanIPPrefix via_ip;
 
     gboolean onlink;
 
@@ -487,6 +504,9 @@ typedef struct {
 
     char* from;
     char* to;
+    /* binary forms of the above */
+    NetplanIPPrefix from_ip;
+    NetplanIPPrefix to_ip;
 
     /* table: Valid values are 1 <= x <= 4294967295) */
     guint table;
@@ -497,11 +517,20 @@ typedef struct {
     guint tos;
 } NetplanIPRule;
 
-/* Written/updated by parse_yaml(): char* id →  net_definition */
+/* Written/updated by parse_yaml() of the default parser: char* id →  net_definition */
 extern GHashTable* netdefs;
 extern GList* netdefs_ordered;
 extern NetplanOVSSettings ovs_settings_global;
 
+/* Secondary lookup keys for netplan_netdefs_lookup() */
+typedef enum {
+    NETPLAN_NETDEF_INDEX_SET_NAME,
+    NETPLAN_NETDEF_INDEX_MATCH_NAME,
+    NETPLAN_NETDEF_INDEX_MATCH_MAC,
+    NETPLAN_NETDEF_INDEX_MATCH_DRIVER,
+    NETPLAN_NETDEF_INDEX_MAX_,
+} NetplanNetdefIndex;
+
 /****************************************************
  * Functions
  ****************************************************/
@@ -512,6 +541,22 @@ guint netplan_clear_netdefs();
 NetplanBackend netplan_get_global_backend();
 const char* tunnel_mode_to_string(NetplanTunnelMode mode);
 NetplanNetDefinition* netplan_netdef_new(const char* id, NetplanDefType type, NetplanBackend renderer);
+const GPtrArray* netplan_netdefs_lookup(NetplanNetdefIndex index, const char* key);
 
 void process_input_file(const char* f);
+GPtrArray* yaml_hierarchy_files(const char* rootdir);
 gboolean process_yaml_hierarchy(const char* rootdir);
+gboolean netplan_parse_yaml_hierarchy(const char* rootdir, GError** error);
+
+/* Opaque handle for the state of one parse, see netplan_parser_new() */
+typedef struct netplan_parser NetplanParser;
+
+NetplanParser* netplan_parser_new();
+gboolean netplan_parser_parse_file(NetplanParser* parser, const char* filename, GError** error);
+gboolean netplan_parser_parse_hierarchy(NetplanParser* parser, const char* rootdir, GError** error);
+gboolean netplan_parser_update_hierarchy(NetplanParser* parser, const char* rootdir, GError** error);
+GHashTable* netplan_parser_finish(NetplanParser* parser, GError** error);
+NetplanBackend netplan_parser_get_backend(const NetplanParser* parser);
+GHashTable* netplan_parser_get_netdefs(const NetplanParser* parser);
+const NetplanOVSSettings* netplan_parser_get_ovs_settings(const NetplanParser* parser);
+void netplan_parser_free(NetplanParser* parser);
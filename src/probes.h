@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2021 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/*
+ * USDT probes of the "netplan" provider, for bpftrace, perf or SystemTap
+ * (see tests/tracing/ for examples). They only get built with NETPLAN_SDT
+ * defined, which needs <sys/sdt.h>; otherwise they compile away entirely,
+ * including their arguments, so those must not have side effects.
+ *
+ *   load_start(filename)                  reading and loading a YAML file
+ *   load_end(filename, bytes, ok)         (for big, streamed files: only reading it)
+ *   document_start(filename)              processing a YAML document
+ *   document_end(filename, netdefs, ok)   into netdefs
+ *   netdef_new(id, type, backend)         a new netdef got created
+ *   networkd_start(id, type, backend)     rendering a netdef for networkd,
+ *   networkd_end(id, written)             whether it generated anything
+ *   nm_start(id, type, backend)           ... for NetworkManager
+ *   nm_end(id)
+ *   ovs_start(id, type, backend)          ... for Open vSwitch
+ *   ovs_end(id)
+ *   output_file(path, bytes, staged)      a generated file, staged in memory
+ *                                         (see netplan_output_stage()) or written
+ *
+ * Strings are passed as char*, the type as NetplanDefType (1 ethernet,
+ * 2 wifi, 3 modem, 4 bridge, 5 bond, 6 vlan, 7 tunnel, 8 OVS port,
+ * 9 NetworkManager passthrough) and the backend by name, as in
+ * netplan_backend_to_name.
+ */
+
+#ifdef NETPLAN_SDT
+#include <sys/sdt.h>
+
+#define NETPLAN_PROBE1(name, a) DTRACE_PROBE1(netplan, name, a)
+#define NETPLAN_PROBE2(name, a, b) DTRACE_PROBE2(netplan, name, a, b)
+#define NETPLAN_PROBE3(name, a, b, c) DTRACE_PROBE3(netplan, name, a, b, c)
+#else
+#define NETPLAN_PROBE1(name, a) do { } while (0)
+#define NETPLAN_PROBE2(name, a, b) do { } while (0)
+#define NETPLAN_PROBE3(name, a, b, c) do { } while (0)
+#endif
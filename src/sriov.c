@@ -35,6 +35,5 @@ write_sriov_conf_finish(const char* rootdir)
 void
 cleanup_sriov_conf(const char* rootdir)
 {
-    g_autofree char* rulepath = g_strjoin(NULL, rootdir ?: "", "/run/udev/rules.d/99-sriov-netplan-setup.rules", NULL);
-    unlink(rulepath);
+    unlink_glob(rootdir, "/run/udev/rules.d/99-sriov-netplan-setup.rules");
 }
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2021 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Accounting of where a generate run spends its time. Everything here is a
+ * no-op unless netplan_timings_enable() got called, which is meant to happen
+ * once at startup, before any threads exist.
+ */
+
+#include <time.h>
+
+#include <glib.h>
+
+#include "timings.h"
+#include "util.h"
+
+typedef struct {
+    guint calls;
+    NetplanTiming total;
+} NetplanPhaseTimings;
+
+typedef struct {
+    gchar* filename;
+    NetplanTiming load;
+    NetplanTiming parse;
+} NetplanFileTimings;
+
+static gboolean enabled;
+static NetplanTiming run;
+static NetplanPhaseTimings phases[NETPLAN_PHASE_MAX_];
+static guint counters[NETPLAN_COUNTER_MAX_];
+static GArray* files;
+/* libnetplan users might parse in several threads at once */
+G_LOCK_DEFINE_STATIC(timings);
+
+static gint64
+cpu_time(clockid_t clock)
+{
+    struct timespec ts;
+
+    if (clock_gettime(clock, &ts) != 0)
+        return 0; // LCOV_EXCL_LINE
+    return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+void
+netplan_timings_enable(void)
+{
+    enabled = TRUE;
+    run.wall = g_get_monotonic_time();
+    run.cpu = cpu_time(CLOCK_PROCESS_CPUTIME_ID);
+    files = g_array_new(FALSE, FALSE, sizeof(NetplanFileTimings));
+}
+
+gboolean
+netplan_timings_enabled(void)
+{
+    return enabled;
+}
+
+void
+netplan_timing_start(NetplanTiming* t)
+{
+    if (!enabled)
+        return;
+    t->wall = g_get_monotonic_time();
+    t->cpu = cpu_time(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void
+netplan_timing_stop(NetplanTiming* t)
+{
+    if (!enabled)
+        return;
+    t->wall = g_get_monotonic_time() - t->wall;
+    t->cpu = cpu_time(CLOCK_THREAD_CPUTIME_ID) - t->cpu;
+}
+
+static void
+add_timing(NetplanPhase phase, const NetplanTiming* t)
+{
+    phases[phase].calls++;
+    phases[phase].total.wall += t->wall;
+    phases[phase].total.cpu += t->cpu;
+}
+
+/**
+ * Account the span @t, stopped with netplan_timing_stop(), to @phase.
+ */
+void
+netplan_timings_add(NetplanPhase phase, const NetplanTiming* t)
+{
+    if (!enabled)
+        return;
+    G_LOCK(timings);
+    add_timing(phase, t);
+    G_UNLOCK(timings);
+}
+
+/**
+ * Record the time it took to load (read, and YAML-parse unless streamed) and
+ * to parse (process into netdefs) @filename, and account them to the load
+ * and parse phases.
+ */
+void
+netplan_timings_add_file(const char* filename, const NetplanTiming* load, const NetplanTiming* parse)
+{
+    NetplanFileTimings entry;
+
+    if (!enabled)
+        return;
+    entry = (NetplanFileTimings){ g_strdup(filename), *load, *parse };
+    G_LOCK(timings);
+    g_array_append_val(files, entry);
+    add_timing(NETPLAN_PHASE_LOAD, load);
+    add_timing(NETPLAN_PHASE_PARSE, parse);
+    counters[NETPLAN_COUNTER_FILES_PARSED]++;
+    G_UNLOCK(timings);
+}
+
+void
+netplan_timings_count(NetplanCounter counter, guint n)
+{
+    if (!enabled)
+        return;
+    G_LOCK(timings);
+    counters[counter] += n;
+    G_UNLOCK(timings);
+}
+
+static void
+g_string_append_timing(GString* s, const NetplanTiming* t)
+{
+    g_string_append_printf(s, "\"wall-us\": %" G_GINT64_FORMAT ", \"cpu-us\": %" G_GINT64_FORMAT, t->wall, t->cpu);
+}
+
+/**
+ * Print everything accounted since netplan_timings_enable() to @f, as a JSON
+ * object. All phases and counters are always listed, also if they did not
+ * happen. The time of the load phase is the sum over the worker threads,
+ * which load files in parallel.
+ */
+void
+netplan_timings_print(FILE* f)
+{
+    NetplanTiming total;
+    GString* s;
+
+    if (!enabled)
+        return;
+    total.wall = g_get_monotonic_time() - run.wall;
+    total.cpu = cpu_time(CLOCK_PROCESS_CPUTIME_ID) - run.cpu;
+
+    G_LOCK(timings);
+    s = g_string_new("{\"total\": {");
+    g_string_append_timing(s, &total);
+    g_string_append(s, "},\n \"phases\": {");
+    for (guint i = 0; i < NETPLAN_PHASE_MAX_; i++) {
+        g_string_append(s, i ? ",\n  " : "\n  ");
+        g_string_append_json_string(s, netplan_phase_to_str[i]);
+        g_string_append_printf(s, ": {\"calls\": %u, ", phases[i].calls);
+        g_string_append_timing(s, &phases[i].total);
+        g_string_append_c(s, '}');
+    }
+    g_string_append(s, "},\n \"files\": [");
+    for (guint i = 0; i < files->len; i++) {
+        const NetplanFileTimings* entry = &g_array_index(files, NetplanFileTimings, i);
+        g_string_append(s, i ? ",\n  {\"path\": " : "\n  {\"path\": ");
+        g_string_append_json_string(s, entry->filename);
+        g_string_append(s, ", \"load\": {");
+        g_string_append_timing(s, &entry->load);
+        g_string_append(s, "}, \"parse\": {");
+        g_string_append_timing(s, &entry->parse);
+        g_string_append(s, "}}");
+    }
+    g_string_append(s, "],\n \"counters\": {");
+    for (guint i = 0; i < NETPLAN_COUNTER_MAX_; i++) {
+        g_string_append(s, i ? ", " : "");
+        g_string_append_json_string(s, netplan_counter_to_str[i]);
+        g_string_append_printf(s, ": %u", counters[i]);
+    }
+    g_string_append(s, "}}\n");
+    G_UNLOCK(timings);
+
+    fputs(s->str, f);
+    fflush(f);
+    g_string_free(s, TRUE);
+}
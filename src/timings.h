@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2021 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <glib.h>
+
+/* Phases of a generate run whose wall clock and CPU time get accounted */
+typedef enum {
+    NETPLAN_PHASE_GLOB,
+    NETPLAN_PHASE_CACHE,
+    NETPLAN_PHASE_LOAD,
+    NETPLAN_PHASE_PARSE,
+    NETPLAN_PHASE_VALIDATE,
+    NETPLAN_PHASE_RENDER_NETWORKD,
+    NETPLAN_PHASE_RENDER_NM,
+    NETPLAN_PHASE_RENDER_OVS,
+    NETPLAN_PHASE_RENDER_SRIOV,
+    NETPLAN_PHASE_WRITE,
+    NETPLAN_PHASE_UNLINK,
+    NETPLAN_PHASE_UDEV_RELOAD,
+    NETPLAN_PHASE_JIT_START,
+    NETPLAN_PHASE_MAX_,
+} NetplanPhase;
+
+static const char* const netplan_phase_to_str[NETPLAN_PHASE_MAX_] = {
+    [NETPLAN_PHASE_GLOB] = "glob",
+    [NETPLAN_PHASE_CACHE] = "cache",
+    [NETPLAN_PHASE_LOAD] = "load",
+    [NETPLAN_PHASE_PARSE] = "parse",
+    [NETPLAN_PHASE_VALIDATE] = "validate",
+    [NETPLAN_PHASE_RENDER_NETWORKD] = "render-networkd",
+    [NETPLAN_PHASE_RENDER_NM] = "render-nm",
+    [NETPLAN_PHASE_RENDER_OVS] = "render-ovs",
+    [NETPLAN_PHASE_RENDER_SRIOV] = "render-sriov",
+    [NETPLAN_PHASE_WRITE] = "write",
+    [NETPLAN_PHASE_UNLINK] = "unlink",
+    [NETPLAN_PHASE_UDEV_RELOAD] = "udev-reload",
+    [NETPLAN_PHASE_JIT_START] = "jit-start",
+};
+
+typedef enum {
+    NETPLAN_COUNTER_FILES_PARSED,
+    NETPLAN_COUNTER_DOCUMENTS,
+    NETPLAN_COUNTER_DEFERRED_REFS,
+    NETPLAN_COUNTER_NETDEFS,
+    NETPLAN_COUNTER_FILES_WRITTEN,
+    NETPLAN_COUNTER_FILES_UNCHANGED,
+    NETPLAN_COUNTER_FILES_REMOVED,
+    NETPLAN_COUNTER_CHILDREN_SPAWNED,
+    NETPLAN_COUNTER_MAX_,
+} NetplanCounter;
+
+static const char* const netplan_counter_to_str[NETPLAN_COUNTER_MAX_] = {
+    [NETPLAN_COUNTER_FILES_PARSED] = "files-parsed",
+    [NETPLAN_COUNTER_DOCUMENTS] = "documents",
+    [NETPLAN_COUNTER_DEFERRED_REFS] = "deferred-refs",
+    [NETPLAN_COUNTER_NETDEFS] = "netdefs",
+    [NETPLAN_COUNTER_FILES_WRITTEN] = "files-written",
+    [NETPLAN_COUNTER_FILES_UNCHANGED] = "files-unchanged",
+    [NETPLAN_COUNTER_FILES_REMOVED] = "files-removed",
+    [NETPLAN_COUNTER_CHILDREN_SPAWNED] = "children-spawned",
+};
+
+/* A span of wall clock (monotonic) and CPU time of the calling thread, in
+ * microseconds: the start times until netplan_timing_stop(), the elapsed
+ * times after it */
+typedef struct {
+    gint64 wall;
+    gint64 cpu;
+} NetplanTiming;
+
+void netplan_timings_enable(void);
+gboolean netplan_timings_enabled(void);
+void netplan_timing_start(NetplanTiming* t);
+void netplan_timing_stop(NetplanTiming* t);
+void netplan_timings_add(NetplanPhase phase, const NetplanTiming* t);
+void netplan_timings_add_file(const char* filename, const NetplanTiming* load, const NetplanTiming* parse);
+void netplan_timings_count(NetplanCounter counter, guint n);
+void netplan_timings_print(FILE* f);
+
+/* Account the time of running @code to @phase */
+#define netplan_timed(phase, code) { \
+    NetplanTiming _timing; \
+    netplan_timing_start(&_timing); \
+    code; \
+    netplan_timing_stop(&_timing); \
+    netplan_timings_add(phase, &_timing); \
+}
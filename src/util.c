@@ -16,7 +16,15 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <linux/magic.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include <glib.h>
@@ -24,10 +32,125 @@
 
 #include "util.h"
 #include "netplan.h"
+#include "networkd.h"
+#include "nm.h"
+#include "openvswitch.h"
+#include "probes.h"
+#include "sriov.h"
+#include "timings.h"
 
 GHashTable* wifi_frequency_24;
 GHashTable* wifi_frequency_5;
 
+/* A generated file (or enablement symlink) which is held back in memory
+ * between netplan_output_stage() and netplan_output_commit(). */
+typedef struct {
+    gchar* contents;
+    gsize len;
+    /* SHA-256 of @contents */
+    gchar* checksum;
+    /* permissions the file gets created with (0666 masked by the umask it
+     * was staged with) */
+    mode_t mode;
+    /* symlink target; if set, this is a symlink and @contents is unused */
+    gchar* target;
+    /* netdef this file was generated for, see netplan_output_set_netdef() */
+    gchar* netdef_id;
+} NetplanStagedFile;
+
+/* canonical full path -> NetplanStagedFile; NULL while not staging */
+static GHashTable* staged_files;
+/* keys of @staged_files, in the order they were first staged */
+static GPtrArray* staged_order;
+/* canonical full paths of existing files matched by unlink_glob() while staging */
+static GHashTable* stale_files;
+static gchar* staged_rootdir;
+static gchar* staged_netdef_id;
+/* the umask at netplan_output_stage(), for files staged without a umask of
+ * their own */
+static mode_t staged_umask;
+
+typedef struct {
+    /* canonical full path */
+    gchar* path;
+    NetplanStagedFile* file;
+} NetplanStagedEntry;
+
+/* NetplanStagedEntry staged by a render worker for its current netdef, to be
+ * merged into @staged_files in the order of the netdefs; see
+ * render_netdefs_parallel() */
+static __thread GArray* thread_staged;
+
+static void
+staged_file_free(gpointer data)
+{
+    NetplanStagedFile* f = data;
+    g_free(f->contents);
+    g_free(f->checksum);
+    g_free(f->target);
+    g_free(f->netdef_id);
+    g_free(f);
+}
+
+static void
+output_change_free(gpointer data)
+{
+    NetplanOutputChange* change = data;
+    g_free(change->path);
+    g_free(change->netdef_id);
+    g_free(change);
+}
+
+/**
+ * Collapse repeated directory separators, so that paths built via
+ * g_build_path() and via concatenating rootdir and a glob compare equal.
+ */
+static gchar*
+canonical_output_path(const char* path)
+{
+    gchar* canon = g_malloc(strlen(path) + 1);
+    gchar* t = canon;
+
+    for (const char* f = path; *f; f++)
+        if (*f != '/' || t == canon || *(t-1) != '/')
+            *(t++) = *f;
+    *t = '\0';
+    return canon;
+}
+
+/**
+ * Add @f, staged for @path, to the staged output, replacing whatever got
+ * staged for @path before. Takes ownership of both.
+ */
+static void
+add_staged_file(gchar* path, NetplanStagedFile* f)
+{
+    if (!g_hash_table_contains(staged_files, path))
+        g_ptr_array_add(staged_order, path);
+    /* keeps the key which is in @staged_order already, frees @path then */
+    g_hash_table_insert(staged_files, path, f);
+}
+
+static void
+stage_file(const char* full_path, gchar* contents, gsize len, gchar* target, mode_t mode)
+{
+    NetplanStagedFile* f = g_new0(NetplanStagedFile, 1);
+    NetplanStagedEntry entry = { canonical_output_path(full_path), f };
+
+    f->contents = contents;
+    f->len = len;
+    f->mode = mode;
+    f->target = target;
+    if (contents)
+        f->checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar*) contents, len);
+    if (thread_staged) {
+        g_array_append_val(thread_staged, entry);
+        return;
+    }
+    f->netdef_id = g_strdup(staged_netdef_id);
+    add_staged_file(entry.path, f);
+}
+
 /**
  * Create the parent directories of given file path. Exit program on failure.
  */
@@ -43,24 +166,55 @@ safe_mkdir_p_dir(const char* file_path)
 }
 
 /**
- * Write a GString to a file and free it. Create necessary parent directories
- * and exit with error message on error.
- * @s: #GString whose contents to write. Will be fully freed afterwards.
- * @rootdir: optional rootdir (@NULL means "/")
- * @path: path of file to write (@rootdir will be prepended)
- * @suffix: optional suffix to append to path
+ * Create an (enablement) symlink, including its parent directories. An
+ * already existing @link is kept. Exit program on failure.
+ * @target: what the symlink points to
+ * @link: full path of the symlink to create
  */
-void g_string_free_to_file(GString* s, const char* rootdir, const char* path, const char* suffix)
+void
+safe_symlink(const char* target, const char* link)
+{
+    if (staged_files) {
+        stage_file(link, NULL, 0, g_strdup(target), 0);
+        return;
+    }
+
+    safe_mkdir_p_dir(link);
+    if (symlink(target, link) < 0 && errno != EEXIST) {
+        // LCOV_EXCL_START
+        g_fprintf(stderr, "failed to create enablement symlink: %m\n");
+        exit(1);
+        // LCOV_EXCL_STOP
+    }
+}
+
+/**
+ * Write a GString to a file and free it, see g_string_free_to_file().
+ * @mask: umask to create the file (and its directories) with, or %NULL for
+ *        the current one
+ */
+static void
+free_to_file(GString* s, const char* rootdir, const char* path, const char* suffix, const mode_t* mask)
 {
     g_autofree char* full_path = NULL;
     g_autofree char* path_suffix = NULL;
+    gsize len = s->len;
     g_autofree char* contents = g_string_free(s, FALSE);
     GError* error = NULL;
+    mode_t orig_umask = 0;
 
     path_suffix = g_strjoin(NULL, path, suffix, NULL);
     full_path = g_build_path(G_DIR_SEPARATOR_S, rootdir ?: G_DIR_SEPARATOR_S, path_suffix, NULL);
+    NETPLAN_PROBE3(output_file, full_path, len, staged_files != NULL);
+    if (staged_files) {
+        stage_file(full_path, g_steal_pointer(&contents), len, NULL, 0666 & ~(mask ? *mask : staged_umask));
+        return;
+    }
+
+    if (mask)
+        orig_umask = umask(*mask);
     safe_mkdir_p_dir(full_path);
-    if (!g_file_set_contents(full_path, contents, -1, &error)) {
+    if (!g_file_set_contents(full_path, contents, len, &error)) {
         /* the mkdir() just succeeded, there is no sensible
          * method to test this without root privileges, bind mounts, and
          * simulating ENOSPC */
@@ -69,10 +223,46 @@ void g_string_free_to_file(GString* s, const char* rootdir, const char* path, co
         exit(1);
         // LCOV_EXCL_STOP
     }
+    if (mask)
+        umask(orig_umask);
 }
 
 /**
- * Remove all files matching given glob.
+ * Write a GString to a file and free it. Create necessary parent directories
+ * and exit with error message on error. While staging output (see
+ * netplan_output_stage()), the file is only written on commit.
+ * @s: #GString whose contents to write. Will be fully freed afterwards.
+ * @rootdir: optional rootdir (@NULL means "/")
+ * @path: path of file to write (@rootdir will be prepended)
+ * @suffix: optional suffix to append to path
+ */
+void
+g_string_free_to_file(GString* s, const char* rootdir, const char* path, const char* suffix)
+{
+    free_to_file(s, rootdir, path, suffix, NULL);
+}
+
+/**
+ * Like g_string_free_to_file(), but create the file with @mask as umask,
+ * e.g. 077 for files with secrets. Unlike changing the umask around
+ * g_string_free_to_file(), this is safe while rendering in parallel.
+ */
+void
+g_string_free_to_file_umask(GString* s, const char* rootdir, const char* path, const char* suffix, mode_t mask)
+{
+    free_to_file(s, rootdir, path, suffix, &mask);
+}
+
+/* Hidden temporary files which were not touched for this many seconds are
+ * left behind by an interrupted commit, rather than being written by one
+ * running concurrently */
+#define STALE_TMP_FILE_AGE (60 * 60)
+
+/**
+ * Remove all files matching given glob. While staging output (see
+ * netplan_output_stage()), the files are only removed on commit, unless they
+ * got generated again in the meantime. Hidden temporary files next to them,
+ * left behind by a commit which got interrupted, are removed right away then.
  */
 void
 unlink_glob(const char* rootdir, const char* _glob)
@@ -89,9 +279,358 @@ unlink_glob(const char* rootdir, const char* _glob)
         // LCOV_EXCL_STOP
     }
 
-    for (size_t i = 0; i < gl.gl_pathc; ++i)
-        unlink(gl.gl_pathv[i]);
+    for (size_t i = 0; i < gl.gl_pathc; ++i) {
+        if (staged_files)
+            g_hash_table_add(stale_files, canonical_output_path(gl.gl_pathv[i]));
+        else
+            unlink(gl.gl_pathv[i]);
+    }
     globfree(&gl);
+
+    if (staged_files) {
+        /* see prepare_staged_file() */
+        g_autofree char* dir = g_path_get_dirname(rglob);
+        g_autofree char* base = g_path_get_basename(rglob);
+        g_autofree char* tmp_glob = g_strdup_printf("%s/.%s.??????", dir, base);
+
+        struct stat st;
+
+        if (glob(tmp_glob, GLOB_BRACE, NULL, &gl) == 0) {
+            for (size_t i = 0; i < gl.gl_pathc; ++i)
+                if (lstat(gl.gl_pathv[i], &st) == 0 && st.st_mtime + STALE_TMP_FILE_AGE < time(NULL))
+                    unlink(gl.gl_pathv[i]);
+            globfree(&gl);
+        }
+    }
+}
+
+/**
+ * Start staging generated output for @rootdir in memory: from now on,
+ * g_string_free_to_file() and safe_symlink() only record what they would
+ * write, and unlink_glob() only records what it would remove, until
+ * netplan_output_commit() is called.
+ * @rootdir: optional rootdir (@NULL means "/"), used to report changes
+ */
+void
+netplan_output_stage(const char* rootdir)
+{
+    g_assert(staged_files == NULL);
+    staged_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, staged_file_free);
+    staged_order = g_ptr_array_new();
+    stale_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    staged_rootdir = canonical_output_path(rootdir ?: "");
+    staged_umask = umask(0);
+    umask(staged_umask);
+    /* strip a trailing separator, so that reported paths keep their leading one */
+    if (g_str_has_suffix(staged_rootdir, G_DIR_SEPARATOR_S))
+        staged_rootdir[strlen(staged_rootdir) - 1] = '\0';
+}
+
+/**
+ * Attribute the output staged from now on to the netdef with the given ID
+ * (or to none, if @NULL).
+ */
+void
+netplan_output_set_netdef(const char* netdef_id)
+{
+    g_free(staged_netdef_id);
+    staged_netdef_id = g_strdup(netdef_id);
+}
+
+/**
+ * Check whether @path on disk already has the staged contents (compared by
+ * SHA-256 checksum) and permissions, or is the staged symlink.
+ * @exists: set to whether there is anything at @path
+ */
+static gboolean
+staged_file_is_current(const char* path, const NetplanStagedFile* f, gboolean* exists)
+{
+    struct stat st;
+    g_autofree gchar* contents = NULL;
+    g_autofree gchar* checksum = NULL;
+    gsize len;
+
+    *exists = (lstat(path, &st) == 0);
+    if (!*exists)
+        return FALSE;
+
+    if (f->target) {
+        g_autofree gchar* target = S_ISLNK(st.st_mode) ? g_file_read_link(path, NULL) : NULL;
+        return g_strcmp0(target, f->target) == 0;
+    }
+
+    if (!S_ISREG(st.st_mode) || (st.st_mode & 07777) != f->mode || st.st_size != f->len)
+        return FALSE;
+    if (!g_file_get_contents(path, &contents, &len, NULL))
+        return FALSE; // LCOV_EXCL_LINE
+    checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar*) contents, len);
+    return g_strcmp0(checksum, f->checksum) == 0;
+}
+
+/* A changed staged file on its way to disk: written (or linked) to
+ * @tmp_path next to @path by prepare_staged_file(), then moved into place by
+ * publish_staged_file() */
+typedef struct {
+    const char* path;
+    const NetplanStagedFile* file;
+    gchar* tmp_path;
+} NetplanPendingFile;
+
+/**
+ * Whether @fd is on a file system which does not survive a reboot anyway,
+ * like /run usually is, so that syncing it to disk is pointless.
+ */
+static gboolean
+is_volatile_fs(int fd)
+{
+    struct statfs sfs;
+
+    return fstatfs(fd, &sfs) == 0 && (sfs.f_type == TMPFS_MAGIC || sfs.f_type == RAMFS_MAGIC);
+}
+
+/* Set @error from errno for failing to @what @path */
+static void
+set_file_error(GError** error, const char* what, const char* path)
+{
+    int err = errno;
+
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err), "ERROR: cannot %s %s: %s", what, path, g_strerror(err));
+}
+
+/**
+ * Create a symlink to @target with a new name from the template @tmpl, whose
+ * last six characters are "XXXXXX", like g_mkstemp() does for files.
+ * Returns: 0 on success, -1 with errno set otherwise.
+ */
+static int
+mkstemp_symlink(gchar* tmpl, const char* target)
+{
+    static const char letters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    gchar* x = tmpl + strlen(tmpl) - 6;
+
+    for (guint attempt = 0; attempt < 100; attempt++) {
+        for (guint i = 0; i < 6; i++)
+            x[i] = letters[g_random_int_range(0, sizeof(letters) - 1)];
+        if (symlink(target, tmpl) == 0)
+            return 0;
+        if (errno != EEXIST)
+            return -1; // LCOV_EXCL_LINE
+    }
+    return -1; // LCOV_EXCL_LINE
+}
+
+/**
+ * Create the directory of @p, and write the staged contents into a new
+ * hidden temporary file in there, with the staged permissions, or create the
+ * staged symlink under such a name. A file gets synced to disk unless it is
+ * on tmpfs; its directory then gets added to @sync_dirs, to be synced after
+ * the rename.
+ */
+static gboolean
+prepare_staged_file(NetplanPendingFile* p, GHashTable* sync_dirs, GError** error)
+{
+    g_autofree gchar* dir = g_path_get_dirname(p->path);
+    g_autofree gchar* base = g_path_get_basename(p->path);
+    const gchar* data = p->file->contents;
+    gsize left = p->file->len;
+    gboolean ok;
+    int fd;
+
+    if (g_mkdir_with_parents(dir, 0755) < 0) {
+        set_file_error(error, "create directory", dir);
+        return FALSE;
+    }
+    /* unlink_glob() removes these if they get left behind */
+    p->tmp_path = g_strdup_printf("%s/.%s.XXXXXX", dir, base);
+    if (p->file->target) {
+        if (mkstemp_symlink(p->tmp_path, p->file->target) < 0) {
+            // LCOV_EXCL_START
+            set_file_error(error, "create enablement symlink", p->tmp_path);
+            g_clear_pointer(&p->tmp_path, g_free);
+            return FALSE;
+            // LCOV_EXCL_STOP
+        }
+        return TRUE;
+    }
+    fd = g_mkstemp_full(p->tmp_path, O_WRONLY, p->file->mode);
+    if (fd < 0) {
+        // LCOV_EXCL_START
+        set_file_error(error, "create file", p->tmp_path);
+        g_clear_pointer(&p->tmp_path, g_free);
+        return FALSE;
+        // LCOV_EXCL_STOP
+    }
+
+    /* the mode of g_mkstemp_full() is subject to the umask */
+    ok = fchmod(fd, p->file->mode) == 0;
+    while (ok && left > 0) {
+        ssize_t n = write(fd, data, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0;
+        if (ok) {
+            data += n;
+            left -= n;
+        }
+    }
+    if (ok && !is_volatile_fs(fd)) {
+        ok = fsync(fd) == 0;
+        g_hash_table_add(sync_dirs, g_steal_pointer(&dir));
+    }
+    if (!ok)
+        set_file_error(error, "write file", p->tmp_path); // LCOV_EXCL_LINE
+    if (close(fd) < 0 && ok) {
+        set_file_error(error, "write file", p->tmp_path); // LCOV_EXCL_LINE
+        ok = FALSE; // LCOV_EXCL_LINE
+    }
+    return ok;
+}
+
+/* Remove the temporary files of @pending from @first on, and free them all */
+static void
+discard_pending_files(GArray* pending, guint first)
+{
+    for (guint i = 0; i < pending->len; i++) {
+        NetplanPendingFile* p = &g_array_index(pending, NetplanPendingFile, i);
+        if (p->tmp_path && i >= first)
+            unlink(p->tmp_path);
+        g_free(p->tmp_path);
+    }
+    g_array_free(pending, TRUE);
+}
+
+static gboolean
+publish_staged_file(const NetplanPendingFile* p, GError** error)
+{
+    if (rename(p->tmp_path, p->path) < 0) {
+        set_file_error(error, "replace file", p->path); // LCOV_EXCL_LINE
+        return FALSE; // LCOV_EXCL_LINE
+    }
+    return TRUE;
+}
+
+static void
+sync_dir(gpointer key, gpointer value, gpointer user_data)
+{
+    int fd = open(key, O_RDONLY);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void
+add_output_change(GPtrArray* changes, NetplanOutputChangeType type, const char* path, const NetplanStagedFile* f)
+{
+    NetplanOutputChange* change = g_new0(NetplanOutputChange, 1);
+    change->type = type;
+    change->path = g_strdup(path + strlen(staged_rootdir));
+    change->netdef_id = f ? g_strdup(f->netdef_id) : NULL;
+    g_ptr_array_add(changes, change);
+}
+
+static gint
+compare_changes(gconstpointer a, gconstpointer b)
+{
+    const NetplanOutputChange* change_a = *(const NetplanOutputChange* const*) a;
+    const NetplanOutputChange* change_b = *(const NetplanOutputChange* const*) b;
+    return g_strcmp0(change_a->path, change_b->path);
+}
+
+/* Stop staging, dropping whatever got staged */
+static void
+output_stage_free(void)
+{
+    g_clear_pointer(&staged_order, g_ptr_array_unref);
+    g_clear_pointer(&staged_files, g_hash_table_destroy);
+    g_clear_pointer(&stale_files, g_hash_table_destroy);
+    g_clear_pointer(&staged_rootdir, g_free);
+    g_clear_pointer(&staged_netdef_id, g_free);
+}
+
+/**
+ * Write out the output staged since netplan_output_stage(): only files whose
+ * contents, permissions or symlink target differ from what is on disk get
+ * (re)written, and only those files matched by unlink_glob() which did not
+ * get generated again are removed. Stops staging.
+ * All changed files get written to temporary files first, and only then
+ * renamed into place one after the other, so that a failure to write any
+ * of them leaves the previous output alone, and the backends get to see a
+ * mix of old and new files for as short as possible. Should one of the
+ * renames fail, the files after it are left alone as well. Files on tmpfs
+ * (like everything in /run) do not get synced to disk.
+ * Returns: #GPtrArray of #NetplanOutputChange for every staged and every
+ *          removed file, sorted by path. The caller is responsible for
+ *          freeing it. %NULL on error, with nothing removed then.
+ */
+GPtrArray*
+netplan_output_commit(GError** error)
+{
+    GPtrArray* changes = g_ptr_array_new_with_free_func(output_change_free);
+    GArray* pending = g_array_new(FALSE, FALSE, sizeof(NetplanPendingFile));
+    GHashTable* sync_dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GHashTableIter iter;
+    gpointer key;
+    NetplanTiming timing;
+    guint unchanged = 0;
+    guint removed = 0;
+    guint published = 0;
+
+    g_assert(staged_files != NULL);
+
+    /* write in the order the files were generated in */
+    netplan_timing_start(&timing);
+    for (guint i = 0; i < staged_order->len; i++) {
+        const char* path = g_ptr_array_index(staged_order, i);
+        const NetplanStagedFile* f = g_hash_table_lookup(staged_files, path);
+        NetplanPendingFile p = { path, f, NULL };
+        gboolean exists;
+
+        if (staged_file_is_current(path, f, &exists)) {
+            add_output_change(changes, NETPLAN_OUTPUT_UNCHANGED, path, f);
+            unchanged++;
+            continue;
+        }
+        g_array_append_val(pending, p);
+        if (!prepare_staged_file(&g_array_index(pending, NetplanPendingFile, pending->len - 1), sync_dirs, error))
+            goto cleanup; /* leaving the previous output alone */
+        add_output_change(changes, exists ? NETPLAN_OUTPUT_CHANGED : NETPLAN_OUTPUT_ADDED, path, f);
+    }
+    /* everything got written, now swap it in at once */
+    for (; published < pending->len; published++)
+        if (!publish_staged_file(&g_array_index(pending, NetplanPendingFile, published), error))
+            goto cleanup; // LCOV_EXCL_LINE
+    g_hash_table_foreach(sync_dirs, sync_dir, NULL);
+    netplan_timing_stop(&timing);
+    netplan_timings_add(NETPLAN_PHASE_WRITE, &timing);
+    netplan_timings_count(NETPLAN_COUNTER_FILES_WRITTEN, changes->len - unchanged);
+    netplan_timings_count(NETPLAN_COUNTER_FILES_UNCHANGED, unchanged);
+
+    netplan_timing_start(&timing);
+    g_hash_table_iter_init(&iter, stale_files);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (!g_hash_table_contains(staged_files, key) && unlink(key) == 0) {
+            add_output_change(changes, NETPLAN_OUTPUT_REMOVED, key, NULL);
+            removed++;
+        }
+    }
+    netplan_timing_stop(&timing);
+    netplan_timings_add(NETPLAN_PHASE_UNLINK, &timing);
+    netplan_timings_count(NETPLAN_COUNTER_FILES_REMOVED, removed);
+    g_ptr_array_sort(changes, compare_changes);
+
+cleanup:
+    if (published < pending->len) {
+        /* what already got renamed into place still needs to reach the disk */
+        if (published > 0)
+            g_hash_table_foreach(sync_dirs, sync_dir, NULL); // LCOV_EXCL_LINE
+        g_clear_pointer(&changes, g_ptr_array_unref);
+    }
+    discard_pending_files(pending, published);
+    g_hash_table_destroy(sync_dirs);
+    output_stage_free();
+    return changes;
 }
 
 /**
@@ -114,13 +653,15 @@ int find_yaml_glob(const char* rootdir, glob_t* out_glob)
 
 /**
  * Get the frequency of a given 2.4GHz WiFi channel
+ * Returns: the frequency, or 0 with @error set if @channel is invalid
  */
 int
-wifi_get_freq24(int channel)
+wifi_get_freq24(int channel, GError** error)
 {
     if (channel < 1 || channel > 14) {
-        g_fprintf(stderr, "ERROR: invalid 2.4GHz WiFi channel: %d\n", channel);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "ERROR: invalid 2.4GHz WiFi channel: %d", channel);
+        return 0;
     }
 
     if (!wifi_frequency_24) {
@@ -140,9 +681,10 @@ wifi_get_freq24(int channel)
 
 /**
  * Get the frequency of a given 5GHz WiFi channel
+ * Returns: the frequency, or 0 with @error set if @channel is invalid
  */
 int
-wifi_get_freq5(int channel)
+wifi_get_freq5(int channel, GError** error)
 {
     int channels[] = { 7, 8, 9, 11, 12, 16, 32, 34, 36, 38, 40, 42, 44, 46, 48,
                        50, 52, 54, 56, 58, 60, 62, 64, 68, 96, 100, 102, 104,
@@ -157,8 +699,9 @@ wifi_get_freq5(int channel)
         }
     }
     if (!found) {
-        g_fprintf(stderr, "ERROR: invalid 5GHz WiFi channel: %d\n", channel);
-        exit(1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                    "ERROR: invalid 5GHz WiFi channel: %d", channel);
+        return 0;
     }
     if (!wifi_frequency_5) {
         wifi_frequency_5 = g_hash_table_new(g_direct_hash, g_direct_equal);
@@ -175,27 +718,33 @@ wifi_get_freq5(int channel)
 }
 
 /**
- * Systemd-escape the given string. The caller is responsible for freeing
- * the allocated escaped string.
+ * Systemd-escape the given string, the same way as "systemd-escape" (without
+ * --path) does. The caller is responsible for freeing the allocated escaped
+ * string.
  */
 gchar*
 systemd_escape(char* string)
 {
-    g_autoptr(GError) err = NULL;
-    g_autofree gchar* stderrh = NULL;
-    gint exit_status = 0;
-    gchar *escaped;
+    static const char hex[] = "0123456789abcdef";
+    /* worst case: every byte gets escaped as \xNN */
+    gchar* escaped = g_malloc(strlen(string) * 4 + 1);
+    gchar* t = escaped;
 
-    gchar *argv[] = {"bin" "/" "systemd-escape", string, NULL};
-    g_spawn_sync("/", argv, NULL, 0, NULL, NULL, &escaped, &stderrh, &exit_status, &err);
-    g_spawn_check_exit_status(exit_status, &err);
-    if (err != NULL) {
-        // LCOV_EXCL_START
-        g_fprintf(stderr, "failed to ask systemd to escape %s; exit %d\nstdout: '%s'\nstderr: '%s'", string, exit_status, escaped, stderrh);
-        exit(1);
-        // LCOV_EXCL_STOP
+    /* '/' becomes '-', everything else but [a-zA-Z0-9:_.] is escaped, and so
+     * is a leading '.' to not create hidden unit files */
+    for (const char* f = string; *f; f++) {
+        if (*f == '/')
+            *(t++) = '-';
+        else if ((*f == '.' && f == string) ||
+                 !(g_ascii_isalnum(*f) || *f == ':' || *f == '_' || *f == '.')) {
+            *(t++) = '\\';
+            *(t++) = 'x';
+            *(t++) = hex[(guchar) *f >> 4];
+            *(t++) = hex[(guchar) *f & 0xf];
+        } else
+            *(t++) = *f;
     }
-    g_strstrip(escaped);
+    *t = '\0';
 
     return escaped;
 }
@@ -204,7 +753,6 @@ gboolean
 netplan_delete_connection(const char* id, const char* rootdir)
 {
     g_autofree gchar* filename = NULL;
-    g_autofree gchar* del = NULL;
     g_autoptr(GError) error = NULL;
     NetplanNetDefinition* nd = NULL;
 
@@ -229,32 +777,428 @@ netplan_delete_connection(const char* id, const char* rootdir)
 
     filename = g_path_get_basename(nd->filename);
     filename[strlen(filename) - 5] = '\0'; //stip ".yaml" suffix
-    del = g_strdup_printf("network.%s.%s=NULL", netplan_def_type_to_str[nd->type], id);
     netplan_clear_netdefs();
 
-    /* TODO: refactor logic to actually be inside the library instead of spawning another process */
-    const gchar *argv[] = { SBINDIR "/" "netplan", "set", del, "--origin-hint" , filename, NULL, NULL, NULL };
-    if (rootdir) {
-        argv[5] = "--root-dir";
-        argv[6] = rootdir;
+    if (!netplan_delete_netdef_from_file(id, filename, rootdir, &error)) {
+        g_warning("netplan_delete_connection: %s", error->message);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+reload_udevd(void)
+{
+    const gchar *argv[] = { "/bin/udevadm", "control", "--reload", NULL };
+    netplan_timed(NETPLAN_PHASE_UDEV_RELOAD,
+                  g_spawn_sync(NULL, (gchar**)argv, NULL, G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, NULL, NULL, NULL, NULL));
+    netplan_timings_count(NETPLAN_COUNTER_CHILDREN_SPAWNED, 1);
+};
+
+/* Render in parallel only from this many netdefs on; for fewer, starting the
+ * threads costs more than it saves */
+#define PARALLEL_RENDER_MIN_NETDEFS 64
+
+/* Rendering one netdef for all backends */
+typedef struct {
+    NetplanNetDefinition* def;
+    const char* rootdir;
+    /* what got rendered, to be merged into the NetplanOutputSummary */
+    gboolean any_networkd;
+    gboolean any_sriov;
+    /* NetplanStagedEntry, if rendered by render_worker() */
+    GArray* staged;
+    /* why @def could not be rendered; reported by whoever runs the job */
+    GError* error;
+} NetplanRenderJob;
+
+static gboolean
+render_netdef(NetplanRenderJob* job)
+{
+    NetplanNetDefinition* def = job->def;
+    gboolean ret;
+
+    NETPLAN_PROBE3(networkd_start, def->id, def->type, netplan_backend_to_name[def->backend]);
+    netplan_timed(NETPLAN_PHASE_RENDER_NETWORKD,
+                  ret = write_networkd_conf(def, job->rootdir, &job->any_networkd, &job->error));
+    NETPLAN_PROBE2(networkd_end, def->id, job->any_networkd);
+    if (!ret)
+        return FALSE;
+
+    NETPLAN_PROBE3(ovs_start, def->id, def->type, netplan_backend_to_name[def->backend]);
+    netplan_timed(NETPLAN_PHASE_RENDER_OVS, ret = write_ovs_conf(def, job->rootdir, &job->error));
+    NETPLAN_PROBE1(ovs_end, def->id);
+    if (!ret)
+        return FALSE;
+    NETPLAN_PROBE3(nm_start, def->id, def->type, netplan_backend_to_name[def->backend]);
+    netplan_timed(NETPLAN_PHASE_RENDER_NM, ret = write_nm_conf(def, job->rootdir, &job->error));
+    NETPLAN_PROBE1(nm_end, def->id);
+    if (!ret)
+        return FALSE;
+    job->any_sriov = def->sriov_explicit_vf_count < G_MAXUINT || def->sriov_link;
+    return TRUE;
+}
+
+static void
+merge_render_summary(NetplanOutputSummary* summary, const NetplanRenderJob* job)
+{
+    if (job->any_networkd)
+        summary->any_networkd = TRUE;
+    if (job->any_sriov)
+        summary->any_sriov = TRUE;
+}
+
+/**
+ * Render all netdefs one by one, stopping at the first which cannot be
+ * rendered.
+ */
+static gboolean
+render_netdefs_serial(NetplanOutputSummary* summary, GError** error)
+{
+    for (GList* l = netdefs_ordered; l; l = l->next) {
+        NetplanRenderJob job = { .def = l->data, .rootdir = summary->rootdir };
+
+        netplan_output_set_netdef(job.def->id);
+        if (!render_netdef(&job)) {
+            g_propagate_error(error, job.error);
+            return FALSE;
+        }
+        merge_render_summary(summary, &job);
+    }
+    netplan_output_set_netdef(NULL);
+    return TRUE;
+}
+
+static void
+render_worker(gpointer data, gpointer user_data)
+{
+    NetplanRenderJob* job = data;
+
+    job->staged = g_array_new(FALSE, FALSE, sizeof(NetplanStagedEntry));
+    thread_staged = job->staged;
+    /* any error stays with the job, see render_netdefs_parallel() */
+    render_netdef(job);
+    thread_staged = NULL;
+}
+
+/**
+ * Set up what rendering the netdefs would otherwise initialize on demand,
+ * shared between them: the tables of WiFi frequencies, and the connection
+ * UUIDs which NetworkManager VLANs refer to their parents by.
+ */
+static void
+prepare_render(void)
+{
+    wifi_get_freq24(1, NULL);
+    wifi_get_freq5(36, NULL);
+    write_nm_conf_prepare();
+}
+
+/**
+ * Render all netdefs like render_netdefs_serial() does, but on a pool of
+ * @threads worker threads. The output of each netdef gets staged separately
+ * and then merged in the order of the netdefs, so that the result is the
+ * same as rendering them one by one. Rendering a netdef must not touch
+ * anything shared with the others for that, see prepare_render(). Errors
+ * stay with their job until all of them are done; the first broken netdef
+ * in order gets reported then, like it would be when rendering one by one.
+ * @rendered: set to FALSE if there are no threads to be had, without
+ *            rendering anything
+ */
+static gboolean
+render_netdefs_parallel(NetplanOutputSummary* summary, guint threads, gboolean* rendered, GError** error)
+{
+    guint len = g_list_length(netdefs_ordered);
+    NetplanRenderJob* jobs;
+    GThreadPool* pool;
+    gboolean ret = TRUE;
+    guint i = 0;
+
+    prepare_render();
+    /* exclusive, like in parse_yaml_files() */
+    pool = g_thread_pool_new(render_worker, NULL, threads, TRUE, NULL);
+    *rendered = (pool != NULL);
+    if (!pool)
+        return TRUE; // LCOV_EXCL_LINE
+
+    jobs = g_new0(NetplanRenderJob, len);
+    for (GList* l = netdefs_ordered; l; l = l->next, i++) {
+        jobs[i] = (NetplanRenderJob){ .def = l->data, .rootdir = summary->rootdir };
+        g_thread_pool_push(pool, &jobs[i], NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    for (i = 0; i < len; i++) {
+        netplan_output_set_netdef(jobs[i].def->id);
+        if (ret && jobs[i].error) {
+            g_propagate_error(error, jobs[i].error);
+            ret = FALSE;
+        } else if (jobs[i].error) {
+            g_error_free(jobs[i].error);
+        }
+        for (guint j = 0; j < jobs[i].staged->len; j++) {
+            NetplanStagedEntry* entry = &g_array_index(jobs[i].staged, NetplanStagedEntry, j);
+            if (!ret) {
+                g_free(entry->path);
+                staged_file_free(entry->file);
+                continue;
+            }
+            entry->file->netdef_id = g_strdup(staged_netdef_id);
+            add_staged_file(entry->path, entry->file);
+        }
+        g_array_free(jobs[i].staged, TRUE);
+        merge_render_summary(summary, &jobs[i]);
     }
-    if (getenv("TEST_NETPLAN_CMD") != 0)
-       argv[0] = getenv("TEST_NETPLAN_CMD");
-    return g_spawn_sync(NULL, (gchar**)argv, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL);
+    netplan_output_set_netdef(NULL);
+    g_free(jobs);
+    return ret;
 }
 
+/**
+ * Number of threads to render the netdefs with: one per CPU, unless there
+ * are only few netdefs, or NETPLAN_RENDER_THREADS says otherwise. Never more
+ * than there are netdefs.
+ */
+static guint
+render_threads(void)
+{
+    const char* env = getenv("NETPLAN_RENDER_THREADS");
+    guint len = g_list_length(netdefs_ordered);
+
+    if (env && *env)
+        return MIN(g_ascii_strtoull(env, NULL, 10), len);
+    if (len < PARALLEL_RENDER_MIN_NETDEFS)
+        return 1;
+    return MIN(g_get_num_processors(), len);
+}
+
+void
+g_string_append_json_string(GString* s, const char* str)
+{
+    g_string_append_c(s, '"');
+    for (const char* c = str; *c; c++) {
+        /* IDs and paths of generated files do not contain those in practice */
+        if (*c == '"' || *c == '\\')
+            g_string_append_printf(s, "\\%c", *c); // LCOV_EXCL_LINE
+        else if ((guchar) *c < 0x20)
+            g_string_append_printf(s, "\\u%04x", (guchar) *c); // LCOV_EXCL_LINE
+        else
+            g_string_append_c(s, *c);
+    }
+    g_string_append_c(s, '"');
+}
+
+/**
+ * Name of the interface a netdef applies to, if it is known upfront
+ * (might still be a glob, if matching by name).
+ */
+static const char*
+netdef_interface_name(const NetplanNetDefinition* nd)
+{
+    if (nd->type >= NETPLAN_DEF_TYPE_VIRTUAL)
+        return nd->id;
+    if (nd->set_name)
+        return nd->set_name;
+    if (nd->has_match)
+        return nd->match.original_name;
+    return nd->id;
+}
+
+/**
+ * Write a JSON manifest of the generated files to /run/netplan/generate.json,
+ * so that "netplan apply" can tell which backends and interfaces are affected
+ * by the last run. Each file is listed with its status (added, changed,
+ * removed, unchanged) and, unless removed, the netdef ID and the interface
+ * name it was generated for. If $NETPLAN_GENERATE_RUN_ID is set, it gets
+ * recorded as "run-id", so that the caller can make sure the manifest was
+ * written by its own run, and not by one that happened in between.
+ */
+static void
+write_manifest(const GPtrArray* changes, const char* rootdir)
+{
+    const char* run_id = getenv("NETPLAN_GENERATE_RUN_ID");
+    GString* s = g_string_new("{");
+
+    if (run_id) {
+        g_string_append(s, "\"run-id\": ");
+        g_string_append_json_string(s, run_id);
+        g_string_append(s, ", ");
+    }
+    g_string_append(s, "\"files\": [");
+
+    for (guint i = 0; i < changes->len; i++) {
+        const NetplanOutputChange* change = g_ptr_array_index(changes, i);
+        const NetplanNetDefinition* nd = NULL;
+        const char* iface = NULL;
+
+        g_string_append(s, i ? ",\n  {\"path\": " : "\n  {\"path\": ");
+        g_string_append_json_string(s, change->path);
+        g_string_append(s, ", \"status\": ");
+        g_string_append_json_string(s, netplan_output_change_type_to_str[change->type]);
+        if (change->netdef_id) {
+            g_string_append(s, ", \"netdef\": ");
+            g_string_append_json_string(s, change->netdef_id);
+            nd = g_hash_table_lookup(netdefs, change->netdef_id);
+            iface = netdef_interface_name(nd);
+        }
+        if (iface) {
+            g_string_append(s, ", \"interface\": ");
+            g_string_append_json_string(s, iface);
+        }
+        g_string_append_c(s, '}');
+    }
+    g_string_append(s, "\n]}\n");
+    g_string_free_to_file(s, rootdir, "run/netplan/generate.json", NULL);
+}
+
+/**
+ * Render the currently parsed (and finished) netdefs into backend
+ * configuration for @rootdir, staging it in memory (see
+ * netplan_output_stage()) to be written by netplan_output_commit().
+ * @summary: Optionally filled in with what got generated
+ * Returns: FALSE if any netdef cannot be rendered for its backend, with
+ *          @error set and nothing staged
+ */
 gboolean
-netplan_generate(const char* rootdir)
+netplan_render_output(const char* rootdir, NetplanOutputSummary* summary, GError** error)
+{
+    NetplanOutputSummary local_summary = { 0 };
+
+    if (!summary)
+        summary = &local_summary;
+    *summary = (NetplanOutputSummary){ .rootdir = rootdir };
+
+    /* Collect the new output in memory, so that only files which actually
+     * changed get written, and only stale ones get removed */
+    netplan_output_stage(rootdir);
+
+    /* Clean up generated config from previous runs */
+    netplan_timed(NETPLAN_PHASE_RENDER_NETWORKD, cleanup_networkd_conf(rootdir));
+    netplan_timed(NETPLAN_PHASE_RENDER_NM, cleanup_nm_conf(rootdir));
+    netplan_timed(NETPLAN_PHASE_RENDER_OVS, cleanup_ovs_conf(rootdir));
+    netplan_timed(NETPLAN_PHASE_RENDER_SRIOV, cleanup_sriov_conf(rootdir));
+
+    /* Generate backend specific configuration files from merged data. */
+    // OVS cleanup unit is always written
+    netplan_timed(NETPLAN_PHASE_RENDER_OVS, write_ovs_conf_finish(rootdir));
+    if (netdefs) {
+        guint threads = render_threads();
+        gboolean rendered = FALSE;
+        gboolean ret;
+
+        g_debug("Generating output files..");
+        ret = threads > 1 ? render_netdefs_parallel(summary, threads, &rendered, error) : TRUE;
+        if (ret && !rendered)
+            ret = render_netdefs_serial(summary, error);
+        if (!ret) {
+            output_stage_free();
+            return FALSE;
+        }
+        netplan_timed(NETPLAN_PHASE_RENDER_NM, write_nm_conf_finish(rootdir));
+        if (summary->any_sriov)
+            netplan_timed(NETPLAN_PHASE_RENDER_SRIOV, write_sriov_conf_finish(rootdir));
+    }
+
+    /* Disable /usr/lib/NetworkManager/conf.d/10-globally-managed-devices.conf
+     * (which restricts NM to wifi and wwan) if global renderer is NM */
+    if (netplan_get_global_backend() == NETPLAN_BACKEND_NM)
+        g_string_free_to_file(g_string_new(NULL), rootdir, "/run/NetworkManager/conf.d/10-globally-managed-devices.conf", NULL);
+    return TRUE;
+}
+
+/**
+ * Render the currently parsed (and finished) netdefs into backend
+ * configuration below @rootdir. Only files which actually changed get
+ * written and stale ones get removed; udevd is told to reload its rules if
+ * any of its files changed, and the manifest /run/netplan/generate.json is
+ * updated. This is what the "generate" binary does after parsing.
+ * @summary: Optionally filled in with what got generated
+ * Returns: A #GPtrArray of all #NetplanOutputChange (including unchanged files),
+ *          or %NULL if rendering or writing the files failed
+ */
+GPtrArray*
+netplan_write_output(const char* rootdir, NetplanOutputSummary* summary, GError** error)
 {
-    /* TODO: refactor logic to actually be inside the library instead of spawning another process */
-    const gchar *argv[] = { SBINDIR "/" "netplan", "generate", NULL , NULL, NULL };
+    GPtrArray* changes = NULL;
+    gboolean udev_changed = FALSE;
+
+    if (!netplan_render_output(rootdir, summary, error))
+        return NULL;
+    changes = netplan_output_commit(error);
+    if (!changes)
+        return NULL;
+    for (guint i = 0; i < changes->len; i++) {
+        const NetplanOutputChange* change = g_ptr_array_index(changes, i);
+        if (change->type == NETPLAN_OUTPUT_UNCHANGED)
+            continue;
+        if (g_str_has_prefix(change->path, "/run/udev/rules.d/") || g_str_has_suffix(change->path, ".link"))
+            udev_changed = TRUE;
+    }
+    netplan_timed(NETPLAN_PHASE_WRITE, write_manifest(changes, rootdir));
+
+    /* If we changed any .rules or .link files, we must invalidate udevd
+     * cache of its config as by default it only invalidates cache at most
+     * every 3 seconds. Not sure if this should live in `generate' or
+     * `apply', but it is confusing when udevd ignores just-in-time created
+     * rules files.
+     */
+    if (udev_changed)
+        reload_udevd();
+
+    return changes;
+}
+
+static gboolean
+_netplan_generate(const char* rootdir, GError** error)
+{
+    g_autofree gchar* stderrh = NULL;
+    g_autoptr(GError) spawn_error = NULL;
+    const gchar* argv[] = { getenv("NETPLAN_GENERATE_PATH") ?: ROOTLIBEXECDIR "/netplan/generate",
+                            NULL, NULL, NULL };
+    gint status = 0;
+
+    /* Run the generator, rather than rendering in this process: that would
+     * replace the caller's parsed netdefs, and the caller (e.g.
+     * NetworkManager) might be multi-threaded, so it must not fork without
+     * exec either. */
     if (rootdir) {
-        argv[2] = "--root-dir";
-        argv[3] = rootdir;
+        argv[1] = "--root-dir";
+        argv[2] = rootdir;
     }
-    if (getenv("TEST_NETPLAN_CMD") != 0)
-       argv[0] = getenv("TEST_NETPLAN_CMD");
-    return g_spawn_sync(NULL, (gchar**)argv, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL);
+    if (!g_spawn_sync(NULL, (gchar**) argv, NULL, G_SPAWN_DEFAULT, NULL, NULL,
+                      NULL, error ? &stderrh : NULL, &status, &spawn_error)) {
+        if (!error)
+            g_fprintf(stderr, "netplan_generate: cannot run %s: %s\n", argv[0], spawn_error->message);
+        g_propagate_error(error, g_steal_pointer(&spawn_error));
+        return FALSE;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return TRUE;
+
+    g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, "%s",
+                stderrh && *stderrh ? g_strchomp(stderrh) : "generating failed");
+    return FALSE;
+}
+
+/**
+ * Generate the backend configuration for the YAML hierarchy below @rootdir,
+ * by running the generator (or $NETPLAN_GENERATE_PATH, like the CLI does)
+ * with "--root-dir @rootdir". Problems get reported on stderr.
+ */
+gboolean
+netplan_generate(const char* rootdir)
+{
+    return _netplan_generate(rootdir, NULL);
+}
+
+/**
+ * Like netplan_generate(), but report problems via @error instead of stderr,
+ * e.g. for forwarding them to a DBus client.
+ */
+gboolean
+netplan_generate_full(const char* rootdir, GError** error)
+{
+    return _netplan_generate(rootdir, error);
 }
 
 /**
@@ -304,12 +1248,9 @@ netplan_get_filename_by_id(const char* netdef_id, const char* rootdir)
     if (!process_yaml_hierarchy(rootdir))
         return NULL; // LCOV_EXCL_LINE
     GHashTable* netdefs = netplan_finish_parse(NULL);
-    if (!netdefs)
-        return NULL;
-    NetplanNetDefinition* nd = g_hash_table_lookup(netdefs, netdef_id);
-    if (!nd)
-        return NULL;
-    filename = g_strdup(nd->filename);
+    NetplanNetDefinition* nd = netdefs ? g_hash_table_lookup(netdefs, netdef_id) : NULL;
+    if (nd)
+        filename = g_strdup(nd->filename);
     netplan_clear_netdefs();
     return filename;
 }
@@ -17,24 +17,66 @@
 
 #define __USE_MISC
 #include <glob.h>
+#include <sys/types.h>
 #pragma once
 
 extern GHashTable* wifi_frequency_24;
 extern GHashTable* wifi_frequency_5;
 
+typedef enum {
+    NETPLAN_OUTPUT_ADDED,
+    NETPLAN_OUTPUT_CHANGED,
+    NETPLAN_OUTPUT_REMOVED,
+    NETPLAN_OUTPUT_UNCHANGED,
+    NETPLAN_OUTPUT_MAX_,
+} NetplanOutputChangeType;
+
+static const char* const netplan_output_change_type_to_str[NETPLAN_OUTPUT_MAX_] = {
+    [NETPLAN_OUTPUT_ADDED] = "added",
+    [NETPLAN_OUTPUT_CHANGED] = "changed",
+    [NETPLAN_OUTPUT_REMOVED] = "removed",
+    [NETPLAN_OUTPUT_UNCHANGED] = "unchanged",
+};
+
+typedef struct {
+    NetplanOutputChangeType type;
+    /* absolute path below the rootdir the output was staged for */
+    gchar* path;
+    /* ID of the netdef the file was generated for, if any; unknown for
+     * removed files */
+    gchar* netdef_id;
+} NetplanOutputChange;
+
+typedef struct {
+    const char* rootdir;
+    /* any netdef got rendered for systemd-networkd */
+    gboolean any_networkd;
+    /* any netdef needs SR-IOV setup */
+    gboolean any_sriov;
+} NetplanOutputSummary;
+
 void safe_mkdir_p_dir(const char* file_path);
+void safe_symlink(const char* target, const char* link);
+void g_string_append_json_string(GString* s, const char* str);
 void g_string_free_to_file(GString* s, const char* rootdir, const char* path, const char* suffix);
+void g_string_free_to_file_umask(GString* s, const char* rootdir, const char* path, const char* suffix, mode_t mask);
 void unlink_glob(const char* rootdir, const char* _glob);
+void netplan_output_stage(const char* rootdir);
+void netplan_output_set_netdef(const char* netdef_id);
+GPtrArray* netplan_output_commit(GError** error);
+gboolean netplan_render_output(const char* rootdir, NetplanOutputSummary* summary, GError** error);
+GPtrArray* netplan_write_output(const char* rootdir, NetplanOutputSummary* summary, GError** error);
 int find_yaml_glob(const char* rootdir, glob_t* out_glob);
 
 const char *get_global_network(int ip_family);
 
-int wifi_get_freq24(int channel);
-int wifi_get_freq5(int channel);
+int wifi_get_freq24(int channel, GError** error);
+int wifi_get_freq5(int channel, GError** error);
 
 gchar* systemd_escape(char* string);
 gboolean netplan_delete_connection(const char* id, const char* rootdir);
 gboolean netplan_generate(const char* rootdir);
+gboolean netplan_generate_full(const char* rootdir, GError** error);
 gchar* netplan_get_id_from_nm_filename(const char* filename, const char* ssid);
 gchar* netplan_get_filename_by_id(const char* netdef_id, const char* rootdir);
 
@@ -15,6 +15,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gio/gio.h>
@@ -26,6 +28,7 @@
 #include "parse.h"
 #include "error.h"
 #include "util.h"
+#include "validation.h"
 
 
 /* Check sanity for address types */
@@ -58,6 +61,88 @@ is_ip6_address(const char* address)
     return FALSE;
 }
 
+/**
+ * Parse the IPv4 or IPv6 @address into @out, with the full address length as
+ * prefix length.
+ * Returns: %FALSE if @address is neither; @out is zeroed then.
+ */
+gboolean
+parse_ip_address(const char* address, NetplanIPPrefix* out)
+{
+    memset(out, 0, sizeof(*out));
+    if (inet_pton(AF_INET, address, out->addr) > 0) {
+        out->family = AF_INET;
+        out->prefix = 32;
+    } else if (inet_pton(AF_INET6, address, out->addr) > 0) {
+        out->family = AF_INET6;
+        out->prefix = 128;
+    }
+    return out->family != 0;
+}
+
+/**
+ * Parse @text, an IPv4 or IPv6 address optionally followed by "/prefixlength",
+ * into @out. The prefix length is taken as given; it is up to the caller to
+ * check its range, as the error to report for it depends on the context.
+ * Returns: %FALSE if the address part of @text is malformed.
+ */
+gboolean
+parse_ip_prefix(const char* text, NetplanIPPrefix* out)
+{
+    char addr[INET6_ADDRSTRLEN];
+    const char* prefix_len = strrchr(text, '/');
+    gsize addr_len = prefix_len ? prefix_len - text : strlen(text);
+
+    if (addr_len >= sizeof(addr)) {
+        /* too long to be any address, so it is malformed */
+        memset(out, 0, sizeof(*out));
+        return FALSE;
+    }
+    memcpy(addr, text, addr_len);
+    addr[addr_len] = '\0';
+    if (!parse_ip_address(addr, out))
+        return FALSE;
+    if (prefix_len)
+        out->prefix = MIN(g_ascii_strtoull(prefix_len + 1, NULL, 10), G_MAXUINT);
+    return TRUE;
+}
+
+/**
+ * Write @address into @buf, as an address with "/prefixlength" if
+ * @with_prefix is set, else as a plain one.
+ * Returns: the text it was given as, if kept, else @buf.
+ */
+const char*
+format_address(const NetplanAddress* address, gboolean with_prefix, char* buf)
+{
+    gsize len;
+
+    if (address->text)
+        return address->text;
+    if (!inet_ntop(address->ip.family, address->ip.addr, buf, INET6_ADDRSTRLEN))
+        g_assert_not_reached(); // LCOV_EXCL_LINE
+    if (with_prefix) {
+        len = strlen(buf);
+        snprintf(buf + len, NETPLAN_ADDRESS_STRLEN - len, "/%u", address->ip.prefix);
+    }
+    return buf;
+}
+
+/**
+ * Set @out to @ip, which got parsed from @text. @text itself is only kept if
+ * format_address() would not give it back.
+ */
+void
+set_address(NetplanAddress* out, const NetplanIPPrefix* ip, const char* text, gboolean with_prefix)
+{
+    char buf[NETPLAN_ADDRESS_STRLEN];
+
+    out->ip = *ip;
+    out->text = NULL;
+    if (strcmp(format_address(out, with_prefix, buf), text) != 0)
+        out->text = g_strdup(text);
+}
+
 gboolean
 is_hostname(const char *hostname)
 {
@@ -82,6 +167,7 @@ validate_ovs_target(gboolean host_first, gchar* s) {
     static guint dport = 6653; // the default port
     g_autofree gchar* host = NULL;
     g_autofree gchar* port = NULL;
+    g_autofree gchar* with_port = NULL;
     gchar** vec = NULL;
 
     /* Format tcp:host[:port] or ssl:host[:port] */
@@ -92,15 +178,19 @@ validate_ovs_target(gboolean host_first, gchar* s) {
             gchar* tmp = NULL;
             tmp = s+1; //get rid of leading '['
             // append default port to unify parsing
-            if (!g_strrstr(tmp, "]:"))
-                vec = g_strsplit(g_strdup_printf("%s:%u", tmp, dport), "]:", 2);
+            if (!g_strrstr(tmp, "]:")) {
+                with_port = g_strdup_printf("%s:%u", tmp, dport);
+                vec = g_strsplit(with_port, "]:", 2);
+            }
             else
                 vec = g_strsplit(tmp, "]:", 2);
         // IP4 host
         } else {
             // append default port to unify parsing
-            if (!g_strrstr(s, ":"))
-                vec = g_strsplit(g_strdup_printf("%s:%u", s, dport), ":", 2);
+            if (!g_strrstr(s, ":")) {
+                with_port = g_strdup_printf("%s:%u", s, dport);
+                vec = g_strsplit(with_port, ":", 2);
+            }
             else
                 vec = g_strsplit(s, ":", 2);
         }
@@ -296,17 +386,10 @@ validate_tunnel_backend_rules(NetplanNetDefinition* nd, yaml_node_t* node, GErro
 gboolean
 validate_netdef_grammar(NetplanNetDefinition* nd, yaml_node_t* node, GError** error)
 {
-    int missing_id_count = g_hash_table_size(missing_id);
     gboolean valid = FALSE;
 
     g_assert(nd->type != NETPLAN_DEF_TYPE_NONE);
 
-    /* Skip all validation if we're missing some definition IDs (devices).
-     * The ones we have yet to see may be necessary for validation to succeed,
-     * we can complete it on the next parser pass. */
-    if (missing_id_count > 0)
-        return TRUE;
-
     /* set-name: requires match: */
     if (nd->set_name && !nd->has_match)
         return yaml_error(node, error, "%s: 'set-name:' requires 'match:' properties", nd->id);
@@ -372,22 +455,155 @@ backend_rules_error:
     return valid;
 }
 
-struct _defroute_entry {
-    int family;
-    int table;
-    int metric;
-    const char *netdef_id;
+/* Table the kernel looks up routes in if none is given */
+#define ROUTE_TABLE_MAIN 254
+
+static guint
+route_table(guint table)
+{
+    return table == NETPLAN_ROUTE_TABLE_UNSPEC ? ROUTE_TABLE_MAIN : table;
+}
+
+/* A route as the kernel tells it apart from others: by family, table, metric
+ * and destination network. Routes declared by gateway4/gateway6 have no
+ * NetplanIPRoute, hence the copies of the fields telling them apart. */
+struct _route_entry {
+    guint family;
+    guint table;
+    guint metric;
+    NetplanIPPrefix to; /* network address only */
+    const char* to_str;
+    const char* via;
+    const char* type;
+    const char* netdef_id;
+};
+
+/* A routing policy rule, with the networks it selects */
+struct _rule_entry {
+    const NetplanIPRule* rule;
+    NetplanIPPrefix from; /* network address only, the whole family if unset */
+    NetplanIPPrefix to; /* ditto */
+    const char* netdef_id;
 };
 
+/**
+ * Return the network of @ip with the given @prefix length, i.e. with all
+ * bits after the first @prefix ones cleared. An unset @ip with a @family
+ * gives the network of all addresses of that family.
+ */
+static NetplanIPPrefix
+ip_network(const NetplanIPPrefix* ip, guint family, guint prefix)
+{
+    NetplanIPPrefix net = {0};
+    guint bytes;
+
+    net.family = ip->family ? ip->family : family;
+    if (!ip->family)
+        return net;
+    net.prefix = MIN(prefix, ip->family == AF_INET ? 32 : 128);
+    bytes = net.prefix / 8;
+    memcpy(net.addr, ip->addr, bytes);
+    if (net.prefix % 8)
+        net.addr[bytes] = ip->addr[bytes] & (0xff << (8 - net.prefix % 8));
+    return net;
+}
+
+static guint
+ip_prefix_hash(const NetplanIPPrefix* ip, guint hash)
+{
+    hash = hash * 31 + ip->family;
+    hash = hash * 31 + ip->prefix;
+    for (unsigned i = 0; i < sizeof(ip->addr); ++i)
+        hash = hash * 31 + ip->addr[i];
+    return hash;
+}
+
+static gboolean
+ip_prefix_equal(const NetplanIPPrefix* a, const NetplanIPPrefix* b)
+{
+    return a->family == b->family && a->prefix == b->prefix && memcmp(a->addr, b->addr, sizeof(a->addr)) == 0;
+}
+
+/* The kernel keeps IPv6 routes to the same network with the same metric side
+ * by side (multipath/ECMP) if they differ in gateway or interface, so those
+ * tell apart such routes as well, except for default ones */
+static gboolean
+route_by_nexthop(const struct _route_entry* e)
+{
+    return e->family == AF_INET6 && e->to.prefix > 0;
+}
+
+static guint
+route_entry_hash(gconstpointer key)
+{
+    const struct _route_entry* e = key;
+    guint hash = ip_prefix_hash(&e->to, (e->family * 31 + e->table) * 31 + e->metric);
+    if (route_by_nexthop(e))
+        hash = (hash * 31 + g_str_hash(e->via ?: "")) * 31 + g_str_hash(e->netdef_id);
+    return hash;
+}
+
+static gboolean
+route_entry_equal(gconstpointer a, gconstpointer b)
+{
+    const struct _route_entry* x = a;
+    const struct _route_entry* y = b;
+    return x->family == y->family && x->table == y->table && x->metric == y->metric &&
+           ip_prefix_equal(&x->to, &y->to) &&
+           (!route_by_nexthop(x) || (g_strcmp0(x->via, y->via) == 0 && g_strcmp0(x->netdef_id, y->netdef_id) == 0));
+}
+
+/* Rule entries get indexed by the networks they select */
+static guint
+rule_selector_hash(gconstpointer key)
+{
+    const struct _rule_entry* e = key;
+    return ip_prefix_hash(&e->to, ip_prefix_hash(&e->from, 0));
+}
+
+static gboolean
+rule_selector_equal(gconstpointer a, gconstpointer b)
+{
+    const struct _rule_entry* x = a;
+    const struct _rule_entry* y = b;
+    return ip_prefix_equal(&x->from, &y->from) && ip_prefix_equal(&x->to, &y->to);
+}
+
+/* ... and for finding duplicates, by everything */
+static guint
+rule_entry_hash(gconstpointer key)
+{
+    const struct _rule_entry* e = key;
+    const NetplanIPRule* r = e->rule;
+    return (((rule_selector_hash(key) * 31 + r->table) * 31 + r->priority) * 31 + r->fwmark) * 31 + r->tos;
+}
+
+static gboolean
+rule_entry_equal(gconstpointer a, gconstpointer b)
+{
+    const NetplanIPRule* x = ((const struct _rule_entry*) a)->rule;
+    const NetplanIPRule* y = ((const struct _rule_entry*) b)->rule;
+    return rule_selector_equal(a, b) && x->table == y->table && x->priority == y->priority &&
+           x->fwmark == y->fwmark && x->tos == y->tos;
+}
+
+static gint
+rule_entry_cmp_priority(gconstpointer a, gconstpointer b)
+{
+    const struct _rule_entry* x = *(struct _rule_entry* const*) a;
+    const struct _rule_entry* y = *(struct _rule_entry* const*) b;
+    return (x->rule->priority > y->rule->priority) - (x->rule->priority < y->rule->priority);
+}
+
 static void
-defroute_err(struct _defroute_entry *entry, const char *new_netdef_id, GError **error) {
+route_err(GString* problems, const struct _route_entry *entry, const struct _route_entry *new_entry)
+{
     char table_name[128] = {};
     char metric_name[128] = {};
 
     g_assert(entry->family == AF_INET || entry->family == AF_INET6);
 
-    // XXX: handle 254 as an alias for main ?
-    if (entry->table == NETPLAN_ROUTE_TABLE_UNSPEC)
+    if (route_table(entry->table) == ROUTE_TABLE_MAIN)
         strncpy(table_name, "table: main", sizeof(table_name) - 1);
     else
         snprintf(table_name, sizeof(table_name) - 1, "table: %d", entry->table);
@@ -397,48 +613,171 @@ defroute_err(struct _defroute_entry *entry, const char *new_netdef_id, GError **
     else
         snprintf(metric_name, sizeof(metric_name) - 1, "metric: %d", entry->metric);
 
-    g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
-            "Conflicting default route declarations for %s (%s, %s), first declared in %s but also in %s",
-            (entry->family == AF_INET) ? "IPv4" : "IPv6",
-            table_name,
-            metric_name,
-            entry->netdef_id,
-            new_netdef_id);
+    if (entry->to.prefix == 0)
+        g_string_append_printf(problems,
+                "Conflicting default route declarations for %s (%s, %s), first declared in %s but also in %s. "
+                "Please set up multiple routing tables and use `routing-policy` instead.\n",
+                (entry->family == AF_INET) ? "IPv4" : "IPv6",
+                table_name,
+                metric_name,
+                entry->netdef_id,
+                new_entry->netdef_id);
+    else if (g_strcmp0(entry->netdef_id, new_entry->netdef_id) == 0 &&
+             g_strcmp0(entry->via, new_entry->via) == 0 &&
+             g_strcmp0(entry->type, new_entry->type) == 0)
+        g_string_append_printf(problems, "Duplicate route to %s (%s, %s) in %s\n",
+                               new_entry->to_str, table_name, metric_name, new_entry->netdef_id);
+    else
+        g_string_append_printf(problems,
+                "Conflicting route declarations for %s (%s, %s), first declared in %s but also in %s\n",
+                new_entry->to_str,
+                table_name,
+                metric_name,
+                entry->netdef_id,
+                new_entry->netdef_id);
 }
 
-static gboolean
-check_defroute(struct _defroute_entry *candidate,
-               GSList **entries,
-               GError **error)
+static void
+append_rule(GString* s, const NetplanIPRule* r)
 {
-    struct _defroute_entry *entry;
-    GSList *it;
-
-    g_assert(entries != NULL);
-    it = *entries;
-
-    while (it) {
-        struct _defroute_entry *e = it->data;
-        if (e->family == candidate->family &&
-                e->table == candidate->table &&
-                e->metric == candidate->metric) {
-            defroute_err(e, candidate->netdef_id, error);
-            return FALSE;
-        }
-        it = it->next;
+    g_string_append_printf(s, "from %s to %s", r->from ? r->from : "all", r->to ? r->to : "all");
+    if (r->fwmark != NETPLAN_IP_RULE_FW_MARK_UNSPEC)
+        g_string_append_printf(s, " mark %u", r->fwmark);
+    if (r->tos != NETPLAN_IP_RULE_TOS_UNSPEC)
+        g_string_append_printf(s, " tos %u", r->tos);
+    if (r->priority != NETPLAN_IP_RULE_PRIO_UNSPEC)
+        g_string_append_printf(s, " priority %u", r->priority);
+    g_string_append_printf(s, " table %u", r->table);
+}
+
+static void
+check_route(struct _route_entry* candidate, GHashTable* routes, GString* problems)
+{
+    struct _route_entry* entry = g_hash_table_lookup(routes, candidate);
+
+    if (entry) {
+        route_err(problems, entry, candidate);
+        return;
     }
-    entry = g_malloc(sizeof(*entry));
+    entry = g_new(struct _route_entry, 1);
     *entry = *candidate;
-    *entries = g_slist_prepend(*entries, entry);
-    return TRUE;
+    g_hash_table_add(routes, entry);
+}
+
+/**
+ * Find the rule among those in @index that matches all packets that @e
+ * matches, and that takes precedence. It hides @e if it looks up the same
+ * table, or one with a default route (see @default_tables), as the lookup
+ * does not fall through to @e then.
+ * @from_lens, @to_lens: prefix lengths of the networks in @index
+ */
+static const struct _rule_entry*
+find_shadowing_rule(const struct _rule_entry* e, GHashTable* index, const gboolean* from_lens,
+                    const gboolean* to_lens, GHashTable* default_tables)
+{
+    const NetplanIPRule* r = e->rule;
+    struct _rule_entry key = {0};
+
+    for (guint from_len = 0; from_len <= e->from.prefix; ++from_len) {
+        if (!from_lens[from_len])
+            continue;
+        key.from = ip_network(&e->from, 0, from_len);
+        for (guint to_len = 0; to_len <= e->to.prefix; ++to_len) {
+            GPtrArray* rules;
+            if (!to_lens[to_len])
+                continue;
+            key.to = ip_network(&e->to, 0, to_len);
+            rules = g_hash_table_lookup(index, &key);
+            for (guint i = 0; rules && i < rules->len; ++i) {
+                const struct _rule_entry* other = g_ptr_array_index(rules, i);
+                const NetplanIPRule* o = other->rule;
+                if (o->priority < r->priority &&
+                    (o->fwmark == NETPLAN_IP_RULE_FW_MARK_UNSPEC || o->fwmark == r->fwmark) &&
+                    (o->tos == NETPLAN_IP_RULE_TOS_UNSPEC || o->tos == r->tos) &&
+                    (route_table(o->table) == route_table(r->table) ||
+                     g_hash_table_contains(default_tables, GUINT_TO_POINTER(route_table(o->table)))))
+                    return other;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Check @rules for duplicates, and for rules which never apply because
+ * another one always matches before.
+ * @default_tables: sets of tables with a default route, IPv4 and IPv6
+ */
+static void
+check_rules(GPtrArray* rules, GHashTable** default_tables, GString* problems)
+{
+    g_autoptr(GHashTable) seen = g_hash_table_new(rule_entry_hash, rule_entry_equal);
+    g_autoptr(GHashTable) index = g_hash_table_new_full(rule_selector_hash, rule_selector_equal,
+                                                        NULL, (GDestroyNotify) g_ptr_array_unref);
+    gboolean from_lens[2][129] = {};
+    gboolean to_lens[2][129] = {};
+
+    /* walk the rules in the order the kernel does, so that all those which
+     * might shadow a rule are in the index when getting to it */
+    g_ptr_array_sort(rules, rule_entry_cmp_priority);
+    for (guint i = 0; i < rules->len; ++i) {
+        struct _rule_entry* e = g_ptr_array_index(rules, i);
+        const struct _rule_entry* other;
+        guint fam = e->from.family == AF_INET6;
+        GPtrArray* bucket;
+
+        other = g_hash_table_lookup(seen, e);
+        if (other) {
+            g_string_append(problems, "Duplicate routing policy rule ");
+            append_rule(problems, e->rule);
+            g_string_append_printf(problems, ", first declared in %s but also in %s\n",
+                                   other->netdef_id, e->netdef_id);
+            continue;
+        }
+        g_hash_table_add(seen, e);
+
+        /* without a priority, the kernel picks one by the order of adding */
+        if (e->rule->priority == NETPLAN_IP_RULE_PRIO_UNSPEC)
+            continue;
+
+        other = find_shadowing_rule(e, index, from_lens[fam], to_lens[fam], default_tables[fam]);
+        if (other) {
+            g_string_append(problems, "Routing policy rule ");
+            append_rule(problems, e->rule);
+            g_string_append_printf(problems, " in %s never applies, the rule ", e->netdef_id);
+            append_rule(problems, other->rule);
+            g_string_append_printf(problems, " in %s takes precedence\n", other->netdef_id);
+        }
+
+        bucket = g_hash_table_lookup(index, e);
+        if (!bucket) {
+            bucket = g_ptr_array_new();
+            g_hash_table_insert(index, e, bucket);
+        }
+        g_ptr_array_add(bucket, e);
+        from_lens[fam][e->from.prefix] = TRUE;
+        to_lens[fam][e->to.prefix] = TRUE;
+    }
 }
 
+/**
+ * Check the routes and routing policy rules of all @netdefs against each
+ * other: routes that the kernel cannot tell apart (including several default
+ * routes), duplicate rules, and rules which never apply as others take
+ * precedence.
+ * Returns: %FALSE if there are any of those; @error lists them, one per line.
+ */
 gboolean
-validate_default_route_consistency(GHashTable *netdefs, GError ** error)
+validate_route_consistency(GHashTable *netdefs, GError ** error)
 {
-    struct _defroute_entry candidate = {};
-    GSList *defroutes = NULL;
-    gboolean ret = TRUE;
+    struct _route_entry candidate = {};
+    g_autoptr(GHashTable) routes = g_hash_table_new_full(route_entry_hash, route_entry_equal, g_free, NULL);
+    g_autoptr(GPtrArray) rules = g_ptr_array_new_with_free_func(g_free);
+    g_autoptr(GHashTable) default_tables_ip4 = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_autoptr(GHashTable) default_tables_ip6 = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTable* default_tables[2] = { default_tables_ip4, default_tables_ip6 };
+    GString* problems = g_string_new(NULL);
+    gboolean ret;
     gpointer key, value;
     GHashTableIter iter;
 
@@ -449,38 +788,61 @@ validate_default_route_consistency(GHashTable *netdefs, GError ** error)
         candidate.netdef_id = key;
         candidate.metric = NETPLAN_METRIC_UNSPEC;
         candidate.table = NETPLAN_ROUTE_TABLE_UNSPEC;
-        if (nd->gateway4) {
+        candidate.to_str = "default";
+        candidate.type = "unicast";
+        /* via only tells apart routes that are not default ones */
+        candidate.via = NULL;
+        if (nd->gateway4.ip.family) {
             candidate.family = AF_INET;
-            if (!check_defroute(&candidate, &defroutes, error)) {
-                ret = FALSE;
-                break;
-            }
+            candidate.to = (NetplanIPPrefix) { .family = AF_INET };
+            check_route(&candidate, routes, problems);
         }
-        if (nd->gateway6) {
+        if (nd->gateway6.ip.family) {
             candidate.family = AF_INET6;
-            if (!check_defroute(&candidate, &defroutes, error)) {
-                ret = FALSE;
-                break;
-            }
+            candidate.to = (NetplanIPPrefix) { .family = AF_INET6 };
+            check_route(&candidate, routes, problems);
         }
 
-        if (!nd->routes)
-            continue;
-
-        for (size_t i = 0; i < nd->routes->len; i++) {
+        for (size_t i = 0; nd->routes && i < nd->routes->len; i++) {
             NetplanIPRoute* r = g_array_index(nd->routes, NetplanIPRoute*, i);
-            char *suffix = strrchr(r->to, '/');
-            if (g_strcmp0(suffix, "/0") == 0 || g_strcmp0(r->to, "default") == 0) {
-                candidate.family = r->family;
-                candidate.table = r->table;
-                candidate.metric = r->metric;
-                if (!check_defroute(&candidate, &defroutes, error)) {
-                    ret = FALSE;
-                    break;
-                }
-            }
+            if ((r->family != AF_INET && r->family != AF_INET6) || !r->to_ip.family)
+                continue;
+            candidate.family = r->family;
+            candidate.table = r->table;
+            candidate.metric = r->metric;
+            candidate.to = ip_network(&r->to_ip, r->family, r->to_ip.prefix);
+            candidate.to_str = r->to;
+            candidate.via = r->via;
+            candidate.type = r->type;
+            check_route(&candidate, routes, problems);
+        }
+
+        for (size_t i = 0; nd->ip_rules && i < nd->ip_rules->len; i++) {
+            NetplanIPRule* r = g_array_index(nd->ip_rules, NetplanIPRule*, i);
+            struct _rule_entry* e = g_new0(struct _rule_entry, 1);
+            e->rule = r;
+            e->from = ip_network(&r->from_ip, r->family, r->from_ip.prefix);
+            e->to = ip_network(&r->to_ip, r->family, r->to_ip.prefix);
+            e->netdef_id = key;
+            g_ptr_array_add(rules, e);
         }
     }
-    g_slist_free_full(defroutes, g_free);
+
+    /* which tables have a default route, for telling which rules get to look
+     * up tables after theirs */
+    g_hash_table_iter_init (&iter, routes);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        const struct _route_entry* e = key;
+        if (e->to.prefix == 0)
+            g_hash_table_add(default_tables[e->family == AF_INET6], GUINT_TO_POINTER(route_table(e->table)));
+    }
+    check_rules(rules, default_tables, problems);
+
+    ret = problems->len == 0;
+    if (!ret) {
+        g_string_truncate(problems, problems->len - 1);
+        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, "%s", problems->str);
+    }
+    g_string_free(problems, TRUE);
     return ret;
 }
@@ -19,10 +19,17 @@
 
 #include "parse.h"
 #include <glib.h>
+#include <arpa/inet.h>
 
+/* Room for any address written by format_address(), prefix length included */
+#define NETPLAN_ADDRESS_STRLEN (INET6_ADDRSTRLEN + 4)
 
 gboolean is_ip4_address(const char* address);
 gboolean is_ip6_address(const char* address);
+gboolean parse_ip_address(const char* address, NetplanIPPrefix* out);
+gboolean parse_ip_prefix(const char* text, NetplanIPPrefix* out);
+const char* format_address(const NetplanAddress* address, gboolean with_prefix, char* buf);
+void set_address(NetplanAddress* out, const NetplanIPPrefix* ip, const char* text, gboolean with_prefix);
 gboolean is_hostname(const char* hostname);
 gboolean is_wireguard_key(const char* hostname);
 gboolean validate_ovs_target(gboolean host_first, gchar* s);
@@ -34,4 +41,4 @@ gboolean
 validate_backend_rules(NetplanNetDefinition* nd, GError** error);
 
 gboolean
-validate_default_route_consistency(GHashTable* netdefs, GError** error);
+validate_route_consistency(GHashTable* netdefs, GError** error);
@@ -0,0 +1,235 @@
+#!/usr/bin/python3
+#
+# Benchmark runner for the netplan parser and generator.
+#
+# Synthesizes large configurations (see synth.py) and reports how long
+# libnetplan takes to parse, validate, render and write them, how long
+# "netplan generate" takes to do all of that, and the peak RSS of both.
+# Run from the top of a built tree, e.g.:
+#   LD_LIBRARY_PATH=. tests/benchmark/run.py --scenario chains --size 5000
+# "generate" runs without the parsed state cache, "cached" with a valid one,
+# as on a boot with unchanged configuration. Both start from an empty /run.
+# To only measure libnetplan:
+#   LD_LIBRARY_PATH=. tests/benchmark/run.py --scenario ethernets --size 10000 --lib-only
+# The "addresses" scenario takes the number of addresses as size instead, e.g.
+# 5000 to 20000 for a host with anycast service addresses.
+#
+# Results can be saved with --save-baseline and later runs compared against
+# them with --compare, which fails if anything got slower or bigger by more
+# than --threshold. "make benchmark-baseline" and "make benchmark" do that
+# for all scenarios, with a baseline local to the tree.
+#
+# Copyright (C) 2021 Canonical, Ltd.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+import argparse
+import ctypes
+import ctypes.util
+import json
+import os
+import shutil
+import statistics
+import sys
+import tempfile
+import time
+
+import synth
+
+rootdir = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+exe_generate = os.path.join(rootdir, 'generate')
+
+
+class _GError(ctypes.Structure):
+    _fields_ = [("domain", ctypes.c_uint32), ("code", ctypes.c_int), ("message", ctypes.c_char_p)]
+
+
+lib = ctypes.CDLL(ctypes.util.find_library('netplan'))
+lib.netplan_parse_yaml.argtypes = [ctypes.c_char_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_finish_parse.argtypes = [ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_finish_parse.restype = ctypes.c_void_p
+lib.netplan_render_output.argtypes = [ctypes.c_char_p, ctypes.c_void_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_output_commit.argtypes = [ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_output_commit.restype = ctypes.c_void_p
+
+
+def in_child(func):
+    '''Run func() in a child process, for a fresh heap and its own peak RSS.
+
+    Return the result of func() (which must be JSON serializable) and the
+    peak RSS of the child in bytes.
+    '''
+    r, w = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        status = 1
+        try:
+            os.close(r)
+            with os.fdopen(w, 'w') as f:
+                json.dump(func(), f)
+            status = 0
+        except SystemExit as e:
+            print(e, file=sys.stderr)
+        finally:
+            os._exit(status)
+    os.close(w)
+    with os.fdopen(r) as f:
+        result = f.read()
+    _, status, rusage = os.wait4(pid, 0)
+    if status != 0:
+        sys.exit('Benchmark process failed')
+    return json.loads(result), rusage.ru_maxrss * 1024
+
+
+def clean_output(workdir):
+    shutil.rmtree(os.path.join(workdir, 'run'), ignore_errors=True)
+
+
+def bench_lib(path, workdir):
+    '''Time the phases of libnetplan for the YAML file path'''
+    err = ctypes.POINTER(_GError)()
+    times = {}
+    start = time.perf_counter()
+    ok = lib.netplan_parse_yaml(path.encode(), ctypes.byref(err))
+    times['parse'] = time.perf_counter() - start
+    start = time.perf_counter()
+    ok = ok and lib.netplan_finish_parse(ctypes.byref(err))
+    times['validate'] = time.perf_counter() - start
+    if not ok:
+        sys.exit('Cannot parse %s: %s' % (path, err.contents.message.decode('utf-8')))
+    start = time.perf_counter()
+    if not lib.netplan_render_output(workdir.encode(), None, ctypes.byref(err)):
+        sys.exit('Cannot render %s: %s' % (path, err.contents.message.decode('utf-8')))
+    times['render'] = time.perf_counter() - start
+    start = time.perf_counter()
+    if not lib.netplan_output_commit(ctypes.byref(err)):
+        sys.exit('Cannot write %s: %s' % (workdir, err.contents.message.decode('utf-8')))
+    times['write'] = time.perf_counter() - start
+    return times
+
+
+def bench_generate(workdir):
+    '''Time a generate run, return it with its peak RSS in bytes'''
+    start = time.perf_counter()
+    pid = os.spawnv(os.P_NOWAIT, exe_generate, [exe_generate, '--root-dir', workdir])
+    _, status, rusage = os.wait4(pid, 0)
+    elapsed = time.perf_counter() - start
+    if status != 0:
+        sys.exit('generate failed')
+    return elapsed, rusage.ru_maxrss * 1024
+
+
+def run_scenario(scenario, args):
+    '''Benchmark one scenario, return metric name → list of samples'''
+    samples = {}
+    with tempfile.TemporaryDirectory() as workdir:
+        confdir = os.path.join(workdir, 'etc', 'netplan')
+        os.makedirs(confdir)
+        path = os.path.join(confdir, 'a.yaml')
+        if scenario == 'fleet':
+            ovs = os.path.exists('/usr/bin/ovs-vsctl')
+            if not ovs:
+                print('ovs-vsctl is not installed, leaving out Open vSwitch')
+            synth.dump(synth.fleet(args.size, args.routes, ovs), path)
+        else:
+            synth.dump(synth.SCENARIOS[scenario](args.size), path)
+        print('%s: size %d, %d bytes of YAML' % (scenario, args.size, os.path.getsize(path)))
+
+        for _ in range(args.repeat):
+            clean_output(workdir)
+            times, rss = in_child(lambda: bench_lib(path, workdir))
+            for phase, t in times.items():
+                samples.setdefault('lib ' + phase, []).append(t)
+            samples.setdefault('lib rss', []).append(rss)
+        if args.lib_only:
+            return samples
+
+        for name in ('generate', 'cached'):
+            if name == 'cached':
+                # prime the cache
+                os.makedirs(os.path.join(workdir, 'var', 'cache', 'netplan'))
+                bench_generate(workdir)
+            for _ in range(args.repeat):
+                clean_output(workdir)
+                elapsed, rss = bench_generate(workdir)
+                samples.setdefault(name, []).append(elapsed)
+                samples.setdefault(name + ' rss', []).append(rss)
+    return samples
+
+
+def summarize(samples):
+    '''Times by their median, memory by its maximum'''
+    return {name: max(values) if name.endswith('rss') else statistics.median(values)
+            for name, values in samples.items()}
+
+
+def report(samples, baseline, threshold):
+    '''Print samples, compared to the summary in baseline; return whether any regressed'''
+    regressed = False
+    summary = summarize(samples)
+    for name, values in samples.items():
+        if name.endswith('rss'):
+            line = '%-14s max %8.1f MiB' % (name, summary[name] / 2**20)
+        else:
+            line = '%-14s min %8.3fs  median %8.3fs  max %8.3fs' % (name, min(values), summary[name], max(values))
+        if baseline.get(name):
+            change = summary[name] / baseline[name] - 1
+            line += '  %+6.1f%% vs. baseline' % (change * 100)
+            if change > threshold:
+                line += '  REGRESSION'
+                regressed = True
+        print(line)
+    return regressed
+
+
+parser = argparse.ArgumentParser(description='Benchmark the netplan parser and generator')
+parser.add_argument('--scenario', choices=sorted(synth.SCENARIOS), action='append',
+                    help='Kind of configuration to synthesize, can be given multiple times (default: chains)')
+parser.add_argument('--size', type=int, default=5000,
+                    help='Number of interfaces to synthesize (of addresses for "addresses")')
+parser.add_argument('--routes', type=int, default=4,
+                    help='Number of routes, routing-policy rules and WireGuard peers per interface for "fleet"')
+parser.add_argument('--repeat', type=int, default=5, help='Number of runs to time')
+parser.add_argument('--lib-only', action='store_true', help='Only time libnetplan, not generate')
+parser.add_argument('--save-baseline', metavar='FILE', help='Store the results in FILE, for comparing against later')
+parser.add_argument('--compare', metavar='FILE', help='Compare the results against the baseline in FILE')
+parser.add_argument('--threshold', type=float, default=0.2,
+                    help='Relative slowdown or growth to fail --compare on (default: 0.2)')
+args = parser.parse_args()
+
+baselines = {}
+if args.compare and os.path.exists(args.compare):
+    with open(args.compare) as f:
+        baselines = json.load(f)
+elif args.compare:
+    print('No baseline in %s yet, run with --save-baseline first' % args.compare)
+
+results = {}
+regressed = False
+for scenario in args.scenario or ['chains']:
+    key = '%s-%d' % (scenario, args.size)
+    samples = run_scenario(scenario, args)
+    regressed |= report(samples, baselines.get(key, {}), args.threshold)
+    results[key] = summarize(samples)
+
+if args.save_baseline:
+    saved = {}
+    if os.path.exists(args.save_baseline):
+        with open(args.save_baseline) as f:
+            saved = json.load(f)
+    saved.update(results)
+    with open(args.save_baseline, 'w') as f:
+        json.dump(saved, f, indent=2, sort_keys=True)
+        f.write('\n')
+
+sys.exit(1 if regressed else 0)
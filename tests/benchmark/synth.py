@@ -0,0 +1,175 @@
+#
+# Synthetic netplan configurations for benchmarking the parser and generator.
+#
+# Copyright (C) 2021 Canonical, Ltd.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+import base64
+
+import yaml
+
+
+def chains(interfaces=5000):
+    '''VLAN-on-bridge-on-bond chains over two ethernets each.
+
+    Every chain consists of 5 interfaces. Definitions are emitted top-down
+    (vlans, bridges, bonds, ethernets), so that every single reference in
+    the document is a forward reference.
+    '''
+    ethernets, bonds, bridges, vlans = {}, {}, {}, {}
+    for c in range(interfaces // 5):
+        eths = ['eth%da' % c, 'eth%db' % c]
+        for e in eths:
+            ethernets[e] = {}
+        bonds['bond%d' % c] = {'interfaces': eths, 'parameters': {'mode': 'active-backup', 'primary': eths[0]}}
+        bridges['br%d' % c] = {'interfaces': ['bond%d' % c], 'parameters': {'path-cost': {'bond%d' % c: 50}}}
+        vlans['vlan%d' % c] = {'id': c % 4094 + 1, 'link': 'br%d' % c,
+                               'addresses': ['10.%d.%d.1/24' % (c // 256, c % 256)]}
+    return {'network': {'version': 2, 'renderer': 'networkd',
+                        'vlans': vlans, 'bridges': bridges, 'bonds': bonds, 'ethernets': ethernets}}
+
+
+def ethernets(interfaces=10000):
+    '''Physical interfaces using many keys each.
+
+    Mostly stresses the key dispatch of the parser, as every definition walks
+    the long ethernet handler table for a couple of dozen keys.
+    '''
+    eths = {}
+    for i in range(interfaces):
+        eths['eth%d' % i] = {
+            'match': {'macaddress': '00:16:3e:%02x:%02x:%02x' % (i >> 16 & 0xff, i >> 8 & 0xff, i & 0xff)},
+            'set-name': 'eth%d' % i,
+            'wakeonlan': False,
+            'optional': True,
+            'critical': False,
+            'mtu': 9000,
+            'accept-ra': False,
+            'ipv6-privacy': False,
+            'link-local': ['ipv6'],
+            'dhcp4': True,
+            'dhcp6': False,
+            'dhcp-identifier': 'mac',
+            'dhcp4-overrides': {'use-dns': False, 'use-ntp': False, 'use-hostname': False,
+                                'use-routes': True, 'route-metric': 200, 'send-hostname': False},
+            'nameservers': {'search': ['example.com'], 'addresses': ['10.0.0.53']},
+            'optional-addresses': ['ipv4-ll'],
+            'ipv6-mtu': 1500,
+            'emit-lldp': True,
+        }
+    return {'network': {'version': 2, 'renderer': 'networkd', 'ethernets': eths}}
+
+
+def routes(routes=50000):
+    '''A border router: a few interfaces with a huge number of static routes.
+
+    Mostly stresses the memory needed for the YAML nodes of the routes.
+    '''
+    eths = {}
+    for i in range(4):
+        eths['eth%d' % i] = {
+            'addresses': ['192.168.%d.1/24' % i],
+            'routes': [{'to': '10.%d.%d.0/24' % (r >> 8 & 0xff, r & 0xff), 'via': '192.168.%d.254' % i,
+                        'metric': 100 + i, 'table': 1000 + i}
+                       for r in range(i, routes, 4)],
+            'routing-policy': [{'from': '192.168.%d.0/24' % i, 'table': 1000 + i}],
+        }
+    return {'network': {'version': 2, 'renderer': 'networkd', 'ethernets': eths}}
+
+
+def addresses(addresses=20000):
+    '''An anycast/load balancer host: service addresses on lo and two bridges.
+
+    Half of the /32 and /128 host addresses go on lo, the rest on the
+    bridges; one in a hundred on the bridges carries address options. Stresses keeping
+    the address lists free of duplicates.
+    '''
+    def address(i):
+        if i % 2:
+            return '2001:db8:%x:%x::1/128' % (i >> 16, i & 0xffff)
+        return '10.%d.%d.%d/32' % (i >> 16 & 0xff, i >> 8 & 0xff, i & 0xff)
+
+    eths = {'lo': {'match': {'name': 'lo'}, 'addresses': [address(i) for i in range(addresses // 2)]}}
+    bridges = {}
+    for b in range(2):
+        addrs = [address(i) for i in range(addresses // 2 + b, addresses, 2)]
+        addrs[::100] = [{a: {'label': 'br%d:%d' % (b, n)}} for n, a in enumerate(addrs[::100])]
+        bridges['br%d' % b] = {'addresses': addrs}
+    return {'network': {'version': 2, 'renderer': 'networkd', 'ethernets': eths, 'bridges': bridges}}
+
+
+def wireguard_key(n):
+    return base64.b64encode(n.to_bytes(32, 'big')).decode()
+
+
+def fleet(interfaces=1000, routes=4, ovs=True):
+    '''A mix of everything found on large fleets, for the overall picture.
+
+    Chains of two ethernets, a bond, a bridge and a VLAN; the VLAN carries
+    @routes static routes and as many routing-policy rules. Every tenth chain
+    also gets a WireGuard tunnel with @routes peers, a pair of Open vSwitch
+    bridges joined by a patch port pair (unless not @ovs, as netplan refuses
+    those without ovs-vsctl installed), and an SR-IOV PF with four VFs.
+    '''
+    ethernets, bonds, bridges, vlans, tunnels, ports = {}, {}, {}, {}, {}, []
+    for c in range(interfaces // 5):
+        eths = ['eth%da' % c, 'eth%db' % c]
+        for e in eths:
+            ethernets[e] = {}
+        bonds['bond%d' % c] = {'interfaces': eths, 'parameters': {'mode': '802.3ad', 'lacp-rate': 'fast'}}
+        bridges['br%d' % c] = {'interfaces': ['bond%d' % c], 'parameters': {'stp': False}}
+        vlans['vlan%d' % c] = {
+            'id': c % 4094 + 1, 'link': 'br%d' % c,
+            'addresses': ['10.%d.%d.1/24' % (c >> 8 & 0xff, c & 0xff), '2001:db8:%x::1/64' % c],
+            'routes': [{'to': '2001:db8:%x:%x::/64' % (c, r + 1), 'via': '2001:db8:%x::fe' % c,
+                        'metric': 100 + r % 4, 'table': 1000 + r}
+                       for r in range(routes)],
+            'routing-policy': [{'from': '2001:db8:%x:%x::/64' % (c, r + 1), 'table': 1000 + r,
+                                'priority': 100 + c * routes + r}
+                               for r in range(routes)],
+        }
+        if c % 10:
+            continue
+        tunnels['wg%d' % c] = {
+            'mode': 'wireguard', 'key': wireguard_key(c), 'port': 51820,
+            'addresses': ['172.16.%d.%d/31' % (c >> 7 & 0xff, c << 1 & 0xff)],
+            'peers': [{'keys': {'public': wireguard_key((c + 1) << 32 | p)},
+                       'endpoint': '192.0.2.%d:51820' % (p % 254 + 1),
+                       'allowed-ips': ['2001:db8:ffff:%x::%x/128' % (c, p + 1)]}
+                      for p in range(routes)],
+        }
+        if ovs:
+            ports.append(['patch%da' % c, 'patch%db' % c])
+            for side in 'ab':
+                bridges['ovs%d%s' % (c, side)] = {'interfaces': ['patch%d%s' % (c, side)], 'openvswitch': {}}
+        ethernets['pf%d' % c] = {'virtual-function-count': 4}
+        for v in range(4):
+            ethernets['pf%dvf%d' % (c, v)] = {'link': 'pf%d' % c}
+    return {'network': {'version': 2, 'renderer': 'networkd', 'openvswitch': {'ports': ports},
+                        'ethernets': ethernets, 'bonds': bonds, 'bridges': bridges, 'vlans': vlans,
+                        'tunnels': tunnels}}
+
+
+SCENARIOS = {
+    'addresses': addresses,
+    'chains': chains,
+    'ethernets': ethernets,
+    'fleet': fleet,
+    'routes': routes,
+}
+
+
+def dump(config, path):
+    with open(path, 'w') as f:
+        yaml.safe_dump(config, f, sort_keys=False)
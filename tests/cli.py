@@ -17,6 +17,7 @@
 # You should have received a copy of the GNU General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+import json
 import os
 import sys
 import subprocess
@@ -101,6 +102,35 @@ class TestGenerate(unittest.TestCase):
         self.assertEqual(os.listdir(os.path.join(self.workdir.name, 'run', 'systemd', 'network')),
                          ['10-netplan-enlol.network'])
 
+    def test_changes(self):
+        os.environ['NETPLAN_GENERATE_PATH'] = os.path.join(rootdir, 'generate')
+        c = os.path.join(self.workdir.name, 'etc', 'netplan')
+        os.makedirs(c)
+        with open(os.path.join(c, 'a.yaml'), 'w') as f:
+            f.write('''network:
+  version: 2
+  ethernets:
+    enlol: {dhcp4: yes}''')
+        out = subprocess.check_output(exe_cli + ['generate', '--root-dir', self.workdir.name, '--changes'])
+        self.assertIn(b'added /run/systemd/network/10-netplan-enlol.network\n', out)
+        # nothing changed, so nothing gets rewritten on the second run
+        out = subprocess.check_output(exe_cli + ['generate', '--root-dir', self.workdir.name, '--changes'])
+        self.assertEqual(out, b'')
+
+    def test_timings(self):
+        os.environ['NETPLAN_GENERATE_PATH'] = os.path.join(rootdir, 'generate')
+        c = os.path.join(self.workdir.name, 'etc', 'netplan')
+        os.makedirs(c)
+        with open(os.path.join(c, 'a.yaml'), 'w') as f:
+            f.write('''network:
+  version: 2
+  ethernets:
+    enlol: {dhcp4: yes}''')
+        p = subprocess.run(exe_cli + ['generate', '--root-dir', self.workdir.name, '--timings'],
+                           stdout=subprocess.PIPE, stderr=subprocess.PIPE, check=True)
+        self.assertEqual(p.stdout, b'')
+        self.assertEqual(json.loads(p.stderr)['counters']['netdefs'], 1)
+
     def test_mapping_for_unknown_iface(self):
         os.environ['NETPLAN_GENERATE_PATH'] = os.path.join(rootdir, 'generate')
         c = os.path.join(self.workdir.name, 'etc', 'netplan')
@@ -14,6 +14,7 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 import os
+import re
 import shutil
 import subprocess
 import tempfile
@@ -114,6 +115,26 @@ class TestNetplanDBus(unittest.TestCase):
         # Return random config ID
         return cid
 
+    def _monitor_bus(self):
+        mon = subprocess.Popen(["busctl", "--system", "monitor", "io.netplan.Netplan"],
+                               stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, universal_newlines=True)
+        self.addCleanup(mon.wait)
+        self.addCleanup(mon.terminate)
+        time.sleep(0.5)  # Give some time for busctl to subscribe
+        return mon
+
+    def _job_signals(self, mon):
+        '''Stop monitoring and return the job signals as (member, [args]) tuples'''
+        time.sleep(0.5)  # Give some time for the last signals to arrive
+        mon.terminate()
+        signals = []
+        for msg in mon.communicate()[0].split('‣ ')[1:]:
+            if msg.startswith('Type=signal') and 'Job' in msg:
+                member = re.search(r'Member=(\w+)', msg).group(1)
+                args = re.findall(r'^\s+(?!MESSAGE)[A-Z_]+ (?:"(.*?)"|(\w+));$', msg, re.MULTILINE | re.DOTALL)
+                signals.append((member, [a[0] or a[1] for a in args]))
+        return signals
+
     def test_netplan_apply_in_snap_uses_dbus(self):
         p = subprocess.Popen(
             exe_cli + ["apply"],
@@ -244,6 +265,82 @@ class TestNetplanDBus(unittest.TestCase):
                 ["netplan", "apply"],
         ])
 
+    def test_netplan_dbus_apply_concurrent(self):
+        # keep the first 'netplan apply' running for a while
+        with open(self.mock_netplan_cmd.path, "a") as fp:
+            fp.write("sleep 1\n")
+        BUSCTL_NETPLAN_APPLY = [
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan",
+            "io.netplan.Netplan",
+            "Apply",
+        ]
+        first = subprocess.Popen(BUSCTL_NETPLAN_APPLY, stdout=subprocess.PIPE)
+        time.sleep(0.5)
+        # the service keeps answering other calls meanwhile
+        output = subprocess.check_output(BUSCTL_NETPLAN_APPLY[:-1] + ["Info"])
+        self.assertIn("Features", output.decode("utf-8"))
+        # but refuses to Try() a config meanwhile
+        cid = self._new_config_object()
+        self.addCleanup(shutil.rmtree, '/tmp/netplan-config-{}'.format(cid))
+        err = self._check_dbus_error([
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan/config/{}".format(cid),
+            "io.netplan.Netplan.Config",
+            "Try", "u", "1",
+        ])
+        self.assertIn('An Apply() is currently in progress: PID ', err)
+        # later calls are answered by a single follow-up run
+        others = [subprocess.Popen(BUSCTL_NETPLAN_APPLY, stdout=subprocess.PIPE) for _ in range(2)]
+        for p in [first] + others:
+            self.assertEqual(p.communicate(timeout=10)[0], b"b true\n")
+        self.assertEquals(self.mock_netplan_cmd.calls(), [
+                ["netplan", "apply"],
+                ["netplan", "apply"],
+        ])
+
+    def test_netplan_dbus_apply_failed(self):
+        with open(self.mock_netplan_cmd.path, "a") as fp:
+            fp.write("echo 'something went wrong' >&2\n")
+        self.mock_netplan_cmd.set_returncode(1)
+        err = self._check_dbus_error([
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan",
+            "io.netplan.Netplan",
+            "Apply",
+        ])
+        self.assertIn("netplan apply failed: exited with status 1", err)
+        self.assertIn("something went wrong", err)
+
+    def test_netplan_dbus_apply_job(self):
+        mon = self._monitor_bus()
+        BUSCTL_NETPLAN_APPLY = [
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan",
+            "io.netplan.Netplan",
+            "Apply",
+        ]
+        output = subprocess.check_output(BUSCTL_NETPLAN_APPLY)
+        self.assertEqual(output.decode("utf-8"), "b true\n")
+        self.mock_netplan_cmd.set_returncode(1)
+        err = self._check_dbus_error(BUSCTL_NETPLAN_APPLY)
+        self.assertIn("netplan apply failed: exited with status 1", err)
+        self.assertEqual(self._job_signals(mon), [
+            ('JobStarted', ['/io/netplan/Netplan/job/1', 'apply']),
+            ('Progress', ['running']),
+            ('Finished', ['true', '']),
+            ('JobStarted', ['/io/netplan/Netplan/job/2', 'apply']),
+            ('Progress', ['running']),
+            ('Finished', ['false', "netplan apply failed: exited with status 1\nstderr: ''"]),
+        ])
+        # the finished jobs are gone from the bus
+        err = self._check_dbus_error(["busctl", "introspect", "--system", "io.netplan.Netplan", "/io/netplan/Netplan/job/1"])
+        self.assertIn("Unknown object '/io/netplan/Netplan/job/1'", err)
+
     def test_netplan_dbus_generate(self):
         BUSCTL_NETPLAN_CMD = [
             "busctl", "call", "--system",
@@ -254,11 +351,50 @@ class TestNetplanDBus(unittest.TestCase):
         ]
         output = subprocess.check_output(BUSCTL_NETPLAN_CMD)
         self.assertEqual(output.decode("utf-8"), "b true\n")
-        # one call to netplan apply in total
+        # one call to netplan generate in total
         self.assertEquals(self.mock_netplan_cmd.calls(), [
                 ["netplan", "generate"],
         ])
 
+    def test_netplan_dbus_generate_concurrent(self):
+        # keep the first 'netplan generate' running for a while
+        with open(self.mock_netplan_cmd.path, "a") as fp:
+            fp.write("sleep 1\n")
+        BUSCTL_NETPLAN_CMD = [
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan",
+            "io.netplan.Netplan",
+            "Generate",
+        ]
+        first = subprocess.Popen(BUSCTL_NETPLAN_CMD, stdout=subprocess.PIPE)
+        time.sleep(0.5)
+        # the service keeps answering other calls meanwhile
+        output = subprocess.check_output(BUSCTL_NETPLAN_CMD[:-1] + ["Info"])
+        self.assertIn("Features", output.decode("utf-8"))
+        # later calls are answered by a single follow-up run
+        others = [subprocess.Popen(BUSCTL_NETPLAN_CMD, stdout=subprocess.PIPE) for _ in range(2)]
+        for p in [first] + others:
+            self.assertEqual(p.communicate(timeout=10)[0], b"b true\n")
+        self.assertEquals(self.mock_netplan_cmd.calls(), [
+                ["netplan", "generate"],
+                ["netplan", "generate"],
+        ])
+
+    def test_netplan_dbus_generate_failed(self):
+        with open(self.mock_netplan_cmd.path, "a") as fp:
+            fp.write("echo \"interface 'eth0' is not defined\" >&2\n")
+        self.mock_netplan_cmd.set_returncode(1)
+        err = self._check_dbus_error([
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan",
+            "io.netplan.Netplan",
+            "Generate",
+        ])
+        self.assertIn("netplan generate failed: exited with status 1", err)
+        self.assertIn("interface 'eth0' is not defined", err)
+
     def test_netplan_dbus_info(self):
         BUSCTL_NETPLAN_INFO = [
             "busctl", "call", "--system",
@@ -274,10 +410,10 @@ class TestNetplanDBus(unittest.TestCase):
         # Create test YAML
         test_file_lib = os.path.join(self.tmp, 'lib', 'netplan', 'lib_test.yaml')
         with open(test_file_lib, 'w') as f:
-            f.write('TESTING-lib')
+            f.write('network:\n  ethernets:\n    eth1:\n      dhcp6: true')
         test_file_run = os.path.join(self.tmp, 'run', 'netplan', 'run_test.yaml')
         with open(test_file_run, 'w') as f:
-            f.write('TESTING-run')
+            f.write('network:\n  ethernets:\n    eth2:\n      dhcp4: true')
         self.assertTrue(os.path.isfile(os.path.join(self.tmp, 'etc', 'netplan', 'main_test.yaml')))
         self.assertTrue(os.path.isfile(os.path.join(self.tmp, 'lib', 'netplan', 'lib_test.yaml')))
         self.assertTrue(os.path.isfile(os.path.join(self.tmp, 'run', 'netplan', 'run_test.yaml')))
@@ -296,10 +432,11 @@ class TestNetplanDBus(unittest.TestCase):
             "Get",
         ]
         out = subprocess.check_output(BUSCTL_NETPLAN_CMD, universal_newlines=True)
-        self.assertIn(r's ""', out)  # No output as 'netplan get' is actually mocked
-        self.assertEquals(self.mock_netplan_cmd.calls(), [[
-            "netplan", "get", "all", "--root-dir={}".format(tmpdir)
-        ]])
+        self.assertIn(r'eth0:\n      dhcp4: true', out)
+        self.assertIn(r'eth1:\n      dhcp6: true', out)
+        self.assertIn(r'eth2:\n      dhcp4: true', out)
+        # parsed in-process, without calling the netplan CLI
+        self.assertEquals(self.mock_netplan_cmd.calls(), [])
 
         # Verify all *.yaml files have been copied
         self.assertTrue(os.path.isfile(os.path.join(tmpdir, 'etc', 'netplan', 'main_test.yaml')))
@@ -332,19 +469,40 @@ class TestNetplanDBus(unittest.TestCase):
         ]
         out = subprocess.check_output(BUSCTL_NETPLAN_CMD)
         self.assertEqual(b'b true\n', out)
-        print(self.mock_netplan_cmd.calls(), flush=True)
         self.assertEquals(self.mock_netplan_cmd.calls(), [[
             "netplan", "set", "ethernets.eth42.dhcp6=true",
             "--root-dir={}".format(tmpdir)
         ]])
 
+    def test_netplan_dbus_config_set_invalid(self):
+        cid = self._new_config_object()
+        tmpdir = '/tmp/netplan-config-{}'.format(cid)
+        self.addCleanup(shutil.rmtree, tmpdir)
+
+        BUSCTL_NETPLAN_CMD = [
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan/config/{}".format(cid),
+            "io.netplan.Netplan.Config",
+            "Set", "ss", "ethernets.eth0.dhcp4=maybe", "70-snapd",
+        ]
+        with open(self.mock_netplan_cmd.path, "a") as fp:
+            fp.write("echo \"invalid boolean value 'maybe'\" >&2\n")
+        self.mock_netplan_cmd.set_returncode(1)
+        err = self._check_dbus_error(BUSCTL_NETPLAN_CMD)
+        self.assertIn("netplan set failed", err)
+        self.assertIn("invalid boolean value 'maybe'", err)
+        self.assertEquals(self.mock_netplan_cmd.calls(), [[
+            "netplan", "set", "ethernets.eth0.dhcp4=maybe", "--origin-hint=70-snapd",
+            "--root-dir={}".format(tmpdir)
+        ]])
+
     def test_netplan_dbus_config_get(self):
         cid = self._new_config_object()
         tmpdir = '/tmp/netplan-config-{}'.format(cid)
         self.addCleanup(shutil.rmtree, tmpdir)
 
         # Verify .Config.Get() on the config object
-        self.mock_netplan_cmd.set_output("network:\n  eth42:\n    dhcp6: true")
         BUSCTL_NETPLAN_CMD = [
             "busctl", "call", "--system",
             "io.netplan.Netplan",
@@ -353,10 +511,138 @@ class TestNetplanDBus(unittest.TestCase):
             "Get",
         ]
         out = subprocess.check_output(BUSCTL_NETPLAN_CMD, universal_newlines=True)
-        self.assertIn(r's "network:\n  eth42:\n    dhcp6: true\n"', out)
-        self.assertEquals(self.mock_netplan_cmd.calls(), [[
-            "netplan", "get", "all", "--root-dir={}".format(tmpdir)
-        ]])
+        self.assertIn(r's "network:\n  version: 2\n  ethernets:\n    eth0:\n      dhcp4: true\n"', out)
+        self.assertEquals(self.mock_netplan_cmd.calls(), [])
+
+    def test_netplan_dbus_config_get_cached(self):
+        etc = os.path.join(self.tmp, 'etc', 'netplan')
+
+        def get(cid):
+            return subprocess.check_output([
+                "busctl", "call", "--system",
+                "io.netplan.Netplan",
+                "/io/netplan/Netplan/config/{}".format(cid),
+                "io.netplan.Netplan.Config",
+                "Get",
+            ], universal_newlines=True)
+
+        def new_config():
+            cid = self._new_config_object()
+            self.addCleanup(shutil.rmtree, '/tmp/netplan-config-{}'.format(cid))
+            return cid
+
+        def write(cid, content, name='main_test.yaml'):
+            with open('/tmp/netplan-config-{}/etc/netplan/{}'.format(cid, name), 'w') as f:
+                f.write(content)
+
+        # served from memory, once parsed: nothing but Set() changes a config object
+        cid = new_config()
+        out = get(cid)
+        self.assertIn(r'eth0:\n      dhcp4: true', out)
+        write(cid, 'network: {}')
+        self.assertEqual(get(cid), out)
+        # new copies of the main config, too
+        cid2 = new_config()
+        write(cid2, 'network: {}')
+        self.assertEqual(get(cid2), out)
+        # until a YAML file of the main config changes
+        with open(os.path.join(etc, 'main_test.yaml'), 'a') as f:
+            f.write('\n    eth1:\n      dhcp6: true')
+        self.assertEqual(get(cid), out)
+        out = get(new_config())
+        self.assertIn(r'eth1:\n      dhcp6: true', out)
+        cid2 = new_config()
+        write(cid2, 'network: {}')
+        self.assertEqual(get(cid2), out)
+        # other files in the config dirs do not matter
+        with open(os.path.join(etc, 'main_test.yaml.swp'), 'w') as f:
+            f.write('garbage')
+        with open(os.path.join(self.tmp, 'run', 'unrelated.yaml'), 'w') as f:
+            f.write('garbage')
+        cid2 = new_config()
+        write(cid2, 'network: {}')
+        self.assertEqual(get(cid2), out)
+        # the netplan/ dirs coming and going
+        shutil.rmtree(etc)
+        self.assertEqual(get(new_config()), 's ""\n')
+        os.makedirs(etc)
+        with open(os.path.join(etc, 'a.yaml'), 'w') as f:
+            f.write('network:\n  bonds:\n    bond0: {}')
+        self.assertIn(r'bond0: {}', get(new_config()))
+        # Set() drops the cache of its config object, which is no copy anymore
+        cid = new_config()
+        self.assertIn(r'bond0: {}', get(cid))
+        BUSCTL_NETPLAN_CMD = [
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan/config/{}".format(cid),
+            "io.netplan.Netplan.Config",
+        ]
+        write(cid, 'network:\n  renderer: networkd', 'a.yaml')
+        subprocess.check_output(BUSCTL_NETPLAN_CMD + ["Set", "ss", "ethernets.eth0.dhcp4=true", ""])
+        self.assertEqual(get(cid), r's "network:\n  version: 2\n  renderer: networkd\n"' + '\n')
+        self.assertIn(r'bond0: {}', get(new_config()))
+        # errors are not cached
+        write(cid, 'network: [', 'a.yaml')
+        subprocess.check_output(BUSCTL_NETPLAN_CMD + ["Set", "ss", "ethernets.eth0.dhcp4=true", ""])
+        for _ in range(2):
+            err = self._check_dbus_error(BUSCTL_NETPLAN_CMD + ["Get"])
+            self.assertIn('netplan get failed', err)
+        write(cid, 'network:\n  renderer: networkd', 'a.yaml')
+        self.assertEqual(get(cid), r's "network:\n  version: 2\n  renderer: networkd\n"' + '\n')
+
+    def test_netplan_dbus_config_get_invalid(self):
+        with open(os.path.join(self.tmp, 'etc', 'netplan', 'main_test.yaml'), 'w') as f:
+            f.write('network:\n  ethernets:\n    eth0:\n      dhcp4: [')
+        cid = self._new_config_object()
+        tmpdir = '/tmp/netplan-config-{}'.format(cid)
+        self.addCleanup(shutil.rmtree, tmpdir)
+
+        BUSCTL_NETPLAN_CMD = [
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan/config/{}".format(cid),
+            "io.netplan.Netplan.Config",
+            "Get",
+        ]
+        err = self._check_dbus_error(BUSCTL_NETPLAN_CMD)
+        self.assertIn('netplan get failed', err)
+        self.assertIn('Invalid YAML', err)
+
+    def test_netplan_dbus_config_set_concurrent(self):
+        cid = self._new_config_object()
+        tmpdir = '/tmp/netplan-config-{}'.format(cid)
+        self.addCleanup(shutil.rmtree, tmpdir)
+        # keep each 'netplan set' running for a while, then make it write the config
+        with open(self.mock_netplan_cmd.path, "a") as fp:
+            fp.write("sleep 1\n")
+            fp.write("printf 'network:\\n  bonds:\\n    %%s: {}\\n' \"$2\" > %s/etc/netplan/main_test.yaml\n" % tmpdir)
+        config = [
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan/config/{}".format(cid),
+            "io.netplan.Netplan.Config",
+        ]
+        first = subprocess.Popen(config + ["Set", "ss", "bond0", ""], stdout=subprocess.PIPE)
+        time.sleep(0.5)
+        # the service keeps answering other calls meanwhile
+        output = subprocess.check_output(["busctl", "call", "--system", "io.netplan.Netplan",
+                                          "/io/netplan/Netplan", "io.netplan.Netplan", "Info"])
+        self.assertIn("Features", output.decode("utf-8"))
+        # the config object cannot be applied while a Set() is in progress
+        err = self._check_dbus_error(config + ["Apply"])
+        self.assertIn("A Set() is currently in progress on this config object", err)
+        # later calls on the config object are processed in order, after it
+        second = subprocess.Popen(config + ["Set", "ss", "bond1", ""], stdout=subprocess.PIPE)
+        time.sleep(0.1)
+        get = subprocess.Popen(config + ["Get"], stdout=subprocess.PIPE, universal_newlines=True)
+        for p in [first, second]:
+            self.assertEqual(p.communicate(timeout=10)[0], b"b true\n")
+        self.assertIn(r'bond1: {}', get.communicate(timeout=10)[0])
+        self.assertEquals(self.mock_netplan_cmd.calls(), [
+            ["netplan", "set", "bond0", "--root-dir={}".format(tmpdir)],
+            ["netplan", "set", "bond1", "--root-dir={}".format(tmpdir)],
+        ])
 
     def test_netplan_dbus_config_cancel(self):
         cid = self._new_config_object()
@@ -543,6 +829,105 @@ class TestNetplanDBus(unittest.TestCase):
         err = self._check_dbus_error(BUSCTL_NETPLAN_CMD2)
         self.assertIn('Another \'netplan try\' process is already running', err)
 
+    def test_netplan_dbus_config_try_cancel_async(self):
+        # self-terminate after 30 dsec = 3 sec, if not cancelled before,
+        # and take another second to revert
+        self.mock_netplan_cmd.set_timeout(30)
+        with open(self.mock_netplan_cmd.path, 'a') as f:
+            f.write('\nsleep 1\n')
+        cid = self._new_config_object()
+        tmpdir = '/tmp/netplan-config-{}'.format(cid)
+        with open(os.path.join(tmpdir, 'etc', 'netplan', 'try_test.yaml'), 'w') as f:
+            f.write('TESTING-try')
+        mon = self._monitor_bus()
+        BUSCTL_NETPLAN_CMD = [
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan/config/{}".format(cid),
+            "io.netplan.Netplan.Config",
+        ]
+        out = subprocess.check_output(BUSCTL_NETPLAN_CMD + ["Try", "u", "3"])
+        self.assertEqual(b'b true\n', out)
+        self.assertTrue(os.path.isfile(os.path.join(self.tmp, 'etc', 'netplan', 'try_test.yaml')))
+
+        cancel = subprocess.Popen(BUSCTL_NETPLAN_CMD + ["Cancel"], stdout=subprocess.PIPE)
+        time.sleep(0.2)
+        # the daemon keeps serving other calls, while 'netplan try' reverts
+        out = subprocess.check_output(BUSCTL_NETPLAN_CMD[:4] + ["/io/netplan/Netplan", "io.netplan.Netplan", "Info"])
+        self.assertIn(b'dbus-config', out)
+        err = self._check_dbus_error(BUSCTL_NETPLAN_CMD + ["Cancel"])
+        self.assertIn("The current 'netplan try' process is already being rejected", err)
+        self.assertIsNone(cancel.poll())
+        self.assertEqual(cancel.communicate()[0], b'b true\n')
+
+        # the backup has been restored, once 'netplan try' stopped
+        self.assertFalse(os.path.isdir(tmpdir))
+        self.assertFalse(os.path.isdir('/tmp/netplan-config-BACKUP'))
+        self.assertTrue(os.path.isfile(os.path.join(self.tmp, 'etc', 'netplan', 'main_test.yaml')))
+        self.assertFalse(os.path.isfile(os.path.join(self.tmp, 'etc', 'netplan', 'try_test.yaml')))
+        self.assertEqual(self._job_signals(mon), [
+            ('JobStarted', ['/io/netplan/Netplan/job/1', 'try']),
+            ('Progress', ['running']),
+            ('Progress', ['reverting']),
+            ('Finished', ['false', 'reverted']),
+        ])
+
+    def test_netplan_dbus_config_try_config_apply(self):
+        self.mock_netplan_cmd.set_timeout(30)  # 30 dsec = 3 sec
+        cid = self._new_config_object()
+        tmpdir = '/tmp/netplan-config-{}'.format(cid)
+        with open(os.path.join(tmpdir, 'etc', 'netplan', 'try_test.yaml'), 'w') as f:
+            f.write('TESTING-try')
+        mon = self._monitor_bus()
+        BUSCTL_NETPLAN_CMD = [
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan/config/{}".format(cid),
+            "io.netplan.Netplan.Config",
+        ]
+        out = subprocess.check_output(BUSCTL_NETPLAN_CMD + ["Try", "u", "3"])
+        self.assertEqual(b'b true\n', out)
+        # Apply() accepts the running 'netplan try'
+        out = subprocess.check_output(BUSCTL_NETPLAN_CMD + ["Apply"])
+        self.assertEqual(b'b true\n', out)
+
+        # the tried config stays, no backup or config state is left behind
+        self.assertTrue(os.path.isfile(os.path.join(self.tmp, 'etc', 'netplan', 'try_test.yaml')))
+        self.assertFalse(os.path.isdir(tmpdir))
+        self.assertFalse(os.path.isdir('/tmp/netplan-config-BACKUP'))
+        self.assertEqual(self._job_signals(mon), [
+            ('JobStarted', ['/io/netplan/Netplan/job/1', 'try']),
+            ('Progress', ['running']),
+            ('Progress', ['accepting']),
+            ('Finished', ['true', '']),
+        ])
+        self.assertEquals(self.mock_netplan_cmd.calls(), [["netplan", "try", "--timeout=3"]])
+
+    def test_netplan_dbus_config_try_failed(self):
+        self.mock_netplan_cmd.set_returncode(1)
+        cid = self._new_config_object()
+        tmpdir = '/tmp/netplan-config-{}'.format(cid)
+        with open(os.path.join(tmpdir, 'etc', 'netplan', 'try_test.yaml'), 'w') as f:
+            f.write('TESTING-try')
+        mon = self._monitor_bus()
+        out = subprocess.check_output([
+            "busctl", "call", "--system",
+            "io.netplan.Netplan",
+            "/io/netplan/Netplan/config/{}".format(cid),
+            "io.netplan.Netplan.Config",
+            "Try", "u", "1",
+        ])
+        self.assertEqual(b'b true\n', out)
+        self.assertEqual(self._job_signals(mon), [
+            ('JobStarted', ['/io/netplan/Netplan/job/1', 'try']),
+            ('Progress', ['running']),
+            ('Finished', ['false', 'netplan try failed: exited with status 1']),
+        ])
+        # the previous config is restored
+        self.assertFalse(os.path.isdir(tmpdir))
+        self.assertFalse(os.path.isfile(os.path.join(self.tmp, 'etc', 'netplan', 'try_test.yaml')))
+        self.assertTrue(os.path.isfile(os.path.join(self.tmp, 'etc', 'netplan', 'main_test.yaml')))
+
     def test_netplan_dbus_config_try_config_try(self):
         self.mock_netplan_cmd.set_timeout(50)  # 50 dsec = 5 sec
         cid = self._new_config_object()
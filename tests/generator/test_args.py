@@ -16,8 +16,13 @@
 # You should have received a copy of the GNU General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+import json
 import os
+import re
+import shutil
+import stat
 import subprocess
+import time
 
 from .base import TestBase, exe_generate, OVS_CLEANUP
 
@@ -50,6 +55,14 @@ class TestConfigArgs(TestBase):
         self.assert_nm_udev(None)
         self.assert_ovs({'cleanup.service': OVS_CLEANUP % {'iface': 'cleanup'}})
 
+    def test_empty_config_device(self):
+        # not a regular file, so it gets read rather than mapped
+        os.makedirs(self.confdir)
+        os.symlink('/dev/null', os.path.join(self.confdir, 'a.yaml'))
+        subprocess.check_call([exe_generate, '--root-dir', self.workdir.name])
+        self.assert_networkd(None)
+        self.assert_nm(None)
+
     def test_file_args(self):
         conf = os.path.join(self.workdir.name, 'config')
         with open(conf, 'w') as f:
@@ -96,6 +109,128 @@ class TestConfigArgs(TestBase):
         self.assertIn('Usage:', out)
         self.assertEqual(os.listdir(self.workdir.name), ['etc'])
 
+    def test_timings(self):
+        os.makedirs(self.confdir)
+        for name in ('a', 'b'):
+            with open(os.path.join(self.confdir, name + '.yaml'), 'w') as f:
+                f.write('''network:
+  version: 2
+  ethernets:
+    eth_%s:
+      dhcp4: true''' % name)
+
+        env = dict(os.environ, NETPLAN_TIMINGS='1')
+        p = subprocess.run([exe_generate, '--root-dir', self.workdir.name], env=env,
+                           stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+        self.assertEqual(p.returncode, 0, p.stderr)
+        self.assertEqual(p.stdout, '')
+        timings = json.loads(p.stderr)
+        self.assertEqual([f['path'] for f in timings['files']],
+                         [os.path.join(self.confdir, 'a.yaml'), os.path.join(self.confdir, 'b.yaml')])
+        for phase in ('glob', 'load', 'parse', 'validate', 'render-networkd', 'render-nm', 'render-ovs', 'write'):
+            self.assertGreater(timings['phases'][phase]['calls'], 0, phase)
+            self.assertGreaterEqual(timings['phases'][phase]['wall-us'], 0, phase)
+        self.assertEqual(timings['phases']['render-sriov']['calls'], 1)  # only the cleanup
+        self.assertGreaterEqual(timings['total']['wall-us'], timings['phases']['parse']['wall-us'])
+        self.assertEqual(timings['counters']['files-parsed'], 2)
+        self.assertEqual(timings['counters']['documents'], 2)
+        self.assertEqual(timings['counters']['netdefs'], 2)
+        self.assertEqual(timings['counters']['files-written'], 5)
+        self.assertEqual(timings['counters']['files-removed'], 0)
+
+        # a single file gets streamed; only NetworkManager's list of
+        # unmanaged devices changes then
+        p = subprocess.run([exe_generate, '--root-dir', self.workdir.name, '--timings',
+                            os.path.join(self.confdir, 'a.yaml')],
+                           stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+        self.assertEqual(p.returncode, 0, p.stderr)
+        timings = json.loads(p.stderr)
+        self.assertEqual(timings['phases']['glob']['calls'], 0)
+        self.assertEqual(len(timings['files']), 1)
+        self.assertEqual(timings['counters']['files-written'], 1)
+        self.assertEqual(timings['counters']['files-unchanged'], 3)
+        self.assertEqual(timings['counters']['files-removed'], 1)
+
+    def test_render_threads(self):
+        conf = ['network:\n  version: 2\n  ethernets:\n']
+        for i in range(40):
+            conf.append('''    nd%(i)d:
+      addresses: [10.0.%(i)d.1/24]
+      match: {macaddress: "00:11:22:33:44:%(i)02x"}
+      set-name: lan%(i)d
+''' % {'i': i})
+        for i in range(40):
+            conf.append('    nm%d:\n      renderer: NetworkManager\n      dhcp6: true\n' % i)
+        conf.append('''    nmparent:
+      renderer: NetworkManager
+      match: {name: "en*"}
+  vlans:
+    nmvlan1: {id: 1, link: nmparent, renderer: NetworkManager}
+    nmvlan2: {id: 2, link: nmparent, renderer: NetworkManager}
+  wifis:
+    wl0:
+      dhcp4: true
+      access-points:
+        "Joe's Home":
+          password: "s0s3kr1t"
+''')
+        os.makedirs(self.confdir)
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write(''.join(conf))
+
+        def render(threads):
+            env = dict(os.environ)
+            env.pop('NETPLAN_RENDER_THREADS', None)
+            if threads is not None:
+                env['NETPLAN_RENDER_THREADS'] = threads
+            rootdir = os.path.join(self.workdir.name, 'out-%s' % threads)
+            shutil.copytree(os.path.join(self.workdir.name, 'etc'), os.path.join(rootdir, 'etc'))
+            subprocess.check_call([exe_generate, '--root-dir', rootdir], env=env)
+            files = {}
+            for (dirpath, _, filenames) in os.walk(os.path.join(rootdir, 'run')):
+                for name in filenames:
+                    path = os.path.join(dirpath, name)
+                    if os.path.islink(path):
+                        files[os.path.relpath(path, rootdir)] = os.readlink(path)
+                        continue
+                    with open(path) as f:
+                        contents = f.read()
+                    if name == 'netplan-nmparent.nmconnection':
+                        parent_uuid = re.search(r'^uuid=(.*)$', contents, re.MULTILINE).group(1)
+                    files[os.path.relpath(path, rootdir)] = (contents, stat.S_IMODE(os.stat(path).st_mode))
+            # VLANs refer to the generated UUID of their parent
+            for vlan in ('nmvlan1', 'nmvlan2'):
+                with open(os.path.join(rootdir, 'run/NetworkManager/system-connections/netplan-%s.nmconnection' % vlan)) as f:
+                    self.assertIn('parent=%s\n' % parent_uuid, f.read())
+            return files
+
+        serial = render('1')
+        self.assertEqual(serial['run/systemd/network/10-netplan-nd0.network'][1], 0o644)
+        self.assertEqual(serial['run/NetworkManager/system-connections/netplan-nm0.nmconnection'][1], 0o600)
+        self.assertEqual(serial['run/netplan/wpa-wl0.conf'][1], 0o600)
+        self.assertEqual(render('4'), serial)
+        self.assertEqual(render(None), serial)
+
+    def test_parallel_render_error(self):
+        conf = ['network:\n  version: 2\n  ethernets:\n']
+        for i in range(40):
+            conf.append('    nd%d:\n      dhcp4: true\n' % i)
+            if i in (5, 30):
+                conf.append('      renderer: NetworkManager\n      ipv6-mtu: 1600\n')
+        os.makedirs(self.confdir)
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write(''.join(conf))
+
+        for threads in ('1', '4'):
+            env = dict(os.environ, NETPLAN_RENDER_THREADS=threads)
+            p = subprocess.Popen([exe_generate, '--root-dir', self.workdir.name], env=env,
+                                 stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+            (out, err) = p.communicate()
+            self.assertEqual(p.returncode, 1, err)
+            # the first broken netdef gets reported, however the threads finish
+            self.assertEqual(err, 'ERROR: nd5: NetworkManager definitions do not support ipv6-mtu\n')
+            self.assertFalse(os.path.exists(os.path.join(self.workdir.name, 'run')))
+
     def test_unknown_cli_args(self):
         p = subprocess.Popen([exe_generate, '--foo'],
                              stdout=subprocess.PIPE, stderr=subprocess.PIPE,
@@ -116,6 +251,63 @@ class TestConfigArgs(TestBase):
         # can be /proc/foor/run/systemd/{network,system}
         self.assertIn('cannot create directory /proc/foo/run/systemd/', err)
 
+    def test_output_write_error_keeps_previous(self):
+        self.generate('''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true
+  wifis:
+    wl0:
+      access-points:
+        "Joe's Home":
+          password: "s0s3kr1t"
+      dhcp4: yes''')
+        networkd_dir = os.path.join(self.workdir.name, 'run', 'systemd', 'network')
+        with open(os.path.join(networkd_dir, '10-netplan-eth0.network')) as f:
+            eth0 = f.read()
+
+        # the wpa_supplicant configuration of wl0 cannot be written any more,
+        # so nothing else gets replaced either
+        shutil.rmtree(os.path.join(self.workdir.name, 'run', 'netplan'))
+        with open(os.path.join(self.workdir.name, 'run', 'netplan'), 'w') as f:
+            f.write('in the way')
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp6: true
+  wifis:
+    wl0:
+      access-points:
+        "Joe's Home":
+          password: "s0s3kr1t"
+      dhcp4: yes''', expect_fail=True)
+        self.assertIn('cannot create directory %s/run/netplan' % self.workdir.name, err)
+        with open(os.path.join(networkd_dir, '10-netplan-eth0.network')) as f:
+            self.assertEqual(f.read(), eth0)
+        # no temporary files are left behind
+        self.assertEqual(sorted(os.listdir(networkd_dir)), ['10-netplan-eth0.network', '10-netplan-wl0.network'])
+
+    def test_output_removes_stale_temporary_files(self):
+        conf = '''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true'''
+        self.generate(conf)
+        # left behind by a run which got interrupted while writing
+        networkd_dir = os.path.join(self.workdir.name, 'run', 'systemd', 'network')
+        for name in ['.10-netplan-eth0.network.Xy12Z3', '.10-netplan-eth1.network.abcdef']:
+            with open(os.path.join(networkd_dir, name), 'w') as f:
+                f.write('[Match]\n')
+            os.utime(os.path.join(networkd_dir, name), (time.time() - 7200, time.time() - 7200))
+        # still being written by a concurrent run
+        with open(os.path.join(networkd_dir, '.10-netplan-eth0.network.fresh1'), 'w') as f:
+            f.write('[Match]\n')
+        self.generate(conf)
+        self.assertEqual(sorted(os.listdir(networkd_dir)), ['.10-netplan-eth0.network.fresh1', '10-netplan-eth0.network'])
+
     def test_systemd_generator(self):
         conf = os.path.join(self.confdir, 'a.yaml')
         os.makedirs(os.path.dirname(conf))
@@ -182,3 +374,138 @@ class TestConfigArgs(TestBase):
         except subprocess.CalledProcessError as e:
             self.assertEqual(e.returncode, 1)
             self.assertIn(b'can not be called directly', e.output)
+
+    def test_changes(self):
+        def generate(yaml):
+            os.makedirs(self.confdir, exist_ok=True)
+            with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+                f.write(yaml)
+            return subprocess.check_output([exe_generate, '--root-dir', self.workdir.name, '--changes'],
+                                           universal_newlines=True)
+
+        config = '''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true
+    eth1:
+      dhcp4: true
+  wifis:
+    wl0:
+      access-points:
+        "Joe's Home":
+          password: "s0s3kr1t"
+      dhcp4: yes'''
+        self.assertEqual(generate(config).splitlines(), [
+            'added /run/NetworkManager/conf.d/netplan.conf',
+            'added /run/netplan/wpa-wl0.conf',
+            'added /run/systemd/network/10-netplan-eth0.network',
+            'added /run/systemd/network/10-netplan-eth1.network',
+            'added /run/systemd/network/10-netplan-wl0.network',
+            'added /run/systemd/system/netplan-ovs-cleanup.service',
+            'added /run/systemd/system/netplan-wpa-wl0.service',
+            'added /run/systemd/system/systemd-networkd.service.wants/netplan-ovs-cleanup.service',
+            'added /run/systemd/system/systemd-networkd.service.wants/netplan-wpa-wl0.service',
+        ])
+        n = os.path.join(self.workdir.name, 'run', 'systemd', 'network', '10-netplan-eth0.network')
+        link = os.path.join(self.workdir.name, 'run', 'systemd', 'system', 'systemd-networkd.service.wants',
+                            'netplan-wpa-wl0.service')
+        st = os.stat(n)
+
+        # unchanged files are left alone
+        self.assertEqual(generate(config), '')
+        self.assertEqual(os.stat(n).st_ino, st.st_ino)
+
+        # modified permissions and symlinks get restored
+        os.chmod(n, 0o600)
+        os.unlink(link)
+        os.symlink('/dev/null', link)
+        self.assertEqual(generate(config),
+                         'changed /run/systemd/network/10-netplan-eth0.network\n'
+                         'changed /run/systemd/system/systemd-networkd.service.wants/netplan-wpa-wl0.service\n')
+        self.assertEqual(os.stat(n).st_mode & 0o777, 0o644)
+        self.assertEqual(os.readlink(link), '/run/systemd/system/netplan-wpa-wl0.service')
+        # the new symlink got renamed into place
+        self.assertEqual(sorted(os.listdir(os.path.dirname(link))),
+                         ['netplan-ovs-cleanup.service', 'netplan-wpa-wl0.service'])
+        # compare against the inode which is in use right now, as the original one might get recycled
+        st = os.stat(n)
+
+        # only the changed files get rewritten, and only stale ones get removed
+        out = generate('''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true
+      dhcp6: true
+    eth2:
+      dhcp4: true''')
+        self.assertEqual(out.splitlines(), [
+            'changed /run/NetworkManager/conf.d/netplan.conf',
+            'removed /run/netplan/wpa-wl0.conf',
+            'changed /run/systemd/network/10-netplan-eth0.network',
+            'removed /run/systemd/network/10-netplan-eth1.network',
+            'added /run/systemd/network/10-netplan-eth2.network',
+            'removed /run/systemd/network/10-netplan-wl0.network',
+            'removed /run/systemd/system/netplan-wpa-wl0.service',
+            'removed /run/systemd/system/systemd-networkd.service.wants/netplan-wpa-wl0.service',
+        ])
+        self.assertNotEqual(os.stat(n).st_ino, st.st_ino)
+
+    def test_mapping_keeps_output(self):
+        self.generate('''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true''')
+        out = subprocess.check_output([exe_generate, '--root-dir', self.workdir.name, '--mapping', 'eth0'])
+        self.assertIn(b'id=eth0', out)
+        # only prints the mapping, without touching the generated files
+        self.assertTrue(os.path.exists(os.path.join(
+            self.workdir.name, 'run', 'systemd', 'network', '10-netplan-eth0.network')))
+
+    def test_manifest(self):
+        def manifest():
+            with open(os.path.join(self.workdir.name, 'run', 'netplan', 'generate.json')) as f:
+                return {entry['path']: entry for entry in json.load(f)['files']}
+
+        self.generate('''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true
+    eth1:
+      match:
+        macaddress: 00:11:22:33:44:55
+      set-name: lan1
+  vlans:
+    vlan7:
+      id: 7
+      link: eth0''')
+        files = manifest()
+        self.assertEqual(files['/run/systemd/network/10-netplan-eth0.network'],
+                         {'path': '/run/systemd/network/10-netplan-eth0.network', 'status': 'added',
+                          'netdef': 'eth0', 'interface': 'eth0'})
+        self.assertEqual(files['/run/systemd/network/10-netplan-eth1.link']['interface'], 'lan1')
+        self.assertEqual(files['/run/systemd/network/10-netplan-vlan7.netdev']['netdef'], 'vlan7')
+        # not generated for a particular netdef
+        self.assertEqual(files['/run/systemd/system/netplan-ovs-cleanup.service'],
+                         {'path': '/run/systemd/system/netplan-ovs-cleanup.service', 'status': 'added'})
+
+        self.generate('''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true''')
+        files = manifest()
+        self.assertEqual(files['/run/systemd/network/10-netplan-eth0.network']['status'], 'changed')
+        self.assertEqual(files['/run/systemd/network/10-netplan-vlan7.netdev'],
+                         {'path': '/run/systemd/network/10-netplan-vlan7.netdev', 'status': 'removed'})
+        self.assertEqual(files['/run/systemd/system/netplan-ovs-cleanup.service']['status'], 'unchanged')
+
+        with open(os.path.join(self.workdir.name, 'run', 'netplan', 'generate.json')) as f:
+            self.assertNotIn('run-id', json.load(f))
+        env = dict(os.environ, NETPLAN_GENERATE_RUN_ID='abc"1')
+        subprocess.check_call([exe_generate, '--root-dir', self.workdir.name], env=env)
+        with open(os.path.join(self.workdir.name, 'run', 'netplan', 'generate.json')) as f:
+            self.assertEqual(json.load(f)['run-id'], 'abc"1')
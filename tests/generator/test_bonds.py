@@ -799,6 +799,22 @@ class TestConfigErrors(TestBase):
       interfaces: [eno1]''', expect_fail=True)
         self.assertIn("bond1: interface 'eno1' is already assigned to bridge br0", err)
 
+    def test_bond_bridge_cross_assignments_nested(self):
+        # bond1 gets resolved on behalf of br1, which refers to it
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    eno1: {}
+  bridges:
+    br0:
+      interfaces: [eno1]
+    br1:
+      interfaces: [bond1]
+  bonds:
+    bond1:
+      interfaces: [eno1]''', expect_fail=True)
+        self.assertIn("a.yaml:12:19: Error in network definition: bond1: interface 'eno1' is already assigned to bridge br0", err)
+
     def test_bond_bridge_nested_assignments(self):
         self.generate('''network:
   version: 2
@@ -0,0 +1,244 @@
+#
+# Tests for the parsed state cache of the generator
+#
+# Copyright (C) 2021 Canonical, Ltd.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+import os
+import shutil
+import stat
+import struct
+import subprocess
+
+from .base import TestBase, exe_generate
+
+CONFIG = '''network:
+  version: 2
+  renderer: networkd
+  openvswitch:
+    external-ids:
+      iface-id: myhostname
+    other-config:
+      disable-in-band: true
+  ethernets:
+    eth0:
+      match:
+        macaddress: "00:11:22:33:44:55"
+      set-name: lan0
+      wakeonlan: true
+      addresses:
+        - 10.0.0.5/24:
+            label: lan0:0
+        - 2001:db8::5/64
+      routes:
+        - to: 10.10.0.0/16
+          via: 10.0.0.1
+          metric: 100
+      routing-policy:
+        - from: 10.0.0.0/24
+          table: 100
+      nameservers:
+        addresses: [8.8.8.8]
+        search: [example.com]
+      dhcp4-overrides:
+        use-dns: false
+    eth1: {}
+  bonds:
+    bond0:
+      interfaces: [eth1]
+      parameters:
+        mode: active-backup
+        primary: eth1
+  vlans:
+    vlan10:
+      id: 10
+      link: bond0
+      dhcp4: true
+  wifis:
+    wl0:
+      renderer: NetworkManager
+      access-points:
+        "home":
+          password: "s0s3kr1t"
+        "work":
+          mode: ap
+'''
+
+
+class TestStateCache(TestBase):
+    '''Parsed state cache below var/cache/netplan'''
+
+    def setUp(self):
+        super().setUp()
+        self.cachedir = os.path.join(self.workdir.name, 'var', 'cache', 'netplan')
+        self.cache = os.path.join(self.cachedir, 'state.cache')
+        os.makedirs(self.cachedir)
+
+    def generated(self):
+        '''Return path → contents of all generated files, removing them'''
+        files = {}
+        rundir = os.path.join(self.workdir.name, 'run')
+        for root, _, names in os.walk(rundir):
+            for name in names:
+                path = os.path.join(root, name)
+                if os.path.islink(path):
+                    files[os.path.relpath(path, rundir)] = os.readlink(path)
+                    continue
+                with open(path) as f:
+                    files[os.path.relpath(path, rundir)] = f.read()
+        shutil.rmtree(rundir)
+        return files
+
+    def generate(self, yaml, **kwargs):
+        # None regenerates from the existing files, keeping their mtime
+        return super().generate(yaml, skip_generated_yaml_validation=True, **kwargs)
+
+    def test_no_cache_dir(self):
+        os.rmdir(self.cachedir)
+        self.generate(CONFIG)
+        self.assertFalse(os.path.exists(self.cachedir))
+
+    def test_cached_state_same_output(self):
+        self.generate(CONFIG)
+        st = os.stat(self.cache)
+        self.assertEqual(stat.S_IMODE(st.st_mode), 0o600)
+        parsed = self.generated()
+        self.assertIn('systemd/network/10-netplan-vlan10.network', parsed)
+
+        # unchanged input: the cache gets used, not written again
+        self.generate(None)
+        self.assertEqual(os.stat(self.cache).st_ino, st.st_ino)
+        self.assertEqual(self.generated(), parsed)
+
+    def test_changed_input(self):
+        self.generate(CONFIG)
+        conf = os.path.join(self.confdir, 'a.yaml')
+        st = os.stat(conf)
+        ino = os.stat(self.cache).st_ino
+        # same size and mtime, different contents
+        with open(conf, 'w') as f:
+            f.write(CONFIG.replace('vlan10', 'vlan11'))
+        os.utime(conf, ns=(st.st_atime_ns, st.st_mtime_ns))
+        self.generated()
+        self.generate(None)
+        self.assertNotEqual(os.stat(self.cache).st_ino, ino)
+        files = self.generated()
+        self.assertIn('systemd/network/10-netplan-vlan11.network', files)
+        self.assertNotIn('systemd/network/10-netplan-vlan10.network', files)
+
+    def test_added_input(self):
+        self.generate(CONFIG)
+        self.generated()
+        self.generate(None, confs={'b': '''network:
+  version: 2
+  ethernets:
+    eth2:
+      dhcp6: true'''})
+        self.assertIn('systemd/network/10-netplan-eth2.network', self.generated())
+
+    def test_broken_cache(self):
+        self.generate(CONFIG)
+        parsed = self.generated()
+        with open(self.cache, 'r+b') as f:
+            size = os.fstat(f.fileno()).st_size
+            f.truncate(size // 2)
+        self.generate(None)
+        self.assertGreater(os.path.getsize(self.cache), size // 2)
+        self.assertEqual(self.generated(), parsed)
+
+    def test_cache_not_private(self):
+        self.generate(CONFIG)
+        parsed = self.generated()
+        os.chmod(self.cache, 0o644)
+        self.generate(None)
+        self.assertEqual(stat.S_IMODE(os.stat(self.cache).st_mode), 0o600)
+        self.assertEqual(self.generated(), parsed)
+
+    def test_cache_of_other_build(self):
+        self.generate(CONFIG)
+        parsed = self.generated()
+        with open(self.cache, 'r+b') as f:
+            data = bytearray(f.read())
+            # the header starts with the magic and the build ID of libnetplan,
+            # each prefixed with its length plus one
+            (magic_len,) = struct.unpack_from('=I', data, 0)
+            pos = 4 + magic_len - 1 + 4
+            self.assertIn(chr(data[pos]), '0123456789abcdef')
+            data[pos] = ord('1') if data[pos] == ord('0') else ord('0')
+            f.seek(0)
+            f.write(data)
+        self.assertIn('is not valid for the current configuration', self.generate_debug())
+        self.assertEqual(self.generated(), parsed)
+
+    def generate_debug(self):
+        '''Regenerate from the existing files, returning the debug output'''
+        env = dict(os.environ, G_MESSAGES_DEBUG='all')
+        out = subprocess.check_output([exe_generate, '--root-dir', self.workdir.name],
+                                      stderr=subprocess.STDOUT, env=env, universal_newlines=True)
+        return out
+
+    def test_changed_last_input(self):
+        self.generate('''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true''', confs={'b': '''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp6: true'''})
+        files = self.generated()
+        self.assertIn('DHCP=yes', files['systemd/network/10-netplan-eth0.network'])
+
+        # only the changed file gets parsed again, on top of the state
+        # before it, so that its old settings are gone
+        with open(os.path.join(self.confdir, 'b.yaml'), 'w') as f:
+            f.write('''network:
+  version: 2
+  ethernets:
+    eth1:
+      dhcp6: true''')
+        out = self.generate_debug()
+        self.assertIn('Processing input file %s/b.yaml' % self.confdir, out)
+        self.assertNotIn('Processing input file %s/a.yaml' % self.confdir, out)
+        files = self.generated()
+        self.assertIn('DHCP=ipv4', files['systemd/network/10-netplan-eth0.network'])
+        self.assertIn('DHCP=ipv6', files['systemd/network/10-netplan-eth1.network'])
+
+        # and nothing at all the next time
+        out = self.generate_debug()
+        self.assertNotIn('Processing input file', out)
+        self.assertEqual(self.generated(), files)
+
+    def test_changed_first_input(self):
+        self.generate('''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true''', confs={'b': '''network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp6: true'''})
+        self.generated()
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('''network:
+  version: 2
+  renderer: NetworkManager''')
+        out = self.generate_debug()
+        self.assertIn('Processing input file %s/a.yaml' % self.confdir, out)
+        self.assertIn('Processing input file %s/b.yaml' % self.confdir, out)
+        files = self.generated()
+        self.assertNotIn('systemd/network/10-netplan-eth0.network', files)
+        self.assertIn('NetworkManager/system-connections/netplan-eth0.nmconnection', files)
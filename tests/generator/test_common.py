@@ -337,6 +337,34 @@ Address=2001:FFfe::1/64
 [DHCP]
 RouteMetric=100
 UseMTU=true
+'''})
+
+    def test_eth_manual_addresses_duplicate(self):
+        self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      addresses:
+        - 192.168.14.2/24
+        - 2001:FFfe::1/64
+        - 2001:fffe:0::1/64
+        - 2001:fffe::1/64
+        - 2001:fffe::1/80
+      gateway6: 2001:FFfe::2
+      nameservers:
+        addresses: [2001:4860:4860:0:0:0:0:8888, 8.8.8.8]''', skip_generated_yaml_validation=True)  # the duplicates get dropped
+
+        self.assert_networkd({'engreen.network': '''[Match]
+Name=engreen
+
+[Network]
+LinkLocalAddressing=ipv6
+Address=192.168.14.2/24
+Address=2001:FFfe::1/64
+Address=2001:fffe::1/80
+Gateway=2001:FFfe::2
+DNS=8.8.8.8
+DNS=2001:4860:4860:0:0:0:0:8888
 '''})
 
     def test_eth_address_option_lifetime_zero(self):
@@ -438,6 +466,36 @@ Label=ip6
             'br0.network': ND_EMPTY % ('br0', 'ipv6'),
             'br0.netdev': '[NetDev]\nName=br0\nKind=bridge\n'})
 
+    def test_eth_address_option_repeated(self):
+        # a drop-in repeating an address with options still gets the ones after it
+        self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      addresses:
+        - 192.168.14.2/24:
+            label: test-label''', confs={'b': '''network:
+  version: 2
+  ethernets:
+    engreen:
+      addresses:
+        - 192.168.14.2/24:
+            label: test-label
+        - 10.0.0.2/8
+        - 10.0.0.2/8'''}, skip_generated_yaml_validation=True)  # the duplicate gets dropped
+
+        self.assert_networkd({'engreen.network': '''[Match]
+Name=engreen
+
+[Network]
+LinkLocalAddressing=ipv6
+Address=10.0.0.2/8
+
+[Address]
+Address=192.168.14.2/24
+Label=test-label
+'''})
+
     def test_bond_arp_ip_targets_multi_pass(self):
         self.generate('''network:
   bonds:
@@ -16,6 +16,8 @@
 # You should have received a copy of the GNU General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+import os
+
 from .base import TestBase
 
 
@@ -121,6 +123,9 @@ class TestConfigErrors(TestBase):
 ''', expect_fail=True)
         self.assertIn("unknown renderer 'bogus'", err)
 
+        err = self.generate('network: {version: 2}', confs={'b': 'network: {ethernets: {renderer: bogus}}'}, expect_fail=True)
+        self.assertIn("b.yaml:1:33: Error in network definition: unknown renderer 'bogus'", err)
+
     def test_invalid_id(self):
         err = self.generate('''network:
   version: 2
@@ -304,6 +309,16 @@ class TestConfigErrors(TestBase):
 
         self.assertIn("malformed address '2001:G::1/64', must be X.X.X.X/NN", err)
 
+    def test_invalid_ipv6_address_too_long(self):
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      addresses:
+        - 1111:2222:3333:4444:5555:6666:7777:8888:9999:aaaa:bbbb/64''', expect_fail=True)
+
+        self.assertIn("malformed address '1111:2222:3333:4444:5555:6666:7777:8888:9999:aaaa:bbbb/64'", err)
+
     def test_missing_ipv6_prefixlen(self):
         err = self.generate('''network:
   version: 2
@@ -445,7 +460,7 @@ class TestConfigErrors(TestBase):
     enblue:
       addresses: [10.49.34.4/16]
       gateway4: 10.49.2.38''', expect_fail=False)
-        self.assertIn("Problem encountered while validating default route consistency", err)
+        self.assertIn("Problem encountered while validating route consistency", err)
         self.assertIn("Conflicting default route declarations for IPv4 (table: main, metric: default)", err)
         self.assertIn("engreen", err)
         self.assertIn("enblue", err)
@@ -460,7 +475,7 @@ class TestConfigErrors(TestBase):
     enblue:
       addresses: [2001:FFfe::33/62]
       gateway6: 2001:FFfe::34''', expect_fail=False)
-        self.assertIn("Problem encountered while validating default route consistency", err)
+        self.assertIn("Problem encountered while validating route consistency", err)
         self.assertIn("Conflicting default route declarations for IPv6 (table: main, metric: default)", err)
         self.assertIn("engreen", err)
         self.assertIn("enblue", err)
@@ -475,7 +490,7 @@ class TestConfigErrors(TestBase):
       routes:
       - to: default
         via: 10.49.65.89''', expect_fail=False)
-        self.assertIn("Problem encountered while validating default route consistency", err)
+        self.assertIn("Problem encountered while validating route consistency", err)
         self.assertIn("Conflicting default route declarations for IPv4 (table: main, metric: default)", err)
         self.assertIn("engreen", err)
 
@@ -501,7 +516,7 @@ class TestConfigErrors(TestBase):
         via: 172.137.1.1
         table: 23
         ''', expect_fail=False)
-        self.assertIn("Problem encountered while validating default route consistency", err)
+        self.assertIn("Problem encountered while validating route consistency", err)
         self.assertIn("Conflicting default route declarations for IPv4 (table: 23, metric: default)", err)
         self.assertIn("enblue", err)
         self.assertIn("enred", err)
@@ -530,7 +545,7 @@ class TestConfigErrors(TestBase):
         via: 172.137.1.1
         metric: 600
         ''', expect_fail=False)
-        self.assertIn("Problem encountered while validating default route consistency", err)
+        self.assertIn("Problem encountered while validating route consistency", err)
         self.assertIn("Conflicting default route declarations for IPv4 (table: main, metric: 600)", err)
         self.assertIn("enblue", err)
         self.assertIn("enred", err)
@@ -547,10 +562,107 @@ class TestConfigErrors(TestBase):
         via: 10.49.65.89
       - to: 0.0.0.0/0
         via: 10.49.65.67''', expect_fail=False)
-        self.assertIn("Problem encountered while validating default route consistency", err)
+        self.assertIn("Problem encountered while validating route consistency", err)
         self.assertIn("Conflicting default route declarations for IPv4 (table: main, metric: default)", err)
         self.assertIn("engreen", err)
 
+    def test_duplicate_and_conflicting_routes(self):
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      addresses: [10.49.34.4/16]
+      routes:
+      - to: 10.10.0.0/16
+        via: 10.49.1.1
+      - to: 10.10.0.0/16
+        via: 10.49.1.1
+      - to: 10.20.0.0/16
+        via: 10.49.1.1
+        metric: 100
+    enblue:
+      addresses: [10.50.35.3/16]
+      routes:
+      - to: 10.20.0.1/16
+        via: 10.50.1.1
+        metric: 100
+      - to: 10.20.0.0/16
+        via: 10.50.1.1
+        metric: 200''', expect_fail=False)
+        self.assertIn("Problem encountered while validating route consistency", err)
+        self.assertIn("Duplicate route to 10.10.0.0/16 (table: main, metric: default) in engreen", err)
+        self.assertRegex(err, r"Conflicting route declarations for 10.20.0.[01]/16 \(table: main, metric: 100\)")
+        self.assertNotIn("metric: 200", err)
+
+    def test_ipv6_multipath_routes(self):
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      addresses: ["2001:db8:1::4/64"]
+      routes:
+      - to: 2001:db8:10::/48
+        via: 2001:db8:1::1
+      - to: 2001:db8:10::/48
+        via: 2001:db8:1::2
+      - to: 2001:db8:20::/48
+        via: 2001:db8:1::1
+      - to: 2001:db8:20::/48
+        via: 2001:db8:1::1
+      - to: default
+        via: 2001:db8:1::1
+    enblue:
+      addresses: ["2001:db8:2::4/64"]
+      routes:
+      - to: 2001:db8:10::/48
+        via: 2001:db8:2::1
+      - to: "::/0"
+        via: 2001:db8:2::1''', expect_fail=False)
+        self.assertIn("Problem encountered while validating route consistency", err)
+        # same network and metric through other gateways or interfaces are multipath routes
+        self.assertNotIn("Conflicting route declarations", err)
+        self.assertIn("Duplicate route to 2001:db8:20::/48 (table: main, metric: default) in engreen", err)
+        self.assertIn("Conflicting default route declarations for IPv6 (table: main, metric: default)", err)
+
+    def test_duplicate_and_shadowed_routing_policy(self):
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      addresses: [10.49.34.4/16]
+      routes:
+      - to: default
+        via: 10.49.1.1
+        table: 100
+      routing-policy:
+      - from: 10.49.0.0/16
+        table: 100
+        priority: 10
+      - from: 10.49.34.0/24
+        to: 192.168.1.0/24
+        table: 101
+        priority: 20
+      - from: 10.49.34.0/24
+        mark: 5
+        table: 102
+        priority: 5
+      - from: 10.49.34.0/24
+        table: 102
+        priority: 30
+      - from: 10.49.34.0/24
+        mark: 5
+        table: 102
+        priority: 5''', expect_fail=False)
+        self.assertIn("Problem encountered while validating route consistency", err)
+        self.assertIn("Duplicate routing policy rule from 10.49.34.0/24 to all mark 5 priority 5 table 102, "
+                      "first declared in engreen but also in engreen", err)
+        self.assertIn("Routing policy rule from 10.49.34.0/24 to 192.168.1.0/24 priority 20 table 101 in engreen "
+                      "never applies, the rule from 10.49.0.0/16 to all priority 10 table 100 in engreen "
+                      "takes precedence", err)
+        self.assertIn("Routing policy rule from 10.49.34.0/24 to all priority 30 table 102", err)
+        # only packets with that mark get looked up in table 102 first
+        self.assertNotIn("the rule from 10.49.34.0/24 to all mark 5", err)
+
     def test_invalid_nameserver_ipv4(self):
         for a in ['300.400.1.1', '1.2.3', '192.168.14.1/24']:
             err = self.generate('''network:
@@ -967,6 +1079,192 @@ class TestConfigErrors(TestBase):
       dhcp4: *yes''', expect_fail=True)
         self.assertIn("aliases are not supported", err)
 
+    def test_invalid_yaml_recursive_alias(self):
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen: &eth
+      dhcp4: yes
+      routes: *eth''', expect_fail=True)
+        self.assertIn("a.yaml:6:15: Invalid YAML: aliases are not supported", err)
+
+    def test_invalid_yaml_undefined_alias_in_route(self):
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      routes:
+        - to: *net''', expect_fail=True)
+        self.assertIn("a.yaml:6:15: Invalid YAML: aliases are not supported", err)
+
+    def test_invalid_yaml_undefined_alias_preloaded(self):
+        err = self.generate('network: {version: 2}', confs={'b': '''network:
+  ethernets:
+    engreen:
+      dhcp4: *yes
+      dhcp6: yes'''}, expect_fail=True)
+        self.assertIn("b.yaml:4:14: Invalid YAML: aliases are not supported", err)
+
+    def test_invalid_yaml_alias_replayed(self):
+        # the aliased node is fine where it is anchored, but not where it is used
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen: &eth
+      wakeonlan: true
+  bonds:
+    bond0: *eth''', expect_fail=True)
+        self.assertIn("a.yaml:5:7: Error in network definition: unknown key 'wakeonlan'", err)
+
+    def generate_b_yaml_all_ways(self, yaml):
+        '''Let b.yaml fail as the only file, preparsed and streamed, with the same error'''
+        err = self.generate(None, confs={'b': yaml}, expect_fail=True)
+        self.assertEqual(self.generate('network: {version: 2}', confs={'b': yaml}, expect_fail=True), err)
+        # big enough to be streamed
+        self.assertEqual(self.generate('network: {version: 2}', confs={'b': yaml + '\n' + '#' * 256 * 1024},
+                                       expect_fail=True), err)
+        return err
+
+    def test_invalid_yaml_alias_expansion(self):
+        # "billion laughs": every level of aliases multiplies the nodes by ten
+        levels = ['&l0 [x, x, x, x, x, x, x, x, x, x]']
+        for i in range(1, 9):
+            levels.append('&l%i [%s]' % (i, ', '.join(['*l%i' % (i - 1)] * 10)))
+        err = self.generate_b_yaml_all_ways('''network:
+  version: 2
+  ethernets:
+    engreen:
+      nameservers:
+        search: [%s]''' % ', '.join(levels))
+        self.assertIn("b.yaml:6:247: Invalid YAML: aliases expand to too many nodes", err)
+
+    def test_invalid_yaml_alias_same_ways(self):
+        err = self.generate_b_yaml_all_ways('''network:
+  ethernets:
+    engreen:
+      dhcp4: *yes
+      dhcp6: yes''')
+        self.assertIn("b.yaml:4:14: Invalid YAML: aliases are not supported", err)
+
+        # aliases within aliased nodes get replayed, too
+        err = self.generate_b_yaml_all_ways('''network:
+  ethernets:
+    engreen:
+      dhcp4: &yes yes
+  bonds:
+    bond0: &bond
+      dhcp4: *yes
+      interfaces: [engreen]
+  vlans:
+    vlan0: *bond''')
+        self.assertIn("b.yaml:8:7: Error in network definition: unknown key 'interfaces'", err)
+
+    def test_invalid_yaml_error_order_same_ways(self):
+        # the first error in the file wins, whether it is about the YAML or its contents
+        err = self.generate_b_yaml_all_ways('''network:
+  ethernets:
+    engreen:
+      dhcp4: maybe
+      dhcp6: [yes''')
+        self.assertIn("b.yaml:4:14: Error in network definition: invalid boolean value 'maybe'", err)
+
+    def test_invalid_yaml_in_route(self):
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      routes:
+        - to: 10.10.10.0/24
+          via:
+           - 192.168.14.20
+          - 192.168.14.21''', expect_fail=True)
+        self.assertIn("a.yaml:9:11: Invalid YAML: inconsistent indentation", err)
+
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      routes:
+        - to:
+          - [10.10.10.0/24,''', expect_fail=True)
+        self.assertIn("a.yaml:8:1: Invalid YAML: did not find expected node content", err)
+
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      routes: [%&]''', expect_fail=True)
+        self.assertIn("a.yaml:5:16: Invalid YAML: found character that cannot start any token", err)
+
+    def test_invalid_yaml_key(self):
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      ? [dhcp4,''', expect_fail=True)
+        self.assertIn("a.yaml:6:1: Invalid YAML: did not find expected node content", err)
+
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      ? - dhcp4
+        - dhcp6
+      : true''', expect_fail=True)
+        self.assertIn("a.yaml:5:9: Error in network definition: expected scalar", err)
+
+    def test_invalid_yaml_top_level(self):
+        err = self.generate('- network', expect_fail=True)
+        self.assertIn("a.yaml:1:1: Error in network definition: expected mapping (check indentation)", err)
+
+    def test_invalid_yaml_netdef(self):
+        err = self.generate('''network:
+  version: 2
+  ethernets:
+    engreen: true''', expect_fail=True)
+        self.assertIn("a.yaml:4:14: Error in network definition: expected mapping (check indentation)", err)
+
+    def test_invalid_netdef_preloaded(self):
+        err = self.generate('network: {version: 2}', confs={'b': '''network:
+  ethernets:
+    "eng*": {}'''}, expect_fail=True)
+        self.assertIn("b.yaml:3:5: Error in network definition: Definition ID 'eng*' must not use globbing", err)
+
+    def test_invalid_route_preloaded(self):
+        err = self.generate('network: {version: 2}', confs={'b': '''network:
+  ethernets:
+    engreen:
+      routes:
+        - to: 10.10.10.0/24
+          via: 192.168.14.20
+          metric: -1'''}, expect_fail=True)
+        self.assertIn("b.yaml:7:19: Error in network definition: invalid unsigned int value '-1'", err)
+
+        err = self.generate('network: {version: 2}', confs={'b': '''network:
+  ethernets:
+    engreen:
+      routing-policy:
+        - from: 192.168.14.2
+          table: -1'''}, expect_fail=True)
+        self.assertIn("b.yaml:6:18: Error in network definition: invalid unsigned int value '-1'", err)
+
+    def test_invalid_yaml_dangling_symlink(self):
+        os.makedirs(self.confdir)
+        os.symlink('nothing', os.path.join(self.confdir, 'b.yaml'))
+        err = self.generate('network: {version: 2}', expect_fail=True)
+        self.assertIn("Cannot open %s/b.yaml: No such file or directory" % self.confdir, err)
+
+    def test_invalid_yaml_before_streamed(self):
+        # b.yaml is big enough to be streamed, so it never gets looked at
+        err = self.generate('network: {version: 2', confs={'b': '#' * 256 * 1024 + '\nnetwork: {version: 2}'},
+                            expect_fail=True)
+        self.assertIn("a.yaml:2:1: Invalid YAML: did not find expected ',' or '}'", err)
+
+    def test_invalid_yaml_directory(self):
+        os.makedirs(os.path.join(self.confdir, 'b.yaml'))
+        err = self.generate('network: {version: 2}', expect_fail=True)
+        self.assertIn("Error reading file “%s/b.yaml”: Is a directory" % self.confdir, err)
+
     def test_invalid_activation_mode(self):
         err = self.generate('''network:
   version: 2
@@ -700,7 +700,8 @@ ExecStart=/usr/bin/ovs-vsctl set open_vswitch . external-ids:netplan/global/set-
 ''', expect_fail=True)
         self.assertIn("ERROR: openvswitch bridge controller target 'ssl:10.10.10.1' needs SSL configuration, but global \
 'openvswitch.ssl' settings are not set", err)
-        self.assert_ovs({'cleanup.service': OVS_CLEANUP % {'iface': 'cleanup'}})
+        # nothing gets written if generating fails half-way
+        self.assert_ovs({})
         self.assert_networkd({})
 
     def test_global_ports(self):
@@ -711,7 +712,8 @@ ExecStart=/usr/bin/ovs-vsctl set open_vswitch . external-ids:netplan/global/set-
       - [patch0-1, patch1-0]
 ''', expect_fail=True)
         self.assertIn('patch0-1: OpenVSwitch patch port needs to be assigned to a bridge/bond', err)
-        self.assert_ovs({'cleanup.service': OVS_CLEANUP % {'iface': 'cleanup'}})
+        # nothing gets written if generating fails half-way
+        self.assert_ovs({})
         self.assert_networkd({})
 
     def test_few_ports(self):
@@ -809,6 +811,41 @@ LinkLocalAddressing=no
 Bond=bond0
 '''})
 
+    def test_bridge_auto_ovs_backend_reverse_order(self):
+        # References are resolved after the whole document is known, so the
+        # OVS backend propagates up regardless of definition order
+        self.generate('''network:
+  version: 2
+  bridges:
+    br0:
+      addresses: [192.170.1.1/24]
+      interfaces: [bond0]
+  bonds:
+    bond0:
+      interfaces: [eth1, eth2]
+      openvswitch: {}
+  ethernets:
+    eth1: {}
+    eth2: {}
+''')
+        self.assert_ovs({'br0.service': OVS_BR_EMPTY % {'iface': 'br0'},
+                         'bond0.service': OVS_VIRTUAL % {'iface': 'bond0', 'extra':
+                                                         '''Requires=netplan-ovs-br0.service
+After=netplan-ovs-br0.service
+
+[Service]
+Type=oneshot
+ExecStart=/usr/bin/ovs-vsctl --may-exist add-bond br0 bond0 eth1 eth2
+ExecStart=/usr/bin/ovs-vsctl set Port bond0 external-ids:netplan=true
+ExecStart=/usr/bin/ovs-vsctl set Port bond0 lacp=off
+ExecStart=/usr/bin/ovs-vsctl set Port bond0 external-ids:netplan/lacp=off
+'''},
+                         'cleanup.service': OVS_CLEANUP % {'iface': 'cleanup'}})
+        self.assert_networkd({'br0.network': ND_WITHIP % ('br0', '192.170.1.1/24'),
+                              'bond0.network': ND_EMPTY % ('bond0', 'no'),
+                              'eth1.network': '[Match]\nName=eth1\n\n[Network]\nLinkLocalAddressing=no\nBond=bond0\n',
+                              'eth2.network': '[Match]\nName=eth2\n\n[Network]\nLinkLocalAddressing=no\nBond=bond0\n'})
+
     def test_bond_auto_ovs_backend(self):
         self.generate('''network:
   version: 2
@@ -987,7 +1024,8 @@ ExecStart=/usr/bin/ovs-vsctl set Interface br0.100 external-ids:netplan=true
             openvswitch: {}
 ''', expect_fail=True)
         self.assertIn('eth0: This device type is not supported with the OpenVSwitch backend', err)
-        self.assert_ovs({'cleanup.service': OVS_CLEANUP % {'iface': 'cleanup'}})
+        # nothing gets written if generating fails half-way
+        self.assert_ovs({})
         self.assert_networkd({})
 
     def test_bridge_non_ovs_bond(self):
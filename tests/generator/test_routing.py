@@ -128,6 +128,145 @@ Metric=5000
 Destination=11.11.11.0/24
 Gateway=192.168.1.3
 Metric=9999
+'''})
+
+    def test_route_yaml_aliases(self):
+        # routes get streamed one by one, aliases still refer to earlier ones
+        self.generate('''network:
+  version: 2
+  ethernets:
+    engreen:
+      addresses: ["192.168.14.2/24"]
+      routes: &routes
+        - &net10
+          to: 10.10.10.0/24
+          via: 192.168.14.20
+          metric: &metric 100
+        - to: 10.20.0.0/16
+          via: 192.168.14.20
+    enblue:
+      addresses: ["192.168.14.3/24"]
+      routes:
+        - *net10
+        - to: 10.30.0.0/16
+          via: 192.168.14.20
+          metric: *metric
+      routing-policy: &policy
+        - from: 192.168.14.3
+          table: *metric
+    enred: &dhcp
+      dhcp4: true
+    enyellow: *dhcp
+  vlans:
+    vlan1:
+      id: 1
+      link: engreen
+      routes: *routes
+      routing-policy: *policy''', skip_generated_yaml_validation=True)
+
+        route10 = '[Route]\nDestination=10.10.10.0/24\nGateway=192.168.14.20\nMetric=100\n'
+        route20 = '[Route]\nDestination=10.20.0.0/16\nGateway=192.168.14.20\n'
+        rule = '[RoutingPolicyRule]\nFrom=192.168.14.3\nTable=100\n'
+        dhcp = '\n[Network]\nDHCP=ipv4\nLinkLocalAddressing=ipv6\n\n[DHCP]\nRouteMetric=100\nUseMTU=true\n'
+        self.assert_networkd({'engreen.network': '''[Match]
+Name=engreen
+
+[Network]
+LinkLocalAddressing=ipv6
+Address=192.168.14.2/24
+VLAN=vlan1
+
+''' + route10 + '\n' + route20,
+                              'enblue.network': '''[Match]
+Name=enblue
+
+[Network]
+LinkLocalAddressing=ipv6
+Address=192.168.14.3/24
+
+''' + route10 + '''
+[Route]
+Destination=10.30.0.0/16
+Gateway=192.168.14.20
+Metric=100
+
+''' + rule,
+                              'enred.network': '[Match]\nName=enred\n' + dhcp,
+                              'enyellow.network': '[Match]\nName=enyellow\n' + dhcp,
+                              'vlan1.netdev': '[NetDev]\nName=vlan1\nKind=vlan\n\n[VLAN]\nId=1\n',
+                              'vlan1.network': '''[Match]
+Name=vlan1
+
+[Network]
+LinkLocalAddressing=ipv6
+ConfigureWithoutCarrier=yes
+
+''' + route10 + '\n' + route20 + '\n' + rule})
+
+    def test_route_yaml_nested_aliases(self):
+        # aliases within aliased nodes get replayed, in preparsed files, too
+        self.generate('network: {version: 2}', confs={'b': '''network:
+  ethernets:
+    engreen:
+      routes: &routes
+        - to: 10.10.10.0/24
+          via: 192.168.14.20
+    enblue: &blue
+      routes: *routes
+    enred: *blue'''}, skip_generated_yaml_validation=True)
+
+        network = '[Match]\nName=%s\n\n[Network]\nLinkLocalAddressing=ipv6\n\n' \
+                  '[Route]\nDestination=10.10.10.0/24\nGateway=192.168.14.20\n'
+        self.assert_networkd({name + '.network': network % name for name in ['engreen', 'enblue', 'enred']})
+
+    def test_route_multiple_files(self):
+        # a.yaml gets preloaded as a whole, the big b.yaml gets streamed
+        self.generate('''network:
+  version: 2
+  ethernets:
+    renderer: networkd
+    engreen:
+      addresses: ["192.168.14.2/24"]
+      routes:
+        - to: 10.10.10.0/24
+          via: 192.168.14.20
+      routing-policy:
+        - from: 192.168.14.2
+          table: 100''', confs={'b': '#' * 256 * 1024 + '''
+network:
+  ethernets:
+    enblue:
+      addresses: ["192.168.14.3/24"]
+      routes: []
+      routing-policy:
+        - from: 192.168.14.3
+          table: 100'''}, skip_generated_yaml_validation=True)
+
+        self.assert_networkd({'engreen.network': '''[Match]
+Name=engreen
+
+[Network]
+LinkLocalAddressing=ipv6
+Address=192.168.14.2/24
+
+[Route]
+Destination=10.10.10.0/24
+Gateway=192.168.14.20
+
+[RoutingPolicyRule]
+From=192.168.14.2
+Table=100
+''',
+                              'enblue.network': '''[Match]
+Name=enblue
+
+[Network]
+LinkLocalAddressing=ipv6
+Address=192.168.14.3/24
+
+[RoutingPolicyRule]
+From=192.168.14.3
+Table=100
 '''})
 
     def test_route_v4_default(self):
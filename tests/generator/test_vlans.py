@@ -223,7 +223,8 @@ method=auto
             m = re.search('uuid=([0-9a-fA-F-]{36})\n', f.read())
             self.assertTrue(m)
             uuid = m.group(1)
-            self.assertNotEquals(uuid, "00000000-0000-0000-0000-000000000000")
+            # derived from the netdef ID, so that it stays the same across runs
+            self.assertEqual(uuid, "f561c33b-52a7-59e3-b8f4-5f541a0fbfeb")
 
         self.assert_nm({'en-v': '''[connection]
 id=netplan-en-v
@@ -315,6 +315,52 @@ route1_options=unknown=invalid,
           proxy._: ""
 '''.format(UUID, UUID)})
 
+    def test_keyfile_method_manual_invalid_addresses(self):
+        self.generate_from_keyfile('''[connection]
+id=Test
+uuid={}
+type=ethernet
+
+[ethernet]
+mac-address=00:11:22:33:44:55
+
+[ipv4]
+dns=9.8.7.6;not-an-ip
+method=manual
+address1=1.2.3.4/24
+address2=5.6.7.8/99
+gateway=6.6.6.6.6
+
+[ipv6]
+method=manual
+address1=1:2:3::9/128
+gateway=6:6::6
+
+[proxy]
+'''.format(UUID))
+        self.assert_netplan({UUID: '''network:
+  version: 2
+  ethernets:
+    NM-{}:
+      renderer: NetworkManager
+      match:
+        macaddress: "00:11:22:33:44:55"
+      addresses:
+      - "1.2.3.4/24"
+      - "1:2:3::9/128"
+      gateway6: 6:6::6
+      wakeonlan: true
+      networkmanager:
+        uuid: "{}"
+        name: "Test"
+        passthrough:
+          ipv4.dns: "9.8.7.6;not-an-ip"
+          ipv4.method: "manual"
+          ipv4.address2: "5.6.7.8/99"
+          ipv4.gateway: "6.6.6.6.6"
+          proxy._: ""
+'''.format(UUID, UUID)})
+
     def _template_keyfile_type(self, nd_type, nm_type, supported=True):
         self.maxDiff = None
         file = os.path.join(self.workdir.name, 'tmp/some.keyfile')
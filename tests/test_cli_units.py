@@ -39,3 +39,43 @@ class TestCLI(unittest.TestCase):
     def test_is_composite_member_with_renderer(self):
         res = NetplanApply.is_composite_member([{'renderer': 'networkd', 'br0': {'interfaces': ['eth0']}}], 'eth0')
         self.assertTrue(res)
+
+    def test_process_generate_manifest(self):
+        old = {'files': [
+            {'path': '/run/systemd/network/10-netplan-eth1.network', 'status': 'unchanged',
+             'netdef': 'eth1', 'interface': 'eth1'},
+        ]}
+        new = {'files': [
+            {'path': '/run/NetworkManager/conf.d/netplan.conf', 'status': 'changed'},
+            {'path': '/run/systemd/network/10-netplan-eth0.network', 'status': 'unchanged',
+             'netdef': 'eth0', 'interface': 'eth0'},
+            {'path': '/run/systemd/network/10-netplan-eth1.network', 'status': 'removed'},
+            {'path': '/run/systemd/network/10-netplan-en.network', 'status': 'added',
+             'netdef': 'en', 'interface': 'en*'},
+            {'path': '/run/systemd/network/10-netplan-vlan7.netdev', 'status': 'added',
+             'netdef': 'vlan7', 'interface': 'vlan7'},
+            {'path': '/run/udev/rules.d/99-netplan-en.rules', 'status': 'added', 'netdef': 'en'},
+        ]}
+        res = NetplanApply.process_generate_manifest(old, new, ['lo', 'eth0', 'eth1', 'ens3', 'ens4'])
+        # networkd needs to reconfigure the affected, existing interfaces only; NM does not need a restart
+        self.assertEqual(res, (True, False, True, {'eth1', 'ens3', 'ens4'}))
+
+    def test_process_generate_manifest_nm(self):
+        new = {'files': [
+            {'path': '/run/NetworkManager/system-connections/netplan-eth0.nmconnection', 'status': 'changed',
+             'netdef': 'eth0', 'interface': 'eth0'},
+            {'path': '/run/systemd/network/10-netplan-eth1.network', 'status': 'unchanged',
+             'netdef': 'eth1', 'interface': 'eth1'},
+        ]}
+        res = NetplanApply.process_generate_manifest(None, new, ['eth0', 'eth1'])
+        self.assertEqual(res, (False, True, False, set()))
+
+    def test_process_generate_manifest_unknown_interface(self):
+        new = {'files': [
+            {'path': '/run/systemd/network/10-netplan-eth0.network', 'status': 'unchanged',
+             'netdef': 'eth0', 'interface': 'eth0'},
+            # the previous manifest is unknown, so is the interface of a removed file
+            {'path': '/run/systemd/network/10-netplan-eth1.network', 'status': 'removed'},
+        ]}
+        res = NetplanApply.process_generate_manifest(None, new, ['eth0', 'eth1'])
+        self.assertEqual(res, (True, False, False, None))
@@ -19,20 +19,60 @@
 
 import os
 import shutil
+import stat
+import subprocess
+import tempfile
+import threading
 import ctypes
 import ctypes.util
 
 from generator.base import TestBase
 from parser.base import capture_stderr
-from tests.test_utils import MockCmd
 
 rootdir = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
-exe_cli = os.path.join(rootdir, 'src', 'netplan.script')
 # Make sure we can import our development netplan.
 os.environ.update({'PYTHONPATH': '.'})
+# netplan_generate() runs the generator
+os.environ.update({'NETPLAN_GENERATE_PATH': os.path.join(rootdir, 'generate')})
 
 lib = ctypes.CDLL(ctypes.util.find_library('netplan'))
 lib.netplan_get_id_from_nm_filename.restype = ctypes.c_char_p
+lib.systemd_escape.restype = ctypes.c_char_p
+
+
+class _NetplanNetDefinition(ctypes.Structure):
+    _fields_ = [("type", ctypes.c_int), ("backend", ctypes.c_int), ("id", ctypes.c_char_p)]
+
+
+class _GPtrArray(ctypes.Structure):
+    _fields_ = [("pdata", ctypes.POINTER(ctypes.POINTER(_NetplanNetDefinition))), ("len", ctypes.c_uint)]
+
+
+lib.netplan_netdefs_lookup.restype = ctypes.POINTER(_GPtrArray)
+
+
+class _GError(ctypes.Structure):
+    _fields_ = [("domain", ctypes.c_uint32), ("code", ctypes.c_int), ("message", ctypes.c_char_p)]
+
+
+lib.netplan_parse_yaml_hierarchy.argtypes = [ctypes.c_char_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_conf_full_to_string.restype = ctypes.c_char_p
+lib.netplan_generate_full.argtypes = [ctypes.c_char_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_parser_new.restype = ctypes.c_void_p
+lib.netplan_parser_parse_file.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_parser_parse_hierarchy.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_parser_finish.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_parser_finish.restype = ctypes.c_void_p
+lib.netplan_parser_get_backend.argtypes = [ctypes.c_void_p]
+lib.netplan_parser_free.argtypes = [ctypes.c_void_p]
+lib.netplan_parser_update_hierarchy.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.POINTER(_GError))]
+lib.netplan_parser_conf_to_string.argtypes = [ctypes.c_void_p]
+lib.netplan_parser_conf_to_string.restype = ctypes.c_char_p
+
+glib = ctypes.CDLL(ctypes.util.find_library('glib-2.0'))
+glib.g_hash_table_size.argtypes = [ctypes.c_void_p]
+glib.g_hash_table_lookup.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+glib.g_hash_table_lookup.restype = ctypes.POINTER(_NetplanNetDefinition)
 
 
 class TestLibnetplan(TestBase):
@@ -79,15 +119,301 @@ class TestLibnetplan(TestBase):
                 self.assertIn('netplan: cannot load keyfile', f.read().strip())
 
     def test_generate(self):
-        self.mock_netplan_cmd = MockCmd("netplan")
-        os.environ["TEST_NETPLAN_CMD"] = self.mock_netplan_cmd.path
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('''network:
+  ethernets:
+    eth0:
+      dhcp4: true''')
         self.assertTrue(lib.netplan_generate(self.workdir.name.encode()))
-        self.assertEquals(self.mock_netplan_cmd.calls(), [
-            ["netplan", "generate", "--root-dir", self.workdir.name],
-        ])
+        self.assertTrue(os.path.isfile(os.path.join(self.workdir.name, 'run', 'systemd', 'network', '10-netplan-eth0.network')))
+        self.assertTrue(os.path.isfile(os.path.join(self.workdir.name, 'run', 'netplan', 'generate.json')))
+
+    def test_generate_invalid(self):
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('''network:
+  renderer: NetworkManager
+  ethernets:
+    eth0:
+      match:
+        driver: e1000''')
+        with capture_stderr() as outf:
+            # the generator fails, this process carries on
+            self.assertFalse(lib.netplan_generate(self.workdir.name.encode()))
+            with open(outf.name, 'r') as f:
+                self.assertIn('NetworkManager definitions do not support matching by driver', f.read())
+        self.assertFalse(os.path.exists(os.path.join(self.workdir.name, 'run')))
+
+    def test_generate_parse_error(self):
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('''network:
+  bridges:
+    br0:
+      interfaces: [eth0]''')
+        with capture_stderr() as outf:
+            self.assertFalse(lib.netplan_generate(self.workdir.name.encode()))
+            with open(outf.name, 'r') as f:
+                self.assertIn("interface 'eth0' is not defined", f.read())
+
+    def test_generate_full(self):
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('network:\n  ethernets:\n    eth0:\n      dhcp4: true')
+        err = ctypes.POINTER(_GError)()
+        self.assertTrue(lib.netplan_generate_full(self.workdir.name.encode(), ctypes.byref(err)))
+        self.assertTrue(os.path.isfile(os.path.join(self.workdir.name, 'run', 'systemd', 'network', '10-netplan-eth0.network')))
+
+    def test_generate_full_error(self):
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('''network:
+  bridges:
+    br0:
+      interfaces: [eth0]''')
+        err = ctypes.POINTER(_GError)()
+        with capture_stderr() as outf:
+            self.assertFalse(lib.netplan_generate_full(self.workdir.name.encode(), ctypes.byref(err)))
+            with open(outf.name, 'r') as f:
+                self.assertEqual(f.read(), '')
+        self.assertIn("interface 'eth0' is not defined", err.contents.message.decode())
+        # backend specific validation happens after parsing
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('network:\n  tunnels:\n    tun0:\n      mode: isatap\n      local: 10.0.0.1\n      remote: 10.0.0.2')
+        err = ctypes.POINTER(_GError)()
+        self.assertFalse(lib.netplan_generate_full(self.workdir.name.encode(), ctypes.byref(err)))
+        self.assertIn('tun0: ISATAP tunnel mode is not supported by networkd', err.contents.message.decode())
+
+    def test_generate_full_no_generator(self):
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('network:\n  ethernets:\n    eth0:\n      dhcp4: true')
+        err = ctypes.POINTER(_GError)()
+        os.environ['NETPLAN_GENERATE_PATH'] = os.path.join(self.workdir.name, 'nonexistent')
+        try:
+            self.assertFalse(lib.netplan_generate_full(self.workdir.name.encode(), ctypes.byref(err)))
+        finally:
+            os.environ['NETPLAN_GENERATE_PATH'] = os.path.join(rootdir, 'generate')
+        self.assertIn('nonexistent', err.contents.message.decode())
+        self.assertFalse(os.path.exists(os.path.join(self.workdir.name, 'run')))
+
+    def test_parse_yaml_hierarchy(self):
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('network:\n  ethernets:\n    eth0:\n      dhcp4: true')
+        with open(os.path.join(self.confdir, 'b.yaml'), 'w') as f:
+            f.write('network:\n  renderer: NetworkManager')
+        err = ctypes.POINTER(_GError)()
+        self.assertTrue(lib.netplan_parse_yaml_hierarchy(self.workdir.name.encode(), ctypes.byref(err)))
+        self.assertEqual(lib.netplan_conf_full_to_string(),
+                         b'network:\n  version: 2\n  renderer: NetworkManager\n  ethernets:\n    eth0:\n      dhcp4: true\n')
+        lib.netplan_clear_netdefs()
+        self.assertIsNone(lib.netplan_conf_full_to_string())
+
+    def test_parse_yaml_hierarchy_many(self):
+        rundir = os.path.join(self.workdir.name, 'run', 'netplan')
+        os.makedirs(rundir)
+        for i in range(50):
+            with open(os.path.join(self.confdir, '%02d.yaml' % i), 'w') as f:
+                f.write('network:\n  renderer: %s\n  ethernets:\n    eth0: {mtu: %d}\n    eth%d: {dhcp4: true}\n' %
+                        ('NetworkManager' if i % 2 else 'networkd', 1000 + i, i + 1))
+        # /run shadows /etc
+        with open(os.path.join(rundir, '49.yaml'), 'w') as f:
+            f.write('network:\n  ethernets:\n    eth0: {mtu: 2000}\n')
+        err = ctypes.POINTER(_GError)()
+        self.assertTrue(lib.netplan_parse_yaml_hierarchy(self.workdir.name.encode(), ctypes.byref(err)))
+        out = lib.netplan_conf_full_to_string().decode()
+        lib.netplan_clear_netdefs()
+        # merged in asciibetical order, no matter which file got loaded first
+        self.assertIn('renderer: networkd\n', out)
+        self.assertIn('eth0:\n      mtu: 2000\n', out)
+        self.assertIn('eth49:\n      dhcp4: true\n', out)
+        self.assertNotIn('eth50', out)
+        self.assertLess(out.index('eth1:'), out.index('eth2:'))
+        self.assertLess(out.index('eth2:'), out.index('eth10:'))
+
+        # the first error in that order gets reported
+        with open(os.path.join(self.confdir, '40.yaml'), 'w') as f:
+            f.write('network: [')
+        with open(os.path.join(self.confdir, '30.yaml'), 'w') as f:
+            f.write('network:\n  ethernets:\n    eth0: {dhcp4: maybe}')
+        for _ in range(5):
+            err = ctypes.POINTER(_GError)()
+            self.assertFalse(lib.netplan_parse_yaml_hierarchy(self.workdir.name.encode(), ctypes.byref(err)))
+            self.assertIn("30.yaml:3:19: Error in network definition: invalid boolean value 'maybe'",
+                          err.contents.message.decode())
+            lib.netplan_clear_netdefs()
+        os.unlink(os.path.join(self.confdir, '30.yaml'))
+        err = ctypes.POINTER(_GError)()
+        self.assertFalse(lib.netplan_parse_yaml_hierarchy(self.workdir.name.encode(), ctypes.byref(err)))
+        self.assertIn('40.yaml:2:1: Invalid YAML', err.contents.message.decode())
+        lib.netplan_clear_netdefs()
+
+    def test_parse_yaml_hierarchy_error(self):
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('network:\n  ethernets:\n    eth0:\n      dhcp4: [')
+        err = ctypes.POINTER(_GError)()
+        # reported, instead of exiting the process
+        self.assertFalse(lib.netplan_parse_yaml_hierarchy(self.workdir.name.encode(), ctypes.byref(err)))
+        self.assertIn('a.yaml:5:1: Invalid YAML', err.contents.message.decode())
+        lib.netplan_clear_netdefs()
+
+    def _parser_parse(self, parser, path):
+        err = ctypes.POINTER(_GError)()
+        if not lib.netplan_parser_parse_file(parser, path.encode(), ctypes.byref(err)):
+            return err.contents.message.decode()
+        return lib.netplan_parser_finish(parser, ctypes.byref(err))
+
+    def test_parser(self):
+        a = os.path.join(self.confdir, 'a.yaml')
+        with open(a, 'w') as f:
+            f.write('network:\n  renderer: NetworkManager\n  ethernets:\n    eth0: {dhcp4: true}')
+        b = os.path.join(self.confdir, 'b.yaml')
+        with open(b, 'w') as f:
+            f.write('network:\n  bridges:\n    br0: {interfaces: [eth1]}\n  ethernets:\n    eth1: {}')
+        c = os.path.join(self.confdir, 'c.yaml')
+        with open(c, 'w') as f:
+            f.write('network:\n  ethernets:\n    eth2: {dhcp4: maybe}')
+
+        # independent of each other and of the global state
+        lib.netplan_parse_yaml(b.encode(), None)
+        p1 = lib.netplan_parser_new()
+        p2 = lib.netplan_parser_new()
+        self.assertIsNone(lib.netplan_parser_finish(p1, None))
+        self.assertIn("c.yaml:3:19: Error in network definition: invalid boolean value 'maybe'", self._parser_parse(p1, c))
+        netdefs1 = self._parser_parse(p1, a)
+        netdefs2 = self._parser_parse(p2, b)
+        # eth2 was defined before the error
+        self.assertEqual(glib.g_hash_table_size(netdefs1), 2)
+        self.assertEqual(glib.g_hash_table_lookup(netdefs1, b'eth0').contents.backend, 2)  # NM
+        self.assertEqual(glib.g_hash_table_size(netdefs2), 2)
+        self.assertEqual(glib.g_hash_table_lookup(netdefs2, b'br0').contents.backend, 1)  # networkd
+        self.assertEqual(lib.netplan_parser_get_backend(p1), 2)
+        self.assertEqual(lib.netplan_parser_get_backend(p2), 0)
+        out = lib.netplan_conf_full_to_string()
+        self.assertIn(b'br0', out)
+        self.assertNotIn(b'eth0', out)
+        lib.netplan_clear_netdefs()
+        lib.netplan_parser_free(p1)
+        lib.netplan_parser_free(p2)
+        lib.netplan_parser_free(None)
+
+        os.unlink(c)
+        p = lib.netplan_parser_new()
+        err = ctypes.POINTER(_GError)()
+        self.assertTrue(lib.netplan_parser_parse_hierarchy(p, self.workdir.name.encode(), ctypes.byref(err)))
+        self.assertEqual(glib.g_hash_table_size(lib.netplan_parser_finish(p, ctypes.byref(err))), 3)
+        lib.netplan_parser_free(p)
+
+    def test_parser_update_hierarchy(self):
+        os.environ['G_MESSAGES_DEBUG'] = 'all'
+        self.addCleanup(os.environ.pop, 'G_MESSAGES_DEBUG')
+        files = {}
+        for name in ['a', 'b', 'c', 'd']:
+            files[name] = os.path.join(self.confdir, name + '.yaml')
+            with open(files[name], 'w') as f:
+                f.write('network:\n  ethernets:\n    eth_%s:\n      dhcp4: true\n' % name)
+        p = lib.netplan_parser_new()
+        self.addCleanup(lib.netplan_parser_free, p)
+
+        def update():
+            # GLib writes debug messages to stdout
+            err = ctypes.POINTER(_GError)()
+            with tempfile.TemporaryFile() as tmp:
+                stdout_copy = os.dup(1)
+                os.dup2(tmp.fileno(), 1)
+                try:
+                    ret = lib.netplan_parser_update_hierarchy(p, self.workdir.name.encode(), ctypes.byref(err))
+                    lib.netplan_clear_netdefs()
+                finally:
+                    os.dup2(stdout_copy, 1)
+                    os.close(stdout_copy)
+                tmp.seek(0)
+                log = tmp.read().decode()
+            return (ret, err.contents.message if err else None, log)
+
+        def fresh():
+            q = lib.netplan_parser_new()
+            lib.netplan_parser_update_hierarchy(q, self.workdir.name.encode(), None)
+            out = lib.netplan_parser_conf_to_string(q)
+            lib.netplan_clear_netdefs()
+            lib.netplan_parser_free(q)
+            return out
+
+        ret, _, log = update()
+        self.assertTrue(ret)
+        self.assertIn('Processing input file %s' % files['a'], log)
+        self.assertNotIn('Resumed from', log)
+        out = lib.netplan_parser_conf_to_string(p)
+        self.assertIn(b'eth_a', out)
+        self.assertIn(b'eth_d', out)
+
+        # only the changed tail gets parsed again, earlier settings of it are gone
+        with open(files['c'], 'w') as f:
+            f.write('network:\n  ethernets:\n    eth_a:\n      dhcp6: true\n')
+        ret, _, log = update()
+        self.assertTrue(ret)
+        self.assertIn('Resumed from', log)
+        self.assertNotIn('Processing input file %s' % files['b'], log)
+        self.assertIn('Processing input file %s' % files['c'], log)
+        self.assertIn('Processing input file %s' % files['d'], log)
+        out = lib.netplan_parser_conf_to_string(p)
+        self.assertNotIn(b'eth_c', out)
+        self.assertIn(b'dhcp6: true', out)
+        self.assertEqual(out, fresh())
+
+        # nothing changed
+        ret, _, log = update()
+        self.assertTrue(ret)
+        self.assertNotIn('Processing input file', log)
+        self.assertEqual(lib.netplan_parser_conf_to_string(p), out)
+
+        # an error keeps what was parsed before it, then recovers
+        with open(files['b'], 'w') as f:
+            f.write('network:\n  ethernets:\n    eth_b:\n      dhcp4: [\n')
+        ret, msg, _ = update()
+        self.assertFalse(ret)
+        self.assertIn(b'b.yaml', msg)
+        os.unlink(files['b'])
+        ret, _, log = update()
+        self.assertTrue(ret)
+        self.assertNotIn('Processing input file %s' % files['a'], log)
+        out = lib.netplan_parser_conf_to_string(p)
+        self.assertNotIn(b'eth_b', out)
+        self.assertIn(b'eth_d', out)
+        self.assertEqual(out, fresh())
+
+    def test_parser_threads(self):
+        configs = []
+        for i in range(8):
+            path = os.path.join(self.confdir, '%d.yaml' % i)
+            with open(path, 'w') as f:
+                if i % 4 == 3:
+                    f.write('network:\n  ethernets:\n    eth0:\n      routes: [{to: 1.2.3.4/32, via: bogus}]')
+                else:
+                    f.write('network:\n  bonds:\n' +
+                            ''.join('    bond%d: {interfaces: [eth%d]}\n' % (j, j) for j in range(i + 1)) +
+                            '  ethernets:\n' + ''.join('    eth%d: {mtu: %d}\n' % (j, 1500 + i) for j in range(i + 1)))
+            configs.append(path)
+        results = [None] * len(configs)
+
+        def validate(i):
+            for _ in range(50):
+                parser = lib.netplan_parser_new()
+                ret = self._parser_parse(parser, configs[i])
+                if isinstance(ret, str):
+                    results[i] = ret
+                else:
+                    eth = glib.g_hash_table_lookup(ret, b'eth%d' % i)
+                    results[i] = (glib.g_hash_table_size(ret), eth.contents.id if eth else None)
+                lib.netplan_parser_free(parser)
+
+        threads = [threading.Thread(target=validate, args=(i,)) for i in range(len(configs))]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        for i, result in enumerate(results):
+            if i % 4 == 3:
+                self.assertIn("%d.yaml:4:38: Error in network definition: invalid IP family '-1'" % i, result)
+            else:
+                self.assertEqual(result, (2 * (i + 1), b'eth%d' % i))
 
     def test_delete_connection(self):
-        os.environ["TEST_NETPLAN_CMD"] = exe_cli
         orig = os.path.join(self.confdir, 'some-filename.yaml')
         with open(orig, 'w') as f:
             f.write('''network:
@@ -114,7 +440,6 @@ class TestLibnetplan(TestBase):
                 self.assertIn('netplan_delete_connection: Cannot delete unknown-id, does not exist.', f.read().strip())
 
     def test_delete_connection_two_in_file(self):
-        os.environ["TEST_NETPLAN_CMD"] = exe_cli
         orig = os.path.join(self.confdir, 'some-filename.yaml')
         with open(orig, 'w') as f:
             f.write('''network:
@@ -128,7 +453,107 @@ class TestLibnetplan(TestBase):
         self.assertTrue(os.path.isfile(orig))
         # Verify the file still exists and still contains the other connection
         with open(orig, 'r') as f:
-            self.assertEquals(f.read(), 'network:\n  ethernets:\n    other-id:\n      dhcp6: true\n')
+            self.assertEqual(f.read(), 'network:\n  ethernets:\n    other-id:\n      dhcp6: true')
+
+    def test_delete_connection_not_in_etc(self):
+        rundir = os.path.join(self.workdir.name, 'run', 'netplan')
+        os.makedirs(rundir)
+        with open(os.path.join(rundir, 'some-filename.yaml'), 'w') as f:
+            f.write('''network:
+  ethernets:
+    some-netplan-id:
+      dhcp4: true''')
+        with capture_stderr() as outf:
+            self.assertFalse(lib.netplan_delete_connection('some-netplan-id'.encode(), self.workdir.name.encode()))
+            with open(outf.name, 'r') as f:
+                self.assertIn('netplan_delete_connection: Cannot open', f.read())
+
+    def test_delete_connection_shadowed(self):
+        rundir = os.path.join(self.workdir.name, 'run', 'netplan')
+        os.makedirs(rundir)
+        with open(os.path.join(rundir, 'some-filename.yaml'), 'w') as f:
+            f.write('''network:
+  ethernets:
+    some-netplan-id:
+      dhcp4: true''')
+        orig = os.path.join(self.confdir, 'some-filename.yaml')
+        with open(orig, 'w') as f:
+            f.write('''network:
+  ethernets:
+    other-id:
+      dhcp4: true''')
+        with capture_stderr() as outf:
+            self.assertFalse(lib.netplan_delete_connection('some-netplan-id'.encode(), self.workdir.name.encode()))
+            with open(outf.name, 'r') as f:
+                self.assertIn("netdef 'some-netplan-id' is not defined in this file", f.read())
+        self.assertTrue(os.path.isfile(orig))
+
+    def test_delete_connection_keeps_comments(self):
+        orig = os.path.join(self.confdir, 'some-filename.yaml')
+        with open(orig, 'w') as f:
+            f.write('''# uplinks
+network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true
+    # the spare one
+    eth1: {dhcp6: true}   # for now
+    eth2:
+      # static
+      addresses: [10.0.0.2/24]
+
+    # done
+  wifis:
+    wl0:
+      access-points:
+        ssid: {}
+''')
+        os.chmod(orig, 0o640)
+        self.assertTrue(lib.netplan_delete_connection('eth1'.encode(), self.workdir.name.encode()))
+        self.assertTrue(lib.netplan_delete_connection('eth2'.encode(), self.workdir.name.encode()))
+        self.assertTrue(lib.netplan_delete_connection('wl0'.encode(), self.workdir.name.encode()))
+        with open(orig, 'r') as f:
+            self.assertEqual(f.read(), '''# uplinks
+network:
+  version: 2
+  ethernets:
+    eth0:
+      dhcp4: true
+    # the spare one
+
+    # done
+''')
+        self.assertEqual(stat.S_IMODE(os.stat(orig).st_mode), 0o640)
+        self.assertEqual(os.listdir(self.confdir), ['some-filename.yaml'])
+        # nothing but the version left
+        self.assertTrue(lib.netplan_delete_connection('eth0'.encode(), self.workdir.name.encode()))
+        self.assertFalse(os.path.exists(orig))
+
+    def test_delete_connection_cross_file(self):
+        with open(os.path.join(self.confdir, 'a.yaml'), 'w') as f:
+            f.write('network:\n  ethernets:\n    eth0: {}\n')
+        with open(os.path.join(self.confdir, 'b.yaml'), 'w') as f:
+            f.write('''network:
+  ethernets:
+    eth9:
+      dhcp4: true
+  bridges:
+    br0:
+      interfaces: [eth0]
+''')
+        # b.yaml does not make sense on its own
+        self.assertTrue(lib.netplan_delete_connection('eth9'.encode(), self.workdir.name.encode()))
+        with open(os.path.join(self.confdir, 'b.yaml'), 'r') as f:
+            self.assertEqual(f.read(), 'network:\n  bridges:\n    br0:\n      interfaces: [eth0]\n')
+        # br0 still needs eth0
+        with capture_stderr() as outf:
+            self.assertFalse(lib.netplan_delete_connection('eth0'.encode(), self.workdir.name.encode()))
+            with open(outf.name, 'r') as f:
+                self.assertIn("interface 'eth0' is not defined", f.read())
+        with open(os.path.join(self.confdir, 'a.yaml'), 'r') as f:
+            self.assertEqual(f.read(), 'network:\n  ethernets:\n    eth0: {}\n')
+        self.assertEqual(sorted(os.listdir(self.confdir)), ['a.yaml', 'b.yaml'])
 
     def test_write_netplan_conf(self):
         netdef_id = 'some-netplan-id'
@@ -151,3 +576,168 @@ class TestLibnetplan(TestBase):
         with open(orig, 'r') as f:
             with open(generated, 'r') as new:
                 self.assertEquals(f.read(), new.read())
+
+    def test_netdefs_lookup(self):
+        orig = os.path.join(self.confdir, 'a.yaml')
+        with open(orig, 'w') as f:
+            f.write('''network:
+  version: 2
+  ethernets:
+    eth0:
+      match:
+        macaddress: "00:11:22:33:44:55"
+      set-name: lan0
+    eth1:
+      match:
+        driver: ixgbe
+        name: "en*"
+      set-name: lan1
+    eth2:
+      match:
+        driver: ixgbe
+        name: "en*"
+    eth3: {}
+''')
+        self.assertTrue(lib.netplan_parse_yaml(orig.encode(), None))
+
+        def lookup(index, key):
+            arr = lib.netplan_netdefs_lookup(index, key.encode())
+            if not arr:
+                return []
+            return [arr.contents.pdata[i].contents.id.decode() for i in range(arr.contents.len)]
+
+        # NETPLAN_NETDEF_INDEX_SET_NAME, _MATCH_NAME, _MATCH_MAC, _MATCH_DRIVER
+        self.assertEqual(lookup(0, 'lan1'), ['eth1'])
+        self.assertEqual(lookup(0, 'eth1'), [])
+        self.assertEqual(lookup(1, 'en*'), ['eth1', 'eth2'])
+        self.assertEqual(lookup(1, 'eth3'), ['eth3'])
+        self.assertEqual(lookup(2, '00:11:22:33:44:55'), ['eth0'])
+        self.assertEqual(lookup(3, 'ixgbe'), ['eth1', 'eth2'])
+        self.assertEqual(lib.netplan_clear_netdefs(), 4)
+        self.assertEqual(lookup(3, 'ixgbe'), [])
+
+    def test_clear_netdefs_frees_memory(self):
+        a = os.path.join(self.confdir, 'a.yaml')
+        with open(a, 'w') as f:
+            f.write('''network:
+  renderer: networkd
+  openvswitch:
+    external-ids: {iface-id: myhost}
+    other-config: {disable-in-band: "true"}
+    protocols: [OpenFlow13]
+    ssl: {ca-cert: /a, certificate: /b, private-key: /c}
+  ethernets:
+    eth0:
+      match: {driver: ixgbe, macaddress: "00:11:22:33:44:55", name: "en*"}
+      set-name: lan0
+      macaddress: "00:11:22:33:44:66"
+      dhcp4-overrides: {use-domains: "true", hostname: foo}
+      addresses: [10.0.0.1/24, "2001:db8::1/64", 10.0.1.1/24: {lifetime: 0, label: "eth0:1"}]
+      ipv6-address-token: "::2"
+      nameservers: {addresses: [8.8.8.8, "2001:4860::8888"], search: [example.com]}
+      routes: [{to: 10.9.0.0/16, via: 10.0.0.2, from: 10.0.0.1, scope: global, type: unicast}]
+      routing-policy: [{from: 10.0.0.0/24, to: 10.9.0.0/16, table: 100}]
+      auth: {key-management: 802.1x, method: peap, identity: id, password: pw, phase2-auth: MSCHAPV2}
+      activation-mode: manual
+      openvswitch: {external-ids: {a: b}}
+    eth1: {}
+    eth2: {}
+    eth3: {}
+  bonds:
+    bond0:
+      interfaces: [eth1]
+      parameters: {mode: active-backup, arp-ip-targets: [10.0.0.9], up-delay: 10, primary: eth1}
+    bond1:
+      interfaces: [eth2, eth3]
+      openvswitch: {lacp: active}
+  bridges:
+    br0:
+      interfaces: [bond1]
+      openvswitch: {fail-mode: secure, controller: {addresses: ["tcp:1.2.3.4"], connection-mode: in-band}}
+  vlans:
+    vl10: {id: 10, link: eth0}
+  tunnels:
+    wg0:
+      mode: wireguard
+      key: "4GgaQCy68nzNsUE5aJ9fuLzHhB65tAlwbmA72MWnOm8="
+      peers:
+        - keys: {public: "M9nt4YujIOmNrRmpIRTmYSfMdrpvE7u6WkG8FY8WjG4=", shared: "7voRZ/ojfXgfPOlswo3Lpma1RJq7qijIEEUEMShQFV8="}
+          allowed-ips: [0.0.0.0/0]
+          endpoint: 1.2.3.4:5
+  modems:
+    mdm0: {apn: a, username: b, password: c}
+''')
+        b = os.path.join(self.confdir, 'b.yaml')
+        with open(b, 'w') as f:
+            f.write('''network:
+  wifis:
+    wl0:
+      renderer: NetworkManager
+      networkmanager: {uuid: "ff9d6ebc-226d-4f82-a485-b7ff83b9607f", name: conn, passthrough: {ipv4.dns-search: ""}}
+      access-points:
+        "home": {password: secret, bssid: "00:11:22:33:44:77", networkmanager: {name: ap, passthrough: {wifi.x: y}}}
+        "work": {auth: {key-management: eap, method: tls, identity: i, ca-certificate: /a, client-key: /c}}
+''')
+        k = os.path.join(self.workdir.name, 'netplan-wl1-TESTSSID.nmconnection')
+        with open(k, 'w') as f:
+            f.write('''[connection]
+id=netplan-wl1-TESTSSID
+type=wifi
+interface-name=wl1
+uuid=ff9d6ebc-226d-4f82-a485-b7ff83b96070
+
+[ipv4]
+method=auto
+dns-search=
+
+[wifi]
+ssid=TESTSSID
+
+[wifi-security]
+key-mgmt=wpa-psk
+psk=s0s3cr1t
+
+[proxy]
+''')
+
+        def rss():
+            with open('/proc/self/statm') as f:
+                return int(f.read().split()[1]) * os.sysconf('SC_PAGE_SIZE')
+
+        def cycle():
+            self.assertTrue(lib.netplan_parse_yaml(a.encode(), None))
+            self.assertTrue(lib.netplan_parse_yaml(b.encode(), None))
+            self.assertTrue(lib.netplan_parse_keyfile(k.encode(), None))
+            self.assertEqual(lib.netplan_clear_netdefs(), 12)
+
+        for _ in range(1000):
+            cycle()
+        warm = rss()
+        for _ in range(9000):
+            cycle()
+        # all definitions, with everything they own, got freed again
+        self.assertLess(rss() - warm, 1024 * 1024)
+
+    def test_systemd_escape(self):
+        # expectations as produced by systemd-escape(1)
+        corpus = {
+            'eth0': 'eth0',
+            'bond0.100': 'bond0.100',
+            'a.b:c_d': 'a.b:c_d',
+            'br-int': 'br\\x2dint',
+            'my interface': 'my\\x20interface',
+            '.hidden': '\\x2ehidden',
+            '..x': '\\x2e.x',
+            '/foo/bar': '-foo-bar',
+            'x\\y': 'x\\x5cy',
+            'tab\there': 'tab\\x09here',
+            'a+b=c%d': 'a\\x2bb\\x3dc\\x25d',
+            '*?[]@~': '\\x2a\\x3f\\x5b\\x5d\\x40\\x7e',
+            'café': 'caf\\xc3\\xa9',
+            '\x7f\x01': '\\x7f\\x01',
+        }
+        tool = shutil.which('systemd-escape')
+        for string, expected in corpus.items():
+            self.assertEqual(lib.systemd_escape(string.encode()).decode(), expected)
+            if tool:
+                self.assertEqual(subprocess.check_output([tool, string]).decode().strip(), expected)
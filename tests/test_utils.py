@@ -56,6 +56,8 @@ printf '\\0' >> %(log)s
         calls() returns the calls to the given mock command in the form of
         [ ["cmd", "call1-arg1"], ["cmd", "call2-arg1"], ... ]
         """
+        if not os.path.exists(self.call_log):
+            return []
         with open(self.call_log) as fp:
             b = fp.read()
         calls = []
@@ -197,6 +199,25 @@ class TestUtils(unittest.TestCase):
       key: 0.0.0.0''')
         self.assertIsNone(utils.netplan_get_filename_by_id('some-id', self.workdir.name))
 
+    def test_generate_manifest(self):
+        self.assertIsNone(utils.generate_manifest(self.workdir.name))
+        os.makedirs(os.path.join(self.workdir.name, 'run', 'netplan'))
+        with open(os.path.join(self.workdir.name, 'run', 'netplan', 'generate.json'), 'w') as f:
+            f.write('{"files": [{"path": "/run/systemd/network/10-netplan-eth0.network", "status": "added"')
+        # truncated
+        self.assertIsNone(utils.generate_manifest(self.workdir.name))
+        with open(os.path.join(self.workdir.name, 'run', 'netplan', 'generate.json'), 'a') as f:
+            f.write('}]}')
+        self.assertEqual(utils.generate_manifest(self.workdir.name),
+                         {'files': [{'path': '/run/systemd/network/10-netplan-eth0.network', 'status': 'added'}]})
+        # not written by the run we asked about
+        self.assertIsNone(utils.generate_manifest(self.workdir.name, run_id='1234'))
+        with open(os.path.join(self.workdir.name, 'run', 'netplan', 'generate.json'), 'w') as f:
+            f.write('{"run-id": "1234", "files": []}')
+        self.assertIsNone(utils.generate_manifest(self.workdir.name, run_id='5678'))
+        self.assertEqual(utils.generate_manifest(self.workdir.name, run_id='1234'),
+                         {'run-id': '1234', 'files': []})
+
     def test_systemctl(self):
         self.mock_systemctl = MockCmd('systemctl')
         path_env = os.environ['PATH']